@@ -51,6 +51,15 @@
 
 #define DES_THREADS 81
 
+#ifdef USE_SUBGROUPS
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#endif
+
+// This must match HAAR_MAP_TABLE_SIZE defined in surf.h
+#define HAAR_MAP_TABLE_SIZE 64
+
 #ifdef M_PI_F
 #define pi M_PI_F
 #else
@@ -128,6 +137,69 @@ float haarY(
 }
 
 
+//! Calculate the Haar wavelet responses in x and y
+/*!
+    The responses are read from a precomputed map if there is one for the
+    filter size (haarMapSlot is indexed by half the filter size).  The 
+    map stores at each pixel the same clamped response haarX and haarY 
+    compute, so the result is the same either way.  The check of the top
+    and left borders keeps the sampler reads of image mode in bounds.
+*/
+float2 haarXY(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t img,
+#else              
+              __global float* img, 
+#endif
+              int width, int height, int row, int column, int s,
+              __global float2* haarMaps, __constant int* haarMapSlot)
+{
+    int slot = (s/2 < HAAR_MAP_TABLE_SIZE) ? haarMapSlot[s/2] : -1;
+
+    if(slot >= 0 && row > s/2 && column > s/2 && 
+       row < height && column < width) 
+    {
+        return haarMaps[(slot * height + row) * width + column];
+    }
+
+    return (float2)(haarX(img, width, height, row, column, s),
+                    haarY(img, width, height, row, column, s));
+}
+
+
+#ifdef USE_SUBGROUPS
+//! Sum the values of the work group into desc[0].  Each subgroup sums its 
+//! values, and only the subgroup sums meet in local memory.
+void sumDesc(__local float4* desc, int tha, int length) 
+{
+    float4 value = (tha < length) ? desc[tha] : (float4)(0.0f);
+
+    float4 sum;
+    sum.x = sub_group_reduce_add(value.x);
+    sum.y = sub_group_reduce_add(value.y);
+    sum.z = sub_group_reduce_add(value.z);
+    sum.w = sub_group_reduce_add(value.w);
+
+    // All values have been read before the subgroup sums overwrite them
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(get_sub_group_local_id() == 0) 
+    {
+        desc[get_sub_group_id()] = sum;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(tha == 0) 
+    {
+        float4 total = (float4)(0.0f);
+        for(uint s = 0; s < get_num_sub_groups(); s++) 
+        {
+            total += desc[s];
+        }
+        desc[0] = total;
+    }
+}
+#else
 void sumDesc(__local float4* desc, int tha, int length) 
 {
     // do one loop to get all the > tha 64 values
@@ -147,6 +219,7 @@ void sumDesc(__local float4* desc, int tha, int length)
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 }
+#endif
 
 //! Calculate the value of the 2d gaussian at x,y
 float gaussian(float x, float y, float sig)
@@ -168,14 +241,31 @@ __kernel void createDescriptors_kernel(
               __global float* orientation,
               __global float* descLength,
               __constant int* mj,
-              __constant int* mi)
+              __constant int* mi,
+              int extended,
+              __global float2* haarMaps,
+              __constant int* haarMapSlot,
+              __global int* imageIndex,
+              int imageStride)
 {
     __local float4 desc[DES_THREADS];
 
+    // Second half of the sub-region sums for the extended (SURF-128) 
+    // descriptor.  Unused when computing SURF-64.
+    __local float4 descExt[DES_THREADS];
+
     // There are 16 work groups per descriptor.  The groups are arranged as 
     // 16 x NumDescriptors, so each bIdy is a new descriptor.
     int bIdx = get_group_id(0);
     int bIdy = get_group_id(1);
+
+#ifndef IMAGES_SUPPORTED
+    // Ipoints of a batch are described in the integral image of the 
+    // image they were detected in
+    if(imageStride > 0) {
+        intImage += imageIndex[bIdy] * imageStride;
+    }
+#endif
   
     // get the x & y indexes and absolute
     int thx = get_local_id(0);
@@ -231,23 +321,48 @@ __kernel void createDescriptors_kernel(
     // Get the gaussian weighted x and y responses
     float gauss_s1 = gaussian((float)(xs-sample_x), (float)(ys-sample_y), 
                               2.5f*thScale);
-    float rx = haarX(intImage, width, height, sample_y, sample_x, 
-                     2*round(thScale));
-    float ry = haarY(intImage, width, height, sample_y, sample_x, 
-                     2*round(thScale));
+    float2 r = haarXY(intImage, width, height, sample_y, sample_x, 
+                      2*round(thScale), haarMaps, haarMapSlot);
+    float rx = r.x;
+    float ry = r.y;
 
     //Get the gaussian weighted x and y responses on rotated axis
     float rrx = gauss_s1*(-rx*si + ry*co);
     float rry = gauss_s1*(rx*co + ry*si);
-    desc[tha].x = rrx;
-    desc[tha].y = rry;
-    desc[tha].z = fabs(rrx);
-    desc[tha].w = fabs(rry);
+
+    if(extended) 
+    {
+        // SURF-128: the sums of dx and |dx| are split by the sign of dy,
+        // and the sums of dy and |dy| are split by the sign of dx
+        if(rry >= 0.0f) {
+            desc[tha] = (float4)(rrx, fabs(rrx), 0.0f, 0.0f);
+        }
+        else {
+            desc[tha] = (float4)(0.0f, 0.0f, rrx, fabs(rrx));
+        }
+        if(rrx >= 0.0f) {
+            descExt[tha] = (float4)(rry, fabs(rry), 0.0f, 0.0f);
+        }
+        else {
+            descExt[tha] = (float4)(0.0f, 0.0f, rry, fabs(rry));
+        }
+    }
+    else 
+    {
+        desc[tha].x = rrx;
+        desc[tha].y = rry;
+        desc[tha].z = fabs(rrx);
+        desc[tha].w = fabs(rry);
+    }
     
     barrier(CLK_LOCAL_MEM_FENCE);
 
     // Call summer function (result goes in index 0)
     sumDesc(desc, tha, DES_THREADS);
+    if(extended) 
+    {
+        sumDesc(descExt, tha, DES_THREADS);
+    }
     
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -259,11 +374,25 @@ __kernel void createDescriptors_kernel(
         
         desc[0] *= gauss_s2;
         
-        // Store the descriptor
-        surfDescriptor[dpos] = desc[0];
+        if(extended) 
+        {
+            // Each sub-region contributes 8 values (2 float4s)
+            descExt[0] *= gauss_s2;
 
-        // Store the descriptor length
-        descLength[bIdy * get_num_groups(0) + bIdx] = dot(desc[0], desc[0]);	
+            surfDescriptor[dpos*2] = desc[0];
+            surfDescriptor[dpos*2+1] = descExt[0];
+
+            descLength[bIdy * get_num_groups(0) + bIdx] = 
+                dot(desc[0], desc[0]) + dot(descExt[0], descExt[0]);
+        }
+        else 
+        {
+            // Store the descriptor
+            surfDescriptor[dpos] = desc[0];
+
+            // Store the descriptor length
+            descLength[bIdy * get_num_groups(0) + bIdx] = dot(desc[0], desc[0]);	
+        }
     }  
 
 }
@@ -0,0 +1,327 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+// Dense (upright) SURF descriptors on a regular grid.
+//
+// createDescriptors_kernel samples 24x24 Haar responses around every 
+// ipoint, so descriptors on a dense grid would compute the same responses
+// many times.  Here the responses of each scale are computed once on a 
+// lattice with the sample spacing of that scale, the gaussian weighted 
+// sub-region sums are computed once per lattice point, and each grid 
+// descriptor is assembled from 16 of the shared sums.  The gaussian 
+// weighting of the samples is separable, so the sub-region sums are 
+// computed with two 9-tap passes.
+//
+// The values match createDescriptors_kernel for an orientation of zero.
+
+#ifdef M_PI_F
+#define pi M_PI_F
+#else
+#define pi 3.141592654f
+#endif
+
+#ifdef IMAGES_SUPPORTED
+__constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+                               CLK_ADDRESS_CLAMP           |
+                               CLK_FILTER_NEAREST;
+#endif
+
+float 
+BoxIntegral( 
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t data,
+#else              
+              __global float* data, 
+#endif
+              int width, int height, int row, int col, int rows, int cols) 
+{
+
+    float A = 0.0f;
+    float B = 0.0f;
+    float C = 0.0f;
+    float D = 0.0f;
+    
+    // The subtraction by one for row/col is because row/col is inclusive.
+    int r1 = min(row, height) - 1;
+    int c1 = min(col, width)  - 1;
+    int r2 = min(row + rows, height) - 1;
+    int c2 = min(col + cols, width)  - 1;
+    
+#ifdef IMAGES_SUPPORTED
+    A = read_imagef(data, sampler, (int2)(c1, r1)).x;
+    B = read_imagef(data, sampler, (int2)(c2, r1)).x;
+    C = read_imagef(data, sampler, (int2)(c1, r2)).x;
+    D = read_imagef(data, sampler, (int2)(c2, r2)).x;
+#else
+    if (r1 >= 0 && c1 >= 0) A = data[r1 * width + c1];  
+    if (r1 >= 0 && c2 >= 0) B = data[r1 * width + c2];  
+    if (r2 >= 0 && c1 >= 0) C = data[r2 * width + c1];
+    if (r2 >= 0 && c2 >= 0) D = data[r2 * width + c2];
+#endif
+
+    return max(0.f, A - B - C + D);
+}
+
+
+//! Calculate Haar wavelet responses in x direction
+float haarX(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t img,
+#else              
+              __global float* img, 
+#endif
+              int width, int height, int row, int column, int s)
+{
+    return BoxIntegral(img, width, height, row-s/2, column, s, s/2) -
+           BoxIntegral(img, width, height, row-s/2, column-s/2, s, s/2);
+}
+
+
+//! Calculate Haar wavelet responses in y direction
+float haarY(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t img,
+#else              
+              __global float* img, 
+#endif
+              int width, int height, int row, int column, int s)
+{
+    return BoxIntegral(img, width, height, row,     column-s/2, s/2, s) -
+           BoxIntegral(img, width, height, row-s/2, column-s/2, s/2, s);
+}
+
+
+//! Calculate the value of the 2d gaussian at x,y
+float gaussian(float x, float y, float sig)
+{
+    return 1.0f/(2.0f*pi*sig*sig) * exp(-(x*x+y*y)/(2.0f*sig*sig));
+}
+
+
+__kernel void denseHaarResponses(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t intImage,
+#else              
+              __global float* intImage, 
+#endif
+              int width, int height, 
+              int scale,
+              __global float4* responses,
+              __global float4* responsesExt,
+              int latticeWidth,
+              int latticeHeight,
+              int extended)
+{
+    // Each work item computes the Haar responses at one lattice point.
+    // Lattice point (u,v) is the pixel (u*scale, v*scale).
+
+    int u = get_global_id(0);
+    int v = get_global_id(1);
+
+    if(u >= latticeWidth || v >= latticeHeight) 
+    {
+        return;
+    }
+
+    int sample_x = u * scale;
+    int sample_y = v * scale;
+
+    float rx = haarX(intImage, width, height, sample_y, sample_x, 2*scale);
+    float ry = haarY(intImage, width, height, sample_y, sample_x, 2*scale);
+
+    // With no rotation, the descriptor's dx is the y response and its dy 
+    // is the x response (see createDescriptors_kernel)
+    int idx = v * latticeWidth + u;
+
+    if(extended) 
+    {
+        // SURF-128: the sums of dx and |dx| are split by the sign of dy,
+        // and the sums of dy and |dy| are split by the sign of dx
+        if(rx >= 0.0f) {
+            responses[idx] = (float4)(ry, fabs(ry), 0.0f, 0.0f);
+        }
+        else {
+            responses[idx] = (float4)(0.0f, 0.0f, ry, fabs(ry));
+        }
+        if(ry >= 0.0f) {
+            responsesExt[idx] = (float4)(rx, fabs(rx), 0.0f, 0.0f);
+        }
+        else {
+            responsesExt[idx] = (float4)(0.0f, 0.0f, rx, fabs(rx));
+        }
+    }
+    else 
+    {
+        responses[idx] = (float4)(ry, rx, fabs(ry), fabs(rx));
+    }
+}
+
+
+__kernel void denseWeightedSums(__global float4* input,
+                                __global float4* output,
+                                int latticeWidth,
+                                int latticeHeight,
+                                int scale,
+                                int vertical)
+{
+    // One pass of the separable gaussian weighting of a 9x9 sub-region.
+    // The output at each lattice point is the weighted sum of the 9 
+    // points starting there (along rows, or along columns if vertical).
+    // Each pass applies half of the 2d gaussian used by 
+    // createDescriptors_kernel, which is centered on the 6th sample.
+
+    int u = get_global_id(0);
+    int v = get_global_id(1);
+
+    if(u >= latticeWidth || v >= latticeHeight) 
+    {
+        return;
+    }
+
+    int du = vertical ? 0 : 1;
+    int dv = vertical ? 1 : 0;
+
+    float4 sum = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+
+    // Sub-regions that extend past the lattice are never used by a grid
+    // descriptor, so they are left at zero
+    if(u + 8*du < latticeWidth && v + 8*dv < latticeHeight) 
+    {
+        float sig = 2.5f*scale;
+        for(int t = 0; t < 9; t++) 
+        {
+            float d = (float)((5 - t)*scale);
+            float weight = sqrt(1.0f/(2.0f*pi*sig*sig)) * 
+                exp(-(d*d)/(2.0f*sig*sig));
+
+            sum += weight * input[(v + t*dv) * latticeWidth + (u + t*du)];
+        }
+    }
+
+    output[v * latticeWidth + u] = sum;
+}
+
+
+__kernel void denseAssembleDescriptors(__global float4* sums,
+                                       __global float4* sumsExt,
+                                       __global float4* surfDescriptor,
+                                       __global float* descLength,
+                                       __global float2* pos,
+                                       __global float* scale,
+                                       __global float* orientation,
+                                       __global int* laplacian,
+                                       __constant int* mj,
+                                       __constant int* mi,
+                                       int latticeWidth,
+                                       int gridWidth,
+                                       int gridCount,
+                                       int firstLattice,
+                                       int gridStride,
+                                       int sampleScale,
+                                       int firstDesc,
+                                       int extended)
+{
+    // Each work group assembles one grid descriptor, and each of its 16 
+    // work items one sub-region.  The descriptors of this scale are 
+    // stored starting at firstDesc.
+
+    int sub = get_local_id(0);
+    int gridIdx = get_group_id(0);
+
+    if(gridIdx >= gridCount) 
+    {
+        return;
+    }
+
+    int desc = firstDesc + gridIdx;
+
+    // Lattice coordinates of the descriptor center
+    int cu = firstLattice + (gridIdx % gridWidth) * gridStride;
+    int cv = firstLattice + (gridIdx / gridWidth) * gridStride;
+
+    // The sub-region starts at (i,j) samples from the center
+    int su = cu + mi[sub];
+    int sv = cv + mj[sub];
+
+    // Subregion centers for the 4x4 gaussian weighting
+    float cx = 0.5f + (float)(sub/4);
+    float cy = 0.5f + (float)(sub%4);
+    float gauss_s2 = gaussian(cx-2.0f, cy-2.0f, 1.5f);
+
+    float4 value = gauss_s2 * sums[sv * latticeWidth + su];
+
+    if(extended) 
+    {
+        // Each sub-region contributes 8 values (2 float4s)
+        float4 valueExt = gauss_s2 * sumsExt[sv * latticeWidth + su];
+
+        surfDescriptor[(desc*16 + sub)*2] = value;
+        surfDescriptor[(desc*16 + sub)*2 + 1] = valueExt;
+
+        descLength[desc*16 + sub] = dot(value, value) + 
+            dot(valueExt, valueExt);
+    }
+    else 
+    {
+        surfDescriptor[desc*16 + sub] = value;
+        descLength[desc*16 + sub] = dot(value, value);
+    }
+
+    if(sub == 0) 
+    {
+        // Grid points are upright and have no laplacian sign
+        pos[desc] = (float2)((float)(cu * sampleScale), 
+                             (float)(cv * sampleScale));
+        scale[desc] = (float)sampleScale;
+        orientation[desc] = 0.0f;
+        laplacian[desc] = 0;
+    }
+}
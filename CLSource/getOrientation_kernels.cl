@@ -57,6 +57,15 @@
 
 #pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
 
+#ifdef USE_SUBGROUPS
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#endif
+
+// This must match HAAR_MAP_TABLE_SIZE defined in surf.h
+#define HAAR_MAP_TABLE_SIZE 64
+
 #ifdef IMAGES_SUPPORTED
 // CLK_ADDRESS_CLAMP returns (0,0,0,1) for out of bounds accesses
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
@@ -136,6 +145,36 @@ float haarY(
 }
 
 
+//! Calculate the Haar wavelet responses in x and y
+/*!
+    The responses are read from a precomputed map if there is one for the
+    filter size (haarMapSlot is indexed by half the filter size).  The 
+    map stores at each pixel the same clamped response haarX and haarY 
+    compute, so the result is the same either way.  The check of the top
+    and left borders keeps the sampler reads of image mode in bounds.
+*/
+float2 haarXY(
+#ifdef IMAGES_SUPPORTED
+            __read_only image2d_t img, 
+#else
+            __global float* img,
+#endif
+            int width, int height, int row, int column, int s,
+            __global float2* haarMaps, __constant int* haarMapSlot)
+{
+    int slot = (s/2 < HAAR_MAP_TABLE_SIZE) ? haarMapSlot[s/2] : -1;
+
+    if(slot >= 0 && row > s/2 && column > s/2 && 
+       row < height && column < width) 
+    {
+        return haarMaps[(slot * height + row) * width + column];
+    }
+
+    return (float2)(haarX(img, width, height, row, column, s),
+                    haarY(img, width, height, row, column, s));
+}
+
+
 //! Get the angle from the +ve x-axis of the vector given by (X Y)
 float getAngle(float X, float Y)
 {
@@ -169,7 +208,11 @@ getOrientationStep1(
                     __global unsigned int* d_id,
                     int i_width, 
                     int i_height,
-                    __global float4* res)
+                    __global float4* res,
+                    __global float2* haarMaps,
+                    __constant int* haarMapSlot,
+                    __global int* d_imageIndex,
+                    int imageStride)
 {
 
      // Cache the gaussian data in local memory
@@ -178,6 +221,14 @@ getOrientationStep1(
     
     int localId = get_local_id(0);
     int groupId = get_group_id(0);
+
+#ifndef IMAGES_SUPPORTED
+    // Ipoints of a batch are oriented in the integral image of the 
+    // image they were detected in
+    if(imageStride > 0) {
+        d_img += d_imageIndex[groupId] * imageStride;
+    }
+#endif
     
     int i = (int)(localId/13) - 6;
     int j = (localId%13) - 6;
@@ -215,8 +266,10 @@ getOrientationStep1(
     if(i*i + j*j < 36)
     {
         gauss = l_gauss25[7*l_id[i+6]+l_id[j+6]];
-        rs.x = gauss * haarX(d_img, i_width, i_height, r+j*s, c+i*s, 4*s);
-        rs.y = gauss * haarY(d_img, i_width, i_height, r+j*s, c+i*s, 4*s);
+        float2 haar = haarXY(d_img, i_width, i_height, r+j*s, c+i*s, 4*s,
+                             haarMaps, haarMapSlot);
+        rs.x = gauss * haar.x;
+        rs.y = gauss * haar.y;
         rs.z = getAngle(rs.x, rs.y);
         int index = atom_add(&angleCount[0], 1);
         
@@ -287,6 +340,37 @@ __kernel void getOrientationStep2(__global float *d_orientation,
         }
     }
     
+#ifdef USE_SUBGROUPS
+    // Each subgroup finds its longest vector (the lowest window wins ties), 
+    // and only these meet in local memory.  A work item only reads its own
+    // sum, so no barrier is needed before this.
+    __local float2 longest[42];
+
+    const float2 own = sum[tid];
+    const float mag = magnitude(own);
+    const float longestMag = sub_group_reduce_max(mag);
+    const int winner = sub_group_reduce_min(mag == longestMag ? tid : 42);
+
+    if(tid == winner) 
+    {
+        longest[get_sub_group_id()] = own;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE); 
+
+    if (tid == 0) 
+    {
+        float2 dominant = longest[0];
+        for(uint s = 1; s < get_num_sub_groups(); s++) 
+        {
+            if(magnitude(dominant) < magnitude(longest[s])) {
+                dominant = longest[s];
+            }
+        }
+
+        // assign orientation of the dominant response vector
+        d_orientation[groupId] = getAngle(dominant.x, dominant.y);
+    }
+#else
     barrier(CLK_LOCAL_MEM_FENCE); 
     
     // If the vector produced from this window is longer than all
@@ -309,4 +393,5 @@ __kernel void getOrientationStep2(__global float *d_orientation,
         // assign orientation of the dominant response vector
         d_orientation[groupId] = getAngle(sum[0].x, sum[0].y);
     }    
+#endif
 }
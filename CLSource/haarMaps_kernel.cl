@@ -0,0 +1,187 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+// Precomputed Haar response maps.
+//
+// On keypoint-dense frames the orientation and descriptor kernels 
+// evaluate the same Haar wavelets (same position, same filter size) many
+// times.  These kernels find the filter sizes in use and compute a map of
+// the x and y responses at every pixel for the busiest ones, which the 
+// orientation and descriptor kernels then read instead of the integral 
+// image.
+
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+
+// This must match HAAR_MAP_TABLE_SIZE defined in surf.h
+#define HAAR_MAP_TABLE_SIZE 64
+
+#ifdef IMAGES_SUPPORTED
+__constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+                               CLK_ADDRESS_CLAMP           |
+                               CLK_FILTER_NEAREST;
+#endif
+
+float 
+BoxIntegral( 
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t data,
+#else              
+              __global float* data, 
+#endif
+              int width, int height, int row, int col, int rows, int cols) 
+{
+
+    float A = 0.0f;
+    float B = 0.0f;
+    float C = 0.0f;
+    float D = 0.0f;
+    
+    // The subtraction by one for row/col is because row/col is inclusive.
+    int r1 = min(row, height) - 1;
+    int c1 = min(col, width)  - 1;
+    int r2 = min(row + rows, height) - 1;
+    int c2 = min(col + cols, width)  - 1;
+    
+#ifdef IMAGES_SUPPORTED
+    A = read_imagef(data, sampler, (int2)(c1, r1)).x;
+    B = read_imagef(data, sampler, (int2)(c2, r1)).x;
+    C = read_imagef(data, sampler, (int2)(c1, r2)).x;
+    D = read_imagef(data, sampler, (int2)(c2, r2)).x;
+#else
+    if (r1 >= 0 && c1 >= 0) A = data[r1 * width + c1];  
+    if (r1 >= 0 && c2 >= 0) B = data[r1 * width + c2];  
+    if (r2 >= 0 && c1 >= 0) C = data[r2 * width + c1];
+    if (r2 >= 0 && c2 >= 0) D = data[r2 * width + c2];
+#endif
+
+    return max(0.f, A - B - C + D);
+}
+
+
+//! Calculate Haar wavelet responses in x direction
+float haarX(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t img,
+#else              
+              __global float* img, 
+#endif
+              int width, int height, int row, int column, int s)
+{
+    return BoxIntegral(img, width, height, row-s/2, column, s, s/2) -
+           BoxIntegral(img, width, height, row-s/2, column-s/2, s, s/2);
+}
+
+
+//! Calculate Haar wavelet responses in y direction
+float haarY(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t img,
+#else              
+              __global float* img, 
+#endif
+              int width, int height, int row, int column, int s)
+{
+    return BoxIntegral(img, width, height, row,     column-s/2, s/2, s) -
+           BoxIntegral(img, width, height, row-s/2, column-s/2, s/2, s);
+}
+
+
+__kernel void haarScaleHistogram(__global float* scale,
+                                 int numIpts,
+                                 __global int* histogram)
+{
+    // Count the ipoints at each rounded scale.  The orientation and 
+    // descriptor kernels use filters of 4 and 2 times the rounded scale.
+
+    int idx = get_global_id(0);
+
+    if(idx >= numIpts) 
+    {
+        return;
+    }
+
+    int s = (int)round(scale[idx]);
+
+    if(s < HAAR_MAP_TABLE_SIZE) 
+    {
+        atom_inc(&histogram[s]);
+    }
+}
+
+
+__kernel void computeHaarMap(
+#ifdef IMAGES_SUPPORTED
+              __read_only image2d_t intImage,
+#else              
+              __global float* intImage, 
+#endif
+              int width, int height, 
+              int filterSize,
+              __global float2* haarMaps,
+              int slot)
+{
+    // Each work item computes the x and y responses at one pixel for
+    // the given filter size, and stores them in the slot of the map
+
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+
+    if(col >= width || row >= height) 
+    {
+        return;
+    }
+
+    float2 response;
+    response.x = haarX(intImage, width, height, row, col, filterSize);
+    response.y = haarY(intImage, width, height, row, col, filterSize);
+
+    haarMaps[(slot * height + row) * width + col] = response;
+}
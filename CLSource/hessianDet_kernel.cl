@@ -105,7 +105,11 @@ BoxIntegral(int_img_t data, int width, int height,
     return max(0.0f, A - B - C + D);
 }
 
-// Compute the hessian determinant 
+// Compute the hessian determinant.  With buffers, the third dimension
+// indexes the images of a batch, which are stored one after the other.
+// When the program is specialised for one layer (SPEC_* defined, see 
+// FastHessian::computeHessianDet), the size arguments are replaced by 
+// constants, so the filter offsets, area and bounds checks are folded.
 __kernel void 
 hessian_det(
     int_img_t img,              // integral image
@@ -125,6 +129,22 @@ hessian_det(
     int idx = get_global_id(0);
     int idy = get_global_id(1);
 
+#ifdef SPEC_FILTER
+    width = SPEC_WIDTH;
+    height = SPEC_HEIGHT;
+    layerWidth = SPEC_LAYER_WIDTH;
+    layerHeight = SPEC_LAYER_HEIGHT;
+    step = SPEC_STEP;
+    filter = SPEC_FILTER;
+#endif
+
+#ifndef IMAGES_SUPPORTED
+    int image = get_global_id(2);
+    img += image * width * height;
+    responses += image * layerWidth * layerHeight;
+    laplacians += image * layerWidth * layerHeight;
+#endif
+
     w = filter;                  // filter size
     l = filter/3;                // lobe for this filter              
     b = (filter - 1)/ 2 + 1;     // border for this filter   
@@ -348,6 +348,11 @@ void transpose(__global float* iImage,
                         
     __local float tmpBuffer[256];
 
+    // The third dimension indexes the images of a batch, each image is 
+    // transposed in place in the batch
+    iImage += get_global_id(2)*inRows*inCols;
+    oImage += get_global_id(2)*inRows*inCols;
+
     // Work groups will perform the transpose (i.e., an entire work group will be moved from
     // one part of the image to another) 
     int myWgInX = get_group_id(0);
@@ -407,6 +412,9 @@ void transposeImage(__read_only image2d_t iImage,
                         
     __local float tmpBuffer[256];
 
+    // Images hold a single frame (batches are only run with buffers), so 
+    // the third dimension of the NDRange is always 1
+
     // Work groups will perform the transpose (i.e., an entire work group will be moved from
     // one part of the image to another) 
     int myWgInX = get_group_id(0);
@@ -49,61 +49,111 @@
  * of Industry and Securitys website at http://www.bis.doc.gov/.             *
  \****************************************************************************/
 
-typedef struct{
-    int point1;
-    float x1;
-    float y1;
-    int point2;
-    float x2;
-    float y2;
-    float dist;
-    float orientationDiff;
-    float scaleDiff;
-    int match;
-    bool dup;
-} distPoint;
-
-typedef struct{
-    float x;
-    float y;
-    float scale;
-    float orientation;
-    int laplacian;
-    int clusterIndex;
-    float descriptor[64];
-} Ipoint;
-
-__kernel void NearestNeighbor(__global Ipoint *d_ipts1,
-                              __global Ipoint *d_ipts2,
-                              __global distPoint *d_distancePoints,
+// These must match the DESC_FORMAT_* values defined in surf.h
+#define DESC_FORMAT_FP32 0
+#define DESC_FORMAT_FP16 1
+#define DESC_FORMAT_INT8 2
+
+// Scale that was applied to the descriptors before rounding to int8
+#define DESC_INT8_SCALE 256.0f
+
+#ifdef USE_SUBGROUPS
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#endif
+
+//! Read a descriptor component stored in the compact output format
+float loadComponent(__global const uchar* descs, int format, int index) 
+{
+    if(format == DESC_FORMAT_FP16) 
+    {
+        return vload_half(index, (__global const half*)descs);
+    }
+    else if(format == DESC_FORMAT_INT8) 
+    {
+        return ((__global const char*)descs)[index] / DESC_INT8_SCALE;
+    }
+    return ((__global const float*)descs)[index];
+}
+
+__kernel void NearestNeighbor(__global const uchar *d_desc1,
+                              __global const uchar *d_desc2,
+                              __global int *d_matchIdx,
+                              __global float *d_matchDist,
                               __local float* tempDistPts,
-                              const unsigned int ipts2Size) {
+                              const unsigned int numDesc2,
+                              const int descSize,
+                              const int format) {
+
+    // Each work group finds the nearest neighbor of one descriptor from
+    // the first set among all descriptors of the second set.  The
+    // descriptors are read in their compact format (fp32, fp16 or int8).
 
     int groupId = get_group_id(0);
     int localId = get_local_id(0);
     int localSize = get_local_size(0);
 
-    __global Ipoint *ipts1 = d_ipts1 + groupId;
-    __global Ipoint *ipts2;
-
-    __global distPoint *dp = d_distancePoints + groupId;
+    int offset1 = groupId * descSize;
 
     int point2Match = 0;
     float minDist = FLT_MAX;
 
-    for (unsigned int i2 = 0; i2 < ipts2Size; i2++){
+    for (unsigned int i2 = 0; i2 < numDesc2; i2++){
          
-        // Calculate the sum of squares distance
-        ipts2 = d_ipts2 + i2;
+        int offset2 = i2 * descSize;
+
         // TODO This metric may need to be improved.  Currently
         //      we determine matches based on the sum of descriptor
         //      differences
-        tempDistPts[localId] = fabs(ipts1->descriptor[localId] -
-                                    ipts2->descriptor[localId]);
+        //      Each work item accumulates descSize/localSize of the
+        //      descriptor differences (localSize is a power of 2)
+        float diff = 0.0f;
+        for (int k = localId; k < descSize; k += localSize) {
+            diff += fabs(loadComponent(d_desc1, format, offset1 + k) -
+                         loadComponent(d_desc2, format, offset2 + k));
+        }
+#ifdef USE_SUBGROUPS
+        // Each subgroup sums its differences, and the subgroup sums meet 
+        // in local memory.  A work group of a single subgroup needs no 
+        // local memory at all.
+        float dist = sub_group_reduce_add(diff);
+
+        if(get_num_sub_groups() > 1) 
+        {
+            if(get_sub_group_local_id() == 0) 
+            {
+                tempDistPts[get_sub_group_id()] = dist;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if(localId == 0) 
+            {
+                dist = 0.0f;
+                for(uint s = 0; s < get_num_sub_groups(); s++) 
+                {
+                    dist += tempDistPts[s];
+                }
+            }
+
+            // The sums are read before the next descriptor overwrites them
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (localId==0) {
+            dist /= descSize; // Get the average descriptor difference
+            if(dist < minDist) 
+            {
+                minDist = dist;
+                point2Match = i2;
+            }
+        }
+#else
+        tempDistPts[localId] = diff;
         barrier(CLK_LOCAL_MEM_FENCE);
          
         // reduce
-        for(int k=32; k > 0 ;k>>=1) {
+        for(int k=localSize/2; k > 0 ;k>>=1) {
             if(localId < k) 
             {
                 tempDistPts[localId] += tempDistPts[localId + k];
@@ -112,28 +162,21 @@ __kernel void NearestNeighbor(__global Ipoint *d_ipts1,
         }
         
         if (localId==0) {
-            tempDistPts[0] /= 64; // Get the average descriptor difference
+            tempDistPts[0] /= descSize; // Get the average descriptor difference
             if(tempDistPts[0] < minDist) 
             {
                 minDist = tempDistPts[0];
                 point2Match = i2;
             }
         }
+#endif
     }
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
     if(localId == 0) 
     {
-        ipts2 = d_ipts2+point2Match;
-        dp->point1 = groupId;
-        dp->x1 = ipts1->x;
-        dp->y1 = ipts1->y;
-        dp->point2 = point2Match;
-        dp->x2 = ipts2->x;
-        dp->y2 = ipts2->y;
-        dp->dist = minDist;
-        dp->orientationDiff = ipts1->orientation - ipts2->orientation;
-        dp->scaleDiff = ipts1->scale - ipts2->scale;      
+        d_matchIdx[groupId] = point2Match;
+        d_matchDist[groupId] = minDist;
     }
-}
\ No newline at end of file
+}
@@ -334,11 +334,23 @@ void non_max_supression_kernel(
              __global  float* d_scale,
              __global    int* d_laplacian,   
                          int  maxPoints,
-                       float  threshold)
+                       float  threshold,
+             __global    int* d_imageIndex)
 {
     
     int r = get_global_id(1);
     int c = get_global_id(0);            
+
+    // The third dimension indexes the images of a batch.  Their layers 
+    // are stored one after the other, and the ipoints record the image 
+    // they were found in.
+    int image = get_global_id(2);
+#ifndef IMAGES_SUPPORTED
+    tResponse += image * tWidth * tHeight;
+    mResponse += image * mWidth * mHeight;
+    mLaplacian += image * mWidth * mHeight;
+    bResponse += image * bWidth * bHeight;
+#endif
     
     float2 pixpos;
     float scale;
@@ -358,6 +370,7 @@ void non_max_supression_kernel(
                 d_pixPos[index] = pixpos;
                 d_scale[index] = scale;
                 d_laplacian[index] = laplacian;
+                d_imageIndex[index] = image;
             }
         }
     }
@@ -49,25 +49,49 @@
  * of Industry and Securitys website at http://www.bis.doc.gov/.             *
  \****************************************************************************/
 
+// These must match the DESC_FORMAT_* values defined in surf.h
+#define DESC_FORMAT_FP32 0
+#define DESC_FORMAT_FP16 1
+#define DESC_FORMAT_INT8 2
+#define DESC_FORMAT_BINARY 3
+#define DESC_FORMAT_BINARY_MAG 4
+
+// Scale applied to the normalized descriptors before rounding to int8
+#define DESC_INT8_SCALE 256.0f
+
+#ifdef USE_SUBGROUPS
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#endif
+
 __kernel void
 normalizeDescriptors(__global float* surfDescriptors, 
-                     __global float* descLengths)
+                     __global float* descLengths,
+                     int descSize,
+                     __global uchar* descOut,
+                     int format)
 {
-    // Previous kernels have computed 64 descriptors (surfDescriptors) and 
-    // 16 lengths (descLengths) for each interesting point found by SURF.
-    // This kernel will sum up all of the lengths for each interesting point 
-    // and take the square root.  This value will then be used to scale the 
-    // descriptors.
+    // Previous kernels have computed descSize (64 or 128) descriptors 
+    // (surfDescriptors) and 16 lengths (descLengths) for each interesting 
+    // point found by SURF.  This kernel will sum up all of the lengths for 
+    // each interesting point and take the square root.  This value will 
+    // then be used to scale the descriptors.
 
-    // Note that each work group contains 64 work items (one per descriptor).
+    // Note that each work group contains 64 work items, so each work item
+    // scales descSize/64 descriptors.
 
     // This array is used to cache data that will be accessed multiple times.  
     // Since it is declared __local, only one instance is created and shared 
     // by the entire work group
     __local float ldescLengths[16];
 
+    // Normalized descriptor cached for packing the binary formats 
+    // (large enough for the extended descriptor)
+    __local float ldesc[128];
+
     // Get the offset for the descriptor that this work group will normalize
-    int descOffset = get_group_id(0) * 64;
+    int descOffset = get_group_id(0) * descSize;
 
     // Get the offset for the descriptor lengths that this work group will 
     // use to scale the descriptors
@@ -76,6 +100,28 @@ normalizeDescriptors(__global float* surfDescriptors,
     // Get this work items ID within the work group
     int tid = get_local_id(0);
 
+#ifdef USE_SUBGROUPS
+    // Each subgroup sums the lengths held by its work items, and the 
+    // subgroup sums meet in local memory.  Work items 0-15 belong to the 
+    // first 16 subgroups, so later subgroups only hold zeros.
+    float partialLength = sub_group_reduce_add(
+        tid < 16 ? descLengths[lenOffset + tid] : 0.0f);
+
+    if(get_sub_group_local_id() == 0 && get_sub_group_id() < 16) {
+        ldescLengths[get_sub_group_id()] = partialLength;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int numPartials = min((int)get_num_sub_groups(), 16);
+    float sumOfLengths = 0.0f;
+    for(int i = 0; i < numPartials; i++) {
+        sumOfLengths += ldescLengths[i];
+    }
+
+    // Calculate the normalized length of the descriptors
+    float lengthOfDescriptor = 1.0f/sqrt(sumOfLengths);
+#else
     // Only 16 of the work items are needed to cache the lengths
     if(tid < 16) {
         // Have the first 16 work items cache the lengths for this 
@@ -101,7 +147,99 @@ normalizeDescriptors(__global float* surfDescriptors,
 
     // Calculate the normalized length of the descriptors
     float lengthOfDescriptor = 1.0f/sqrt(ldescLengths[0]);
+#endif
+
+    // Scale each descriptor and convert it to the output format.  The
+    // fp32 descriptor is always written back in place, since it is the
+    // input of the PCA projection.
+    for(int i = tid; i < descSize; i += get_local_size(0)) 
+    {
+        float value = surfDescriptors[descOffset + i] * lengthOfDescriptor;
+
+        surfDescriptors[descOffset + i] = value;	   
+
+        if(format == DESC_FORMAT_FP16) 
+        {
+            vstore_half_rte(value, descOffset + i, (__global half*)descOut);
+        }
+        else if(format == DESC_FORMAT_INT8) 
+        {
+            ((__global char*)descOut)[descOffset + i] = 
+                convert_char_sat_rte(value * DESC_INT8_SCALE);
+        }
+        else if(format == DESC_FORMAT_BINARY || 
+                format == DESC_FORMAT_BINARY_MAG) 
+        {
+            ldesc[i] = value;
+        }
+    }
+
+    if(format == DESC_FORMAT_BINARY || format == DESC_FORMAT_BINARY_MAG) 
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    // Scale each descriptor
-    surfDescriptors[descOffset + tid] *= lengthOfDescriptor;	   
-}
\ No newline at end of file
+        // The binary descriptor is made of 32-bit words holding the sign 
+        // bits of the components, followed (for BINARY_MAG) by words 
+        // holding a bit set when the magnitude exceeds the RMS value
+        int signWords = descSize / 32;
+        int numWords = (format == DESC_FORMAT_BINARY_MAG) ? 
+            2*signWords : signWords;
+        float threshold = rsqrt((float)descSize);
+
+        if(tid < numWords) 
+        {
+            uint word = 0;
+            int first = (tid % signWords) * 32;
+            for(int b = 0; b < 32; b++) 
+            {
+                float v = ldesc[first + b];
+                uint bit = (tid < signWords) ? (v >= 0.0f) : 
+                                               (fabs(v) > threshold);
+                word |= bit << b;
+            }
+            ((__global uint*)descOut)[get_group_id(0) * numWords + tid] = word;
+        }
+    }
+}
+
+
+__kernel void
+projectDescriptors(__global float* surfDescriptors,
+                   __global float* mean,
+                   __global float* basis,
+                   __global float* projected,
+                   int descSize,
+                   int components)
+{
+    // Projects the normalized descriptors onto the leading principal 
+    // components of a PCA basis trained offline.  Each work group 
+    // projects one descriptor, and each work item computes one of the 
+    // (at most 64) output components.
+
+    // The mean-centered descriptor is shared by all of the work items
+    __local float centered[128];
+
+    int tid = get_local_id(0);
+    int descOffset = get_group_id(0) * descSize;
+
+    for(int i = tid; i < descSize; i += get_local_size(0)) 
+    {
+        centered[i] = surfDescriptors[descOffset + i] - mean[i];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(tid < components) 
+    {
+        // Each row of the basis holds one principal component
+        __global float* component = basis + tid * descSize;
+
+        float sum = 0.0f;
+        for(int i = 0; i < descSize; i++) 
+        {
+            sum += centered[i] * component[i];
+        }
+
+        projected[get_group_id(0) * components + tid] = sum;
+    }
+}
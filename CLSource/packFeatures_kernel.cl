@@ -0,0 +1,108 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+// Packing of the ipoint data for readback.
+//
+// The position, scale, orientation, laplacian, descriptors and projected
+// descriptors of the ipoints are gathered into a single structure-of-
+// arrays block so the host can read everything with one transfer.  The
+// offset of each section (in bytes) is chosen by the host and aligned to
+// 32 bytes.  Each work group packs a single ipoint.
+
+__kernel void packFeatures(__global float2* pos,
+                           __global float* scale,
+                           __global float* orientation,
+                           __global int* laplacian,
+                           __global uint* desc,
+                           __global uint* projected,
+                           int numIpts,
+                           int descWords,
+                           int projWords,
+                           __global uchar* block,
+                           uint scaleOffset,
+                           uint orientationOffset,
+                           uint laplacianOffset,
+                           uint descOffset,
+                           uint projOffset)
+{
+    int ipt = get_group_id(0);
+    int lid = get_local_id(0);
+    int lsz = get_local_size(0);
+
+    if(ipt >= numIpts) 
+    {
+        return;
+    }
+
+    // The position section always starts the block
+    if(lid == 0) 
+    {
+        ((__global float2*)block)[ipt] = pos[ipt];
+        ((__global float*)(block + scaleOffset))[ipt] = scale[ipt];
+        ((__global float*)(block + orientationOffset))[ipt] = 
+            orientation[ipt];
+        ((__global int*)(block + laplacianOffset))[ipt] = laplacian[ipt];
+    }
+
+    // Descriptors are copied as 32-bit words so every output format 
+    // is handled the same way
+    __global uint* descOut = (__global uint*)(block + descOffset);
+    for(int i = lid; i < descWords; i += lsz) 
+    {
+        descOut[ipt*descWords + i] = desc[ipt*descWords + i];
+    }
+
+    __global uint* projOut = (__global uint*)(block + projOffset);
+    for(int i = lid; i < projWords; i += lsz) 
+    {
+        projOut[ipt*projWords + i] = projected[ipt*projWords + i];
+    }
+}
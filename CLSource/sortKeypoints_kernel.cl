@@ -0,0 +1,219 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+// Reordering of the ipoints before orientation and description.
+//
+// The non-max suppression kernel appends ipoints with an atomic counter, 
+// so they arrive in effectively random order.  Sorting them by scale 
+// and then by the Morton (Z-order) code of their position makes 
+// consecutive work groups of the orientation and descriptor kernels read
+// nearby parts of the integral image with the same filter sizes.
+
+// Keys are 4 bits of scale followed by 14 bits each of interleaved y 
+// and x (positions up to 16383)
+#define SORT_SCALE_BUCKETS 16
+#define SORT_COORD_MAX 16383
+
+//! Spread the lower 16 bits of x to the even bits
+uint spreadBits(uint x) 
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+
+__kernel void computeSortKeys(__global float2* pos,
+                              __global float* scale,
+                              int numIpts,
+                              __global uint* keys,
+                              __global int* indices)
+{
+    // Each work item computes the key of one ipoint.  The keys are padded
+    // to a power of two with keys that sort last.
+
+    int idx = get_global_id(0);
+
+    indices[idx] = idx;
+
+    if(idx >= numIpts) 
+    {
+        keys[idx] = 0xffffffff;
+        return;
+    }
+
+    uint bucket = (uint)min((int)round(scale[idx]), SORT_SCALE_BUCKETS-1);
+    uint x = (uint)clamp((int)round(pos[idx].x), 0, SORT_COORD_MAX);
+    uint y = (uint)clamp((int)round(pos[idx].y), 0, SORT_COORD_MAX);
+
+    keys[idx] = (bucket << 28) | (spreadBits(y) << 1) | spreadBits(x);
+}
+
+
+__kernel void bitonicSortStep(__global uint* keys,
+                              __global int* indices,
+                              int j,
+                              int k)
+{
+    // One compare-and-exchange step of a bitonic sort of the (key, index)
+    // pairs.  Ties are broken by index, so the order is the same as a 
+    // stable sort of the keys.
+
+    int i = get_global_id(0);
+    int ixj = i ^ j;
+
+    if(ixj <= i) 
+    {
+        return;
+    }
+
+    uint keyI = keys[i];
+    uint keyJ = keys[ixj];
+    int idxI = indices[i];
+    int idxJ = indices[ixj];
+
+    bool greater = (keyI > keyJ) || (keyI == keyJ && idxI > idxJ);
+    bool ascending = ((i & k) == 0);
+
+    if(greater == ascending) 
+    {
+        keys[i] = keyJ;
+        keys[ixj] = keyI;
+        indices[i] = idxJ;
+        indices[ixj] = idxI;
+    }
+}
+
+
+__kernel void bitonicSortLocal(__global uint* keys,
+                               __global int* indices,
+                               int j,
+                               int k,
+                               __local uint* localKeys,
+                               __local int* localIndices)
+{
+    // The steps j, j/2, ..., 1 of stage k of the bitonic sort.  Once j is
+    // below the work group size, both elements of each pair are in the
+    // same work group, so the steps run in local memory in one launch.
+
+    int i = get_global_id(0);
+    int lid = get_local_id(0);
+
+    localKeys[lid] = keys[i];
+    localIndices[lid] = indices[i];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // The direction depends on the global position, as in bitonicSortStep
+    bool ascending = ((i & k) == 0);
+
+    for(; j > 0; j >>= 1) 
+    {
+        int lxj = lid ^ j;
+
+        if(lxj > lid) 
+        {
+            uint keyI = localKeys[lid];
+            uint keyJ = localKeys[lxj];
+            int idxI = localIndices[lid];
+            int idxJ = localIndices[lxj];
+
+            bool greater = (keyI > keyJ) || (keyI == keyJ && idxI > idxJ);
+
+            if(greater == ascending) 
+            {
+                localKeys[lid] = keyJ;
+                localKeys[lxj] = keyI;
+                localIndices[lid] = idxJ;
+                localIndices[lxj] = idxI;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    keys[i] = localKeys[lid];
+    indices[i] = localIndices[lid];
+}
+
+
+__kernel void permuteIpoints(__global int* indices,
+                             int numIpts,
+                             __global float2* pos,
+                             __global float* scale,
+                             __global int* laplacian,
+                             __global float* orientation,
+                             __global int* imageIndex,
+                             __global float2* sortedPos,
+                             __global float* sortedScale,
+                             __global int* sortedLaplacian,
+                             __global float* sortedOrientation,
+                             __global int* sortedImageIndex)
+{
+    // Gather the ipoint data into sorted order (the batch image index 
+    // moves with the ipoint)
+
+    int idx = get_global_id(0);
+
+    if(idx >= numIpts) 
+    {
+        return;
+    }
+
+    int src = indices[idx];
+
+    sortedPos[idx] = pos[src];
+    sortedScale[idx] = scale[src];
+    sortedLaplacian[idx] = laplacian[src];
+    sortedOrientation[idx] = orientation[src];
+    sortedImageIndex[idx] = imageIndex[src];
+}
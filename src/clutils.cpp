@@ -53,6 +53,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
 #include <CL/cl.h>
 
 #include "eventlist.h"
@@ -79,22 +87,248 @@ static cl_device_id device = NULL;
 //! OpenCL context
 static cl_context context = NULL;
 
-//! OpenCL command queue
-static cl_command_queue commandQueue = NULL;
-static cl_command_queue commandQueueProf = NULL;
-static cl_command_queue commandQueueNoProf = NULL;
+//! The devices of the context (the chosen device unless frames are 
+//! scheduled on several workers, see cl_selectContextDevices)
+static cl_device_id* contextDevices = NULL;
+static cl_uint numContextDevices = 0;
+
+//! Whether contextDevices are sub-devices created by cl_init
+static bool contextSubDevices = false;
+
+//! Whether contextDevices are the NUMA nodes of the chosen device, in 
+//! node order
+static bool contextNumaNodes = false;
+
+//! Capabilities shared by all of the context devices (the programs are 
+//! built for all of them with the same options)
+static DeviceCaps contextCaps;
+
+// Transfers whose event names are numbered separately
+#define IO_EVENT_COPY_BUFFER 0
+#define IO_EVENT_TO_DEVICE 1
+#define IO_EVENT_TO_HOST 2
+#define IO_EVENT_TO_HOST_ASYNC 3
+#define IO_EVENT_BUFFER_TO_IMAGE 4
+#define IO_EVENT_IMAGE_TO_DEVICE 5
+#define IO_EVENT_IMAGE_TO_HOST 6
+#define IO_EVENT_MAP 7
+#define IO_EVENT_MAP_ASYNC 8
+#define NUM_IO_EVENTS 9
+
+//! Command queues, kernel objects and events of one SURF pipeline
+/*!
+    The context, programs and memory objects are shared, but each 
+    pipeline enqueues on its own queues and sets the arguments of its own
+    kernel objects, so pipelines on different threads don't interfere.
+*/
+struct SurfContext{
+        // The device the queues are created on, and its capabilities
+        cl_device_id device;
+        DeviceCaps caps;
+
+        // The queue commands are enqueued on (one of the four below)
+        cl_command_queue commandQueue;
+        cl_command_queue commandQueueProf;
+        cl_command_queue commandQueueNoProf;
+
+        // Second command queue for transfers that overlap with computation
+        cl_command_queue transferQueueProf;
+        cl_command_queue transferQueueNoProf;
+
+        // The queue selected with cl_selectQueue (CLUTILS_QUEUE_*)
+        int activeQueue;
 
-//! List of precompiled kernels
-static cl_kernel kernel_list[NUM_KERNELS];
+        // Kernel objects, created by cl_getKernel the first time they 
+        // are used
+        cl_kernel kernels[NUM_KERNELS];
+
+        // Event table and status of events
+        EventList* events;
+        bool eventsEnabled;
+
+        // Numbers of the next transfer event names (IO_EVENT_*)
+        int ioEventCounts[NUM_IO_EVENTS];
+
+        // Logging information for keeping track of device memory
+        int allocationCount;
+        size_t allocationSize;
+};
+
+//! The context created by cl_init
+static SurfContext defaultContext;
+
+//! The context selected by the calling thread (NULL for defaultContext)
+static CL_THREAD_LOCAL SurfContext* threadContext = NULL;
 
 //! List of program objects
 static cl_program program_list[NUM_PROGRAMS];
 
-//! Globally visible event table
-static EventList* events = NULL;
+//! Descriptions of the compile events of cached programs (compile event
+//! descriptions aren't freed with the events)
+static char** cachedEventNames = NULL;
+static int numCachedEventNames = 0;
+
+#ifdef EMBEDDED_KERNELS
+//! Kernel sources compiled into the executable.  Pairs of file name and 
+//! source terminated by NULL (generated from CLSource/ by the Makefile)
+extern const char* cl_embeddedKernels[];
+#endif
+
+// Build states of a program
+#define PROGRAM_NOT_BUILT 0
+#define PROGRAM_BUILDING 1
+#define PROGRAM_BUILT 2
+
+//! Source and build state of a program in program_list
+typedef struct {
+    const char* file;       // Source file (in CLSource/)
+    char* eventName;        // Description of the compile event
+    int state;              // PROGRAM_*
+    bool fromCache;         // Loaded from the binary cache
+    bool recorded;          // The compile event has been created
+    cl_time start;          // Time the build started
+    cl_time end;            // Time the build finished
+} ProgramBuild;
+
+//! The programs of SURF, indexed like program_list
+static ProgramBuild programBuilds[NUM_PROGRAMS] = {
+    {"hessianDet_kernel.cl", "hessian_det",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"createDescriptors_kernel.cl", "createDescriptors",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"normalizeDescriptors_kernel.cl", "normalize",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"nonMaxSuppression_kernel.cl", "NonMaxSuppression",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"getOrientation_kernels.cl", "Orientation",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"nearestNeighbor_kernel.cl", "NearestNeighbor",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"integralImage_kernels.cl", "IntegralImage",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"denseDescriptors_kernel.cl", "DenseDescriptors",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"haarMaps_kernel.cl", "HaarMaps",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"sortKeypoints_kernel.cl", "SortKeypoints",
+        PROGRAM_NOT_BUILT, false, false, 0, 0},
+    {"packFeatures_kernel.cl", "PackFeatures",
+        PROGRAM_NOT_BUILT, false, false, 0, 0}
+};
+
+//! Program and function name of each kernel (indexed by KERNEL_*)
+typedef struct {
+    int program;            // Index into program_list (-1 if none)
+    const char* name;       // Name of the kernel function
+} KernelSource;
+
+static const KernelSource kernelSources[NUM_KERNELS] = {
+    {-1, NULL},                         // KERNEL_INIT_DET
+    {0, "hessian_det"},                 // KERNEL_BUILD_DET
+    {1, "createDescriptors_kernel"},    // KERNEL_SURF_DESC
+    {2, "normalizeDescriptors"},        // KERNEL_NORM_DESC
+    {3, "non_max_supression_kernel"},   // KERNEL_NON_MAX_SUP
+    {4, "getOrientationStep1"},         // KERNEL_GET_ORIENT1
+    {4, "getOrientationStep2"},         // KERNEL_GET_ORIENT2
+    {5, "NearestNeighbor"},             // KERNEL_NN
+    {6, "scan"},                        // KERNEL_SCAN
+    {6, "scan4"},                       // KERNEL_SCAN4
+    {6, "transpose"},                   // KERNEL_TRANSPOSE
+    {6, "scanImage"},                   // KERNEL_SCANIMAGE
+    {6, "transposeImage"},              // KERNEL_TRANSPOSEIMAGE
+    {2, "projectDescriptors"},          // KERNEL_PROJECT_DESC
+    {7, "denseHaarResponses"},          // KERNEL_DENSE_HAAR
+    {7, "denseWeightedSums"},           // KERNEL_DENSE_SUMS
+    {7, "denseAssembleDescriptors"},    // KERNEL_DENSE_DESC
+    {8, "haarScaleHistogram"},          // KERNEL_HAAR_HISTOGRAM
+    {8, "computeHaarMap"},              // KERNEL_HAAR_MAP
+    {9, "computeSortKeys"},             // KERNEL_SORT_KEYS
+    {9, "bitonicSortStep"},             // KERNEL_BITONIC_SORT
+    {9, "permuteIpoints"},              // KERNEL_PERMUTE_IPTS
+    {10, "packFeatures"},               // KERNEL_PACK_FEATURES
+    {9, "bitonicSortLocal"}             // KERNEL_BITONIC_SORT_LOCAL
+};
+
+//! Order the programs are built in the background (the order SURF first
+//! uses them, so the first frame waits as little as possible)
+static const int programBuildOrder[NUM_PROGRAMS] = 
+    {6, 0, 3, 4, 1, 2, 9, 8, 10, 7, 5};
+
+//! Build options of the SURF programs (with the device-specific options 
+//! added by cl_precompileKernels)
+static char* programBuildOptions = NULL;
+
+//! A kernel built with extra preprocessor definitions
+typedef struct {
+    int kernel;             // The kernel (KERNEL_*)
+    char* defines;          // The extra build options
+    cl_program program;     // The program built with them
+    cl_kernel object;       // The kernel object
+    SurfContext* owner;     // The context the kernel object belongs to
+    unsigned long lastUse;  // specialisedClock when it was last returned
+} SpecialisedKernel;
+
+// Specialised kernels kept per context (the least recently used one is
+// released to make room for a new configuration)
+#define MAX_SPECIALISED_KERNELS 48
+
+//! Kernels built by cl_getSpecialisedKernel
+static SpecialisedKernel* specialisedKernels = NULL;
+static int numSpecialisedKernels = 0;
+
+//! Incremented each time a specialised kernel is returned
+static unsigned long specialisedClock = 0;
+
+static void cl_releasePrograms();
+static void cl_lockEvents();
+static void cl_unlockEvents();
+static cl_kernel cl_addSpecialisedKernel(int kernel, char* defines, 
+    cl_program built, SurfContext* ctx);
+static void cl_releaseSpecialisedKernels(SurfContext* ctx);
+
+//! Next entry of programBuildOrder for the build threads
+static int nextProgramBuild = 0;
+
+//! Programs the build threads build (BUILD_* bits)
+static int programBuildSet = BUILD_ALL;
+
+//! Tells the build threads to stop taking programs
+static bool stopProgramBuilds = false;
+
+//! Threads building programs in the background
+static int numBuildThreads = 0;
+#ifdef _WIN32
+static HANDLE* buildThreads = NULL;
+static CRITICAL_SECTION buildLock;
+static CONDITION_VARIABLE buildDone;
+#else
+static pthread_t* buildThreads = NULL;
+static pthread_mutex_t buildLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buildDone = PTHREAD_COND_INITIALIZER;
+#endif
+
+//! Guards the events of the context created by cl_init, which the other
+//! contexts hand their events to when they are released
+#ifdef _WIN32
+static CRITICAL_SECTION eventLock;
+#else
+static pthread_mutex_t eventLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+//! Return the context selected by the calling thread
+static SurfContext* cl_currentContext()
+{
+    return threadContext != NULL ? threadContext : &defaultContext;
+}
 
-//! Global status of events
-static bool eventsEnabled = false;
+static void cl_selectContextDevices(cl_device_id* candidates, 
+    cl_uint numCandidates);
+static bool cl_partitionDevice(cl_device_id parent, 
+    cl_device_affinity_domain domain, int parts);
+static void cl_createQueues(SurfContext* ctx);
+static void cl_releaseQueues(SurfContext* ctx);
+static void cl_updateQueue(SurfContext* ctx);
+static void cl_combineDeviceCaps(DeviceCaps* caps, DeviceCaps* other);
 
 
 //-------------------------------------------------------
@@ -113,7 +347,16 @@ cl_context cl_init(char devicePreference)
     cl_int status;
 
     // Allocate the event table
-    events = new EventList();
+    defaultContext.events = new EventList();
+
+#ifdef _WIN32
+    // Create the lock guarding the program builds
+    InitializeCriticalSection(&buildLock);
+    InitializeConditionVariable(&buildDone);
+
+    // Create the lock guarding the events of the default context
+    InitializeCriticalSection(&eventLock);
+#endif
 
     // Discover and populate the platforms
     status = clGetPlatformIDs(0, NULL, &numPlatforms);
@@ -226,59 +469,350 @@ cl_context cl_init(char devicePreference)
     platform = platforms[chosen_platform];
     device = devices[chosen_platform][chosen_device];
 
+    // Add the devices the workers run on
+    cl_selectContextDevices(devices[chosen_platform], 
+        numDevices[chosen_platform]);
+
+    // The chosen device is replaced by its first sub-device if it was 
+    // partitioned
+    device = contextDevices[0];
+
     // Create the context
     cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM,
         (cl_context_properties)(platform), 0};
-    context = clCreateContext(cps, 1, &device, NULL, NULL, &status);
+    context = clCreateContext(cps, numContextDevices, contextDevices, NULL, 
+        NULL, &status);
     cl_errChk(status, "Creating context", true);
 
-    // Create the command queue
-    commandQueueProf = clCreateCommandQueue(context, device,
-                            CL_QUEUE_PROFILING_ENABLE, &status);
-    cl_errChk(status, "creating command queue", true);
-
-    commandQueueNoProf = clCreateCommandQueue(context, device, 0, &status);
-    cl_errChk(status, "creating command queue", true);
+    // Create the command queues
+    defaultContext.device = device;
+    cl_createQueues(&defaultContext);
+
+    // Query what the kernel variants are chosen by.  The build options 
+    // are chosen by what all of the context devices support.
+    cl_queryDeviceCaps(&defaultContext.caps, device);
+    contextCaps = defaultContext.caps;
+    for(cl_uint i = 1; i < numContextDevices; i++) {
+        DeviceCaps caps;
+        cl_queryDeviceCaps(&caps, contextDevices[i]);
+        cl_combineDeviceCaps(&contextCaps, &caps);
+    }
+    cl_printDeviceCaps(&contextCaps);
 
-    if(eventsEnabled) {
+    if(defaultContext.eventsEnabled) {
         printf("Profiling enabled\n");
-        commandQueue = commandQueueProf;
     }
     else {
         printf("Profiling disabled\n");
-        commandQueue = commandQueueNoProf;
     }
 
     return context;
 }
 
+//! Choose the devices of the context
+/*!
+    In NUMA-aware mode (see isNumaAware) the context holds a sub-device 
+    per NUMA node of the chosen device.  Otherwise, with one worker (see
+    getSchedulerWorkers) the context holds the chosen device.  With 
+    several, it holds every device of the platform, or, if the platform 
+    has only one, the sub-devices the device is partitioned into.  
+    Devices that can't be partitioned are shared by the workers.
+    \param candidates The devices of the chosen platform
+    \param numCandidates The number of devices
+*/
+static void cl_selectContextDevices(cl_device_id* candidates, 
+    cl_uint numCandidates)
+{
+    int workers = getSchedulerWorkers();
+
+    if(isNumaAware() && 
+       cl_partitionDevice(device, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0)) {
+        contextSubDevices = true;
+        contextNumaNodes = true;
+        printf("Partitioned the device into %d NUMA nodes\n", 
+            numContextDevices);
+        return;
+    }
+    if(isNumaAware()) {
+        printf("The device can't be partitioned by NUMA node\n");
+    }
+
+    if(workers > 1 && numCandidates > 1) {
+        numContextDevices = numCandidates;
+        contextDevices = (cl_device_id*)alloc(numCandidates * 
+            sizeof(cl_device_id));
+        for(cl_uint i = 0; i < numCandidates; i++) {
+            contextDevices[i] = candidates[i];
+        }
+    }
+    else if(workers > 1 && cl_partitionDevice(device, 
+            CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE, workers)) {
+        contextSubDevices = true;
+    }
+    else {
+        numContextDevices = 1;
+        contextDevices = (cl_device_id*)alloc(sizeof(cl_device_id));
+        contextDevices[0] = device;
+    }
+
+    if(workers > 1) {
+        printf("Scheduling frames on %d workers over %d %sdevices\n", 
+            workers, numContextDevices, contextSubDevices ? "sub-" : "");
+    }
+}
+
+//! Partition a device into sub-devices for the workers
+/*!
+    The device is split along an affinity domain (e.g. the sockets of a
+    CPU), or else into equal groups of compute units, one per worker.
+    \param parent The device to partition
+    \param domain The affinity domain (CL_DEVICE_AFFINITY_DOMAIN_*)
+    \param parts The number of workers (0 doesn't fall back to equal 
+           groups)
+    \return false if the device can't be partitioned
+*/
+static bool cl_partitionDevice(cl_device_id parent, 
+    cl_device_affinity_domain domain, int parts)
+{
+    cl_int status;
+    cl_uint numSubDevices = 0;
+
+    cl_uint computeUnits = 0;
+    status = clGetDeviceInfo(parent, CL_DEVICE_MAX_COMPUTE_UNITS, 
+        sizeof(cl_uint), &computeUnits, NULL);
+    cl_errChk(status, "Getting the number of compute units", true);
+    if(computeUnits < (cl_uint)parts) {
+        computeUnits = parts;
+    }
+
+    cl_device_partition_property byDomain[3] = {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, 
+        (cl_device_partition_property)domain, 0};
+    cl_device_partition_property equally[3] = {
+        CL_DEVICE_PARTITION_EQUALLY, 
+        (cl_device_partition_property)(parts > 0 ? computeUnits / parts : 1),
+        0};
+
+    cl_device_partition_property* properties = byDomain;
+    status = clCreateSubDevices(parent, properties, 0, NULL, &numSubDevices);
+    if(parts > 0 && (status != CL_SUCCESS || numSubDevices < 2)) {
+        properties = equally;
+        status = clCreateSubDevices(parent, properties, 0, NULL, 
+            &numSubDevices);
+    }
+    if(status != CL_SUCCESS || numSubDevices < 2) {
+        if(parts > 0) {
+            printf("The device can't be partitioned, the workers share it\n");
+        }
+        return false;
+    }
+
+    contextDevices = (cl_device_id*)alloc(numSubDevices * 
+        sizeof(cl_device_id));
+    status = clCreateSubDevices(parent, properties, numSubDevices, 
+        contextDevices, NULL);
+    cl_errChk(status, "Creating sub-devices", true);
+
+    numContextDevices = numSubDevices;
+
+    return true;
+}
+
+//! Return the number of devices of the context
+int cl_getNumContextDevices()
+{
+    return (int)numContextDevices;
+}
+
+//! Return whether the context devices are the NUMA nodes of one device
+/*!
+    Device i is then node i (OpenCL doesn't report the node of a 
+    sub-device, but the runtimes create them in node order)
+*/
+bool cl_isNumaPartitioned()
+{
+    return contextNumaNodes;
+}
+
+//! Return a device of the context
+/*!
+    \param index The device, 0 to cl_getNumContextDevices() - 1
+*/
+cl_device_id cl_getContextDevice(int index)
+{
+    if(index < 0 || index >= (int)numContextDevices) {
+        printf("Invalid context device %d\n", index);
+        exit(-1);
+    }
+    return contextDevices[index];
+}
+
+//! Create the command queues of a context
+static void cl_createQueues(SurfContext* ctx)
+{
+    cl_int status;
+
+    ctx->commandQueueProf = clCreateCommandQueue(context, ctx->device,
+                            CL_QUEUE_PROFILING_ENABLE, &status);
+    cl_errChk(status, "creating command queue", true);
+
+    ctx->commandQueueNoProf = clCreateCommandQueue(context, ctx->device, 0, 
+                            &status);
+    cl_errChk(status, "creating command queue", true);
+
+    // Create the transfer queues
+    ctx->transferQueueProf = clCreateCommandQueue(context, ctx->device,
+                            CL_QUEUE_PROFILING_ENABLE, &status);
+    cl_errChk(status, "creating transfer queue", true);
+
+    ctx->transferQueueNoProf = clCreateCommandQueue(context, ctx->device, 0, 
+                            &status);
+    cl_errChk(status, "creating transfer queue", true);
+
+    cl_updateQueue(ctx);
+}
+
+//! Release the command queues of a context
+static void cl_releaseQueues(SurfContext* ctx)
+{
+    if(ctx->commandQueueProf) {
+        clReleaseCommandQueue(ctx->commandQueueProf);
+    }
+    if(ctx->commandQueueNoProf) {
+        clReleaseCommandQueue(ctx->commandQueueNoProf);
+    }
+    if(ctx->transferQueueProf) {
+        clReleaseCommandQueue(ctx->transferQueueProf);
+    }
+    if(ctx->transferQueueNoProf) {
+        clReleaseCommandQueue(ctx->transferQueueNoProf);
+    }
+    ctx->commandQueue = NULL;
+}
+
+//! Create a context for a SURF pipeline
+/*!
+    Pipelines that run concurrently on different threads each need a 
+    context (see cl_setSurfContext).  The context gets its own command 
+    queues, kernel objects and event table, and starts with the profiling
+    state of the context created by cl_init.  Must be called after cl_init.
+    \param dev The device the queues are created on (one of the context 
+           devices, see cl_getContextDevice), or NULL for the chosen one
+    \return The new context
+*/
+SurfContext* cl_createSurfContext(cl_device_id dev)
+{
+    SurfContext* ctx = (SurfContext*)alloc(sizeof(SurfContext));
+    memset(ctx, 0, sizeof(SurfContext));
+
+    ctx->device = dev != NULL ? dev : device;
+    cl_queryDeviceCaps(&ctx->caps, ctx->device);
+
+    ctx->activeQueue = CLUTILS_QUEUE_COMPUTE;
+    ctx->eventsEnabled = defaultContext.eventsEnabled;
+    ctx->events = new EventList();
+
+    cl_createQueues(ctx);
+
+    return ctx;
+}
+
+//! Select the context the calling thread works on
+/*!
+    All queue, kernel and event functions of clutils work on the context 
+    selected by the calling thread.  Surf objects must be created and 
+    used on a thread that has selected the same context.
+    \param ctx The context, or NULL for the context created by cl_init
+*/
+void cl_setSurfContext(SurfContext* ctx)
+{
+    threadContext = ctx;
+}
+
+//! Return the context selected by the calling thread
+SurfContext* cl_getSurfContext()
+{
+    return cl_currentContext();
+}
+
+//! Release a context created by cl_createSurfContext
+/*!
+    Waits for the commands of the context to finish.  Its events are 
+    moved to the context created by cl_init, so cl_writeEventsToFile 
+    includes them once the context is released.  Must be called before 
+    cl_cleanup, and before the programs are built again by 
+    cl_precompileKernels.
+*/
+void cl_releaseSurfContext(SurfContext* ctx)
+{
+    if(ctx == NULL || ctx == &defaultContext) {
+        return;
+    }
+
+    clFinish(ctx->commandQueueNoProf);
+    clFinish(ctx->commandQueueProf);
+    clFinish(ctx->transferQueueNoProf);
+    clFinish(ctx->transferQueueProf);
+
+    for(int i = 0; i < NUM_KERNELS; i++) {
+        if(ctx->kernels[i]) {
+            clReleaseKernel(ctx->kernels[i]);
+        }
+    }
+    cl_releaseSpecialisedKernels(ctx);
+
+    // Hand the events to the default context, the list left behind is 
+    // empty
+    cl_lockEvents();
+    defaultContext.events->takeEvents(ctx->events);
+    cl_unlockEvents();
+    delete ctx->events;
+
+    cl_releaseQueues(ctx);
+
+    if(threadContext == ctx) {
+        threadContext = NULL;
+    }
+
+    free(ctx);
+}
+
 /*!
     Release all resources that the user doesn't have access to.
 */
 void  cl_cleanup()
 {
-    // Free the events (this frees the OpenCL events as well)
-    delete events;
+    // Free the kernel and program objects (after the background builds 
+    // finish)
+    cl_releasePrograms();
+    free(programBuildOptions);
+    programBuildOptions = NULL;
 
-    // Free the command queue
-    if(commandQueue) {
-        clReleaseCommandQueue(commandQueue);
+    // Free the events (this frees the OpenCL events as well)
+    delete defaultContext.events;
+    defaultContext.events = NULL;
+    for(int i = 0; i < numCachedEventNames; i++) {
+        free(cachedEventNames[i]);
     }
+    free(cachedEventNames);
+    cachedEventNames = NULL;
+    numCachedEventNames = 0;
+
+    // Free the command queues
+    cl_releaseQueues(&defaultContext);
 
     // Free the context
     if(context) {
         clReleaseContext(context);
     }
 
-    // Free the kernel objects
-    for(int i = 0; i < NUM_KERNELS; i++) {
-        clReleaseKernel(kernel_list[i]);
-    }
-
-    // Free the program objects
-    for(int i = 0; i < NUM_PROGRAMS; i++) {
-        clReleaseProgram(program_list[i]);
+    // Free the sub-devices
+    if(contextSubDevices) {
+        for(cl_uint i = 0; i < numContextDevices; i++) {
+            clReleaseDevice(contextDevices[i]);
+        }
     }
+    free(contextDevices);
 
     // Free the devices
     for(int i = 0; i < (int)numPlatforms; i++) {
@@ -343,7 +877,71 @@ void cl_freeProgram(cl_program program)
 */
 void cl_sync()
 {
-    clFinish(commandQueue);
+    SurfContext* ctx = cl_currentContext();
+    clFinish(ctx->commandQueue);
+}
+
+//! Set the queue of a context from the selected queue and the profiling 
+//! state
+static void cl_updateQueue(SurfContext* ctx)
+{
+    if(ctx->activeQueue == CLUTILS_QUEUE_TRANSFER) {
+        ctx->commandQueue = ctx->eventsEnabled ? ctx->transferQueueProf : 
+                                                 ctx->transferQueueNoProf;
+    }
+    else {
+        ctx->commandQueue = ctx->eventsEnabled ? ctx->commandQueueProf : 
+                                                 ctx->commandQueueNoProf;
+    }
+}
+
+//! Select the queue the following commands are enqueued on
+/*!
+    \param queue CLUTILS_QUEUE_COMPUTE or CLUTILS_QUEUE_TRANSFER
+*/
+void cl_selectQueue(int queue)
+{
+    SurfContext* ctx = cl_currentContext();
+    ctx->activeQueue = queue;
+    cl_updateQueue(ctx);
+}
+
+//! Enqueue a marker on the active queue
+/*!
+    \param event Receives an event that completes when all commands 
+           enqueued before the marker have completed.  The caller must 
+           release it.
+*/
+void cl_enqueueMarker(cl_event* event)
+{
+    SurfContext* ctx = cl_currentContext();
+    cl_int status;
+    status = clEnqueueMarker(ctx->commandQueue, event);
+    cl_errChk(status, "Enqueuing a marker", true);
+}
+
+//! Make the active queue wait for an event (e.g. from the other queue)
+void cl_enqueueWaitForEvent(cl_event event)
+{
+    SurfContext* ctx = cl_currentContext();
+    cl_int status;
+    status = clEnqueueWaitForEvents(ctx->commandQueue, 1, &event);
+    cl_errChk(status, "Enqueuing a wait for events", true);
+}
+
+//! Submit the commands of the active queue to the device
+void cl_flush()
+{
+    SurfContext* ctx = cl_currentContext();
+    clFlush(ctx->commandQueue);
+}
+
+//! Block until an event has completed
+void cl_waitForEvent(cl_event event)
+{
+    cl_int status;
+    status = clWaitForEvents(1, &event);
+    cl_errChk(status, "Waiting for an event", true);
 }
 
 
@@ -362,14 +960,10 @@ cl_mem cl_allocBuffer(size_t mem_size, cl_mem_flags flags)
     cl_mem mem;
     cl_int status;
 
-    /*!
-        Logging information for keeping track of device memory
-    */
-    static int allocationCount = 1;
-    static size_t allocationSize = 0;
-
-    allocationCount++;
-    allocationSize += mem_size;
+    // Logging information for keeping track of device memory
+    SurfContext* ctx = cl_currentContext();
+    ctx->allocationCount++;
+    ctx->allocationSize += mem_size;
 
     mem = clCreateBuffer(context, flags, mem_size, NULL, &status);
 
@@ -413,6 +1007,31 @@ cl_mem cl_allocBufferPinned(size_t mem_size)
     return mem;
 }
 
+//! Create a buffer backed by host memory
+/*!
+    The buffer uses the host memory directly (CL_MEM_USE_HOST_PTR).  On
+    devices that share memory with the host, the memory should be page 
+    aligned so the runtime doesn't make a copy of it.  It must stay 
+    allocated until the buffer is released, and should only be accessed
+    by mapping the buffer.
+    \param mem_size Size of the buffer in bytes
+    \param host_ptr The host memory
+    \param flags Optional cl_mem_flags
+    \return Returns a cl_mem object that uses host_ptr
+*/
+cl_mem cl_allocBufferHostPtr(size_t mem_size, void* host_ptr, 
+    cl_mem_flags flags)
+{
+    cl_mem mem;
+    cl_int status;
+
+    mem = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, mem_size, 
+        host_ptr, &status);
+    cl_errChk(status, "Error creating buffer from host memory", true);
+
+    return mem;
+}
+
 //! Allocate an image on a device
 /*!
     \param height Number of rows in the image
@@ -445,14 +1064,10 @@ cl_mem cl_allocImage(size_t height, size_t width, char type, cl_mem_flags flags)
         exit(-1);
     }
 
-    /*!
-        Logging information for keeping track of device memory
-    */
-    static int allocationCount = 1;
-    static size_t allocationSize = 0;
-
-    allocationCount++;
-    allocationSize += height*width*elemSize;
+    // Logging information for keeping track of device memory
+    SurfContext* ctx = cl_currentContext();
+    ctx->allocationCount++;
+    ctx->allocationSize += height*width*elemSize;
 
     // Create the image
     mem = clCreateImage2D(context, flags, &format, width, height, 0, NULL, &status);
@@ -486,25 +1101,43 @@ void* cl_copyAndMapBuffer(cl_mem dst, cl_mem src, size_t size) {
     return ptr;
 }
 
+//! Copy a buffer to pinned memory and map it without blocking
+/*!
+    \param dst Pinned buffer on the host
+    \param src Buffer on the device
+    \param size Number of bytes to copy
+    \param ready Receives an event that completes when the data is mapped.
+           The caller must release it.
+    \return Pointer to the mapped data (not valid until ready completes)
+*/
+void* cl_copyAndMapBufferAsync(cl_mem dst, cl_mem src, size_t size, 
+    cl_event* ready) 
+{
+    cl_copyBufferToBuffer(dst, src, size);
+
+    return cl_mapBufferAsync(dst, size, CL_MAP_READ, ready);
+}
+
 // Copy a buffer
 void cl_copyBufferToBuffer(cl_mem dst, cl_mem src, size_t size)
 {
-    static int eventCnt = 0;
+    SurfContext* ctx = cl_currentContext();
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
     cl_int status;
-    status = clEnqueueCopyBuffer(commandQueue, src, dst, 0, 0, size, 0, NULL,
-        eventPtr);
+    status = clEnqueueCopyBuffer(ctx->commandQueue, src, dst, 0, 0, size, 0, 
+        NULL, eventPtr);
     cl_errChk(status, "Copying buffer", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("copyBuffer", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("copyBuffer", 
+            ctx->ioEventCounts[IO_EVENT_COPY_BUFFER]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
     }
 }
 
@@ -517,22 +1150,23 @@ void cl_copyBufferToBuffer(cl_mem dst, cl_mem src, size_t size)
 */
 void cl_copyBufferToDevice(cl_mem dst, void* src, size_t mem_size, cl_bool blocking)
 {
-    static int eventCnt = 0;
+    SurfContext* ctx = cl_currentContext();
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
     cl_int status;
-    status = clEnqueueWriteBuffer(commandQueue, dst, blocking, 0,
+    status = clEnqueueWriteBuffer(ctx->commandQueue, dst, blocking, 0,
         mem_size, src, 0, NULL, eventPtr);
     cl_errChk(status, "Writing buffer", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("copyBufferToDevice", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("copyBufferToDevice", 
+            ctx->ioEventCounts[IO_EVENT_TO_DEVICE]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
     }
 }
 
@@ -545,22 +1179,51 @@ void cl_copyBufferToDevice(cl_mem dst, void* src, size_t mem_size, cl_bool block
 */
 void cl_copyBufferToHost(void* dst, cl_mem src, size_t mem_size, cl_bool blocking)
 {
-    static int eventCnt = 0;
+    SurfContext* ctx = cl_currentContext();
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
     cl_int status;
-    status = clEnqueueReadBuffer(commandQueue, src, blocking, 0,
+    status = clEnqueueReadBuffer(ctx->commandQueue, src, blocking, 0,
         mem_size, dst, 0, NULL, eventPtr);
     cl_errChk(status, "Reading buffer", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("copyBufferToHost", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("copyBufferToHost", 
+            ctx->ioEventCounts[IO_EVENT_TO_HOST]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
+    }
+}
+
+//! Copy a buffer from the device without blocking
+/*!
+    \param dst Valid host pointer
+    \param src Device pointer that contains the data
+    \param mem_size Size of data to copy
+    \param ready Receives an event that completes when the copy is done.
+           The caller must release it.
+*/
+void cl_copyBufferToHostAsync(void* dst, cl_mem src, size_t mem_size, 
+    cl_event* ready)
+{
+    SurfContext* ctx = cl_currentContext();
+
+    cl_int status;
+    status = clEnqueueReadBuffer(ctx->commandQueue, src, CL_FALSE, 0,
+        mem_size, dst, 0, NULL, ready);
+    cl_errChk(status, "Reading buffer", true);
+
+    clFlush(ctx->commandQueue);
+
+    if(ctx->eventsEnabled) {
+        clRetainEvent(*ready);
+        char* eventStr = catStringWithInt("copyBufferToHostAsync", 
+            ctx->ioEventCounts[IO_EVENT_TO_HOST_ASYNC]++);
+        ctx->events->newIOEvent(*ready, eventStr);
     }
 }
 
@@ -572,11 +1235,11 @@ void cl_copyBufferToHost(void* dst, cl_mem src, size_t mem_size, cl_bool blockin
 */
 void cl_copyBufferToImage(cl_mem buffer, cl_mem image, int height, int width)
 {
-    static int eventCnt = 0;
+    SurfContext* ctx = cl_currentContext();
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
@@ -584,13 +1247,14 @@ void cl_copyBufferToImage(cl_mem buffer, cl_mem image, int height, int width)
     size_t region[3] = {width, height, 1};
 
     cl_int status;
-    status = clEnqueueCopyBufferToImage(commandQueue, buffer, image, 0,
+    status = clEnqueueCopyBufferToImage(ctx->commandQueue, buffer, image, 0,
         origin, region, 0, NULL, eventPtr);
     cl_errChk(status, "Copying buffer to image", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("copyBufferToImage", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("copyBufferToImage", 
+            ctx->ioEventCounts[IO_EVENT_BUFFER_TO_IMAGE]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
     }
 }
 
@@ -600,14 +1264,16 @@ void cl_copyBufferToImage(cl_mem buffer, cl_mem image, int height, int width)
     \param src Host pointer that contains the data
     \param height Height of the image
     \param width Width of the image
+    \param blocking Blocking or non-blocking operation
 */
-void cl_copyImageToDevice(cl_mem dst, void* src, size_t height, size_t width)
+void cl_copyImageToDevice(cl_mem dst, void* src, size_t height, size_t width,
+    cl_bool blocking)
 {
-    static int eventCnt = 0;
+    SurfContext* ctx = cl_currentContext();
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
@@ -615,13 +1281,14 @@ void cl_copyImageToDevice(cl_mem dst, void* src, size_t height, size_t width)
     size_t origin[3] = {0, 0, 0};
     size_t region[3] = {width, height, 1};
 
-    status = clEnqueueWriteImage(commandQueue, dst, CL_TRUE, origin,
+    status = clEnqueueWriteImage(ctx->commandQueue, dst, blocking, origin,
         region, 0, 0, src, 0, NULL, eventPtr);
     cl_errChk(status, "Writing image", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("copyImageToDevice", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("copyImageToDevice", 
+            ctx->ioEventCounts[IO_EVENT_IMAGE_TO_DEVICE]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
     }
 }
 
@@ -634,11 +1301,11 @@ void cl_copyImageToDevice(cl_mem dst, void* src, size_t height, size_t width)
 */
 void cl_copyImageToHost(void* dst, cl_mem src, size_t height, size_t width)
 {
-    static int eventCnt = 0;
+    SurfContext* ctx = cl_currentContext();
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
@@ -646,13 +1313,14 @@ void cl_copyImageToHost(void* dst, cl_mem src, size_t height, size_t width)
     size_t origin[3] = {0, 0, 0};
     size_t region[3] = {width, height, 1};
 
-    status = clEnqueueReadImage(commandQueue, src, CL_TRUE, origin,
+    status = clEnqueueReadImage(ctx->commandQueue, src, CL_TRUE, origin,
         region, 0, 0, dst, 0, NULL, eventPtr);
     cl_errChk(status, "Reading image", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("copyImageToHost", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("copyImageToHost", 
+            ctx->ioEventCounts[IO_EVENT_IMAGE_TO_HOST]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
     }
 }
 
@@ -665,25 +1333,61 @@ void cl_copyImageToHost(void* dst, cl_mem src, size_t height, size_t width)
 */
 void *cl_mapBuffer(cl_mem mem, size_t mem_size, cl_mem_flags flags)
 {
+    SurfContext* ctx = cl_currentContext();
     cl_int status;
     void *ptr;
 
-    static int eventCnt = 0;
 
     cl_event* eventPtr = NULL, event;
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
-    ptr = (void *)clEnqueueMapBuffer(commandQueue, mem, CL_TRUE, flags,
+    ptr = (void *)clEnqueueMapBuffer(ctx->commandQueue, mem, CL_TRUE, flags,
 		                             0, mem_size, 0, NULL, eventPtr, &status);
 
     cl_errChk(status, "Error mapping a buffer", true);
 
-    if(eventsEnabled) {
-        char* eventStr = catStringWithInt("MapBuffer", eventCnt++);
-        events->newIOEvent(*eventPtr, eventStr);
+    if(ctx->eventsEnabled) {
+        char* eventStr = catStringWithInt("MapBuffer", 
+            ctx->ioEventCounts[IO_EVENT_MAP]++);
+        ctx->events->newIOEvent(*eventPtr, eventStr);
+    }
+
+    return ptr;
+}
+
+//! Map a buffer into a host address space without blocking
+/*!
+    \param mem cl_mem object
+    \param mem_size Size of memory in bytes
+    \param flags Optional cl_mem_flags
+    \param ready Receives an event that completes when the mapping is 
+           valid.  The caller must release it.
+    \return Returns a host pointer to the (not yet valid) mapped region
+*/
+void *cl_mapBufferAsync(cl_mem mem, size_t mem_size, cl_mem_flags flags,
+    cl_event* ready)
+{
+    SurfContext* ctx = cl_currentContext();
+    cl_int status;
+    void *ptr;
+
+
+    ptr = (void *)clEnqueueMapBuffer(ctx->commandQueue, mem, CL_FALSE, flags,
+        0, mem_size, 0, NULL, ready, &status);
+    cl_errChk(status, "Error mapping a buffer", true);
+
+    // Flush so the transfer starts while the host does other work
+    clFlush(ctx->commandQueue);
+
+    if(ctx->eventsEnabled) {
+        // The event list releases the events it holds
+        clRetainEvent(*ready);
+        char* eventStr = catStringWithInt("MapBufferAsync", 
+            ctx->ioEventCounts[IO_EVENT_MAP_ASYNC]++);
+        ctx->events->newIOEvent(*ready, eventStr);
     }
 
     return ptr;
@@ -696,13 +1400,15 @@ void *cl_mapBuffer(cl_mem mem, size_t mem_size, cl_mem_flags flags)
 */
 void cl_unmapBuffer(cl_mem mem, void *ptr)
 {
+    SurfContext* ctx = cl_currentContext();
 
     // TODO It looks like AMD doesn't support profiling unmapping yet. Leaving the
     //      commented code here until it's supported
 
     cl_int status;
 
-    status = clEnqueueUnmapMemObject(commandQueue, mem, ptr, 0, NULL, NULL);
+    status = clEnqueueUnmapMemObject(ctx->commandQueue, mem, ptr, 0, NULL, 
+        NULL);
 
     cl_errChk(status, "Error unmapping a buffer or image", true);
 }
@@ -723,37 +1429,272 @@ void cl_writeToZCBuffer(cl_mem mem, void* data, size_t size)
 //          Program and kernels
 //-------------------------------------------------------
 
-//! Convert source code file into cl_program
-/*!
-Compile Opencl source file into a cl_program. The cl_program will be made into a kernel in PrecompileKernels()
+// Parameters of the 64-bit FNV-1a hash
+#define CL_FNV_OFFSET 14695981039346656037ULL
+#define CL_FNV_PRIME 1099511628211ULL
 
-\param kernelPath  Filename of OpenCl code
-\param compileoptions Compilation options
-\param verbosebuild Switch to enable verbose Output
+//! Hash data with 64-bit FNV-1a
+/*!
+    \param data The data to hash
+    \param size The size of the data in bytes
+    \param hash The hash to continue from (CL_FNV_OFFSET to start)
 */
-cl_program cl_compileProgram(char* kernelPath, char* compileoptions, bool verbosebuild )
+static cl_ulong cl_hashBytes(const void* data, size_t size, cl_ulong hash)
 {
-    cl_int status;
-    FILE *fp = NULL;
-    char *source = NULL;
-    long int size;
+    const unsigned char* bytes = (const unsigned char*)data;
 
-    printf("\t%s\n", kernelPath);
-
-    // Determine the size of the source file
-#ifdef _WIN32
-    fopen_s(&fp, kernelPath, "rb");
-#else
-    fp = fopen(kernelPath, "rb");
-#endif
-    if(!fp) {
-        printf("Could not open kernel file\n");
-        exit(-1);
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= CL_FNV_PRIME;
     }
-    status = fseek(fp, 0, SEEK_END);
-    if(status != 0) {
-        printf("Error seeking to end of file\n");
-        exit(-1);
+
+    return hash;
+}
+
+//! Build the key identifying a program binary
+/*!
+    A binary is only valid for the same platform, device, driver, build 
+    options and source, so all of them are part of the key (the source
+    by its hash)
+    \param source The program source
+    \param size The size of the source
+    \param options The build options (may be NULL)
+    \return The key (release with free)
+*/
+static char* cl_programCacheKey(char* source, size_t size, char* options)
+{
+    char platformName[256] = "";
+    char platformVersion[256] = "";
+    char deviceName[256] = "";
+    char driverVersion[256] = "";
+
+    clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(platformName) - 1,
+        platformName, NULL);
+    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, 
+        sizeof(platformVersion) - 1, platformVersion, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, 
+        deviceName, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, 
+        driverVersion, NULL);
+
+    if(options == NULL) {
+        options = (char*)"";
+    }
+
+    cl_ulong sourceHash = cl_hashBytes(source, size, CL_FNV_OFFSET);
+
+    size_t length = strlen(platformName) + strlen(platformVersion) + 
+        strlen(deviceName) + strlen(driverVersion) + strlen(options) + 32;
+    char* key = (char*)alloc(length);
+    sprintf(key, "%s;%s;%s;%s;%s;%08x%08x", platformName, platformVersion, 
+        deviceName, driverVersion, options, (unsigned int)(sourceHash >> 32),
+        (unsigned int)sourceHash);
+
+    return key;
+}
+
+//! Return the path of the cached binary of a program
+/*!
+    The file is named after the program and the hash of its key
+    \param kernelPath The path of the program source
+    \param key The key of the program (see cl_programCacheKey)
+    \return The path (release with free), or NULL if the cache is disabled
+*/
+static char* cl_programCachePath(char* kernelPath, char* key)
+{
+    char* dir = getProgramCacheDir();
+    if(dir == NULL) {
+        return NULL;
+    }
+
+    // The cache holds binaries for one device
+    if(numContextDevices > 1) {
+        return NULL;
+    }
+
+    // Strip the directory and extension of the source file
+    char* name = kernelPath;
+    for(char* c = kernelPath; *c != '\0'; c++) {
+        if(*c == '/' || *c == '\\') name = c + 1;
+    }
+    size_t nameLength = strlen(name);
+    char* ext = strrchr(name, '.');
+    if(ext != NULL) {
+        nameLength = ext - name;
+    }
+
+    cl_ulong keyHash = cl_hashBytes(key, strlen(key), CL_FNV_OFFSET);
+
+    char* path = (char*)alloc(strlen(dir) + nameLength + 32);
+    sprintf(path, "%s/%.*s_%08x%08x.bin", dir, (int)nameLength, name, 
+        (unsigned int)(keyHash >> 32), (unsigned int)keyHash);
+
+    return path;
+}
+
+//! Load a program from its cached binary
+/*!
+    The file holds the key the binary was built for, which must match
+    \param path The path of the cached binary
+    \param key The key of the program
+    \param compileoptions The build options
+    \return The built program, or NULL if there is no usable binary
+*/
+static cl_program cl_loadProgramBinary(char* path, char* key, 
+    char* compileoptions)
+{
+    FILE* fp = NULL;
+#ifdef _WIN32
+    fopen_s(&fp, path, "rb");
+#else
+    fp = fopen(path, "rb");
+#endif
+    if(!fp) {
+        return NULL;
+    }
+
+    // The key is stored with its terminator, followed by the binary
+    size_t keyLength = strlen(key) + 1;
+    char* storedKey = (char*)alloc(keyLength);
+    size_t binarySize = 0;
+    unsigned char* binary = NULL;
+
+    bool valid = (fread(storedKey, 1, keyLength, fp) == keyLength &&
+                  memcmp(storedKey, key, keyLength) == 0 &&
+                  fread(&binarySize, sizeof(size_t), 1, fp) == 1 &&
+                  binarySize > 0);
+    if(valid) {
+        binary = (unsigned char*)alloc(binarySize);
+        valid = (fread(binary, 1, binarySize, fp) == binarySize);
+    }
+
+    free(storedKey);
+    fclose(fp);
+
+    if(!valid) {
+        free(binary);
+        return NULL;
+    }
+
+    cl_int status;
+    cl_int binaryStatus;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, 
+        &binarySize, (const unsigned char**)&binary, &binaryStatus, &status);
+    free(binary);
+
+    if(status != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+        if(program != NULL) {
+            clReleaseProgram(program);
+        }
+        return NULL;
+    }
+
+    status = clBuildProgram(program, 0, NULL, compileoptions, NULL, NULL);
+    if(status != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+//! Store the binary of a built program in the cache
+/*!
+    Failures are reported but not fatal (the program is built from 
+    source next time)
+    \param program The built program
+    \param path The path of the cached binary
+    \param key The key of the program
+*/
+static void cl_saveProgramBinary(cl_program program, char* path, char* key)
+{
+    cl_int status;
+    size_t binarySize = 0;
+
+    // The context has a single device, so there is a single binary
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, 
+        sizeof(size_t), &binarySize, NULL);
+    if(status != CL_SUCCESS || binarySize == 0) {
+        return;
+    }
+
+    unsigned char* binary = (unsigned char*)alloc(binarySize);
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, 
+        sizeof(unsigned char*), &binary, NULL);
+    if(status != CL_SUCCESS) {
+        free(binary);
+        return;
+    }
+
+    // Create the cache directory on first use
+    char* dir = getProgramCacheDir();
+#ifdef _WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+
+    FILE* fp = NULL;
+#ifdef _WIN32
+    fopen_s(&fp, path, "wb");
+#else
+    fp = fopen(path, "wb");
+#endif
+    if(!fp) {
+        printf("Warning: Could not write program binary %s\n", path);
+        free(binary);
+        return;
+    }
+
+    bool written = (fwrite(key, 1, strlen(key) + 1, fp) == strlen(key) + 1 &&
+                    fwrite(&binarySize, sizeof(size_t), 1, fp) == 1 &&
+                    fwrite(binary, 1, binarySize, fp) == binarySize);
+    fclose(fp);
+    free(binary);
+
+    if(!written) {
+        // Don't leave a truncated binary behind
+        printf("Warning: Could not write program binary %s\n", path);
+        remove(path);
+    }
+}
+
+//! Convert source code file into cl_program
+/*!
+Compile Opencl source file into a cl_program. The cl_program will be made into a kernel in PrecompileKernels()
+
+If the program binary cache is enabled (see setProgramCacheDir), a binary
+built for the same platform, device, driver, build options and source is
+loaded instead, and binaries built from source are added to the cache.
+
+\param kernelPath  Filename of OpenCl code
+\param compileoptions Compilation options
+\param verbosebuild Switch to enable verbose Output
+\param fromCache Set to whether the program was loaded from the binary 
+       cache (may be NULL)
+*/
+cl_program cl_compileProgram(char* kernelPath, char* compileoptions, 
+    bool verbosebuild, bool* fromCache)
+{
+    cl_int status;
+    FILE *fp = NULL;
+    char *source = NULL;
+    long int size;
+
+    // Determine the size of the source file
+#ifdef _WIN32
+    fopen_s(&fp, kernelPath, "rb");
+#else
+    fp = fopen(kernelPath, "rb");
+#endif
+    if(!fp) {
+        printf("Could not open kernel file\n");
+        exit(-1);
+    }
+    status = fseek(fp, 0, SEEK_END);
+    if(status != 0) {
+        printf("Error seeking to end of file\n");
+        exit(-1);
     }
     size = ftell(fp);
     if(size < 0) {
@@ -773,15 +1714,59 @@ cl_program cl_compileProgram(char* kernelPath, char* compileoptions, bool verbos
     // Read in the source code
     fread(source, 1, size, fp);
     source[size] = '\0';
+    fclose(fp);
+
+    cl_program clProgramReturn = cl_compileProgramSource(kernelPath, source,
+        size, compileoptions, verbosebuild, fromCache);
+
+    free(source);
+
+    return clProgramReturn;
+}
+
+//! Compile a program from source in memory
+/*!
+Compile a program from source in memory, or load it from the binary cache
+
+\param name  Name of the program (its source file)
+\param source  The source code
+\param size  The length of the source code
+\param compileoptions Compilation options
+\param verbosebuild Switch to enable verbose Output
+\param fromCache Set to whether the program was loaded from the binary 
+       cache (may be NULL)
+*/
+cl_program cl_compileProgramSource(char* name, char* source, size_t size,
+    char* compileoptions, bool verbosebuild, bool* fromCache)
+{
+    cl_int status;
+
+    printf("\t%s\n", name);
+
+    // Look for a binary of the program in the cache
+    if(fromCache != NULL) {
+        *fromCache = false;
+    }
+    char* cacheKey = cl_programCacheKey(source, size, compileoptions);
+    char* cachePath = cl_programCachePath(name, cacheKey);
+    if(cachePath != NULL) {
+        cl_program cached = cl_loadProgramBinary(cachePath, cacheKey,
+            compileoptions);
+        if(cached != NULL) {
+            if(fromCache != NULL) {
+                *fromCache = true;
+            }
+            free(cacheKey);
+            free(cachePath);
+            return cached;
+        }
+    }
 
     // Create the program object
     cl_program clProgramReturn = clCreateProgramWithSource(context, 1,
-        (const char **)&source, NULL, &status);
+        (const char **)&source, &size, &status);
     cl_errChk(status, "Creating program", true);
 
-    free(source);
-    fclose(fp);
-
     // Try to compile the program
     status = clBuildProgram(clProgramReturn, 0, NULL, compileoptions, NULL, NULL);
     if(cl_errChk(status, "Building program", false) || verbosebuild == 1)
@@ -793,6 +1778,11 @@ cl_program cl_compileProgram(char* kernelPath, char* compileoptions, bool verbos
             sizeof(cl_build_status), &build_status, NULL);
 
         if(build_status == CL_SUCCESS && verbosebuild == 0) {
+            if(cachePath != NULL) {
+                cl_saveProgramBinary(clProgramReturn, cachePath, cacheKey);
+            }
+            free(cacheKey);
+            free(cachePath);
             return clProgramReturn;
         }
 
@@ -817,16 +1807,52 @@ cl_program cl_compileProgram(char* kernelPath, char* compileoptions, bool verbos
             getchar();
             exit(-1);
         }
-        else
-            return clProgramReturn;
     }
 
     // print the ptx information
     // printBinaries(clProgram);
 
+    // Cache the binary for the next run
+    if(cachePath != NULL) {
+        cl_saveProgramBinary(clProgramReturn, cachePath, cacheKey);
+    }
+    free(cacheKey);
+    free(cachePath);
+
     return clProgramReturn;
 }
 
+//! Record the time taken to build a program
+/*!
+    Programs loaded from the binary cache are recorded as cache hits, so
+    the compile and load times can be told apart
+    \param start The time the build started
+    \param end The time the build finished
+    \param name The description of the event (a static string)
+    \param fromCache Whether the program was loaded from the binary cache
+*/
+static void cl_recordCompileEvent(cl_time start, cl_time end, char* name,
+    bool fromCache)
+{
+    SurfContext* ctx = cl_currentContext();
+    char* desc = name;
+
+    if(fromCache) {
+        desc = (char*)alloc(strlen(name) + strlen(" (cache hit)") + 1);
+        sprintf(desc, "%s (cache hit)", name);
+
+        cachedEventNames = (char**)realloc(cachedEventNames,
+            (numCachedEventNames + 1) * sizeof(char*));
+        if(cachedEventNames == NULL) {
+            perror("realloc");
+            exit(-1);
+        }
+        cachedEventNames[numCachedEventNames++] = desc;
+    }
+
+    ctx->events->newCompileEvent(cl_computeTime(start, end), desc);
+}
+
 //! Create a kernel from compiled source
 /*!
 Create a kernel from compiled source
@@ -846,6 +1872,40 @@ cl_kernel cl_createKernel(cl_program program, const char* kernel_name) {
     return kernel;
 }
 
+//! Create a new kernel object for the same kernel function
+/*!
+    The clone has its own arguments, so launches of the same kernel with
+    different arguments can each keep theirs bound.  The arguments of 
+    kernel are not copied.
+    \param kernel The kernel to clone
+    \return A new kernel object (release with cl_freeKernel)
+*/
+cl_kernel cl_cloneKernel(cl_kernel kernel) 
+{
+    cl_int status;
+    cl_program program;
+    size_t nameSize;
+
+    status = clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program),
+        &program, NULL);
+    cl_errChk(status, "Getting kernel program", true);
+
+    status = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL, 
+        &nameSize);
+    cl_errChk(status, "Getting kernel name", true);
+
+    char* name = (char*)alloc(nameSize);
+    status = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, nameSize, 
+        name, NULL);
+    cl_errChk(status, "Getting kernel name", true);
+
+    cl_kernel clone = cl_createKernel(program, name);
+
+    free(name);
+
+    return clone;
+}
+
 //! Enqueue and NDRange kernel on a device
 /*!
     \param kernel The kernel to execute
@@ -861,6 +1921,7 @@ void cl_executeKernel(cl_kernel kernel, cl_uint work_dim,
     const size_t* global_work_size, const size_t* local_work_size,
     const char* description, int identifier)
 {
+    SurfContext* ctx = cl_currentContext();
 
 
     cl_int status;
@@ -869,112 +1930,545 @@ void cl_executeKernel(cl_kernel kernel, cl_uint work_dim,
 
 //    eventsEnabled =  phasechecker(description, identifier, granularity);
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         eventPtr = &event;
     }
 
-    status = clEnqueueNDRangeKernel(commandQueue, kernel, work_dim, NULL,
+    status = clEnqueueNDRangeKernel(ctx->commandQueue, kernel, work_dim, NULL,
         global_work_size, local_work_size, 0, NULL, eventPtr);
     cl_errChk(status, "Executing kernel", true);
 
 
-    if(eventsEnabled) {
+    if(ctx->eventsEnabled) {
         char* eventString = catStringWithInt(description, identifier);
-        events->newKernelEvent(*eventPtr, eventString);
+        ctx->events->newKernelEvent(*eventPtr, eventString);
     }
 }
 
-//! SURF specific kernel precompilation call
+//! Lock the build state of the programs
+static void cl_lockBuilds()
+{
+#ifdef _WIN32
+    EnterCriticalSection(&buildLock);
+#else
+    pthread_mutex_lock(&buildLock);
+#endif
+}
+
+//! Unlock the build state of the programs
+static void cl_unlockBuilds()
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&buildLock);
+#else
+    pthread_mutex_unlock(&buildLock);
+#endif
+}
+
+//! Lock the events of the default context
+static void cl_lockEvents()
+{
+#ifdef _WIN32
+    EnterCriticalSection(&eventLock);
+#else
+    pthread_mutex_lock(&eventLock);
+#endif
+}
+
+//! Unlock the events of the default context
+static void cl_unlockEvents()
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&eventLock);
+#else
+    pthread_mutex_unlock(&eventLock);
+#endif
+}
+
+//! Wait until a program build finishes (the lock must be held)
+static void cl_waitForBuilds()
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&buildDone, &buildLock, INFINITE);
+#else
+    pthread_cond_wait(&buildDone, &buildLock);
+#endif
+}
+
+//! Compile a SURF program
 /*!
+    The source compiled into the executable is used if there is one, 
+    otherwise the source is read from CLSource/
+    \param program The index of the program in program_list
+    \param options The build options
+    \param fromCache Set to whether the program was loaded from the 
+           binary cache
+    \return The program
 */
-cl_kernel* cl_precompileKernels(char* buildOptions)
+static cl_program cl_compileSurfProgram(int program, char* options, 
+    bool* fromCache)
 {
-    // Compile each program and create the kernel objects
+    const char* file = programBuilds[program].file;
+    cl_program built = NULL;
+
+    char* path = (char*)alloc(strlen("CLSource/") + strlen(file) + 1);
+    sprintf(path, "CLSource/%s", file);
+
+#ifdef EMBEDDED_KERNELS
+    for(int i = 0; cl_embeddedKernels[i] != NULL; i += 2) {
+        if(strcmp(cl_embeddedKernels[i], file) == 0) {
+            char* source = (char*)cl_embeddedKernels[i+1];
+            built = cl_compileProgramSource(path, source, strlen(source), 
+                options, false, fromCache);
+            break;
+        }
+    }
+#endif
+    if(built == NULL) {
+        built = cl_compileProgram(path, options, false, fromCache);
+    }
 
-    printf("Precompiling kernels...\n");
+    free(path);
 
-    cl_time totalstart, totalend;
-    cl_time start, end;
+    return built;
+}
 
-    cl_getTime(&totalstart);
+//! Build a SURF program
+/*!
+    Called without the lock by the thread that moved the program to 
+    PROGRAM_BUILDING
+    \param program The index of the program in program_list
+*/
+static void cl_buildProgram(int program)
+{
+    ProgramBuild* build = &programBuilds[program];
+    bool fromCache = false;
+    cl_time start, end;
 
-    // Creating descriptors kernel
     cl_getTime(&start);
-    program_list[1]  = cl_compileProgram("CLSource/createDescriptors_kernel.cl",
-        buildOptions, false);
+    cl_program built = cl_compileSurfProgram(program, programBuildOptions,
+        &fromCache);
     cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "createDescriptors");
-    kernel_list[KERNEL_SURF_DESC] = cl_createKernel(program_list[1],
-        "createDescriptors_kernel");
 
-        // Get orientation kernels
-    cl_getTime(&start);
-    program_list[4]  = cl_compileProgram("CLSource/getOrientation_kernels.cl",
-        buildOptions, false);
-    cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "Orientation");
-    kernel_list[KERNEL_GET_ORIENT1] = cl_createKernel(program_list[4],
-        "getOrientationStep1");
-    kernel_list[KERNEL_GET_ORIENT2] = cl_createKernel(program_list[4],
-        "getOrientationStep2");
+    cl_lockBuilds();
+    program_list[program] = built;
+    build->fromCache = fromCache;
+    build->start = start;
+    build->end = end;
+    build->state = PROGRAM_BUILT;
+#ifdef _WIN32
+    WakeAllConditionVariable(&buildDone);
+#else
+    pthread_cond_broadcast(&buildDone);
+#endif
+    cl_unlockBuilds();
+}
 
-    // Hessian determinant kernel
-    cl_getTime(&start);
-    program_list[0]  = cl_compileProgram("CLSource/hessianDet_kernel.cl",
-        buildOptions, false);
-    cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "hessian_det");
-    kernel_list[KERNEL_BUILD_DET] = cl_createKernel(program_list[0],
-        "hessian_det");
+//! Build programs in the background
+/*!
+    Takes programs of programBuildSet in programBuildOrder that nobody has
+    started until all are built or cl_stopProgramBuilds is called
+*/
+#ifdef _WIN32
+static unsigned __stdcall cl_buildThread(void* arg)
+#else
+static void* cl_buildThread(void* arg)
+#endif
+{
+    (void)arg;
+
+    cl_lockBuilds();
+    while(!stopProgramBuilds && nextProgramBuild < NUM_PROGRAMS) {
+        int program = programBuildOrder[nextProgramBuild++];
+        if(!(programBuildSet & (1 << program)) ||
+           programBuilds[program].state != PROGRAM_NOT_BUILT) {
+            continue;
+        }
+        programBuilds[program].state = PROGRAM_BUILDING;
+        cl_unlockBuilds();
 
-    // Integral image kernels
-    cl_getTime(&start);
-    program_list[6] = cl_compileProgram("CLSource/integralImage_kernels.cl",
-        buildOptions, false);
-    cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "IntegralImage");
-    kernel_list[KERNEL_SCAN] = cl_createKernel(program_list[6], "scan");
-    kernel_list[KERNEL_SCAN4] = cl_createKernel(program_list[6], "scan4");
-    kernel_list[KERNEL_SCANIMAGE] = cl_createKernel(program_list[6],
-        "scanImage");
-    kernel_list[KERNEL_TRANSPOSE] = cl_createKernel(program_list[6],
-        "transpose");
-    kernel_list[KERNEL_TRANSPOSEIMAGE] = cl_createKernel(program_list[6],
-        "transposeImage");
-
-    // Nearest neighbor kernels
-    cl_getTime(&start);
-    program_list[5]  = cl_compileProgram("CLSource/nearestNeighbor_kernel.cl",
-        buildOptions, false);
-    cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "NearestNeighbor");
-    kernel_list[KERNEL_NN] = cl_createKernel(program_list[5],
-        "NearestNeighbor");
+        cl_buildProgram(program);
 
-    // Non-maximum suppression kernel
-    cl_getTime(&start);
-    program_list[3]  = cl_compileProgram("CLSource/nonMaxSuppression_kernel.cl",
-        buildOptions, false);
-    cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "NonMaxSuppression");
-    kernel_list[KERNEL_NON_MAX_SUP] = cl_createKernel(program_list[3],
-        "non_max_supression_kernel");
+        cl_lockBuilds();
+    }
+    cl_unlockBuilds();
+
+    return 0;
+}
+
+//! Create the compile events of the programs that have been built
+/*!
+    The event table isn't thread safe, so the build threads leave this
+    to the main thread
+*/
+static void cl_recordProgramBuilds()
+{
+    cl_lockBuilds();
+    for(int i = 0; i < NUM_PROGRAMS; i++) {
+        ProgramBuild* build = &programBuilds[i];
+        if(build->state == PROGRAM_BUILT && !build->recorded) {
+            cl_recordCompileEvent(build->start, build->end, build->eventName,
+                build->fromCache);
+            build->recorded = true;
+        }
+    }
+    cl_unlockBuilds();
+}
+
+//! SURF specific kernel precompilation call
+/*!
+    Starts building the SURF programs the run uses on getCompileThreads()
+    threads and returns without waiting, so the builds overlap with 
+    loading the input and creating the Surf objects.  The kernels are 
+    created by cl_getKernel the first time they are used, which builds the
+    program right away if no thread has started it yet (as for programs
+    left out of the set).
+    The reductions use subgroups (-DUSE_SUBGROUPS) when all of the context
+    devices support them and isUsingSubgroups is set.  Unless they all
+    have cl_intel_subgroups, the programs are built as OpenCL C 2.0 for 
+    the builtins of cl_khr_subgroups.
+    \param buildOptions The options the programs are built with
+    \param programs The programs built in the background (BUILD_* bits)
+    \return The kernel list (entries are valid once cl_getKernel returned
+            them)
+*/
+cl_kernel* cl_precompileKernels(char* buildOptions, int programs)
+{
+    // Programs built with other options are released
+    cl_releasePrograms();
+
+    DeviceCaps* caps = cl_getContextCaps();
+    const char* subgroupOption = "";
+    if(caps->subgroups && isUsingSubgroups()) {
+        if(caps->intelSubgroups) {
+            subgroupOption = " -DUSE_SUBGROUPS";
+        }
+        else if(caps->openclC20) {
+            subgroupOption = " -DUSE_SUBGROUPS -cl-std=CL2.0";
+        }
+    }
+
+    size_t length = strlen(subgroupOption) + 1;
+    if(buildOptions != NULL) {
+        length += strlen(buildOptions);
+    }
+    free(programBuildOptions);
+    programBuildOptions = (char*)alloc(length);
+    sprintf(programBuildOptions, "%s%s", 
+        buildOptions != NULL ? buildOptions : "", subgroupOption);
+
+    programBuildSet = programs & BUILD_ALL;
+    int numPrograms = 0;
+    for(int i = 0; i < NUM_PROGRAMS; i++) {
+        if(programBuildSet & (1 << i)) {
+            numPrograms++;
+        }
+    }
+
+    numBuildThreads = getCompileThreads();
+    if(numBuildThreads > numPrograms) {
+        numBuildThreads = numPrograms;
+    }
+    if(numBuildThreads == 0) {
+        printf("Kernels are built the first time they are used\n\n");
+        return cl_currentContext()->kernels;
+    }
+
+    printf("Precompiling kernels on %d threads...\n\n", numBuildThreads);
+
+#ifdef _WIN32
+    buildThreads = (HANDLE*)alloc(numBuildThreads * sizeof(HANDLE));
+    for(int i = 0; i < numBuildThreads; i++) {
+        buildThreads[i] = (HANDLE)_beginthreadex(NULL, 0, cl_buildThread,
+            NULL, 0, NULL);
+        if(buildThreads[i] == 0) {
+            printf("Error creating a build thread\n");
+            exit(-1);
+        }
+    }
+#else
+    buildThreads = (pthread_t*)alloc(numBuildThreads * sizeof(pthread_t));
+    for(int i = 0; i < numBuildThreads; i++) {
+        if(pthread_create(&buildThreads[i], NULL, cl_buildThread, NULL) != 0) {
+            printf("Error creating a build thread\n");
+            exit(-1);
+        }
+    }
+#endif
+
+    return cl_currentContext()->kernels;
+}
+
+//! Return a SURF kernel, building its program if needed
+/*!
+    The first request for a kernel of a program waits for the build 
+    thread that is building it, or builds it on this thread if no thread 
+    has started it.  All kernels of the program are created then.
+    \param kernel The kernel (KERNEL_*)
+    \return The kernel object
+*/
+cl_kernel cl_getKernel(int kernel)
+{
+    SurfContext* ctx = cl_currentContext();
+    if(ctx->kernels[kernel] != NULL) {
+        return ctx->kernels[kernel];
+    }
+
+    int program = kernelSources[kernel].program;
+    if(program < 0) {
+        printf("Kernel %d isn't part of any program\n", kernel);
+        exit(-1);
+    }
+
+    // Build the program on this thread unless it has been started
+    bool buildHere = false;
+    cl_lockBuilds();
+    if(programBuilds[program].state == PROGRAM_NOT_BUILT) {
+        programBuilds[program].state = PROGRAM_BUILDING;
+        buildHere = true;
+    }
+    cl_unlockBuilds();
+
+    if(buildHere) {
+        cl_buildProgram(program);
+    }
+
+    cl_lockBuilds();
+    while(programBuilds[program].state != PROGRAM_BUILT) {
+        cl_waitForBuilds();
+    }
+    cl_unlockBuilds();
+
+    // Create all kernels of the program
+    for(int i = 0; i < NUM_KERNELS; i++) {
+        if(kernelSources[i].program == program && ctx->kernels[i] == NULL) {
+            ctx->kernels[i] = cl_createKernel(program_list[program],
+                kernelSources[i].name);
+        }
+    }
+
+    cl_recordProgramBuilds();
+
+    return ctx->kernels[kernel];
+}
+
+//! Release the SURF programs and kernels
+/*!
+    Waits for the background builds, then releases everything built so 
+    far, so the programs can be built again with other options
+*/
+static void cl_releasePrograms()
+{
+    cl_stopProgramBuilds();
+
+    // Free the specialised kernels
+    for(int i = 0; i < numSpecialisedKernels; i++) {
+        clReleaseKernel(specialisedKernels[i].object);
+        clReleaseProgram(specialisedKernels[i].program);
+        free(specialisedKernels[i].defines);
+    }
+    free(specialisedKernels);
+    specialisedKernels = NULL;
+    numSpecialisedKernels = 0;
+
+    // Free the kernel objects (only kernels that were used were created).
+    // Other contexts must have been released by their owners.
+    SurfContext* ctx = cl_currentContext();
+    for(int i = 0; i < NUM_KERNELS; i++) {
+        if(ctx->kernels[i]) {
+            clReleaseKernel(ctx->kernels[i]);
+            ctx->kernels[i] = NULL;
+        }
+    }
+
+    // Free the program objects
+    for(int i = 0; i < NUM_PROGRAMS; i++) {
+        if(program_list[i]) {
+            clReleaseProgram(program_list[i]);
+            program_list[i] = NULL;
+        }
+        programBuilds[i].state = PROGRAM_NOT_BUILT;
+        programBuilds[i].fromCache = false;
+        programBuilds[i].recorded = false;
+    }
+
+    nextProgramBuild = 0;
+    stopProgramBuilds = false;
+}
+
+//! Return a SURF kernel built with extra preprocessor definitions
+/*!
+    Used to specialise kernels for a configuration by passing run-time
+    arguments as constants (e.g. "-DSPEC_WIDTH=640").  Each configuration 
+    is built once on the calling thread.  Each context gets its own kernel
+    object, but the program is shared while any context holds it.  A 
+    context keeps its MAX_SPECIALISED_KERNELS most recently used kernels;
+    the object returned is valid until the context asks for 
+    MAX_SPECIALISED_KERNELS other configurations (clone it to keep it, 
+    see cl_cloneKernel).
+    \param kernel The kernel (KERNEL_*)
+    \param defines The build options added to those of cl_precompileKernels
+    \return The kernel object
+*/
+cl_kernel cl_getSpecialisedKernel(int kernel, char* defines)
+{
+    SurfContext* ctx = cl_currentContext();
+    cl_program built = NULL;
+
+    cl_lockBuilds();
+    for(int i = 0; i < numSpecialisedKernels; i++) {
+        if(specialisedKernels[i].kernel == kernel &&
+           strcmp(specialisedKernels[i].defines, defines) == 0) {
+            if(specialisedKernels[i].owner == ctx) {
+                specialisedKernels[i].lastUse = ++specialisedClock;
+                cl_kernel object = specialisedKernels[i].object;
+                cl_unlockBuilds();
+                return object;
+            }
+            built = specialisedKernels[i].program;
+        }
+    }
+    if(built != NULL) {
+        clRetainProgram(built);
+    }
+    cl_unlockBuilds();
+
+    // Another context has built the configuration already
+    if(built != NULL) {
+        return cl_addSpecialisedKernel(kernel, defines, built, ctx);
+    }
+
+    int program = kernelSources[kernel].program;
+    if(program < 0) {
+        printf("Kernel %d isn't part of any program\n", kernel);
+        exit(-1);
+    }
+
+    size_t length = strlen(defines) + 2;
+    if(programBuildOptions != NULL) {
+        length += strlen(programBuildOptions);
+    }
+    char* options = (char*)alloc(length);
+    sprintf(options, "%s %s", 
+        programBuildOptions != NULL ? programBuildOptions : "", defines);
+
+    bool fromCache = false;
+    cl_time start, end;
 
-    // Normalization of descriptors kernel
     cl_getTime(&start);
-    program_list[2]  = cl_compileProgram("CLSource/normalizeDescriptors_kernel.cl",
-        buildOptions, false);
+    built = cl_compileSurfProgram(program, options, &fromCache);
     cl_getTime(&end);
-    events->newCompileEvent(cl_computeTime(start, end), "normalize");
-    kernel_list[KERNEL_NORM_DESC] = cl_createKernel(program_list[2],
-        "normalizeDescriptors");
+    free(options);
+
+    cl_lockBuilds();
+    cl_recordCompileEvent(start, end, programBuilds[program].eventName,
+        fromCache);
+    cl_unlockBuilds();
+
+    return cl_addSpecialisedKernel(kernel, defines, built, ctx);
+}
+
+//! Add a kernel of a specialised program to the list of a context
+/*!
+    \param kernel The kernel (KERNEL_*)
+    \param defines The extra build options of the program
+    \param built The program (the entry takes over the reference)
+    \param ctx The context the kernel object is created for
+    \return The kernel object
+*/
+static cl_kernel cl_addSpecialisedKernel(int kernel, char* defines, 
+    cl_program built, SurfContext* ctx)
+{
+    cl_kernel object = cl_createKernel(built, kernelSources[kernel].name);
+
+    cl_lockBuilds();
+
+    // Make room by releasing the least recently used kernel of the 
+    // context (only the calling thread uses the kernels of its context)
+    int count = 0;
+    int oldest = -1;
+    for(int i = 0; i < numSpecialisedKernels; i++) {
+        if(specialisedKernels[i].owner != ctx) {
+            continue;
+        }
+        count++;
+        if(oldest < 0 || specialisedKernels[i].lastUse < 
+                         specialisedKernels[oldest].lastUse) {
+            oldest = i;
+        }
+    }
+    if(count >= MAX_SPECIALISED_KERNELS) {
+        clReleaseKernel(specialisedKernels[oldest].object);
+        clReleaseProgram(specialisedKernels[oldest].program);
+        free(specialisedKernels[oldest].defines);
+        specialisedKernels[oldest] = 
+            specialisedKernels[--numSpecialisedKernels];
+    }
+
+    specialisedKernels = (SpecialisedKernel*)realloc(specialisedKernels,
+        (numSpecialisedKernels + 1) * sizeof(SpecialisedKernel));
+    if(specialisedKernels == NULL) {
+        perror("realloc");
+        exit(-1);
+    }
 
-    cl_getTime(&totalend);
+    SpecialisedKernel* entry = &specialisedKernels[numSpecialisedKernels++];
+    entry->kernel = kernel;
+    entry->defines = (char*)alloc(strlen(defines) + 1);
+    strcpy(entry->defines, defines);
+    entry->program = built;
+    entry->object = object;
+    entry->owner = ctx;
+    entry->lastUse = ++specialisedClock;
 
-    printf("\tTime for Off-Critical Path Compilation: %.3f milliseconds\n\n",
-        cl_computeTime(totalstart, totalend));
+    cl_unlockBuilds();
 
-    return kernel_list;
+    return object;
+}
+
+//! Release the specialised kernels of a context
+static void cl_releaseSpecialisedKernels(SurfContext* ctx)
+{
+    cl_lockBuilds();
+    int i = 0;
+    while(i < numSpecialisedKernels) {
+        if(specialisedKernels[i].owner != ctx) {
+            i++;
+            continue;
+        }
+        clReleaseKernel(specialisedKernels[i].object);
+        clReleaseProgram(specialisedKernels[i].program);
+        free(specialisedKernels[i].defines);
+        specialisedKernels[i] = specialisedKernels[--numSpecialisedKernels];
+    }
+    cl_unlockBuilds();
+}
+
+//! Wait for the programs being built in the background
+/*!
+    Programs that no thread has started are no longer built
+*/
+void cl_stopProgramBuilds()
+{
+    if(numBuildThreads == 0) {
+        return;
+    }
+
+    cl_lockBuilds();
+    stopProgramBuilds = true;
+    cl_unlockBuilds();
+
+    for(int i = 0; i < numBuildThreads; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(buildThreads[i], INFINITE);
+        CloseHandle(buildThreads[i]);
+#else
+        pthread_join(buildThreads[i], NULL);
+#endif
+    }
+    free(buildThreads);
+    buildThreads = NULL;
+    numBuildThreads = 0;
 }
 
 //! Set an argument for a OpenCL kernel
@@ -1051,30 +2545,33 @@ double cl_computeTime(cl_time start, cl_time end)
 
 //! Create a new user event
 void cl_createUserEvent(cl_time start, cl_time end, char* desc) {
+    SurfContext* ctx = cl_currentContext();
 
-    if(!eventsEnabled) {
+    if(!ctx->eventsEnabled) {
         return;
     }
 
-    events->newUserEvent(cl_computeTime(start, end), desc);
+    ctx->events->newUserEvent(cl_computeTime(start, end), desc);
 }
 
 //! Disables events
 void cl_disableEvents() {
+    SurfContext* ctx = cl_currentContext();
 
-    commandQueue = commandQueueNoProf;
+    ctx->eventsEnabled = false;
 
-    eventsEnabled = false;
+    cl_updateQueue(ctx);
 
     printf("Profiling disabled\n");
 }
 
 //! Enables events
 void cl_enableEvents() {
+    SurfContext* ctx = cl_currentContext();
 
-    commandQueue = commandQueueProf;
+    ctx->eventsEnabled = true;
 
-    eventsEnabled = true;
+    cl_updateQueue(ctx);
 
     printf("Profiling enabled\n");
 }
@@ -1101,14 +2598,24 @@ void cl_getTime(cl_time* time)
 
 //! Print out the OpenCL events
 void cl_printEvents() {
+    SurfContext* ctx = cl_currentContext();
 
-    events->printAllExecTimes();
+    cl_recordProgramBuilds();
+    ctx->events->printAllExecTimes();
 }
 
 //! Write out all current events to a file
+/*!
+    The events of the default context include those of the released 
+    contexts
+*/
 void cl_writeEventsToFile(char* path) {
+    SurfContext* ctx = cl_currentContext();
 
-    events->dumpCSV(path);
+    cl_recordProgramBuilds();
+    cl_lockEvents();
+    ctx->events->dumpCSV(path);
+    cl_unlockEvents();
     //events->dumpTraceCSV(path);
 
 }
@@ -1273,52 +2780,186 @@ int cl_errChk(const cl_int status, const char * msg, bool exitOnErr)
 //          Platform and device information
 //-------------------------------------------------------
 
-//! Returns true if AMD is the device vendor
-bool cl_deviceIsAMD(cl_device_id dev) {
+//! Returns true if the device shares its memory with the host
+/*!
+    CPU devices and devices reporting CL_DEVICE_HOST_UNIFIED_MEMORY can
+    work on host-resident buffers directly, so copies between host and
+    device memory are pure overhead.
+*/
+bool cl_deviceIsZeroCopy(cl_device_id dev) {
+
+    cl_int status;
 
-    bool retval = false;
+    // If dev is NULL, set it to the default device
+    if(dev == NULL) {
+        dev = device;
+    }
 
-    char* vendor = cl_getDeviceVendor(dev);
+    cl_device_type type;
+    status = clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(cl_device_type),
+        &type, NULL);
+    cl_errChk(status, "Getting device type", true);
 
-    if(strncmp(vendor, "Advanced", 8) == 0) {
-        retval = true;
+    if(type & CL_DEVICE_TYPE_CPU) {
+        return true;
     }
 
-    free(vendor);
+    cl_bool unified = CL_FALSE;
+    status = clGetDeviceInfo(dev, CL_DEVICE_HOST_UNIFIED_MEMORY, 
+        sizeof(cl_bool), &unified, NULL);
+    // Not reported by OpenCL 1.0 devices
+    if(status != CL_SUCCESS) {
+        return false;
+    }
 
-    return retval;
+    return (unified == CL_TRUE);
 }
 
-//! Returns true if NVIDIA is the device vendor
-bool cl_deviceIsNVIDIA(cl_device_id dev) {
+//! Query the capabilities of a device
+/*!
+    The kernel variants are chosen by these rather than by the vendor, so
+    every device that supports a variant gets it.  Must be called after 
+    cl_init (the image formats are those of the context).
+    \param caps Receives the capabilities
+    \param dev The device (NULL for the chosen device)
+*/
+void cl_queryDeviceCaps(DeviceCaps* caps, cl_device_id dev)
+{
+    cl_int status;
 
-    bool retval = false;
+    // If dev is NULL, set it to the default device
+    if(dev == NULL) {
+        dev = device;
+    }
 
-    char* vendor = cl_getDeviceVendor(dev);
+    // The image variants read single-channel float and int images
+    cl_bool imageSupport = CL_FALSE;
+    status = clGetDeviceInfo(dev, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool),
+        &imageSupport, NULL);
+    cl_errChk(status, "Getting image support", true);
+
+    caps->images = false;
+    if(imageSupport == CL_TRUE) {
+        cl_uint numFormats = 0;
+        status = clGetSupportedImageFormats(context, CL_MEM_READ_WRITE, 
+            CL_MEM_OBJECT_IMAGE2D, 0, NULL, &numFormats);
+        cl_errChk(status, "getting supported image formats", true);
+
+        cl_image_format* formats = 
+            (cl_image_format*)alloc(sizeof(cl_image_format)*(numFormats+1));
+        status = clGetSupportedImageFormats(context, CL_MEM_READ_WRITE, 
+            CL_MEM_OBJECT_IMAGE2D, numFormats, formats, NULL);
+        cl_errChk(status, "getting supported image formats", true);
+
+        bool floatImages = false;
+        bool intImages = false;
+        for(cl_uint i = 0; i < numFormats; i++) {
+            if(formats[i].image_channel_order != CL_R) {
+                continue;
+            }
+            if(formats[i].image_channel_data_type == CL_FLOAT) {
+                floatImages = true;
+            }
+            if(formats[i].image_channel_data_type == CL_SIGNED_INT32) {
+                intImages = true;
+            }
+        }
+        free(formats);
 
-    if(strncmp(vendor, "NVIDIA", 6) == 0) {
-        retval = true;
+        caps->images = floatImages && intImages;
     }
 
-    free(vendor);
+    status = clGetDeviceInfo(dev, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, 
+        sizeof(cl_uint), &caps->floatVectorWidth, NULL);
+    cl_errChk(status, "Getting the preferred vector width", true);
 
-    return retval;
-}
+    status = clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, 
+        sizeof(size_t), &caps->maxWorkGroupSize, NULL);
+    cl_errChk(status, "Getting the maximum work-group size", true);
 
-//! Returns true if NVIDIA is the device vendor
-bool cl_platformIsNVIDIA(cl_platform_id plat) {
+    caps->unifiedMemory = cl_deviceIsZeroCopy(dev);
 
-    bool retval = false;
+    // Extensions
+    size_t extensionsSize;
+    status = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, 
+        &extensionsSize);
+    cl_errChk(status, "Getting device extensions", true);
 
-    char* vendor = cl_getPlatformVendor(plat);
+    char* extensions = (char*)alloc(extensionsSize + 1);
+    status = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, extensionsSize, 
+        extensions, NULL);
+    cl_errChk(status, "Getting device extensions", true);
+    extensions[extensionsSize] = '\0';
 
-    if(strncmp(vendor, "NVIDIA", 6) == 0) {
-        retval = true;
+    // The builtins of cl_khr_subgroups are only declared by OpenCL C 2.0
+    char version[256];
+    status = clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_VERSION, 
+        sizeof(version), version, NULL);
+    cl_errChk(status, "Getting the OpenCL C version", true);
+
+    int major = 1, minor = 0;
+    sscanf(version, "OpenCL C %d.%d", &major, &minor);
+    caps->openclC20 = (major >= 2);
+
+    caps->intelSubgroups = 
+        (strstr(extensions, "cl_intel_subgroups") != NULL);
+    caps->subgroups = caps->intelSubgroups || 
+        (strstr(extensions, "cl_khr_subgroups") != NULL && caps->openclC20);
+
+    free(extensions);
+}
+
+//! Keep the capabilities that both caps and other have
+/*!
+    \param caps The capabilities to restrict
+    \param other The capabilities of another device
+*/
+static void cl_combineDeviceCaps(DeviceCaps* caps, DeviceCaps* other)
+{
+    caps->images = caps->images && other->images;
+    if(other->floatVectorWidth < caps->floatVectorWidth) {
+        caps->floatVectorWidth = other->floatVectorWidth;
     }
+    caps->subgroups = caps->subgroups && other->subgroups;
+    caps->intelSubgroups = caps->intelSubgroups && other->intelSubgroups;
+    caps->openclC20 = caps->openclC20 && other->openclC20;
+    if(other->maxWorkGroupSize < caps->maxWorkGroupSize) {
+        caps->maxWorkGroupSize = other->maxWorkGroupSize;
+    }
+    caps->unifiedMemory = caps->unifiedMemory && other->unifiedMemory;
+}
 
-    free(vendor);
+//! Return the capabilities of the device of the calling thread's context
+/*!
+    Run-time variants (e.g. the scan or zero-copy transfers) are chosen 
+    by these, so each worker gets the variants of its own device.
+*/
+DeviceCaps* cl_getDeviceCaps()
+{
+    return &cl_currentContext()->caps;
+}
 
-    return retval;
+//! Return the capabilities shared by all of the context devices
+/*!
+    The programs are built once for all of the context devices, so build 
+    options (images, subgroups) and settings shared by the workers (the 
+    work-group sizes) are chosen by these.
+*/
+DeviceCaps* cl_getContextCaps()
+{
+    return &contextCaps;
+}
+
+//! Print the capabilities of a device
+void cl_printDeviceCaps(DeviceCaps* caps)
+{
+    printf("Device capabilities:\n");
+    printf("\tSingle-channel images: %s\n", caps->images ? "yes" : "no");
+    printf("\tPreferred float vector width: %u\n", caps->floatVectorWidth);
+    printf("\tSubgroups: %s\n", caps->subgroups ? "yes" : "no");
+    printf("\tMaximum work-group size: %lu\n", 
+        (unsigned long)caps->maxWorkGroupSize);
+    printf("\tUnified memory: %s\n\n", caps->unifiedMemory ? "yes" : "no");
 }
 
 //! Get the name of the vendor for a device
@@ -1347,6 +2988,24 @@ char* cl_getDeviceDriverVersion(cl_device_id dev)
     return devInfoStr;
 }
 
+//! Get the largest work group a kernel can be launched with on a device
+size_t cl_getKernelWorkGroupSize(cl_kernel kernel, cl_device_id dev)
+{
+    cl_int status;
+    size_t size = 0;
+
+    // If dev is NULL, set it to the default device
+    if(dev == NULL) {
+        dev = device;
+    }
+
+    status = clGetKernelWorkGroupInfo(kernel, dev, CL_KERNEL_WORK_GROUP_SIZE,
+        sizeof(size_t), &size, NULL);
+    cl_errChk(status, "Getting kernel work-group size", true);
+
+    return size;
+}
+
 //! The the name of the device as supplied by the OpenCL implementation
 char* cl_getDeviceName(cl_device_id dev)
 {
@@ -64,6 +64,28 @@ typedef __int64 cl_time;
 typedef double cl_time;
 #endif
 
+// Storage class of variables that each thread has its own copy of
+#ifdef _WIN32
+#define CL_THREAD_LOCAL __declspec(thread)
+#else
+#define CL_THREAD_LOCAL __thread
+#endif
+
+// Command queues, kernel objects and events of one SURF pipeline
+typedef struct SurfContext SurfContext;
+
+// Capabilities of a device that decide which kernel variants run on it
+typedef struct DeviceCaps{
+    bool images;                // Single-channel float and int images
+    cl_uint floatVectorWidth;   // Preferred float vector width
+    bool subgroups;             // Subgroup builtins can be used
+    bool intelSubgroups;        // cl_intel_subgroups (any OpenCL C)
+    bool openclC20;             // OpenCL C 2.0 or later (needed by the
+                                // builtins of cl_khr_subgroups)
+    size_t maxWorkGroupSize;
+    bool unifiedMemory;         // Shares its memory with the host
+} DeviceCaps;
+
 //-------------------------------------------------------
 // Initialization and Cleanup
 //-------------------------------------------------------
@@ -83,6 +105,27 @@ void    cl_freeMem(cl_mem mem);
 // Releases a program object
 void    cl_freeProgram(cl_program program);
 
+// Returns the number of devices of the context
+int     cl_getNumContextDevices();
+
+// Returns a device of the context
+cl_device_id cl_getContextDevice(int index);
+
+// Returns whether the devices of the context are NUMA nodes of one device
+bool    cl_isNumaPartitioned();
+
+// Creates a context for a pipeline that runs concurrently with others
+SurfContext* cl_createSurfContext(cl_device_id dev=NULL);
+
+// Selects the context of the calling thread (NULL for the one of cl_init)
+void    cl_setSurfContext(SurfContext* ctx);
+
+// Returns the context of the calling thread
+SurfContext* cl_getSurfContext();
+
+// Releases a context created by cl_createSurfContext
+void    cl_releaseSurfContext(SurfContext* ctx);
+
 
 //-------------------------------------------------------
 // Synchronization functions
@@ -91,6 +134,27 @@ void    cl_freeProgram(cl_program program);
 // Performs a clFinish on the command queue
 void    cl_sync();
 
+// Command queues that commands can be directed to.  Kernels and transfers
+// go to the active queue, which is the compute queue unless the transfer 
+// queue is selected.
+#define CLUTILS_QUEUE_COMPUTE 0
+#define CLUTILS_QUEUE_TRANSFER 1
+
+// Selects the queue used by the following commands
+void    cl_selectQueue(int queue);
+
+// Enqueues a marker on the active queue
+void    cl_enqueueMarker(cl_event* event);
+
+// Makes the active queue wait for an event before later commands run
+void    cl_enqueueWaitForEvent(cl_event event);
+
+// Submits the commands of the active queue to the device
+void    cl_flush();
+
+// Blocks until an event has completed
+void    cl_waitForEvent(cl_event event);
+
 
 //-------------------------------------------------------
 // Memory allocation
@@ -107,6 +171,10 @@ cl_mem  cl_allocBufferConst(size_t mem_size, void* host_ptr);
 // Allocates pinned memory on the host
 cl_mem  cl_allocBufferPinned(size_t mem_size);
 
+// Creates a buffer that uses the supplied host memory as its storage
+cl_mem  cl_allocBufferHostPtr(size_t mem_size, void* host_ptr, 
+            cl_mem_flags flags = CL_MEM_READ_WRITE);
+
 // Allocates an image on the device
 cl_mem  cl_allocImage(size_t height, size_t width, char type, 
             cl_mem_flags flags = CL_MEM_READ_WRITE);
@@ -121,6 +189,11 @@ cl_mem  cl_allocImage(size_t height, size_t width, char type,
 // maps it so it can be read
 void*   cl_copyAndMapBuffer(cl_mem dst, cl_mem src, size_t size); 
 
+// Same as cl_copyAndMapBuffer, but returns without waiting.  The mapped
+// data is valid once the event 'ready' completes.
+void*   cl_copyAndMapBufferAsync(cl_mem dst, cl_mem src, size_t size,
+            cl_event* ready);
+
 // Copies from one buffer to another
 void    cl_copyBufferToBuffer(cl_mem dst, cl_mem src, size_t size);
 
@@ -129,7 +202,8 @@ void    cl_copyBufferToDevice(cl_mem dst, void *src, size_t mem_size,
             cl_bool blocking = CL_TRUE);
 
 // Copies data to an image on the device
-void cl_copyImageToDevice(cl_mem dst, void* src, size_t height, size_t width);
+void cl_copyImageToDevice(cl_mem dst, void* src, size_t height, size_t width,
+            cl_bool blocking = CL_TRUE);
 
 // Copies an image from the device to the host
 void    cl_copyImageToHost(void* dst, cl_mem src, size_t height, size_t width);
@@ -138,12 +212,22 @@ void    cl_copyImageToHost(void* dst, cl_mem src, size_t height, size_t width);
 void    cl_copyBufferToHost(void *dst, cl_mem src, size_t mem_size, 
             cl_bool blocking = CL_TRUE);
 
+// Copies data from a device buffer to the host without blocking, 
+// returning an event that completes when the data has arrived
+void    cl_copyBufferToHostAsync(void *dst, cl_mem src, size_t mem_size, 
+            cl_event* ready);
+
 // Copies data from a buffer on the device to an image on the device
 void    cl_copyBufferToImage(cl_mem src, cl_mem dst, int height, int width);
 
 // Maps a buffer
 void*   cl_mapBuffer(cl_mem mem, size_t mem_size, cl_mem_flags flags);
 
+// Maps a buffer without blocking.  The pointer is valid once 'ready' 
+// completes.
+void*   cl_mapBufferAsync(cl_mem mem, size_t mem_size, cl_mem_flags flags,
+            cl_event* ready);
+
 // Unmaps a buffer
 void    cl_unmapBuffer(cl_mem mem, void *ptr);
 
@@ -156,18 +240,56 @@ void    cl_writeToZCBuffer(cl_mem mem, void* data, size_t size);
 
 // Compiles a program
 cl_program  cl_compileProgram(char* kernelPath, char* compileoptions, 
-                bool verboseoptions = 0);
+                bool verboseoptions = 0, bool* fromCache = NULL);
+
+// Compiles a program from source in memory
+cl_program  cl_compileProgramSource(char* name, char* source, size_t size,
+                char* compileoptions, bool verboseoptions = 0, 
+                bool* fromCache = NULL);
 
 // Creates a kernel
 cl_kernel   cl_createKernel(cl_program program, const char* kernelName);
 
+// Creates another kernel object for the function of a kernel
+cl_kernel   cl_cloneKernel(cl_kernel kernel);
+
 // Executes a kernel 
 void        cl_executeKernel(cl_kernel kernel, cl_uint work_dim, const size_t* 
                 global_work_size, const size_t* local_work_size, 
                 const char* description, int identifier = 0);
 
-// Precompiles the kernels for SURF
-cl_kernel*  cl_precompileKernels(char* buildOptions);
+// Programs that cl_precompileKernels can build in the background (the
+// bits are the program indices)
+#define BUILD_HESSIAN 0x001
+#define BUILD_DESCRIPTORS 0x002
+#define BUILD_NORMALIZE 0x004
+#define BUILD_NMS 0x008
+#define BUILD_ORIENTATION 0x010
+#define BUILD_NN 0x020
+#define BUILD_INTEGRAL 0x040
+#define BUILD_DENSE 0x080
+#define BUILD_HAAR_MAPS 0x100
+#define BUILD_SORT 0x200
+#define BUILD_PACK 0x400
+#define BUILD_ALL 0x7FF
+// The programs every run of SURF uses
+#define BUILD_SURF (BUILD_HESSIAN | BUILD_DESCRIPTORS | BUILD_NORMALIZE | \
+                    BUILD_NMS | BUILD_ORIENTATION | BUILD_INTEGRAL | \
+                    BUILD_PACK)
+
+// Starts building the kernels for SURF in the background (the programs
+// not in the set are built on first use)
+cl_kernel*  cl_precompileKernels(char* buildOptions, 
+                int programs = BUILD_ALL);
+
+// Returns a kernel for SURF (KERNEL_*), building its program if needed
+cl_kernel   cl_getKernel(int kernel);
+
+// Returns a kernel for SURF built with extra preprocessor definitions
+cl_kernel   cl_getSpecialisedKernel(int kernel, char* defines);
+
+// Waits for the programs being built in the background
+void        cl_stopProgramBuilds();
 
 // Sets a kernel argument
 void        cl_setKernelArg(cl_kernel kernel, unsigned int index, size_t size, 
@@ -218,11 +340,14 @@ void    printSupportedImageFormats();
 // Platform and device information
 //-------------------------------------------------------
 
-bool    cl_deviceIsAMD(cl_device_id dev=NULL);
-bool    cl_deviceIsNVIDIA(cl_device_id dev=NULL);
-bool    cl_platformIsNVIDIA(cl_platform_id plat=NULL);
+bool    cl_deviceIsZeroCopy(cl_device_id dev=NULL);
+void    cl_queryDeviceCaps(DeviceCaps* caps, cl_device_id dev=NULL);
+DeviceCaps* cl_getDeviceCaps();
+DeviceCaps* cl_getContextCaps();
+void    cl_printDeviceCaps(DeviceCaps* caps);
 char*   cl_getDeviceDriverVersion(cl_device_id dev=NULL);
 char*   cl_getDeviceName(cl_device_id dev=NULL);
+size_t  cl_getKernelWorkGroupSize(cl_kernel kernel, cl_device_id dev=NULL);
 char*   cl_getDeviceVendor(cl_device_id dev=NULL);
 char*   cl_getDeviceVersion(cl_device_id dev=NULL);
 char*   cl_getPlatformName(cl_platform_id platform);
@@ -262,9 +387,9 @@ typedef struct{
 
 #define MAX_ERR_VAL 64
 
-#define NUM_PROGRAMS 7
+#define NUM_PROGRAMS 11
 
-#define NUM_KERNELS 13
+#define NUM_KERNELS 24
 #define KERNEL_INIT_DET 0 
 #define KERNEL_BUILD_DET 1 
 #define KERNEL_SURF_DESC 2
@@ -278,5 +403,16 @@ typedef struct{
 #define KERNEL_TRANSPOSE 10
 #define KERNEL_SCANIMAGE 11
 #define KERNEL_TRANSPOSEIMAGE 12
+#define KERNEL_PROJECT_DESC 13
+#define KERNEL_DENSE_HAAR 14
+#define KERNEL_DENSE_SUMS 15
+#define KERNEL_DENSE_DESC 16
+#define KERNEL_HAAR_HISTOGRAM 17
+#define KERNEL_HAAR_MAP 18
+#define KERNEL_SORT_KEYS 19
+#define KERNEL_BITONIC_SORT 20
+#define KERNEL_PERMUTE_IPTS 21
+#define KERNEL_PACK_FEATURES 22
+#define KERNEL_BITONIC_SORT_LOCAL 23
 
 #endif
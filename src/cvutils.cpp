@@ -54,6 +54,7 @@
 #include <time.h>
 #include <limits>
 #include <algorithm>
+#include <string.h>
 
 #include "cv.h"
 #include "highgui.h"
@@ -506,11 +507,26 @@ IplImage *getGray(const IplImage *img)
         exit(-1);
     }
 
-    IplImage* gray8;
     IplImage* gray32;
 
     // Allocate space for the grayscale
     gray32 = cvCreateImage(cvGetSize(img), IPL_DEPTH_32F, 1);
+
+    convertToGray(img, gray32);
+
+    return gray32;
+}
+
+//! Convert image to single channel 32F
+/*!
+    \param img The source image
+    \param gray32 Single channel 32F image of the same size (its data may
+           be supplied by the caller, e.g. a mapped buffer)
+*/
+void convertToGray(const IplImage *img, IplImage *gray32)
+{
+    IplImage* gray8;
+
     if( img->nChannels == 1 )
         gray8 = (IplImage *) cvClone(img);
     else {
@@ -521,8 +537,6 @@ IplImage *getGray(const IplImage *img)
     cvConvertScale(gray8, gray32, 1.0/255.0, 0);
 
     cvReleaseImage(&gray8);
-
-    return gray32;
 }
 
 //! Look at the valid points and determine the median orientation
@@ -700,6 +714,13 @@ void loadSurf(char *filename, std::vector<Ipoint> &ipts)
     infile >> descriptorLength;
     infile >> count;
 
+    // The descriptors are read into the fixed-size Ipoint::descriptor
+    if(!infile || (descriptorLength != DESC_SIZE && 
+                   descriptorLength != DESC_SIZE_EXTENDED)) {
+        printf("Error: %s is not a SURF ipoint log\n", filename);
+        exit(-1);
+    }
+
     // for each ipoint
     for (int i = 0; i < count; i++)
     {
@@ -713,8 +734,9 @@ void loadSurf(char *filename, std::vector<Ipoint> &ipts)
         infile >> ipt.laplacian;
         infile >> ipt.scale;
 
-        // read descriptor components
-        for (int j = 0; j < 64; j++)
+        // read descriptor components (64 or 128)
+        ipt.descriptorLength = descriptorLength;
+        for (int j = 0; j < descriptorLength; j++)
             infile >> ipt.descriptor[j];
 
         ipts.push_back(ipt);
@@ -722,6 +744,63 @@ void loadSurf(char *filename, std::vector<Ipoint> &ipts)
     }
 }
 
+//! Load SURF features stored in the compact binary format
+/*!
+    The descriptors are returned in their stored format in descs, and 
+    decoded to floats in the ipts.  Release descs with freeDescriptorSet.
+*/
+void loadCompactSurf(char *filename, std::vector<Ipoint> &ipts, 
+                     DescriptorSet &descs)
+{
+    std::ifstream infile(filename, std::ios::binary);
+
+    // clear the ipts vector first
+    ipts.clear();
+
+    // read the header
+    char magic[4];
+    infile.read(magic, 4);
+    if(!infile || memcmp(magic, "SRFB", 4) != 0) {
+        printf("Error: %s is not a compact SURF file\n", filename);
+        exit(-1);
+    }
+    infile.read((char*)&descs.format, sizeof(int));
+    infile.read((char*)&descs.length, sizeof(int));
+    infile.read((char*)&descs.count, sizeof(int));
+
+    // The descriptors are decoded into the fixed-size Ipoint::descriptor
+    if(!infile || descs.count < 0 || (descs.length != DESC_SIZE && 
+                                      descs.length != DESC_SIZE_EXTENDED)) {
+        printf("Error: %s is not a compact SURF file\n", filename);
+        exit(-1);
+    }
+
+    descs.stride = getDescriptorBytes(descs.format, descs.length);
+    descs.data = alloc(descs.count * descs.stride);
+
+    // for each ipoint
+    for (int i = 0; i < descs.count; i++)
+    {
+        Ipoint ipt;
+        char* desc = (char*)descs.data + i*descs.stride;
+
+        // read vals
+        infile.read((char*)&ipt.x, sizeof(float));
+        infile.read((char*)&ipt.y, sizeof(float));
+        infile.read((char*)&ipt.scale, sizeof(float));
+        infile.read((char*)&ipt.orientation, sizeof(float));
+        infile.read((char*)&ipt.laplacian, sizeof(int));
+
+        // read the descriptor in its compact format
+        infile.read(desc, descs.stride);
+
+        ipt.descriptorLength = descs.length;
+        decodeDescriptor(desc, descs.format, descs.length, ipt.descriptor);
+
+        ipts.push_back(ipt);
+    }
+}
+
 //! Returns the median value for a vector of floats
 float median(std::vector<float> v) {
 
@@ -842,8 +921,12 @@ void writeIptsToFile(char *path, std::vector<Ipoint> &ipts)
     char* fullpath = smartStrcat(path, "/SurfIpts.log");
     std::ofstream outfile(fullpath);
 
-    // output descriptor length
-    outfile << "64\n";
+    // output descriptor length (all ipts share the same length)
+    int descriptorLength = DESC_SIZE;
+    if(ipts.size() > 0) {
+        descriptorLength = ipts.at(0).descriptorLength;
+    }
+    outfile << descriptorLength << "\n";
     outfile << ipts.size() << "\n";
 
     // create output line as:  scale  x  y  des
@@ -856,7 +939,7 @@ void writeIptsToFile(char *path, std::vector<Ipoint> &ipts)
         outfile << ipts.at(i).orientation << " ";
         outfile << ipts.at(i).laplacian << " ";
         outfile << ipts.at(i).scale << " ";
-        for(int j=0; j<64; j++) {
+        for(int j=0; j<descriptorLength; j++) {
             outfile << ipts.at(i).descriptor[j] << " ";
         }
         outfile << "\n";
@@ -868,6 +951,40 @@ void writeIptsToFile(char *path, std::vector<Ipoint> &ipts)
     free(fullpath);
 }
 
+//! Save the SURF features to file in the compact binary format
+/*!
+    The header is "SRFB" followed by the format, length and count of the 
+    descriptors (as ints).  Each record holds x, y, scale, orientation, 
+    laplacian and the descriptor in its compact format.
+*/
+void writeCompactIptsToFile(char *path, std::vector<Ipoint> &ipts, 
+                            DescriptorSet &descs)
+{
+    char* fullpath = smartStrcat(path, "/SurfIpts.bin");
+    std::ofstream outfile(fullpath, std::ios::binary);
+
+    int count = (int)ipts.size();
+
+    outfile.write("SRFB", 4);
+    outfile.write((char*)&descs.format, sizeof(int));
+    outfile.write((char*)&descs.length, sizeof(int));
+    outfile.write((char*)&count, sizeof(int));
+
+    for(int i=0; i < count; i++)
+    {
+        outfile.write((char*)&ipts.at(i).x, sizeof(float));
+        outfile.write((char*)&ipts.at(i).y, sizeof(float));
+        outfile.write((char*)&ipts.at(i).scale, sizeof(float));
+        outfile.write((char*)&ipts.at(i).orientation, sizeof(float));
+        outfile.write((char*)&ipts.at(i).laplacian, sizeof(int));
+        outfile.write((char*)descs.data + i*descs.stride, descs.stride);
+    }
+
+    outfile.close();
+
+    free(fullpath);
+}
+
 void writeDptsToFile(char *path, std::vector<distPoint> &dpts)
 {
 
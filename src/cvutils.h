@@ -127,6 +127,9 @@ inline int fRound(float flt)
 //! Convert image to single channel 32F
 IplImage* getGray(const IplImage *img);
 
+//! Convert image to single channel 32F, writing into gray32
+void convertToGray(const IplImage *img, IplImage *gray32);
+
 // Determine the rotation of an image with respect to the reference
 float getRotation(std::vector<distPoint> distancePoints);
 
@@ -144,6 +147,10 @@ CvPoint2D32f getTranslation(std::vector<distPoint> distancePoints,
 //! Load the SURF features from file
 void loadSurf(char *filename, std::vector<Ipoint> &ipts);
 
+//! Load the SURF features from a compact binary file
+void loadCompactSurf(char *filename, std::vector<Ipoint> &ipts, 
+                     DescriptorSet &descs);
+
 // Sort an array and return the median value
 float median(std::vector<float> v);
 
@@ -167,6 +174,10 @@ void writeImageText(IplImage *img, char * s);
 //! Save the SURF features to file
 void writeIptsToFile(char *path, std::vector<Ipoint> &ipts);
 
+//! Save the SURF features to file with the descriptors in compact form
+void writeCompactIptsToFile(char *path, std::vector<Ipoint> &ipts, 
+                            DescriptorSet &descs);
+
 //! Save the distance data to file
 void writeDptsToFile(char *path, std::vector<distPoint> &dpts);
 
@@ -251,6 +251,27 @@ void EventList::newUserEvent(double time, char* desc)
     this->user_events.push_back(tuple);
 }
 
+//! Move all events of another list to the end of this one
+/*!
+    The other list is left empty, so only this list releases the events
+*/
+void EventList::takeEvents(EventList* other)
+{
+    this->compile_events.insert(this->compile_events.end(),
+        other->compile_events.begin(), other->compile_events.end());
+    this->kernel_events.insert(this->kernel_events.end(),
+        other->kernel_events.begin(), other->kernel_events.end());
+    this->io_events.insert(this->io_events.end(),
+        other->io_events.begin(), other->io_events.end());
+    this->user_events.insert(this->user_events.end(),
+        other->user_events.begin(), other->user_events.end());
+
+    other->compile_events.clear();
+    other->kernel_events.clear();
+    other->io_events.clear();
+    other->user_events.clear();
+}
+
 //! Print event information for all events
 void EventList::printAllEvents()
 {
@@ -85,6 +85,8 @@ public:
 
     void newUserEvent(double time, char* desc);
 
+    void takeEvents(EventList* other);
+
     void printAllEvents();
 
     void printCompileEvents();
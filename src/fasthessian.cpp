@@ -58,6 +58,7 @@
 #include "cvutils.h"
 #include "clutils.h"
 #include "fasthessian.h"
+#include "tuning.h"
 #include "utils.h"
 
 // Based on the octave (row) and interval (column), this lookup table
@@ -84,6 +85,23 @@ FastHessian::FastHessian(int i_height, int i_width, const int octaves,
 
     this->num_ipts = 0;
 
+    this->imgWidth = i_width;
+    this->imgHeight = i_height;
+    this->frameWidth = i_width;
+    this->frameHeight = i_height;
+    this->batchCapacity = 1;
+    this->numImages = 1;
+    this->specialised = false;
+
+    this->planIntImage = NULL;
+    this->planWidth = 0;
+    this->planHeight = 0;
+    this->planLaplacian = NULL;
+    this->planPixPos = NULL;
+    this->planScale = NULL;
+    this->planImageIndex = NULL;
+    this->planMaxPoints = 0;
+
     // TODO implement this as device zero-copy memory
     this->d_ipt_count = cl_allocBuffer(sizeof(int));
     cl_copyBufferToDevice(this->d_ipt_count, &this->num_ipts, sizeof(int));
@@ -96,6 +114,8 @@ FastHessian::FastHessian(int i_height, int i_width, const int octaves,
 //! Destructor
 FastHessian::~FastHessian()
 {
+    this->clearPlans();
+
     cl_freeMem(this->d_ipt_count);
 
     for(unsigned int i = 0; i < this->responseMap.size(); i++) {
@@ -110,66 +130,200 @@ void FastHessian::createResponseMap(int octaves, int imgWidth, int imgHeight, in
     int h = (imgHeight / sample_step);
     int s = (sample_step);
 
+    // Number of images each layer holds
+    int n = this->batchCapacity;
+
     // Calculate approximated determinant of hessian values
     if (octaves >= 1)
     {
-        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   9));
-        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   15));
-        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   21));
-        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   27));
+        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   9, n));
+        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   15, n));
+        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   21, n));
+        this->responseMap.push_back(new ResponseLayer(w,   h,   s,   27, n));
     }
 
     if (octaves >= 2)
     {
-        this->responseMap.push_back(new ResponseLayer(w/2, h/2, s*2, 39));
-        this->responseMap.push_back(new ResponseLayer(w/2, h/2, s*2, 51));
+        this->responseMap.push_back(new ResponseLayer(w/2, h/2, s*2, 39, n));
+        this->responseMap.push_back(new ResponseLayer(w/2, h/2, s*2, 51, n));
     }
 
     if (octaves >= 3)
     {
-        this->responseMap.push_back(new ResponseLayer(w/4, h/4, s*4, 75));
-        this->responseMap.push_back(new ResponseLayer(w/4, h/4, s*4, 99));
+        this->responseMap.push_back(new ResponseLayer(w/4, h/4, s*4, 75, n));
+        this->responseMap.push_back(new ResponseLayer(w/4, h/4, s*4, 99, n));
     }
 
     if (octaves >= 4)
     {
-        this->responseMap.push_back(new ResponseLayer(w/8, h/8, s*8, 147));
-        this->responseMap.push_back(new ResponseLayer(w/8, h/8, s*8, 195));
+        this->responseMap.push_back(new ResponseLayer(w/8, h/8, s*8, 147, n));
+        this->responseMap.push_back(new ResponseLayer(w/8, h/8, s*8, 195, n));
     }
 
     if (octaves >= 5)
     {
-        this->responseMap.push_back(new ResponseLayer(w/16, h/16, s*16, 291));
-        this->responseMap.push_back(new ResponseLayer(w/16, h/16, s*16, 387));
+        this->responseMap.push_back(new ResponseLayer(w/16, h/16, s*16, 291, n));
+        this->responseMap.push_back(new ResponseLayer(w/16, h/16, s*16, 387, n));
+    }
+}
+
+
+//! Reallocate the response layers for a batch of images
+/*!
+    The layers of the images are stored one after the other, and the
+    hessian and non-max suppression kernels index them by the third 
+    dimension of their NDRange
+    \param images The number of images the layers have space for
+*/
+void FastHessian::setBatchCapacity(int images)
+{
+    if(images == this->batchCapacity) {
+        return;
+    }
+
+    this->clearPlans();
+
+    for(unsigned int i = 0; i < this->responseMap.size(); i++) {
+        delete responseMap.at(i);
+    }
+    this->responseMap.clear();
+
+    this->batchCapacity = images;
+    if(this->numImages > images) {
+        this->numImages = images;
+    }
+
+    this->createResponseMap(this->octaves, this->imgWidth, this->imgHeight,
+        this->sample_step);
+    this->setImageSize(this->frameWidth, this->frameHeight);
+}
+
+
+//! Set the number of images the next detection runs on
+void FastHessian::setNumImages(int images)
+{
+    if(images < 1 || images > this->batchCapacity) {
+        printf("Error: Batch of %d images exceeds the capacity (%d)\n", 
+            images, this->batchCapacity);
+        exit(-1);
+    }
+
+    if(images != this->numImages) {
+        this->clearPlans();
+    }
+    this->numImages = images;
+}
+
+
+//! Set the size of the images processed
+/*!
+    The response layers keep their buffers and are resized to the layer
+    sizes of the smaller image (the layers of an octave are the image 
+    size divided by their step)
+    \param i_width The image width (at most the width allocated for)
+    \param i_height The image height (at most the height allocated for)
+*/
+void FastHessian::setImageSize(int i_width, int i_height)
+{
+    if(i_width > this->imgWidth || i_height > this->imgHeight) {
+        printf("Error: Image (%dx%d) is larger than the response layers "
+            "(%dx%d)\n", i_width, i_height, this->imgWidth, this->imgHeight);
+        exit(-1);
+    }
+
+    this->frameWidth = i_width;
+    this->frameHeight = i_height;
+    this->clearPlans();
+
+    if(this->responseMap.empty()) {
+        return;
+    }
+
+    // The first layer is sampled at the initial step
+    int s = this->responseMap.at(0)->getStep();
+    int w = (i_width / s);
+    int h = (i_height / s);
+
+    for(unsigned int i = 0; i < this->responseMap.size(); i++) {
+        ResponseLayer* layer = this->responseMap.at(i);
+        int octaveScale = layer->getStep() / s;
+        layer->setSize(w / octaveScale, h / octaveScale);
+    }
+}
+
+
+//! Build the hessian determinant kernel for each layer and image size
+/*!
+    The sizes are passed to the compiler as constants, so it can fold the
+    arithmetic that depends on them.  A program is built the first time a
+    layer of a new size is computed.
+    \param enable Use the specialised kernels
+*/
+void FastHessian::setSpecialisedKernels(bool enable)
+{
+    this->specialised = enable;
+    this->clearPlans();
+}
+
+
+//! Return the size of the response layers and counter in bytes
+size_t FastHessian::getDeviceBytes()
+{
+    size_t bytes = sizeof(int);
+
+    for(unsigned int i = 0; i < this->responseMap.size(); i++) {
+        bytes += this->responseMap.at(i)->getBytes();
     }
+
+    return bytes;
 }
 
 
 //! Hessian determinant for the image using approximated box filters
 /*!
+    The launches are recorded once and replayed for each frame (see
+    recordHessianDet)
     \param d_intImage Integral Image
     \param surfipt Pointer to pre-allocated temp data structures
     \param i_width Image Width
     \param i_height Image Height
     \param octaves Octaves for SURF
     \param intervals Number of Intervals
-    \param kernel_list pointer to precompiled kernels
 */
 void FastHessian::computeHessianDet(cl_mem d_intImage,
-                                    int i_width, int i_height,
-                                    cl_kernel* kernel_list)
+                                    int i_width, int i_height)
 {
-    // set matrix size and x,y threads per block
-    const int BLOCK_DIM = 16;
+    // Record the launches the first time and whenever their arguments
+    // change, then replay them
+    if(this->hessianPlan.empty() || d_intImage != this->planIntImage ||
+       i_width != this->planWidth || i_height != this->planHeight) {
+        this->recordHessianDet(d_intImage, i_width, i_height);
+    }
 
-    cl_kernel hessian_det =  kernel_list[KERNEL_BUILD_DET];
+    for(unsigned int i = 0; i < this->hessianPlan.size(); i++) {
+        LaunchPlan* launch = &this->hessianPlan.at(i);
+        cl_executeKernel(launch->kernel, 3, launch->globalWorkSize, 
+            launch->localWorkSize, "BuildHessianDet", i);
+    }
+}
 
-    size_t localWorkSize[2] = {BLOCK_DIM,BLOCK_DIM};
-    size_t globalWorkSize[2];
 
-    cl_setKernelArg(hessian_det, 0, sizeof(cl_mem), (void *)&d_intImage);
-    cl_setKernelArg(hessian_det, 1, sizeof(cl_int), (void *)&i_width);
-    cl_setKernelArg(hessian_det, 2, sizeof(cl_int), (void *)&i_height);
+//! Record the hessian determinant launches of each layer
+/*!
+    Each layer gets its own kernel object with all its arguments bound, 
+    so the launches can be replayed without setting any argument
+    \param d_intImage Integral Image
+    \param i_width Image Width
+    \param i_height Image Height
+*/
+void FastHessian::recordHessianDet(cl_mem d_intImage, int i_width, 
+                                   int i_height)
+{
+    this->freePlan(this->hessianPlan);
+
+    // set matrix size and x,y threads per block (see tuning.h)
+    const int BLOCK_W = getTuningProfile()->hessianLocal[0];
+    const int BLOCK_H = getTuningProfile()->hessianLocal[1];
 
     for(unsigned int i = 0; i < this->responseMap.size(); i++) {
 
@@ -180,47 +334,94 @@ void FastHessian::computeHessianDet(cl_mem d_intImage,
         int layerWidth = this->responseMap.at(i)->getWidth();
         int layerHeight = this->responseMap.at(i)->getHeight();
 
-        globalWorkSize[0] = roundUp(layerWidth, localWorkSize[0]);
-        globalWorkSize[1] = roundUp(layerHeight, localWorkSize[1]);
+        // Use a program built for this layer and image size
+        cl_kernel hessian_det = cl_getKernel(KERNEL_BUILD_DET);
+        if(this->specialised) {
+            char defines[256];
+            sprintf(defines, "-DSPEC_WIDTH=%d -DSPEC_HEIGHT=%d "
+                "-DSPEC_LAYER_WIDTH=%d -DSPEC_LAYER_HEIGHT=%d "
+                "-DSPEC_STEP=%d -DSPEC_FILTER=%d", i_width, i_height,
+                layerWidth, layerHeight, step, filter);
+            hessian_det = cl_getSpecialisedKernel(KERNEL_BUILD_DET, defines);
+        }
 
-        cl_setKernelArg(hessian_det, 3, sizeof(cl_mem), (void*)&responses);
-        cl_setKernelArg(hessian_det, 4, sizeof(cl_mem), (void*)&laplacian);
-        cl_setKernelArg(hessian_det, 5, sizeof(int),    (void*)&layerWidth);
-        cl_setKernelArg(hessian_det, 6, sizeof(int),    (void*)&layerHeight);
-        cl_setKernelArg(hessian_det, 7, sizeof(int),    (void*)&step);
-        cl_setKernelArg(hessian_det, 8, sizeof(int),    (void*)&filter);
+        // The third dimension indexes the images of a batch
+        LaunchPlan launch;
+        launch.kernel = cl_cloneKernel(hessian_det);
+        launch.localWorkSize[0] = BLOCK_W;
+        launch.localWorkSize[1] = BLOCK_H;
+        launch.localWorkSize[2] = 1;
+        launch.globalWorkSize[0] = roundUp(layerWidth, BLOCK_W);
+        launch.globalWorkSize[1] = roundUp(layerHeight, BLOCK_H);
+        launch.globalWorkSize[2] = this->numImages;
+
+        cl_kernel kernel = launch.kernel;
+        cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void*)&d_intImage);
+        cl_setKernelArg(kernel, 1, sizeof(cl_int), (void*)&i_width);
+        cl_setKernelArg(kernel, 2, sizeof(cl_int), (void*)&i_height);
+        cl_setKernelArg(kernel, 3, sizeof(cl_mem), (void*)&responses);
+        cl_setKernelArg(kernel, 4, sizeof(cl_mem), (void*)&laplacian);
+        cl_setKernelArg(kernel, 5, sizeof(int),    (void*)&layerWidth);
+        cl_setKernelArg(kernel, 6, sizeof(int),    (void*)&layerHeight);
+        cl_setKernelArg(kernel, 7, sizeof(int),    (void*)&step);
+        cl_setKernelArg(kernel, 8, sizeof(int),    (void*)&filter);
+
+        this->hessianPlan.push_back(launch);
+    }
 
-        cl_executeKernel(hessian_det, 2, globalWorkSize, localWorkSize,
-            "BuildHessianDet", i);
+    this->planIntImage = d_intImage;
+    this->planWidth = i_width;
+    this->planHeight = i_height;
+}
 
-        // TODO Verify that a clFinish is not required (setting an argument
-        //      to the loop counter without it may be problematic, but it
-        //      really kills performance on AMD parts)
-        //cl_sync();
+
+//! Release the kernel objects of recorded launches
+void FastHessian::freePlan(std::vector<LaunchPlan>& plan)
+{
+    for(unsigned int i = 0; i < plan.size(); i++) {
+        cl_freeKernel(plan.at(i).kernel);
     }
+    plan.clear();
+}
+
+
+//! Discard the recorded launches
+/*!
+    Called when the layers, batch size or kernels change, so the next
+    detection records them again
+*/
+void FastHessian::clearPlans()
+{
+    this->freePlan(this->hessianPlan);
+    this->freePlan(this->nmsPlan);
 }
 
 
 /*!
     Find the image features and write into vector of features
     Determine what points are interesting and store them
-    \param img
+    \param i_width The width of the image
+    \param i_height The height of the image
     \param d_intImage The integral image pointer on the device
     \param d_laplacian
     \param d_pixPos
     \param d_scale
+    \param d_imageIndex Receives the batch image each ipoint was found in
 */
-int FastHessian::getIpoints(IplImage *img, cl_mem d_intImage, cl_mem d_laplacian,
-                            cl_mem d_pixPos, cl_mem d_scale, int maxIpts)
+int FastHessian::getIpoints(int i_width, int i_height, cl_mem d_intImage, 
+                            cl_mem d_laplacian, cl_mem d_pixPos, 
+                            cl_mem d_scale, cl_mem d_imageIndex, 
+                            int maxIpts)
 {
 
 	// Compute the hessian determinants
     // GPU kernels: init_det and build_det kernels
-    this->computeHessianDet(d_intImage, img->width, img->height, kernel_list);
+    this->computeHessianDet(d_intImage, i_width, i_height);
 
 	// Determine which points are interesting
     // GPU kernels: non_max_suppression kernel
-    this->selectIpoints(d_laplacian, d_pixPos, d_scale, kernel_list, maxIpts);
+    this->selectIpoints(d_laplacian, d_pixPos, d_scale, d_imageIndex, 
+        maxIpts);
 
 	// Copy the number of interesting points back to the host
     cl_copyBufferToHost(&this->num_ipts, this->d_ipt_count, sizeof(int));
@@ -234,6 +435,44 @@ int FastHessian::getIpoints(IplImage *img, cl_mem d_intImage, cl_mem d_laplacian
     return num_ipts;
 }
 
+
+/*!
+    Enqueue the detection kernels and a non-blocking read of the number 
+    of ipoints, so the host can carry on while the device works
+    \param detected Receives an event that completes once the number of
+           ipoints has arrived.  The caller must release it.
+*/
+void FastHessian::enqueueIpoints(int i_width, int i_height, 
+                                 cl_mem d_intImage, cl_mem d_laplacian, 
+                                 cl_mem d_pixPos, cl_mem d_scale, 
+                                 cl_mem d_imageIndex, int maxIpts, 
+                                 cl_event* detected)
+{
+    this->computeHessianDet(d_intImage, i_width, i_height);
+
+    this->selectIpoints(d_laplacian, d_pixPos, d_scale, d_imageIndex, 
+        maxIpts);
+
+    cl_copyBufferToHost(&this->num_ipts, this->d_ipt_count, sizeof(int), 
+        CL_FALSE);
+
+    cl_enqueueMarker(detected);
+    cl_flush();
+}
+
+
+//! Return the number of ipoints read back by enqueueIpoints
+int FastHessian::getIpointCount()
+{
+	// Sanity check
+    if(this->num_ipts < 0) {
+        printf("Invalid number of Ipoints\n");
+        exit(-1);
+    };
+
+    return this->num_ipts;
+}
+
 /*!
 //! Calculate the position of ipoints (gpuIpoint::d_pixPos) using non maximal suppression
 
@@ -244,29 +483,52 @@ int FastHessian::getIpoints(IplImage *img, cl_mem d_intImage, cl_mem d_laplacian
     \param d_laplacian
     \param d_pixPos
     \param d_scale
-    \param kernel_list Precompiled Kernels
+    \param d_imageIndex
 */
 void FastHessian::selectIpoints(cl_mem d_laplacian, cl_mem d_pixPos,
-                                cl_mem d_scale, cl_kernel* kernel_list,
+                                cl_mem d_scale, cl_mem d_imageIndex,
                                 int maxPoints)
 {
+    // Record the launches the first time and whenever their arguments
+    // change (the ipoint buffers are reallocated if they overflow)
+    if(this->nmsPlan.empty() || d_laplacian != this->planLaplacian ||
+       d_pixPos != this->planPixPos || d_scale != this->planScale ||
+       d_imageIndex != this->planImageIndex || 
+       maxPoints != this->planMaxPoints) {
+        this->recordNonMaxSuppression(d_laplacian, d_pixPos, d_scale, 
+            d_imageIndex, maxPoints);
+    }
+
+    for(unsigned int i = 0; i < this->nmsPlan.size(); i++) {
+        LaunchPlan* launch = &this->nmsPlan.at(i);
+        cl_executeKernel(launch->kernel, 3, launch->globalWorkSize, 
+            launch->localWorkSize, "NonMaxSupression", i);
+    }
+}
+
+
+//! Record the non-max suppression launches of each octave
+/*!
+    Each launch gets its own kernel object with all its arguments bound.
+    This also means no argument is changed while an earlier launch of the 
+    same kernel object may still be queued.
+*/
+void FastHessian::recordNonMaxSuppression(cl_mem d_laplacian, 
+                                          cl_mem d_pixPos, cl_mem d_scale, 
+                                          cl_mem d_imageIndex, 
+                                          int maxPoints)
+{
+    this->freePlan(this->nmsPlan);
 
     // The search for exterema (the most interesting point in a neighborhood)
     // is done by non-maximal suppression
 
-    cl_kernel non_max_supression = kernel_list[KERNEL_NON_MAX_SUP];
-
-    int BLOCK_W=16;
-    int BLOCK_H=16;
+    cl_kernel non_max_supression = cl_getKernel(KERNEL_NON_MAX_SUP);
 
-    cl_setKernelArg(non_max_supression, 14, sizeof(cl_mem), (void*)&(this->d_ipt_count));
-    cl_setKernelArg(non_max_supression, 15, sizeof(cl_mem), (void*)&d_pixPos);
-    cl_setKernelArg(non_max_supression, 16, sizeof(cl_mem), (void*)&d_scale);
-    cl_setKernelArg(non_max_supression, 17, sizeof(cl_mem), (void*)&d_laplacian);
-    cl_setKernelArg(non_max_supression, 18, sizeof(int),    (void*)&maxPoints);
-    cl_setKernelArg(non_max_supression, 19, sizeof(float),  (void*)&(this->thres));
+    int BLOCK_W=getTuningProfile()->nmsLocal[0];
+    int BLOCK_H=getTuningProfile()->nmsLocal[1];
 
-    // Run the kernel for each octave
+    // Record the kernel for each octave
     for(int o = 0; o < octaves; o++)
     {
         for(int i = 0; i <= 1; i++) {
@@ -288,41 +550,57 @@ void FastHessian::selectIpoints(cl_mem d_laplacian, cl_mem d_pixPos,
             int tFilter = this->responseMap.at(filter_map[o][i+2])->getFilter();
             int tStep = this->responseMap.at(filter_map[o][i+2])->getStep();
 
-            size_t localWorkSize[2] = {BLOCK_W, BLOCK_H};
-            size_t globalWorkSize[2] = {roundUp(mWidth, BLOCK_W),
-                                        roundUp(mHeight, BLOCK_H)};
-
-            cl_setKernelArg(non_max_supression,  0, sizeof(cl_mem), (void*)&tResponse);
-            cl_setKernelArg(non_max_supression,  1, sizeof(int),    (void*)&tWidth);
-            cl_setKernelArg(non_max_supression,  2, sizeof(int),    (void*)&tHeight);
-            cl_setKernelArg(non_max_supression,  3, sizeof(int),    (void*)&tFilter);
-            cl_setKernelArg(non_max_supression,  4, sizeof(int),    (void*)&tStep);
-            cl_setKernelArg(non_max_supression,  5, sizeof(cl_mem), (void*)&mResponse);
-            cl_setKernelArg(non_max_supression,  6, sizeof(cl_mem), (void*)&mLaplacian);
-            cl_setKernelArg(non_max_supression,  7, sizeof(int),    (void*)&mWidth);
-            cl_setKernelArg(non_max_supression,  8, sizeof(int),    (void*)&mHeight);
-            cl_setKernelArg(non_max_supression,  9, sizeof(int),    (void*)&mFilter);
-            cl_setKernelArg(non_max_supression, 10, sizeof(cl_mem), (void*)&bResponse);
-            cl_setKernelArg(non_max_supression, 11, sizeof(int),    (void*)&bWidth);
-            cl_setKernelArg(non_max_supression, 12, sizeof(int),    (void*)&bHeight);
-            cl_setKernelArg(non_max_supression, 13, sizeof(int),    (void*)&bFilter);
-
-            // Call non-max supression kernel
-            cl_executeKernel(non_max_supression, 2, globalWorkSize, localWorkSize,
-                "NonMaxSupression", o*2+i);
-
-            // TODO Verify that a clFinish is not required (setting an argument
-            //      to the loop counter without it may be problematic, but it
-            //      really kills performance on AMD parts)
-            //cl_sync();
+            LaunchPlan launch;
+            launch.kernel = cl_cloneKernel(non_max_supression);
+            launch.localWorkSize[0] = BLOCK_W;
+            launch.localWorkSize[1] = BLOCK_H;
+            launch.localWorkSize[2] = 1;
+            launch.globalWorkSize[0] = roundUp(mWidth, BLOCK_W);
+            launch.globalWorkSize[1] = roundUp(mHeight, BLOCK_H);
+            launch.globalWorkSize[2] = this->numImages;
+
+            cl_kernel kernel = launch.kernel;
+            cl_setKernelArg(kernel,  0, sizeof(cl_mem), (void*)&tResponse);
+            cl_setKernelArg(kernel,  1, sizeof(int),    (void*)&tWidth);
+            cl_setKernelArg(kernel,  2, sizeof(int),    (void*)&tHeight);
+            cl_setKernelArg(kernel,  3, sizeof(int),    (void*)&tFilter);
+            cl_setKernelArg(kernel,  4, sizeof(int),    (void*)&tStep);
+            cl_setKernelArg(kernel,  5, sizeof(cl_mem), (void*)&mResponse);
+            cl_setKernelArg(kernel,  6, sizeof(cl_mem), (void*)&mLaplacian);
+            cl_setKernelArg(kernel,  7, sizeof(int),    (void*)&mWidth);
+            cl_setKernelArg(kernel,  8, sizeof(int),    (void*)&mHeight);
+            cl_setKernelArg(kernel,  9, sizeof(int),    (void*)&mFilter);
+            cl_setKernelArg(kernel, 10, sizeof(cl_mem), (void*)&bResponse);
+            cl_setKernelArg(kernel, 11, sizeof(int),    (void*)&bWidth);
+            cl_setKernelArg(kernel, 12, sizeof(int),    (void*)&bHeight);
+            cl_setKernelArg(kernel, 13, sizeof(int),    (void*)&bFilter);
+            cl_setKernelArg(kernel, 14, sizeof(cl_mem), (void*)&(this->d_ipt_count));
+            cl_setKernelArg(kernel, 15, sizeof(cl_mem), (void*)&d_pixPos);
+            cl_setKernelArg(kernel, 16, sizeof(cl_mem), (void*)&d_scale);
+            cl_setKernelArg(kernel, 17, sizeof(cl_mem), (void*)&d_laplacian);
+            cl_setKernelArg(kernel, 18, sizeof(int),    (void*)&maxPoints);
+            cl_setKernelArg(kernel, 19, sizeof(float),  (void*)&(this->thres));
+            cl_setKernelArg(kernel, 20, sizeof(cl_mem), (void*)&d_imageIndex);
+
+            this->nmsPlan.push_back(launch);
         }
     }
+
+    this->planLaplacian = d_laplacian;
+    this->planPixPos = d_pixPos;
+    this->planScale = d_scale;
+    this->planImageIndex = d_imageIndex;
+    this->planMaxPoints = maxPoints;
 }
 
 
 //! Reset the state of the data
 void FastHessian::reset()
 {
-    int numIpts = 0;
-    cl_copyBufferToDevice(this->d_ipt_count, &numIpts, sizeof(int));
+    // The write doesn't block, so commands queued for other frames keep 
+    // running (the queue is in-order, so it happens before the next 
+    // detection).  The source must outlive the call.
+    static const int numIpts = 0;
+    cl_copyBufferToDevice(this->d_ipt_count, (void*)&numIpts, sizeof(int),
+        CL_FALSE);
 }
@@ -69,6 +69,14 @@ static const int INTERVALS = 4;
 static const float THRES = 0.0001f;
 static const int SAMPLE_STEP = 2;
 
+//! A recorded kernel launch.  The kernel object belongs to the launch and
+//! has all its arguments bound, so it can be enqueued again as is.
+typedef struct LaunchPlan{
+    cl_kernel kernel;
+    size_t globalWorkSize[3];
+    size_t localWorkSize[3];
+} LaunchPlan;
+
 //! FastHessian Calculates array of hessian and co-ordinates of ipoints 
 /*!
     FastHessian declaration\n
@@ -92,24 +100,79 @@ class FastHessian {
 
     // TODO Fix this name
     void selectIpoints(cl_mem d_laplacian, cl_mem d_pixPos, cl_mem d_scale,
-                       cl_kernel* kernel_list, int maxPoints);
+                       cl_mem d_imageIndex, int maxPoints);
     
     // TODO Fix this name
-    void computeHessianDet(cl_mem d_intImage, int i_width, int i_height, 
-                           cl_kernel* kernel_list);
+    void computeHessianDet(cl_mem d_intImage, int i_width, int i_height);
 
     //! Find the image features and write into vector of features
-    int getIpoints(IplImage *img, cl_mem d_intImage, cl_mem d_laplacian,
-                            cl_mem d_pixPos, cl_mem d_scale, int maxIpts);
+    int getIpoints(int i_width, int i_height, cl_mem d_intImage, 
+                   cl_mem d_laplacian, cl_mem d_pixPos, cl_mem d_scale, 
+                   cl_mem d_imageIndex, int maxIpts);
+
+    //! Enqueue the detection without waiting for it.  The number of 
+    //! ipoints is read back without blocking; 'detected' completes when
+    //! getIpointCount may be called.
+    void enqueueIpoints(int i_width, int i_height, cl_mem d_intImage, 
+                        cl_mem d_laplacian, cl_mem d_pixPos, 
+                        cl_mem d_scale, cl_mem d_imageIndex, int maxIpts,
+                        cl_event* detected);
+
+    //! Return the number of ipoints read back by enqueueIpoints
+    int getIpointCount();
 
     //! Resets the information required for the next frame to compute
     void reset();
 
+    //! Reallocate the response layers so they hold a batch of images
+    void setBatchCapacity(int images);
+
+    //! Set the number of images (stored one after the other in the 
+    //! integral image) that the next detection runs on
+    void setNumImages(int images);
+
+    //! Run the next detections on images of a smaller size (up to the 
+    //! size the object was created for) without reallocating
+    void setImageSize(int i_width, int i_height);
+
+    //! Return the size of the device buffers in bytes
+    size_t getDeviceBytes();
+
+    //! Build the hessian determinant kernel for each layer and image 
+    //! size, with the sizes folded into constants
+    void setSpecialisedKernels(bool enable);
+
   private:
 
     void createResponseMap(int octaves, int imgWidth, int 
         imgHeight, int sample_step);
 
+    //! Record the launches of computeHessianDet and selectIpoints
+    void recordHessianDet(cl_mem d_intImage, int i_width, int i_height);
+    void recordNonMaxSuppression(cl_mem d_laplacian, cl_mem d_pixPos, 
+        cl_mem d_scale, cl_mem d_imageIndex, int maxPoints);
+
+    //! Release recorded launches
+    void freePlan(std::vector<LaunchPlan>& plan);
+    void clearPlans();
+
+    //! Size of the images the response layers are allocated for
+    int imgWidth;
+    int imgHeight;
+
+    //! Size of the images processed
+    int frameWidth;
+    int frameHeight;
+
+    //! Number of images the response layers have space for
+    int batchCapacity;
+
+    //! Number of images in the integral image
+    int numImages;
+
+    //! Use kernels specialised for the layer and image sizes
+    bool specialised;
+
     //! Number of Ipoints
     int num_ipts;
 
@@ -129,6 +192,21 @@ class FastHessian {
 
     std::vector<ResponseLayer*> responseMap;
 
+    //! Recorded hessian and non-max suppression launches
+    std::vector<LaunchPlan> hessianPlan;
+    std::vector<LaunchPlan> nmsPlan;
+
+    //! Arguments the launches were recorded with (they are recorded 
+    //! again if these change)
+    cl_mem planIntImage;
+    int planWidth;
+    int planHeight;
+    cl_mem planLaplacian;
+    cl_mem planPixPos;
+    cl_mem planScale;
+    cl_mem planImageIndex;
+    int planMaxPoints;
+
     //! Number of Ipoints on GPU 
     cl_mem d_ipt_count;
 };
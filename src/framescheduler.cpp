@@ -0,0 +1,496 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sched.h>
+#endif
+
+#include "framescheduler.h"
+#include "pinnedpool.h"
+#include "surfpool.h"
+#include "utils.h"
+
+//! Bind the calling thread to the processors of a NUMA node
+/*!
+    Memory the thread touches first is then allocated on the node
+*/
+static void bindThreadToNode(int node)
+{
+#ifdef _WIN32
+    ULONGLONG mask = 0;
+    if(!GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0) 
+    {
+        printf("Warning: No processors found for NUMA node %d\n", node);
+        return;
+    }
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask);
+#else
+    char path[64];
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) 
+    {
+        printf("Warning: No processors found for NUMA node %d\n", node);
+        return;
+    }
+
+    // The list holds ranges such as 0-7,16-23
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int first, last;
+    while(fscanf(fp, "%d", &first) == 1) 
+    {
+        last = first;
+        int separator = fgetc(fp);
+        if(separator == '-') 
+        {
+            if(fscanf(fp, "%d", &last) != 1) 
+            {
+                break;
+            }
+            separator = fgetc(fp);
+        }
+        for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) 
+        {
+            CPU_SET(cpu, &cpus);
+        }
+        if(separator != ',') 
+        {
+            break;
+        }
+    }
+    fclose(fp);
+
+    if(CPU_COUNT(&cpus) == 0) 
+    {
+        printf("Warning: No processors found for NUMA node %d\n", node);
+        return;
+    }
+    if(sched_setaffinity(0, sizeof(cpu_set_t), &cpus) != 0) 
+    {
+        perror("sched_setaffinity");
+    }
+#endif
+}
+
+//! Constructor
+/*!
+    Worker i runs on context device i modulo the number of devices.
+    \param numWorkers Number of workers (1 to MAX_SCHEDULER_WORKERS)
+*/
+FrameScheduler::FrameScheduler(int numWorkers, int initialPoints, 
+    int octaves, int intervals, int sample_step, float threshold, 
+    cl_kernel* kernel_list, void (*configure)(Surf*)) 
+{
+    if(numWorkers < 1 || numWorkers > MAX_SCHEDULER_WORKERS) 
+    {
+        printf("Error: A scheduler needs 1 to %d workers\n", 
+            MAX_SCHEDULER_WORKERS);
+        exit(-1);
+    }
+
+    this->initialPoints = initialPoints;
+    this->octaves = octaves;
+    this->intervals = intervals;
+    this->sample_step = sample_step;
+    this->threshold = threshold;
+    this->kernel_list = kernel_list;
+    this->configure = configure;
+
+    ScheduledFrame empty = {NULL, NULL, NULL, false};
+    this->slots.assign(numWorkers * MAX_WORKER_FRAMES, empty);
+
+    this->head = 0;
+    this->tail = 0;
+    this->stopping = false;
+
+#ifdef _WIN32
+    InitializeCriticalSection(&(this->mutex));
+    InitializeConditionVariable(&(this->workReady));
+    InitializeConditionVariable(&(this->frameDone));
+#else
+    pthread_mutex_init(&(this->mutex), NULL);
+    pthread_cond_init(&(this->workReady), NULL);
+    pthread_cond_init(&(this->frameDone), NULL);
+#endif
+
+    for(int i = 0; i < numWorkers; i++) 
+    {
+        SchedulerWorker* worker = new SchedulerWorker();
+        worker->scheduler = this;
+        worker->deviceIndex = i % cl_getNumContextDevices();
+        worker->device = cl_getContextDevice(worker->deviceIndex);
+        worker->outstanding = 0;
+        worker->outstandingPixels = 0;
+        worker->processed = 0;
+        this->workers.push_back(worker);
+
+#ifdef _WIN32
+        worker->thread = (HANDLE)_beginthreadex(NULL, 0, 
+            FrameScheduler::workerThread, worker, 0, NULL);
+        if(worker->thread == 0) 
+#else
+        if(pthread_create(&(worker->thread), NULL, 
+            FrameScheduler::workerThread, worker) != 0) 
+#endif
+        {
+            printf("Error creating a scheduler worker\n");
+            exit(-1);
+        }
+    }
+}
+
+
+//! Destructor
+/*!
+    The frames still queued are processed, and the ipoints of frames that
+    weren't collected are deleted.  The frames themselves belong to the 
+    caller.  Must be called before cl_cleanup.
+*/
+FrameScheduler::~FrameScheduler() 
+{
+    this->lock();
+    this->stopping = true;
+#ifdef _WIN32
+    WakeAllConditionVariable(&(this->workReady));
+#else
+    pthread_cond_broadcast(&(this->workReady));
+#endif
+    this->unlock();
+
+    for(size_t i = 0; i < this->workers.size(); i++) 
+    {
+#ifdef _WIN32
+        WaitForSingleObject(this->workers[i]->thread, INFINITE);
+        CloseHandle(this->workers[i]->thread);
+#else
+        pthread_join(this->workers[i]->thread, NULL);
+#endif
+        delete this->workers[i];
+    }
+
+    for(size_t i = 0; i < this->slots.size(); i++) 
+    {
+        delete this->slots[i].ipts;
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection(&(this->mutex));
+#else
+    pthread_mutex_destroy(&(this->mutex));
+    pthread_cond_destroy(&(this->workReady));
+    pthread_cond_destroy(&(this->frameDone));
+#endif
+}
+
+
+//! Queue a frame on the worker with the least work outstanding
+/*!
+    \param frame The frame.  It must not be changed until it is collected.
+    \param tag Caller data returned with the ipoints
+    \return false if every slot is busy
+*/
+bool FrameScheduler::submit(IplImage* frame, void* tag) 
+{
+    int capacity = (int)this->slots.size();
+    size_t pixels = (size_t)frame->width * frame->height;
+
+    this->lock();
+
+    if(this->head - this->tail == capacity) 
+    {
+        this->unlock();
+        return false;
+    }
+
+    // Pick the worker with the fewest pixels outstanding
+    SchedulerWorker* worker = NULL;
+    for(size_t i = 0; i < this->workers.size(); i++) 
+    {
+        SchedulerWorker* candidate = this->workers[i];
+        if(candidate->outstanding == MAX_WORKER_FRAMES) 
+        {
+            continue;
+        }
+        if(worker == NULL || 
+           candidate->outstandingPixels < worker->outstandingPixels) 
+        {
+            worker = candidate;
+        }
+    }
+    if(worker == NULL) 
+    {
+        this->unlock();
+        return false;
+    }
+
+    int slot = (int)(this->head % capacity);
+    this->slots[slot].frame = frame;
+    this->slots[slot].tag = tag;
+    this->slots[slot].ipts = NULL;
+    this->slots[slot].done = false;
+    this->head++;
+
+    worker->queue.push_back(slot);
+    worker->outstanding++;
+    worker->outstandingPixels += pixels;
+
+#ifdef _WIN32
+    WakeAllConditionVariable(&(this->workReady));
+#else
+    pthread_cond_broadcast(&(this->workReady));
+#endif
+
+    this->unlock();
+
+    return true;
+}
+
+
+//! Wait for the oldest frame and return its ipoints
+/*!
+    \param ipts Receives the ipoints (the caller deletes them)
+    \param frame If not NULL, receives the frame
+    \param tag If not NULL, receives the tag the frame was submitted with
+    \return false if no frames are pending
+*/
+bool FrameScheduler::collect(IpVec** ipts, IplImage** frame, void** tag) 
+{
+    this->lock();
+
+    if(this->head == this->tail) 
+    {
+        this->unlock();
+        return false;
+    }
+
+    ScheduledFrame* oldest = 
+        &(this->slots[this->tail % (long)this->slots.size()]);
+    while(!oldest->done) 
+    {
+#ifdef _WIN32
+        SleepConditionVariableCS(&(this->frameDone), &(this->mutex), 
+            INFINITE);
+#else
+        pthread_cond_wait(&(this->frameDone), &(this->mutex));
+#endif
+    }
+
+    *ipts = oldest->ipts;
+    if(frame != NULL) 
+    {
+        *frame = oldest->frame;
+    }
+    if(tag != NULL) 
+    {
+        *tag = oldest->tag;
+    }
+
+    oldest->frame = NULL;
+    oldest->tag = NULL;
+    oldest->ipts = NULL;
+    oldest->done = false;
+    this->tail++;
+
+    this->unlock();
+
+    return true;
+}
+
+
+//! Number of frames submitted and not yet collected
+int FrameScheduler::getPending() 
+{
+    this->lock();
+    int pending = (int)(this->head - this->tail);
+    this->unlock();
+
+    return pending;
+}
+
+
+//! Most frames that can be pending
+int FrameScheduler::getCapacity() 
+{
+    return (int)this->slots.size();
+}
+
+
+//! Print the frames each worker has processed
+void FrameScheduler::printOccupancy() 
+{
+    this->lock();
+    printf("Frame scheduler: %d workers\n", (int)this->workers.size());
+    for(size_t i = 0; i < this->workers.size(); i++) 
+    {
+        char* name = cl_getDeviceName(this->workers[i]->device);
+        printf("\tWorker %d (%s): %d frames\n", (int)i, name, 
+            this->workers[i]->processed);
+        free(name);
+    }
+    this->unlock();
+}
+
+
+//! Process the frames queued on a worker until the scheduler stops
+/*!
+    Runs on the worker's thread, so the context, the Surf objects and 
+    their buffers are created there (and first touched by it).
+*/
+void FrameScheduler::runWorker(SchedulerWorker* worker) 
+{
+    // Keep the host work and buffers on the node of the device
+    if(cl_isNumaPartitioned()) 
+    {
+        bindThreadToNode(worker->deviceIndex);
+    }
+    selectPinnedPool(worker->deviceIndex % PINNED_POOL_MAX_POOLS);
+
+    SurfContext* ctx = cl_createSurfContext(worker->device);
+    cl_setSurfContext(ctx);
+
+    SurfPool* pool = new SurfPool(this->initialPoints, this->octaves, 
+        this->intervals, this->sample_step, this->threshold, 
+        this->kernel_list, isUsingExtendedDescriptors(), 
+        getDescriptorFormat(), getSurfPoolGranularity(), 
+        getSurfPoolBudget());
+
+    this->lock();
+    while(true) 
+    {
+        while(worker->queue.empty() && !this->stopping) 
+        {
+#ifdef _WIN32
+            SleepConditionVariableCS(&(this->workReady), &(this->mutex), 
+                INFINITE);
+#else
+            pthread_cond_wait(&(this->workReady), &(this->mutex));
+#endif
+        }
+        if(worker->queue.empty()) 
+        {
+            break;
+        }
+
+        ScheduledFrame* scheduled = &(this->slots[worker->queue.front()]);
+        worker->queue.pop_front();
+        IplImage* frame = scheduled->frame;
+        this->unlock();
+
+        bool created;
+        Surf* surf = pool->acquire(frame->width, frame->height, &created);
+        if(created && this->configure != NULL) 
+        {
+            this->configure(surf);
+        }
+
+        surf->run(frame, false);
+        IpVec* ipts = surf->retrieveDescriptors();
+        pool->release(surf);
+
+        this->lock();
+        scheduled->ipts = ipts;
+        scheduled->done = true;
+        worker->outstanding--;
+        worker->outstandingPixels -= (size_t)frame->width * frame->height;
+        worker->processed++;
+#ifdef _WIN32
+        WakeAllConditionVariable(&(this->frameDone));
+#else
+        pthread_cond_broadcast(&(this->frameDone));
+#endif
+    }
+    this->unlock();
+
+    delete pool;
+    cl_releaseSurfContext(ctx);
+}
+
+
+//! Entry point of the worker threads
+#ifdef _WIN32
+unsigned __stdcall FrameScheduler::workerThread(void* arg)
+#else
+void* FrameScheduler::workerThread(void* arg)
+#endif
+{
+    SchedulerWorker* worker = (SchedulerWorker*)arg;
+    worker->scheduler->runWorker(worker);
+
+    return 0;
+}
+
+
+//! Lock the queues and slots
+void FrameScheduler::lock() 
+{
+#ifdef _WIN32
+    EnterCriticalSection(&(this->mutex));
+#else
+    pthread_mutex_lock(&(this->mutex));
+#endif
+}
+
+
+//! Unlock the queues and slots
+void FrameScheduler::unlock() 
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&(this->mutex));
+#else
+    pthread_mutex_unlock(&(this->mutex));
+#endif
+}
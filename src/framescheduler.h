@@ -0,0 +1,189 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#ifndef _FRAMESCHEDULER_H_
+#define _FRAMESCHEDULER_H_
+
+#include <vector>
+#include <deque>
+#include <CL/cl.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "clutils.h"
+#include "surf.h"
+
+// Most workers frames can be scheduled on
+#define MAX_SCHEDULER_WORKERS 16
+
+// Most frames queued on or processed by one worker
+#define MAX_WORKER_FRAMES 2
+
+//! A frame handed to a FrameScheduler
+typedef struct ScheduledFrame{
+        IplImage* frame;        // The frame (owned by the caller)
+        void* tag;              // Caller data passed with the frame
+        IpVec* ipts;            // The ipoints, once the frame is done
+        bool done;
+} ScheduledFrame;
+
+class FrameScheduler;
+
+//! A thread processing frames on one device with its own SurfContext
+typedef struct SchedulerWorker{
+        FrameScheduler* scheduler;
+        cl_device_id device;
+        int deviceIndex;            // Index of the device in the context
+        std::deque<int> queue;      // Slots of the frames waiting
+        int outstanding;            // Frames queued or being processed
+        size_t outstandingPixels;   // Pixels of those frames
+        int processed;              // Frames done so far
+#ifdef _WIN32
+        HANDLE thread;
+#else
+        pthread_t thread;
+#endif
+} SchedulerWorker;
+
+//! Distributes video frames over several devices or sub-devices
+/*!
+    Each worker is a thread with its own SurfContext on one of the 
+    devices of the OpenCL context (see cl_getContextDevice), and its own
+    SurfPool and pinned pool, so the workers run the whole SURF pipeline
+    concurrently.  If the devices are NUMA nodes (see 
+    cl_isNumaPartitioned), each worker's thread is bound to its node.  
+    A frame goes to the worker with the fewest pixels outstanding, and 
+    the ipoints are collected in submission order.  The events of the 
+    workers are recorded in their own contexts, not in the one that 
+    cl_writeEventsToFile writes out.
+*/
+class FrameScheduler {
+
+  public:
+
+    //! Start the workers.  The other parameters are those of the Surf 
+    //! objects the workers create, and configure (if not NULL) is called
+    //! on each new object on the worker's thread.
+    FrameScheduler(int numWorkers, int initialPoints, int octaves, 
+                   int intervals, int sample_step, float threshold, 
+                   cl_kernel* kernel_list, void (*configure)(Surf*) = NULL);
+
+    //! Finish the frames still queued and stop the workers
+    ~FrameScheduler();
+
+    //! Queue a frame.  The frame must stay valid until it is collected.
+    //! Returns false if every slot is busy (collect the oldest first).
+    bool submit(IplImage* frame, void* tag = NULL);
+
+    //! Wait for the oldest frame and return its ipoints (the caller 
+    //! deletes them), the frame and its tag.  Returns false if no frames
+    //! are pending.
+    bool collect(IpVec** ipts, IplImage** frame = NULL, void** tag = NULL);
+
+    //! Number of frames submitted and not yet collected
+    int getPending();
+
+    //! Most frames that can be pending
+    int getCapacity();
+
+    //! Print the frames each worker has processed
+    void printOccupancy();
+
+  private:
+
+    //! Process the frames queued on a worker until the scheduler stops
+    void runWorker(SchedulerWorker* worker);
+
+#ifdef _WIN32
+    static unsigned __stdcall workerThread(void* arg);
+#else
+    static void* workerThread(void* arg);
+#endif
+
+    void lock();
+
+    void unlock();
+
+    std::vector<SchedulerWorker*> workers;
+
+    //! Frames in flight, indexed by submission number modulo capacity
+    std::vector<ScheduledFrame> slots;
+
+    //! Submission number of the next frame and of the oldest one
+    long head;
+    long tail;
+
+    bool stopping;
+
+    //! Guards the queues and slots.  workReady is signalled when a frame
+    //! is queued (or the workers stop), frameDone when one is processed.
+#ifdef _WIN32
+    CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE workReady;
+    CONDITION_VARIABLE frameDone;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t workReady;
+    pthread_cond_t frameDone;
+#endif
+
+    //! Parameters of the Surf objects
+    int initialPoints;
+    int octaves;
+    int intervals;
+    int sample_step;
+    float threshold;
+    cl_kernel* kernel_list;
+    void (*configure)(Surf*);
+};
+
+#endif
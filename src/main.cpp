@@ -54,6 +54,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <CL/cl.h>
 
 #include "clutils.h"
@@ -61,10 +62,16 @@
 #include "eventlist.h"
 #include "highgui.h"
 #include "nearestNeighbor.h"
+#include "pca.h"
+#include "pinnedpool.h"
 #include "cvutils.h"
 #include "utils.h"
 #include "fasthessian.h"
 #include "surf.h"
+#include "surfpipeline.h"
+#include "surfpool.h"
+#include "tuning.h"
+#include "framescheduler.h"
 
 
 // Signatures for main SURF functions
@@ -76,11 +83,63 @@ int mainStabilization(cl_kernel* kernel_list,char* inputImage,
               char* eventsPath, char* iptsPath);
 int mainBenchmark(cl_kernel* kernel_list,char* inputImage, char* eventsPath,
               char* iptsPath, bool verifyResults);
+int mainTrainPca(char* iptsLog, char* outputPath);
+int mainTune(char* inputImage);
+
+// Applies the PCA projection, Haar map and sorting options from the 
+// command line
+void applySurfOptions(Surf* surf);
+
+// The PCA projection supplied with -p, loaded once and shared by all the
+// Surf objects (NULL without -p)
+static PcaProjection* surfProjection = NULL;
+
+// Runs SURF, or dense extraction if a grid stride was supplied
+void runSurf(Surf* surf, IplImage* img);
+
+// Runs the video loop with several frames in flight
+int mainVideoPipelined(cl_kernel* kernel_list, CvCapture* capture, 
+              IplImage* origFrame, IplImage* frame, char* eventsPath, 
+              char* iptsPath, int octaves, int intervals, int sample_step,
+              float threshold, unsigned int initialIpts);
+
+// Collects the oldest frame of a pipeline and displays it
+bool showPipelinedFrame(SurfPipeline* pipeline, char* iptsPath);
+
+// Runs the video loop with the frames distributed over several devices
+int mainVideoScheduled(cl_kernel* kernel_list, CvCapture* capture, 
+              IplImage* origFrame, IplImage* frame, char* eventsPath, 
+              char* iptsPath, int octaves, int intervals, int sample_step,
+              float threshold, unsigned int initialIpts);
+
+// Collects the oldest frame of a scheduler and displays it
+bool showScheduledFrame(FrameScheduler* scheduler, char* iptsPath);
+
+// Runs the video loop on batches of frames
+int mainVideoBatched(cl_kernel* kernel_list, CvCapture* capture, 
+              IplImage* origFrame, IplImage* frame, char* eventsPath, 
+              char* iptsPath, int octaves, int intervals, int sample_step,
+              float threshold, unsigned int initialIpts);
 
 // Signature for reference implementation of SURF
 int surfRef(char* imagePath, int octaves, int intervals, int step, 
               float threshold, void** iptsPtr);
 
+// Ipoint structure of the reference implementation (the layout Ipoint had
+// before extended descriptors were added)
+typedef struct{
+        float x;
+        float y;
+        float scale;
+        float orientation;
+        int laplacian;
+        int clusterIndex;
+        float descriptor[DESC_SIZE];
+} RefIpoint;
+
+// Converts the ipoints returned by the reference implementation
+IpVec* convertRefIpoints(RefIpoint* refIpts, int numRefIpts);
+
 /**-------------------------------------------------------
  // Run the executable with no command line arguments to
  // see a complete list of options
@@ -155,8 +214,21 @@ int main(int argc, char **argv)
             exit(-1);
         }
         break;
+    case 7:
+        if(inputPath == NULL || iptsLogPath == NULL) {
+            printf("Usage: Procedure 7 requires an input Ipoint log and an output directory\n");
+            printUsage();
+            exit(-1);
+        }
+        // Training runs on the host only, so OpenCL is not initialized
+        return mainTrainPca(inputPath, iptsLogPath);
+    case 8:
+        if(inputPath == NULL) {
+            printf("No input image provided... a synthetic image will be used\n");
+        }
+        break;
     default:
-        printf("Usage: Invalid procedure number was entered.  Must be 1-6.\n");
+        printf("Usage: Invalid procedure number was entered.  Must be 1-8.\n");
         printUsage();
         exit(-1);
     }
@@ -173,12 +245,31 @@ int main(int argc, char **argv)
     // Initialize OpenCL
     cl_init(devicePref);
     
-	// NVIDIA's OpenCL cuurently doesn't support single-channel images
-	if(cl_deviceIsNVIDIA()) 
+	// The image variants need single-channel images, which some devices
+	// (e.g. NVIDIA's) don't support
+	if(!cl_getContextCaps()->images) 
 	{
 		setUsingImages(false);
 	}
     
+    // Use the work-group sizes and variants tuned for the device, unless
+    // they are being tuned
+    if(procedure != 8 && getTuningProfilePath() != NULL) {
+        loadTuningProfile(getTuningProfilePath(), getTuningProfile());
+        if(!getTuningProfile()->images) {
+            setUsingImages(false);
+        }
+    }
+
+    // The built-in sizes may be too large for the devices
+    fitTuningProfile(getTuningProfile(), 
+        cl_getContextCaps()->maxWorkGroupSize);
+
+    // Batches of frames are stored one after the other in buffers
+    if(procedure == 2 && getVideoBatchSize() > 1) {
+        setUsingImages(false);
+    }
+
     // Print a message saying whether or not images are being used
     if(isUsingImages()) 
     {
@@ -189,16 +280,42 @@ int main(int argc, char **argv)
         printf("Not using OpenCL images\n\n");
     }
 
-    // Compile kernels off the critical path
+    // Tuning builds the programs itself
+    if(procedure == 8) {
+        return mainTune(inputPath);
+    }
+
+    // Start building the kernels in the background, so the builds overlap
+    // with loading the input and creating the Surf objects.  Only the 
+    // programs this procedure uses are built, others on first use.
+    int programs = BUILD_SURF;
+    if(procedure == 3) {
+        programs |= BUILD_NN;
+    }
+    if(getDenseGridStride() > 0) {
+        programs |= BUILD_DENSE;
+    }
+    if(getHaarMapRatio() > 0) {
+        programs |= BUILD_HAAR_MAPS;
+    }
+    if(isSortingKeypoints()) {
+        programs |= BUILD_SORT;
+    }
+
     cl_kernel* kernel_list;
 	if(isUsingImages()) 
 	{
-		kernel_list = cl_precompileKernels("-DIMAGES_SUPPORTED");
+		kernel_list = cl_precompileKernels("-DIMAGES_SUPPORTED", programs);
 	}
 	else {
-		kernel_list = cl_precompileKernels(NULL);
+		kernel_list = cl_precompileKernels(NULL, programs);
 	}
 
+    // Load the PCA projection once for all the Surf objects
+    if(getPcaProjectionPath() != NULL) {
+        surfProjection = loadPcaProjection(getPcaProjectionPath());
+    }
+
     // Call the selected procedure
     int retval = 0;
     switch(procedure) {
@@ -222,6 +339,11 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
+    if(surfProjection != NULL) {
+        freePcaProjection(surfProjection);
+        surfProjection = NULL;
+    }
+
     return retval;
 }
 
@@ -257,7 +379,9 @@ int mainImage(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
 
     // Create Surf Object
     Surf* surf = new Surf(initialIpts, img->height, img->width, octaves, 
-        intervals, sample_step, threshold, kernel_list);
+        intervals, sample_step, threshold, kernel_list,
+        isUsingExtendedDescriptors(), getDescriptorFormat());
+    applySurfOptions(surf);
 
     // Start timing (OpenCL only)
     cl_getTime(&surfStart);
@@ -265,14 +389,15 @@ int mainImage(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     // This is the main SURF algorithm.  It detects and describes
     // interesting points in the image.   When the function completes
     // the descriptors are still on the device.
-    surf->run(img, false);
+    runSurf(surf, img);
 
     // Done timing SURF (OpenCL only)
     cl_getTime(&surfEnd);
 
     // Copy the surf descriptors back to the host for rendering
     IpVec* ipts;
-    ipts = surf->retrieveDescriptors();
+    DescriptorSet descs;
+    ipts = surf->retrieveDescriptors(&descs);
 
     // Done timing (OpenCV + OpenCL + host)
     cl_getTime(&totalEnd);
@@ -281,10 +406,15 @@ int mainImage(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     cl_createUserEvent(surfStart, surfEnd, "OpenCL only");
     cl_createUserEvent(totalStart, totalEnd, "OpenCL+OpenCV+host");
 
-    // Write interest points to file if path was supplied
+    // Write interest points to file if path was supplied.  Compact 
+    // descriptors are also written in their binary form
     if(iptsPath != NULL) {
         writeIptsToFile(iptsPath, *ipts);
+        if(descs.format != DESC_FORMAT_FP32) {
+            writeCompactIptsToFile(iptsPath, *ipts, descs);
+        }
     }
+    freeDescriptorSet(&descs);
 
     // Write events to file if path was supplied
     if(eventsPath != NULL) {
@@ -295,11 +425,11 @@ int mainImage(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     if(verifyResults) {
 #ifdef _WIN32
         // Get Ipoints from the reference algorithm
-        Ipoint* refIptsPtr;
+        RefIpoint* refIptsPtr;
         int numRefIpts = surfRef(inputImage, octaves, intervals, 
                                  sample_step, threshold, (void**)&refIptsPtr);
 
-        IpVec* refIpts = new IpVec(refIptsPtr, refIptsPtr+numRefIpts);
+        IpVec* refIpts = convertRefIpoints(refIptsPtr, numRefIpts);
 
         IplImage *refImg = cvCloneImage(img);
         drawIpoints(refImg, *refIpts);
@@ -337,6 +467,7 @@ int mainImage(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     delete ipts;
     cvReleaseImage(&img);
     cvDestroyAllWindows();
+    releasePinnedPool();
     cl_cleanup();
 
     return retval;
@@ -377,8 +508,6 @@ int mainVideo(cl_kernel* kernel_list, char* inputImage, char* eventsPath, char*
 
     // Frame is the pointer to the current frame
     IplImage* frame = NULL;
-    // These are the dimensions of the first frame (used for sanity checking)
-    int firstWidth, firstHeight;
 
     // Initialize some SURF parameters
     int octaves = 3;
@@ -408,14 +537,34 @@ int mainVideo(cl_kernel* kernel_list, char* inputImage, char* eventsPath, char*
         return 0;
     }
 
-    // Remember the height and width of the first frame to sanity
-    // check future frames
-    firstHeight = frame->height;
-    firstWidth = frame->width;
+    // Distribute the frames over several devices if requested
+    if(getSchedulerWorkers() > 1 || cl_isNumaPartitioned()) {
+        return mainVideoScheduled(kernel_list, capture, origFrame, frame,
+            eventsPath, iptsPath, octaves, intervals, sample_step, 
+            threshold, initialIpts);
+    }
 
-    // Create Surf Descriptor Object
-    Surf* surf = new Surf(initialIpts, frame->height, frame->width, octaves, 
-        intervals, sample_step, threshold, kernel_list);
+    // Run the frames in batches if requested
+    if(getVideoBatchSize() > 1) {
+        return mainVideoBatched(kernel_list, capture, origFrame, frame,
+            eventsPath, iptsPath, octaves, intervals, sample_step, 
+            threshold, initialIpts);
+    }
+
+    // Overlap the frames if requested
+    if(getPipelineDepth() > 1) {
+        return mainVideoPipelined(kernel_list, capture, origFrame, frame,
+            eventsPath, iptsPath, octaves, intervals, sample_step, 
+            threshold, initialIpts);
+    }
+
+    // Surf Descriptor Objects are taken from a pool by frame size, so
+    // a change of size reuses (or creates) an object for the new size
+    // instead of ending the loop
+    SurfPool* surfPool = new SurfPool(initialIpts, octaves, intervals, 
+        sample_step, threshold, kernel_list, isUsingExtendedDescriptors(), 
+        getDescriptorFormat(), getSurfPoolGranularity(), 
+        getSurfPoolBudget());
 
     // ---------- Main capture loop -----------
 
@@ -423,10 +572,10 @@ int mainVideo(cl_kernel* kernel_list, char* inputImage, char* eventsPath, char*
     int limit = 1000;
     while(limit--)
     {
-        // Sanity check frame sizes
-        if(frame->width != firstWidth || frame->height != firstHeight) {
-            printf("Frames are inconsistent sizes, exiting loop\n");
-            break;
+        bool created;
+        Surf* surf = surfPool->acquire(frame->width, frame->height, &created);
+        if(created) {
+            applySurfOptions(surf);
         }
 
         //cvShowImage("OpenSURF Input", frame);
@@ -457,9 +606,9 @@ int mainVideo(cl_kernel* kernel_list, char* inputImage, char* eventsPath, char*
         // Display the result
         cvShowImage("OpenSURF", frame);
 
-        // Clean up for the iteration
+        // Clean up for the iteration (the pool resets the object)
         delete ipts;
-        surf->reset();
+        surfPool->release(surf);
 
         // If ESC key pressed exit loop
         if( (cvWaitKey(2) & 255) == 27 ) break;
@@ -478,16 +627,356 @@ int mainVideo(cl_kernel* kernel_list, char* inputImage, char* eventsPath, char*
     if(eventsPath != NULL) {
         cl_writeEventsToFile(eventsPath);
     }
+    // Report the Surf objects and the pinned memory used by the transfers
+    surfPool->printOccupancy();
+    getPinnedPool()->printOccupancy();
+
     // Clean up 
-    delete surf;
+    delete surfPool;
     cvReleaseCapture(&capture);
     cvDestroyAllWindows();
+    releasePinnedPool();
     cl_cleanup();
     fflush(stdout);
     return 0;
 }
 
 
+//! Video loop with several frames in flight
+/*!
+    Each frame is submitted to a SurfPipeline and displayed once its 
+    features come back, getPipelineDepth() frames later.  The upload, 
+    computation and readback of different frames overlap with each other
+    and with the decoding and drawing on the host.
+*/
+int mainVideoPipelined(cl_kernel* kernel_list, CvCapture* capture, 
+    IplImage* origFrame, IplImage* frame, char* eventsPath, char* iptsPath,
+    int octaves, int intervals, int sample_step, float threshold, 
+    unsigned int initialIpts)
+{
+    int firstWidth = frame->width;
+    int firstHeight = frame->height;
+
+    // One Surf object (set of frame buffers) per frame in flight
+    std::vector<Surf*> surfs;
+    for(int i = 0; i < getPipelineDepth(); i++) {
+        Surf* surf = new Surf(initialIpts, frame->height, frame->width, 
+            octaves, intervals, sample_step, threshold, kernel_list,
+            isUsingExtendedDescriptors(), getDescriptorFormat());
+        applySurfOptions(surf);
+        surfs.push_back(surf);
+    }
+    SurfPipeline* pipeline = new SurfPipeline(surfs);
+
+    // ---------- Main capture loop -----------
+
+    // Limit the loop to 1000 iterations
+    int limit = 1000;
+    while(limit--)
+    {
+        // Sanity check frame sizes
+        if(frame->width != firstWidth || frame->height != firstHeight) {
+            printf("Frames are inconsistent sizes, exiting loop\n");
+            break;
+        }
+
+        // The results are drawn on the frame when they come back, so the
+        // pipeline carries a copy of it
+        pipeline->submit(frame, cvCloneImage(frame));
+
+        // Once every slot is busy, display the oldest frame
+        if(pipeline->getPending() == pipeline->getDepth()) {
+            if(showPipelinedFrame(pipeline, iptsPath)) break;
+        }
+
+        // Grab frame from the capture source
+        frame = cvQueryFrame(capture);
+        cvResize(origFrame,frame);
+
+        if(frame == NULL) {
+            printf("No Frames Available\n");
+            break;
+        }
+    }
+
+    // Display the frames still in flight
+    while(pipeline->getPending() > 0) {
+        showPipelinedFrame(pipeline, iptsPath);
+    }
+
+    // Write events to file if path was supplied
+    if(eventsPath != NULL) {
+        cl_writeEventsToFile(eventsPath);
+    }
+
+    // Report the pinned memory used by the transfers
+    getPinnedPool()->printOccupancy();
+
+    // Clean up 
+    delete pipeline;
+    cvReleaseCapture(&capture);
+    cvDestroyAllWindows();
+    releasePinnedPool();
+    cl_cleanup();
+
+    return 0;
+}
+
+
+//! Collect the oldest frame of a pipeline and display it
+/*!
+    \return true if ESC was pressed
+*/
+bool showPipelinedFrame(SurfPipeline* pipeline, char* iptsPath)
+{
+    FeatureSet features;
+    IplImage* frame;
+
+    pipeline->collect(&features, (void**)&frame);
+
+    IpVec* ipts = featureSetToIpVec(features);
+    pipeline->release(&features);
+
+    // Draw the detected points
+    drawIpoints(frame, *ipts);
+
+    // Draw the FPS figure
+    drawFPS(frame);
+
+    // Write interest points to file if path was supplied
+    if(iptsPath != NULL) {
+        writeIptsToFile(iptsPath, *ipts);
+    }
+
+    // Display the result
+    cvShowImage("OpenSURF", frame);
+
+    delete ipts;
+    cvReleaseImage(&frame);
+
+    // If ESC key pressed exit loop
+    return ((cvWaitKey(2) & 255) == 27);
+}
+
+
+//! Video loop with the frames distributed over several devices
+/*!
+    Each frame is copied and submitted to a FrameScheduler, whose workers
+    each run SURF on their own device or sub-device.  The frames are 
+    displayed in order once all slots are busy.
+*/
+int mainVideoScheduled(cl_kernel* kernel_list, CvCapture* capture, 
+    IplImage* origFrame, IplImage* frame, char* eventsPath, char* iptsPath,
+    int octaves, int intervals, int sample_step, float threshold, 
+    unsigned int initialIpts)
+{
+    // In NUMA-aware mode there is at least one worker per node
+    int workers = getSchedulerWorkers();
+    if(cl_isNumaPartitioned() && workers < cl_getNumContextDevices()) {
+        workers = cl_getNumContextDevices();
+    }
+
+    FrameScheduler* scheduler = new FrameScheduler(workers,
+        initialIpts, octaves, intervals, sample_step, threshold, 
+        kernel_list, applySurfOptions);
+
+    // ---------- Main capture loop -----------
+
+    // Limit the loop to 1000 iterations
+    int limit = 1000;
+    while(limit--)
+    {
+        // The capture reuses its frame, so the scheduler gets a copy
+        scheduler->submit(cvCloneImage(frame));
+
+        // Once every slot is busy, display the oldest frame
+        if(scheduler->getPending() == scheduler->getCapacity()) {
+            if(showScheduledFrame(scheduler, iptsPath)) break;
+        }
+
+        // Grab frame from the capture source
+        frame = cvQueryFrame(capture);
+        cvResize(origFrame,frame);
+
+        if(frame == NULL) {
+            printf("No Frames Available\n");
+            break;
+        }
+    }
+
+    // Display the frames still in flight
+    while(scheduler->getPending() > 0) {
+        showScheduledFrame(scheduler, iptsPath);
+    }
+
+    // Report the work done by each device
+    scheduler->printOccupancy();
+    getPinnedPool()->printOccupancy();
+
+    // The workers hand their events to the default context when the 
+    // scheduler stops them
+    delete scheduler;
+
+    // Write events to file if path was supplied
+    if(eventsPath != NULL) {
+        cl_writeEventsToFile(eventsPath);
+    }
+
+    // Clean up 
+    cvReleaseCapture(&capture);
+    cvDestroyAllWindows();
+    releasePinnedPool();
+    cl_cleanup();
+
+    return 0;
+}
+
+
+//! Collect the oldest frame of a scheduler and display it
+/*!
+    \return true if ESC was pressed
+*/
+bool showScheduledFrame(FrameScheduler* scheduler, char* iptsPath)
+{
+    IpVec* ipts;
+    IplImage* frame;
+
+    scheduler->collect(&ipts, &frame);
+
+    // Draw the detected points
+    drawIpoints(frame, *ipts);
+
+    // Draw the FPS figure
+    drawFPS(frame);
+
+    // Write interest points to file if path was supplied
+    if(iptsPath != NULL) {
+        writeIptsToFile(iptsPath, *ipts);
+    }
+
+    // Display the result
+    cvShowImage("OpenSURF", frame);
+
+    delete ipts;
+    cvReleaseImage(&frame);
+
+    // If ESC key pressed exit loop
+    return ((cvWaitKey(2) & 255) == 27);
+}
+
+
+//! Video loop on batches of frames
+/*!
+    getVideoBatchSize() frames are copied and run with Surf::runBatch, 
+    which detects and describes all of them with one set of kernel 
+    launches.  The frames are displayed once their batch completes.
+*/
+int mainVideoBatched(cl_kernel* kernel_list, CvCapture* capture, 
+    IplImage* origFrame, IplImage* frame, char* eventsPath, char* iptsPath,
+    int octaves, int intervals, int sample_step, float threshold, 
+    unsigned int initialIpts)
+{
+    int firstWidth = frame->width;
+    int firstHeight = frame->height;
+    int batchSize = getVideoBatchSize();
+
+    Surf* surf = new Surf(initialIpts, frame->height, frame->width, 
+        octaves, intervals, sample_step, threshold, kernel_list,
+        isUsingExtendedDescriptors(), getDescriptorFormat());
+    applySurfOptions(surf);
+    surf->setBatchCapacity(batchSize);
+
+    IplImage** batch = (IplImage**)alloc(batchSize * sizeof(IplImage*));
+    std::vector<IpVec*> results;
+
+    // ---------- Main capture loop -----------
+
+    // Limit the loop to 1000 frames
+    int limit = 1000;
+    bool done = false;
+    while(!done && limit > 0)
+    {
+        // The capture reuses its frame, so the batch holds copies
+        int count = 0;
+        while(count < batchSize && limit > 0) 
+        {
+            // Sanity check frame sizes
+            if(frame->width != firstWidth || frame->height != firstHeight) {
+                printf("Frames are inconsistent sizes, exiting loop\n");
+                done = true;
+                break;
+            }
+
+            batch[count++] = cvCloneImage(frame);
+            limit--;
+
+            // Grab frame from the capture source
+            frame = cvQueryFrame(capture);
+            if(frame == NULL) {
+                printf("No Frames Available\n");
+                done = true;
+                break;
+            }
+            cvResize(origFrame,frame);
+        }
+
+        if(count == 0) {
+            break;
+        }
+
+        surf->runBatch(batch, count);
+        surf->retrieveBatch(results);
+
+        for(int k = 0; k < count; k++) 
+        {
+            // Ipoints are only split per image if the batch ran as one
+            IpVec* ipts = results.at(results.size() == 1 ? 0 : k);
+
+            // Draw the detected points
+            drawIpoints(batch[k], *ipts);
+
+            // Draw the FPS figure
+            drawFPS(batch[k]);
+
+            // Write interest points to file if path was supplied
+            if(iptsPath != NULL) {
+                writeIptsToFile(iptsPath, *ipts);
+            }
+
+            // Display the result
+            cvShowImage("OpenSURF", batch[k]);
+            cvReleaseImage(&batch[k]);
+
+            // If ESC key pressed exit loop (after the rest of the batch)
+            if( (cvWaitKey(2) & 255) == 27 ) done = true;
+        }
+
+        for(unsigned int k = 0; k < results.size(); k++) {
+            delete results[k];
+        }
+        surf->reset();
+    }
+
+    // Write events to file if path was supplied
+    if(eventsPath != NULL) {
+        cl_writeEventsToFile(eventsPath);
+    }
+
+    // Report the pinned memory used by the transfers
+    getPinnedPool()->printOccupancy();
+
+    // Clean up 
+    free(batch);
+    delete surf;
+    cvReleaseCapture(&capture);
+    cvDestroyAllWindows();
+    releasePinnedPool();
+    cl_cleanup();
+
+    return 0;
+}
+
+
 //--------------------------------------------------------
 //  Procedure == 3: Video Stabilization
 //--------------------------------------------------------
@@ -545,17 +1034,23 @@ int mainStabilization(cl_kernel* kernel_list, char* inputImage, char* eventsPath
 
     // Create Surf Descriptor Object
     Surf* surf = new Surf(initialIpts, frame->height, frame->width, octaves, 
-        intervals, sample_step, threshold, kernel_list);
+        intervals, sample_step, threshold, kernel_list,
+        isUsingExtendedDescriptors(), getDescriptorFormat());
+    applySurfOptions(surf);
 
     IpVec* firstIpts;
     IpVec* prevIpts = new IpVec;
     IpVec* nextIpts = NULL;
 
+    // The descriptors are matched in their compact format
+    DescriptorSet firstDescs, prevDescs, nextDescs;
+    prevDescs.data = NULL;
+
     surf->run(frame, false);
 
     // Set the previous frame to the first frame for the first 
     // iteration of the loop
-    firstIpts = surf->retrieveDescriptors();
+    firstIpts = surf->retrieveDescriptors(&firstDescs);
     *prevIpts = *firstIpts;
     float** distTable = computeDistanceTable(firstIpts);
     
@@ -584,11 +1079,11 @@ int mainStabilization(cl_kernel* kernel_list, char* inputImage, char* eventsPath
         surf->run(frame, false);
         
         // Get the ipoints
-        nextIpts = surf->retrieveDescriptors();
+        nextIpts = surf->retrieveDescriptors(&nextDescs);
 
         // Find nearest neighbors
-        distancePoints = findNearestNeighbors(*nextIpts, *firstIpts,
-            kernel_list);
+        distancePoints = findNearestNeighbors(*nextIpts, nextDescs, 
+            *firstIpts, firstDescs, kernel_list);
 
         // Draw the images on the screen
         drawIpoints(frame, *nextIpts);
@@ -598,6 +1093,8 @@ int mainStabilization(cl_kernel* kernel_list, char* inputImage, char* eventsPath
 
         delete prevIpts;
         prevIpts = nextIpts;
+        freeDescriptorSet(&prevDescs);
+        prevDescs = nextDescs;
 
         delete distancePoints;
 
@@ -613,11 +1110,16 @@ int mainStabilization(cl_kernel* kernel_list, char* inputImage, char* eventsPath
             // Cleanup from the old reference image
             freeDistanceTable(distTable, firstIpts->size());
             delete firstIpts;
+            freeDescriptorSet(&firstDescs);
             cvReleaseImage(&firstFrame);
 
             // Grab the latest Ipts and set them as reference
             firstIpts = new IpVec;
             *firstIpts = *prevIpts;
+            firstDescs = prevDescs;
+            firstDescs.data = alloc(prevDescs.count*prevDescs.stride);
+            memcpy(firstDescs.data, prevDescs.data, 
+                prevDescs.count*prevDescs.stride);
 
             // Compute a new distance table
             distTable = computeDistanceTable(firstIpts);
@@ -644,6 +1146,8 @@ int mainStabilization(cl_kernel* kernel_list, char* inputImage, char* eventsPath
     if(nextIpts != NULL) {
         delete nextIpts;
     }
+    freeDescriptorSet(&prevDescs);
+    freeDescriptorSet(&firstDescs);
 
     freeDistanceTable(distTable, firstIpts->size());
 
@@ -652,6 +1156,7 @@ int mainStabilization(cl_kernel* kernel_list, char* inputImage, char* eventsPath
     cvReleaseImage(&firstFrame);
     cvReleaseCapture(&capture);
     cvDestroyAllWindows();
+    releasePinnedPool();
     cl_cleanup();
 
     return 0;
@@ -687,11 +1192,13 @@ int mainBenchmark(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
 
     // Create Surf Descriptor Object
     Surf* surf = new Surf(initialIpts, img->height, img->width, octaves, 
-        intervals, sample_step, threshold, kernel_list);
+        intervals, sample_step, threshold, kernel_list,
+        isUsingExtendedDescriptors(), getDescriptorFormat());
+    applySurfOptions(surf);
 
     // Since we're benchmarking, perform a warm-up run
     for(int i = 0; i < 5; i++) {
-    surf->run(img, false);
+    runSurf(surf, img);
 
     surf->reset();
     }
@@ -716,16 +1223,17 @@ int mainBenchmark(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     // This is the main SURF algorithm.  It detects and describes
     // interesting points in the image.  When the function completes
     // the descriptors are still on the device.
-    surf->run(img, false);
+    runSurf(surf, img);
 
     // Algorithm is complete
     cl_getTime(&surfEnd);
     // Start copying data back
     copyStart = surfEnd;
 
-    // Copy the SURF descriptors to the host
-    IpVec* ipts;
-    ipts = surf->retrieveDescriptors();
+    // Copy the SURF features to the host.  The FeatureSet points directly
+    // into the transfer buffers, so no host-side copy is timed.
+    FeatureSet features;
+    surf->retrieveFeatures(&features);
 
     // This time includes the transfers back to the host
     cl_getTime(&copyEnd);
@@ -736,10 +1244,18 @@ int mainBenchmark(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     cl_createUserEvent(copyStart, copyEnd, "TransferBack");
     cl_createUserEvent(totalStart, totalEnd, "Total");
 
-    // Write interest points to file if path was supplied
+    // The logging and verification use Ipoints
+    IpVec* ipts = featureSetToIpVec(features);
+
+    // Write interest points to file if path was supplied.  Compact 
+    // descriptors are also written in their binary form
     if(iptsPath != NULL) {
         writeIptsToFile(iptsPath, *ipts);
+        if(features.descriptors.format != DESC_FORMAT_FP32) {
+            writeCompactIptsToFile(iptsPath, *ipts, features.descriptors);
+        }
     }
+    surf->releaseFeatures(&features);
 
     // Write events to file if path was supplied
     if(eventsPath != NULL) {
@@ -750,11 +1266,11 @@ int mainBenchmark(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     if(verifyResults) {
 #ifdef _WIN32
         // Get Ipoints from the reference algorithm
-        Ipoint* refIptsPtr;
+        RefIpoint* refIptsPtr;
         int numRefIpts = surfRef(inputImage, octaves, intervals, 
                                  sample_step, threshold, (void**)&refIptsPtr);
 
-        IpVec* refIpts = new IpVec(refIptsPtr, refIptsPtr+numRefIpts);
+        IpVec* refIpts = convertRefIpoints(refIptsPtr, numRefIpts);
 
         IplImage *refImg = cvCloneImage(img);
         drawIpoints(refImg, *refIpts);
@@ -783,7 +1299,123 @@ int mainBenchmark(cl_kernel* kernel_list, char* inputImage, char* eventsPath,
     delete ipts;
     cvDestroyAllWindows();
     cvReleaseImage(&img);
+    releasePinnedPool();
     cl_cleanup();
 
     return retval;
 }
+
+
+//--------------------------------------------------------
+//  Procedure == 8: Tune the work-group sizes
+//--------------------------------------------------------
+int mainTune(char* inputImage)
+{
+    // Tune on the input image if one was supplied
+    IplImage* img;
+    if(inputImage != NULL) {
+        printf("Tuning on %s\n", inputImage);
+        img = cvLoadImage(inputImage);
+    }
+    else {
+        img = createTuningImage(640, 480);
+    }
+
+    tuneDevice(img);
+
+    char* path = getTuningProfilePath();
+    if(path == NULL) {
+        path = (char*)TUNING_PROFILE_NAME;
+    }
+    writeTuningProfile(path, getTuningProfile());
+
+    cvReleaseImage(&img);
+    releasePinnedPool();
+    cl_cleanup();
+
+    return 0;
+}
+
+
+//--------------------------------------------------------
+//  Procedure == 7: Train PCA projection
+//--------------------------------------------------------
+int mainTrainPca(char* iptsLog, char* outputPath)
+{
+    printf("Training PCA projection from: %s\n", iptsLog);
+
+    // Load the (full length) descriptors written by procedure 1 or 6
+    IpVec ipts;
+    loadSurf(iptsLog, ipts);
+
+    PcaProjection* pca = trainPcaProjection(ipts, getPcaTrainingComponents());
+
+    writePcaProjection(outputPath, pca);
+
+    freePcaProjection(pca);
+
+    return 0;
+}
+
+
+//! Apply the options supplied on the command line to surf.  The PCA
+//! projection supplied with -p replaces the full descriptors, so only the
+//! projected components are copied back and matched.
+void applySurfOptions(Surf* surf) 
+{
+    surf->setHaarMapRatio(getHaarMapRatio());
+    surf->setKeypointSorting(isSortingKeypoints());
+    surf->setSpecialisedKernels(isSpecialisingKernels());
+
+    // The projection loaded in main is copied to the device (setProjection
+    // only reads it, so worker threads can share it)
+    if(surfProjection != NULL) {
+        surf->setProjection(surfProjection, true);
+    }
+}
+
+
+//! Convert the ipoints returned by the reference implementation
+/*!
+    The reference implementation is built separately and keeps the 
+    original Ipoint layout (64 descriptor components), so its ipoints are
+    copied field by field.
+*/
+IpVec* convertRefIpoints(RefIpoint* refIpts, int numRefIpts) 
+{
+    IpVec* ipts = new IpVec();
+
+    for(int i = 0; i < numRefIpts; i++) {
+        Ipoint ipt;
+        ipt.x = refIpts[i].x;
+        ipt.y = refIpts[i].y;
+        ipt.scale = refIpts[i].scale;
+        ipt.orientation = refIpts[i].orientation;
+        ipt.laplacian = refIpts[i].laplacian;
+        ipt.clusterIndex = refIpts[i].clusterIndex;
+        ipt.descriptorLength = DESC_SIZE;
+        memcpy(ipt.descriptor, refIpts[i].descriptor, 
+            DESC_SIZE * sizeof(float));
+        ipts->push_back(ipt);
+    }
+
+    return ipts;
+}
+
+
+//! Run SURF on img.  If a grid stride was supplied with -g, descriptors
+//! are computed on a dense grid at scales 2 and 4 instead of at 
+//! detected ipoints.
+void runSurf(Surf* surf, IplImage* img) 
+{
+    if(getDenseGridStride() == 0) {
+        surf->run(img, false);
+        return;
+    }
+
+    std::vector<int> scales;
+    scales.push_back(2);
+    scales.push_back(4);
+
+    surf->runDense(img, getDenseGridStride(), scales);
+}
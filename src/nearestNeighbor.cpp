@@ -50,10 +50,81 @@
  \****************************************************************************/
 
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
 
 #include "nearestNeighbor.h"
+#include "tuning.h"
 #include "utils.h"
 
+// Fraction of differing bits below which binary descriptors match
+#define HAMMING_MATCH_THRESHOLD 0.2f
+
+// Euclidean distance between PCA-projected descriptors below which they 
+// match.  Like the other thresholds, 0.3 is arbitrary (based on observed
+// values) and may need to be fine tuned for a given projection.
+#define PCA_MATCH_THRESHOLD 0.3f
+
+//! Count the bits set in a 64-bit word
+static inline int popcount64(cl_ulong x) 
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+//! Sort the distance points by distance and mark duplicates and matches
+static void markMatches(std::vector<distPoint>* distancePoints, 
+    size_t numIpts2, float threshold) 
+{
+    // Sort the distancePoints so that the smallest distance is at the front
+    std::sort(distancePoints->begin(),distancePoints->end(),distPointsCmp());
+
+    // Make a histogram of the occurance of each point (to mark duplicates)
+    std::vector<int> dupCount(numIpts2, 0);
+    for(unsigned int i = 0; i < distancePoints->size(); i++){
+
+        if(dupCount[distancePoints->at(i).point2] > 0) {
+            // This point has already been used (and has a better match),
+            // mark as duplicate
+            distancePoints->at(i).dup = true;
+        }
+        else {
+            distancePoints->at(i).dup = false;
+        }
+	    dupCount[distancePoints->at(i).point2]++;
+
+        if(distancePoints->at(i).dist < threshold) {
+            distancePoints->at(i).match = 1;
+        }
+        else {
+            distancePoints->at(i).match = 0;
+        }
+    }
+}
+
+//! Fill in a distance point for the match of ipt1 (index i1) with ipt2
+static void setDistPoint(distPoint& dp, Ipoint& ipt1, int i1, Ipoint& ipt2,
+    int i2, float dist) 
+{
+    dp.point1 = i1;
+    dp.x1 = ipt1.x;
+    dp.y1 = ipt1.y;
+    dp.point2 = i2;
+    dp.x2 = ipt2.x;
+    dp.y2 = ipt2.y;
+    dp.dist = dist;
+    dp.orientationDiff = ipt1.orientation - ipt2.orientation;
+    dp.scaleDiff = ipt1.scale - ipt2.scale;
+}
+
 std::vector<distPoint>* findNearestNeighbors(
 	IpVec &ipts1, IpVec &ipts2,
 	cl_kernel* kernel_list) 
@@ -63,92 +134,269 @@ std::vector<distPoint>* findNearestNeighbors(
 	    return dps;
     }
 
-    cl_kernel NN_kernel = kernel_list[KERNEL_NN];
+    // Pack the descriptors of each set into a (fp32) descriptor set
+    DescriptorSet desc1, desc2;
+    packDescriptors(ipts1, &desc1);
+    packDescriptors(ipts2, &desc2);
+
+    std::vector<distPoint>* distancePoints = findNearestNeighbors(ipts1,
+        desc1, ipts2, desc2, kernel_list);
+
+    freeDescriptorSet(&desc1);
+    freeDescriptorSet(&desc2);
+
+    return distancePoints;
+}
+
+std::vector<distPoint>* findNearestNeighbors(
+	IpVec &ipts1, DescriptorSet &desc1, 
+    IpVec &ipts2, DescriptorSet &desc2,
+	cl_kernel* /*kernel_list*/) 
+{
+    if(!ipts1.size() || !ipts2.size()) {
+	    std::vector<distPoint>* dps = new std::vector<distPoint>(0);
+	    return dps;
+    }
+
+    // Both sets must have been described with the same descriptor size
+    // and stored in the same format
+    int descSize = desc1.length;
+    if(desc2.length != descSize || desc2.format != desc1.format) {
+        printf("Error: Cannot match descriptors of different sizes or formats\n");
+        exit(-1);
+    }
+    int format = desc1.format;
+
+    // Binary descriptors are matched on the host using popcount
+    if(format == DESC_FORMAT_BINARY || format == DESC_FORMAT_BINARY_MAG) {
+        return findNearestNeighborsHamming(ipts1, desc1, ipts2, desc2);
+    }
+
+    // PCA-projected descriptors are matched on the host with early abandon
+    if(format == DESC_FORMAT_PCA) {
+        return findNearestNeighborsPca(ipts1, desc1, ipts2, desc2);
+    }
 
-    // Set up memory on device and send ipts data to device
-    // copy ipts<1,2> to device
-    // also need to alloate memory for the distancePoints
-    cl_mem d_ipts1, d_ipts2;
-    cl_mem d_distancePoints, d_tempDistPoints;
+    cl_kernel NN_kernel = cl_getKernel(KERNEL_NN);
+
+    // Set up memory on device and send the compact descriptors to device
+    // also need to alloate memory for the match indices and distances
+    cl_mem d_desc1, d_desc2;
+    cl_mem d_matchIdx, d_matchDist;
 
     size_t numIpts1 = ipts1.size();
     size_t numIpts2 = ipts2.size();
 
-    // Allocate some GPU memory for Ipoints and distance points 
-    d_ipts1 = cl_allocBuffer(numIpts1*sizeof(Ipoint), CL_MEM_READ_ONLY);
-    d_ipts2 = cl_allocBuffer(numIpts2*sizeof(Ipoint), CL_MEM_READ_ONLY);
-    d_distancePoints = cl_allocBuffer(numIpts1*sizeof(distPoint), CL_MEM_READ_ONLY);
-    d_tempDistPoints = cl_allocBuffer(64*sizeof(float)*numIpts1);
+    // Allocate some GPU memory for descriptors and the matches
+    d_desc1 = cl_allocBuffer(numIpts1*desc1.stride, CL_MEM_READ_ONLY);
+    d_desc2 = cl_allocBuffer(numIpts2*desc2.stride, CL_MEM_READ_ONLY);
+    d_matchIdx = cl_allocBuffer(numIpts1*sizeof(int), CL_MEM_WRITE_ONLY);
+    d_matchDist = cl_allocBuffer(numIpts1*sizeof(float), CL_MEM_WRITE_ONLY);
 
-    // Copy input Ipoints to device
-    cl_copyBufferToDevice(d_ipts1, &ipts1[0], numIpts1*sizeof(Ipoint));
-    cl_copyBufferToDevice(d_ipts2, &ipts2[0], numIpts2*sizeof(Ipoint));
+    // Copy input descriptors to device
+    cl_copyBufferToDevice(d_desc1, desc1.data, numIpts1*desc1.stride);
+    cl_copyBufferToDevice(d_desc2, desc2.data, numIpts2*desc2.stride);
 
     // Set kernel arguments
     unsigned int ipts2Size = (unsigned int)ipts2.size();
 
-    cl_setKernelArg(NN_kernel, 0, sizeof(cl_mem), (void *)&d_ipts1);
-    cl_setKernelArg(NN_kernel, 1, sizeof(cl_mem), (void *)&d_ipts2);
-    cl_setKernelArg(NN_kernel, 2, sizeof(cl_mem), (void *)&d_distancePoints);
-    cl_setKernelArg(NN_kernel, 3, 64*sizeof(float), NULL);
-    cl_setKernelArg(NN_kernel, 4, sizeof(unsigned int), (void *)&ipts2Size);
+    cl_setKernelArg(NN_kernel, 0, sizeof(cl_mem), (void *)&d_desc1);
+    cl_setKernelArg(NN_kernel, 1, sizeof(cl_mem), (void *)&d_desc2);
+    cl_setKernelArg(NN_kernel, 2, sizeof(cl_mem), (void *)&d_matchIdx);
+    cl_setKernelArg(NN_kernel, 3, sizeof(cl_mem), (void *)&d_matchDist);
+    // One work group per descriptor of the first set (the size is a power
+    // of 2 for the reduction)
+    int localSize = getTuningProfile()->nnLocal;
+
+    cl_setKernelArg(NN_kernel, 4, localSize*sizeof(float), NULL);
+    cl_setKernelArg(NN_kernel, 5, sizeof(unsigned int), (void *)&ipts2Size);
+    cl_setKernelArg(NN_kernel, 6, sizeof(int), (void *)&descSize);
+    cl_setKernelArg(NN_kernel, 7, sizeof(int), (void *)&format);
 
     // Enqueue the kernel
     size_t localWorkSize[1];
     size_t globalWorkSize[1];
-    globalWorkSize[0] = ipts1.size()*64;
-    localWorkSize[0] = 64;
+    globalWorkSize[0] = ipts1.size()*localSize;
+    localWorkSize[0] = localSize;
 
     // Run the nearest neighbor kernel
     cl_executeKernel(NN_kernel, 1, globalWorkSize, localWorkSize,
         "NearestNeighbor");
 
     // Transfer data back from the device to a temporary location
-    distPoint* tmpDistPts = (distPoint*)alloc(numIpts1*sizeof(distPoint));
-    cl_copyBufferToHost(tmpDistPts, d_distancePoints, 
-	    numIpts1*sizeof(distPoint));
+    int* matchIdx = (int*)alloc(numIpts1*sizeof(int));
+    float* matchDist = (float*)alloc(numIpts1*sizeof(float));
+    cl_copyBufferToHost(matchIdx, d_matchIdx, numIpts1*sizeof(int), CL_FALSE);
+    cl_copyBufferToHost(matchDist, d_matchDist, numIpts1*sizeof(float));
 
-    // Copy the distance points into a vector
+    // Build the distance points from the matches
     std::vector<distPoint>* distancePoints = 
-        new std::vector<distPoint>(tmpDistPts, tmpDistPts + numIpts1);
+        new std::vector<distPoint>(numIpts1);
+
+    for(unsigned int i = 0; i < numIpts1; i++) {
+        setDistPoint(distancePoints->at(i), ipts1[i], i, 
+            ipts2[matchIdx[i]], matchIdx[i], matchDist[i]);
+    }
 
-    // Release the temp buffer
-    free(tmpDistPts);
+    // Release the temp buffers
+    free(matchIdx);
+    free(matchDist);
 
     // Release device buffers
-    cl_freeMem(d_ipts1);
-    cl_freeMem(d_ipts2);
-    cl_freeMem(d_distancePoints);
-    cl_freeMem(d_tempDistPoints);
+    cl_freeMem(d_desc1);
+    cl_freeMem(d_desc2);
+    cl_freeMem(d_matchIdx);
+    cl_freeMem(d_matchDist);
 
-    // Sort the distancePoints so that the smallest distance is at the front
-    std::sort(distancePoints->begin(),distancePoints->end(),distPointsCmp());
+    // Prior to this, matches were not determined by the
+    // minimum distance, this metric changes that. 
+    // Note that 0.035 is arbitrary (based on observed values)
+    // and may need to be fine tuned.
+    markMatches(distancePoints, numIpts2, 0.035f);
 
-    // Make a histogram of the occurance of each point (to mark duplicates)
-    std::vector<int> dupCount(ipts2.size(), 0);
-    for(unsigned int i = 0; i < distancePoints->size(); i++){
+    return distancePoints;
+}
 
-        if(dupCount[distancePoints->at(i).point2] > 0) {
-            // This point has already been used (and has a better match),
-            // mark as duplicate
-            distancePoints->at(i).dup = true;
-        }
-        else {
-            distancePoints->at(i).dup = false;
-        }
-	    dupCount[distancePoints->at(i).point2]++;
+//! Match binary descriptors by their Hamming distance
+/*!
+    Runs on the host: the descriptors are compared 64 bits at a time
+    using popcount, which is much cheaper than the float metrics.  The
+    distance is the fraction of differing bits.
+*/
+std::vector<distPoint>* findNearestNeighborsHamming(
+	IpVec &ipts1, DescriptorSet &desc1, 
+    IpVec &ipts2, DescriptorSet &desc2)
+{
+    if(!ipts1.size() || !ipts2.size()) {
+	    std::vector<distPoint>* dps = new std::vector<distPoint>(0);
+	    return dps;
+    }
 
-        // Prior to this, matches were not determined by the
-        // minimum distance, this metric changes that. 
-        // Note that 0.035 is arbitrary (based on observed values)
-        // and may need to be fine tuned.
-        if(distancePoints->at(i).dist < 0.035) {
-            distancePoints->at(i).match = 1;
+    if(desc1.format != desc2.format || desc1.stride != desc2.stride ||
+       (desc1.format != DESC_FORMAT_BINARY && 
+        desc1.format != DESC_FORMAT_BINARY_MAG)) {
+        printf("Error: Hamming matching requires binary descriptors of the same size\n");
+        exit(-1);
+    }
+
+    size_t numIpts1 = ipts1.size();
+    size_t numIpts2 = ipts2.size();
+
+    // The binary descriptors are 64 to 256 bits (1 to 4 words) long
+    int numWords = (int)(desc1.stride / sizeof(cl_ulong));
+    float invBits = 1.0f / (desc1.stride * 8);
+
+    std::vector<distPoint>* distancePoints = 
+        new std::vector<distPoint>(numIpts1);
+
+    for(unsigned int i1 = 0; i1 < numIpts1; i1++) {
+        const cl_ulong* d1 = (const cl_ulong*)((char*)desc1.data + 
+            i1*desc1.stride);
+
+        int bestDist = INT_MAX;
+        int bestMatch = 0;
+
+        for(unsigned int i2 = 0; i2 < numIpts2; i2++) {
+            const cl_ulong* d2 = (const cl_ulong*)((char*)desc2.data + 
+                i2*desc2.stride);
+
+            int dist = 0;
+            for(int w = 0; w < numWords; w++) {
+                dist += popcount64(d1[w] ^ d2[w]);
+            }
+            if(dist < bestDist) {
+                bestDist = dist;
+                bestMatch = i2;
+            }
         }
-        else {
-            distancePoints->at(i).match = 0;
+
+        setDistPoint(distancePoints->at(i1), ipts1[i1], i1, 
+            ipts2[bestMatch], bestMatch, bestDist*invBits);
+    }
+
+    markMatches(distancePoints, numIpts2, HAMMING_MATCH_THRESHOLD);
+
+    return distancePoints;
+}
+
+//! Match PCA-projected descriptors by their Euclidean distance
+/*!
+    Runs on the host.  The components are ordered by decreasing variance,
+    so most of the distance is accumulated in the first few components 
+    and a candidate can be abandoned as soon as its partial distance 
+    exceeds the best one found so far.
+*/
+std::vector<distPoint>* findNearestNeighborsPca(
+	IpVec &ipts1, DescriptorSet &desc1, 
+    IpVec &ipts2, DescriptorSet &desc2)
+{
+    if(!ipts1.size() || !ipts2.size()) {
+	    std::vector<distPoint>* dps = new std::vector<distPoint>(0);
+	    return dps;
+    }
+
+    if(desc1.format != DESC_FORMAT_PCA || desc2.format != DESC_FORMAT_PCA ||
+       desc1.length != desc2.length) {
+        printf("Error: PCA matching requires projected descriptors of the same length\n");
+        exit(-1);
+    }
+
+    size_t numIpts1 = ipts1.size();
+    size_t numIpts2 = ipts2.size();
+    int components = desc1.length;
+
+    std::vector<distPoint>* distancePoints = 
+        new std::vector<distPoint>(numIpts1);
+
+    for(unsigned int i1 = 0; i1 < numIpts1; i1++) {
+        const float* d1 = (const float*)((char*)desc1.data + 
+            i1*desc1.stride);
+
+        float bestDist = FLT_MAX;
+        int bestMatch = 0;
+
+        for(unsigned int i2 = 0; i2 < numIpts2; i2++) {
+            const float* d2 = (const float*)((char*)desc2.data + 
+                i2*desc2.stride);
+
+            // Squared distance, abandoned once it can't be the best
+            float dist = 0.0f;
+            for(int c = 0; c < components && dist < bestDist; c++) {
+                float diff = d1[c] - d2[c];
+                dist += diff*diff;
+            }
+            if(dist < bestDist) {
+                bestDist = dist;
+                bestMatch = i2;
+            }
         }
+
+        setDistPoint(distancePoints->at(i1), ipts1[i1], i1, 
+            ipts2[bestMatch], bestMatch, sqrtf(bestDist));
     }
 
+    markMatches(distancePoints, numIpts2, PCA_MATCH_THRESHOLD);
+
     return distancePoints;
-}
\ No newline at end of file
+}
+
+//! Pack the (floating point) descriptors of the ipts into a descriptor set
+void packDescriptors(IpVec &ipts, DescriptorSet* descs) 
+{
+    int length = ipts.size() > 0 ? ipts[0].descriptorLength : DESC_SIZE;
+
+    descs->format = DESC_FORMAT_FP32;
+    descs->length = length;
+    descs->count = (int)ipts.size();
+    descs->stride = length*sizeof(float);
+    descs->data = alloc(ipts.size()*descs->stride);
+
+    for(unsigned int i = 0; i < ipts.size(); i++) {
+        if(ipts[i].descriptorLength != length) {
+            printf("Error: Ipoints have different descriptor lengths\n");
+            exit(-1);
+        }
+        memcpy((char*)descs->data + i*descs->stride, ipts[i].descriptor,
+            descs->stride);
+    }
+}
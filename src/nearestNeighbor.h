@@ -64,6 +64,27 @@
 std::vector<distPoint>* findNearestNeighbors(
     IpVec &ipts1,IpVec &ipts2,		 
     cl_kernel * kernel_list = NULL);
+
+//! Match descriptors in their compact format (fp32, fp16 or int8).  The
+//! ipts supply the positions, orientations and scales of the descriptors
+std::vector<distPoint>* findNearestNeighbors(
+    IpVec &ipts1, DescriptorSet &desc1,
+    IpVec &ipts2, DescriptorSet &desc2,
+    cl_kernel * kernel_list = NULL);
+
+//! Match binary descriptors on the host by their Hamming distance
+std::vector<distPoint>* findNearestNeighborsHamming(
+    IpVec &ipts1, DescriptorSet &desc1,
+    IpVec &ipts2, DescriptorSet &desc2);
+
+//! Match PCA-projected descriptors on the host by their Euclidean 
+//! distance, abandoning candidates early
+std::vector<distPoint>* findNearestNeighborsPca(
+    IpVec &ipts1, DescriptorSet &desc1,
+    IpVec &ipts2, DescriptorSet &desc2);
+
+//! Pack the descriptors of the ipts into an fp32 descriptor set
+void packDescriptors(IpVec &ipts, DescriptorSet* descs);
     
 struct distPointsCmp{
     bool operator()(const distPoint &a,const distPoint &b) const {
@@ -0,0 +1,223 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+
+#include "cv.h"
+#include "pca.h"
+#include "utils.h"
+
+//! Release a projection
+void freePcaProjection(PcaProjection* pca) 
+{
+    free(pca->mean);
+    free(pca->basis);
+    free(pca);
+}
+
+
+//! Load a projection written by writePcaProjection
+/*!
+    The file holds the input length and the number of components,
+    followed by the mean and then one principal component per line
+    \param filename The projection file
+*/
+PcaProjection* loadPcaProjection(char* filename) 
+{
+    std::ifstream infile(filename);
+
+    PcaProjection* pca = (PcaProjection*)alloc(sizeof(PcaProjection));
+
+    infile >> pca->inputLength;
+    infile >> pca->components;
+
+    if(!infile || 
+       (pca->inputLength != DESC_SIZE && 
+        pca->inputLength != DESC_SIZE_EXTENDED) ||
+       pca->components <= 0 || pca->components > MAX_PCA_COMPONENTS ||
+       pca->components > pca->inputLength) {
+        printf("Error: %s is not a valid PCA projection\n", filename);
+        exit(-1);
+    }
+
+    pca->mean = (float*)alloc(pca->inputLength*sizeof(float));
+    pca->basis = (float*)alloc(pca->components*pca->inputLength*
+        sizeof(float));
+
+    for(int i = 0; i < pca->inputLength; i++) {
+        infile >> pca->mean[i];
+    }
+    for(int i = 0; i < pca->components*pca->inputLength; i++) {
+        infile >> pca->basis[i];
+    }
+
+    if(!infile) {
+        printf("Error: %s is truncated\n", filename);
+        exit(-1);
+    }
+
+    return pca;
+}
+
+
+//! Train a projection from a set of Ipoints
+/*!
+    Computes the principal components of the Ipoint descriptors using
+    OpenCV and keeps the leading ones
+    \param ipts The training descriptors (all of the same length)
+    \param components The number of components to keep
+*/
+PcaProjection* trainPcaProjection(IpVec& ipts, int components) 
+{
+    if(ipts.size() < 2) {
+        printf("Error: At least 2 Ipoints are required to train PCA\n");
+        exit(-1);
+    }
+
+    int length = ipts[0].descriptorLength;
+    int count = (int)ipts.size();
+
+    if(components <= 0 || components > MAX_PCA_COMPONENTS || 
+       components > length) {
+        printf("Error: Number of PCA components must be between 1 and %d\n",
+            length < MAX_PCA_COMPONENTS ? length : MAX_PCA_COMPONENTS);
+        exit(-1);
+    }
+
+    // One descriptor per row
+    CvMat* data = cvCreateMat(count, length, CV_32FC1);
+    for(int i = 0; i < count; i++) {
+        if(ipts[i].descriptorLength != length) {
+            printf("Error: Ipoints have different descriptor lengths\n");
+            exit(-1);
+        }
+        for(int j = 0; j < length; j++) {
+            cvmSet(data, i, j, ipts[i].descriptor[j]);
+        }
+    }
+
+    CvMat* mean = cvCreateMat(1, length, CV_32FC1);
+    CvMat* eigenvalues = cvCreateMat(1, components, CV_32FC1);
+    CvMat* eigenvectors = cvCreateMat(components, length, CV_32FC1);
+
+    cvCalcPCA(data, mean, eigenvalues, eigenvectors, CV_PCA_DATA_AS_ROW);
+
+    PcaProjection* pca = (PcaProjection*)alloc(sizeof(PcaProjection));
+    pca->inputLength = length;
+    pca->components = components;
+    pca->mean = (float*)alloc(length*sizeof(float));
+    pca->basis = (float*)alloc(components*length*sizeof(float));
+
+    for(int j = 0; j < length; j++) {
+        pca->mean[j] = (float)cvmGet(mean, 0, j);
+    }
+    for(int i = 0; i < components; i++) {
+        for(int j = 0; j < length; j++) {
+            pca->basis[i*length+j] = (float)cvmGet(eigenvectors, i, j);
+        }
+    }
+
+    // Report the fraction of the variance that is retained.  Only the 
+    // leading eigenvalues are computed, so the total variance is the 
+    // trace of the covariance matrix (scaled by 1/count like them).
+    double retained = 0;
+    for(int i = 0; i < components; i++) {
+        retained += cvmGet(eigenvalues, 0, i);
+    }
+    double total = 0;
+    for(int j = 0; j < length; j++) {
+        double m = cvmGet(mean, 0, j);
+        for(int i = 0; i < count; i++) {
+            double d = cvmGet(data, i, j) - m;
+            total += d*d;
+        }
+    }
+    total /= count;
+    printf("Trained %d-component PCA from %d Ipoints (retained variance %f)\n",
+        components, count, total > 0 ? retained/total : 1.0);
+
+    cvReleaseMat(&data);
+    cvReleaseMat(&mean);
+    cvReleaseMat(&eigenvalues);
+    cvReleaseMat(&eigenvectors);
+
+    return pca;
+}
+
+
+//! Save the projection to SurfPca.txt in the given directory
+void writePcaProjection(char* path, PcaProjection* pca) 
+{
+    char* fullpath = smartStrcat(path, "/SurfPca.txt");
+    std::ofstream outfile(fullpath);
+
+    outfile << pca->inputLength << " " << pca->components << "\n";
+
+    for(int j = 0; j < pca->inputLength; j++) {
+        outfile << pca->mean[j] << " ";
+    }
+    outfile << "\n";
+
+    for(int i = 0; i < pca->components; i++) {
+        for(int j = 0; j < pca->inputLength; j++) {
+            outfile << pca->basis[i*pca->inputLength+j] << " ";
+        }
+        outfile << "\n";
+    }
+
+    outfile.close();
+
+    printf("PCA projection written to %s\n", fullpath);
+
+    free(fullpath);
+}
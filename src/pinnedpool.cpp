@@ -0,0 +1,348 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "clutils.h"
+#include "pinnedpool.h"
+#include "utils.h"
+
+//! The pools threads select from (pool 0 is shared by all Surf objects
+//! unless a thread selects another)
+static PinnedPool* sharedPools[PINNED_POOL_MAX_POOLS];
+
+//! The pool selected by the calling thread
+static CL_THREAD_LOCAL int threadPool = 0;
+
+//! Guards the pools against Surf objects running on several threads 
+//! (see cl_setSurfContext)
+#ifdef _WIN32
+static SRWLOCK poolLock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+//! Lock the pools
+static void lockPools() 
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&poolLock);
+#else
+    pthread_mutex_lock(&poolLock);
+#endif
+}
+
+
+//! Unlock the pools
+static void unlockPools() 
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&poolLock);
+#else
+    pthread_mutex_unlock(&poolLock);
+#endif
+}
+
+
+//! Constructor
+PinnedPool::PinnedPool() 
+{
+    for(int i = 0; i < PINNED_POOL_NUM_CLASSES; i++) 
+    {
+        this->inUse[i] = 0;
+    }
+
+    this->bytesAllocated = 0;
+    this->bytesInUse = 0;
+}
+
+
+//! Destructor
+/*!
+    All buffers must have been returned to the pool
+*/
+PinnedPool::~PinnedPool() 
+{
+    if(this->bytesInUse > 0) 
+    {
+        printf("Warning: %d pinned buffers still in use\n", 
+            this->getBuffersInUse());
+    }
+
+    this->trim();
+}
+
+
+//! Return the size class that holds the given number of bytes
+int PinnedPool::getSizeClass(size_t bytes) 
+{
+    int sizeClass = 0;
+    while(((size_t)1 << (sizeClass + PINNED_POOL_MIN_CLASS_BITS)) < bytes) 
+    {
+        sizeClass++;
+    }
+
+    if(sizeClass >= PINNED_POOL_NUM_CLASSES) 
+    {
+        printf("Error: Pinned buffer of %lu bytes is too large\n", 
+            (unsigned long)bytes);
+        exit(-1);
+    }
+
+    return sizeClass;
+}
+
+
+//! Round a size up to its size class
+size_t PinnedPool::roundToClass(size_t bytes) 
+{
+    return (size_t)1 << (getSizeClass(bytes) + PINNED_POOL_MIN_CLASS_BITS);
+}
+
+
+//! Get a buffer holding at least the given number of bytes
+/*!
+    A free buffer of the right size class is reused if there is one,
+    otherwise a new one is allocated.
+    \param bytes Number of bytes needed
+    \return The buffer, to be given back with release
+*/
+PinnedBuffer PinnedPool::acquire(size_t bytes) 
+{
+    PinnedBuffer buffer;
+
+    buffer.sizeClass = getSizeClass(bytes);
+    buffer.bytes = (size_t)1 << 
+        (buffer.sizeClass + PINNED_POOL_MIN_CLASS_BITS);
+
+    lockPools();
+
+    std::vector<cl_mem>& avail = this->freeBuffers[buffer.sizeClass];
+    if(!avail.empty()) 
+    {
+        buffer.mem = avail.back();
+        avail.pop_back();
+    }
+    else 
+    {
+        buffer.mem = NULL;
+        this->bytesAllocated += buffer.bytes;
+    }
+
+    this->inUse[buffer.sizeClass]++;
+    this->bytesInUse += buffer.bytes;
+
+    unlockPools();
+
+    if(buffer.mem == NULL) 
+    {
+        buffer.mem = cl_allocBufferPinned(buffer.bytes);
+
+        // Place the pages on the NUMA node of the calling thread, which 
+        // is the thread that uses them
+        if(isNumaAware()) 
+        {
+            void* data = cl_mapBuffer(buffer.mem, buffer.bytes, CL_MAP_WRITE);
+            memset(data, 0, buffer.bytes);
+            cl_unmapBuffer(buffer.mem, data);
+        }
+    }
+
+    return buffer;
+}
+
+
+//! Return a buffer to the pool
+/*!
+    \param buffer The buffer.  It is cleared so it can't be used again.
+*/
+void PinnedPool::release(PinnedBuffer* buffer) 
+{
+    if(buffer->mem == NULL) 
+    {
+        return;
+    }
+
+    lockPools();
+    this->freeBuffers[buffer->sizeClass].push_back(buffer->mem);
+    this->inUse[buffer->sizeClass]--;
+    this->bytesInUse -= buffer->bytes;
+    unlockPools();
+
+    buffer->mem = NULL;
+    buffer->bytes = 0;
+    buffer->sizeClass = 0;
+}
+
+
+//! Free the buffers that are not in use
+void PinnedPool::trim() 
+{
+    lockPools();
+    for(int i = 0; i < PINNED_POOL_NUM_CLASSES; i++) 
+    {
+        size_t classBytes = (size_t)1 << (i + PINNED_POOL_MIN_CLASS_BITS);
+        for(size_t j = 0; j < this->freeBuffers[i].size(); j++) 
+        {
+            cl_freeMem(this->freeBuffers[i][j]);
+            this->bytesAllocated -= classBytes;
+        }
+        this->freeBuffers[i].clear();
+    }
+    unlockPools();
+}
+
+
+//! Total bytes of pinned memory held by the pool
+size_t PinnedPool::getBytesAllocated() 
+{
+    return this->bytesAllocated;
+}
+
+
+//! Bytes of pinned memory currently handed out
+size_t PinnedPool::getBytesInUse() 
+{
+    return this->bytesInUse;
+}
+
+
+//! Number of buffers currently handed out
+int PinnedPool::getBuffersInUse() 
+{
+    int count = 0;
+    for(int i = 0; i < PINNED_POOL_NUM_CLASSES; i++) 
+    {
+        count += this->inUse[i];
+    }
+    return count;
+}
+
+
+//! Number of buffers waiting to be reused
+int PinnedPool::getBuffersFree() 
+{
+    int count = 0;
+    for(int i = 0; i < PINNED_POOL_NUM_CLASSES; i++) 
+    {
+        count += (int)this->freeBuffers[i].size();
+    }
+    return count;
+}
+
+
+//! Print the occupancy of each size class
+void PinnedPool::printOccupancy() 
+{
+    printf("Pinned pool: %lu KB allocated, %lu KB in use\n", 
+        (unsigned long)(this->bytesAllocated >> 10), 
+        (unsigned long)(this->bytesInUse >> 10));
+
+    for(int i = 0; i < PINNED_POOL_NUM_CLASSES; i++) 
+    {
+        if(this->inUse[i] == 0 && this->freeBuffers[i].empty()) 
+        {
+            continue;
+        }
+        printf("\t%8lu KB: %d in use, %d free\n", 
+            (unsigned long)(((size_t)1 << (i + PINNED_POOL_MIN_CLASS_BITS)) >> 10),
+            this->inUse[i], (int)this->freeBuffers[i].size());
+    }
+}
+
+
+//! Return the pool selected by the calling thread
+PinnedPool* getPinnedPool() 
+{
+    lockPools();
+    if(sharedPools[threadPool] == NULL) 
+    {
+        sharedPools[threadPool] = new PinnedPool();
+    }
+    PinnedPool* pool = sharedPools[threadPool];
+    unlockPools();
+    return pool;
+}
+
+
+//! Select the pool the calling thread takes buffers from
+/*!
+    Threads working on different devices or NUMA nodes select their own
+    pool, so a buffer is always reused by the thread that first touched
+    it.  The Surf objects of a thread must be deleted on that thread.
+    \param index The pool (0 to PINNED_POOL_MAX_POOLS - 1)
+*/
+void selectPinnedPool(int index) 
+{
+    if(index < 0 || index >= PINNED_POOL_MAX_POOLS) 
+    {
+        printf("Error: Invalid pinned pool %d\n", index);
+        exit(-1);
+    }
+    threadPool = index;
+}
+
+
+//! Free the pools
+void releasePinnedPool() 
+{
+    for(int i = 0; i < PINNED_POOL_MAX_POOLS; i++) 
+    {
+        delete sharedPools[i];
+        sharedPools[i] = NULL;
+    }
+}
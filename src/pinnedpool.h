@@ -0,0 +1,141 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#ifndef _PINNEDPOOL_H_
+#define _PINNEDPOOL_H_
+
+#include <vector>
+#include <CL/cl.h>
+
+// Size classes are powers of two from 4 KB to 2 GB
+#define PINNED_POOL_MIN_CLASS_BITS 12
+#define PINNED_POOL_NUM_CLASSES 20
+
+// Most pools threads can select from (see selectPinnedPool)
+#define PINNED_POOL_MAX_POOLS 16
+
+//! A pinned host buffer handed out by a PinnedPool
+typedef struct PinnedBuffer{
+        cl_mem mem;         // The buffer (NULL if none is held)
+        size_t bytes;       // Capacity of the buffer (its size class)
+        int sizeClass;      // Index of the size class
+} PinnedBuffer;
+
+//! Pool of pinned host staging buffers
+/*!
+    Buffers are grouped in power-of-two size classes.  A released buffer 
+    is kept for reuse by the next request of the same class instead of 
+    being freed, so growing a staging area costs at most one allocation
+    per doubling and nothing once the pool is warm.  The pool never frees
+    a buffer that is in use.
+*/
+class PinnedPool {
+
+  public:
+
+    PinnedPool();
+
+    ~PinnedPool();
+
+    //! Get a buffer holding at least the given number of bytes
+    PinnedBuffer acquire(size_t bytes);
+
+    //! Return a buffer to the pool.  The buffer must not be mapped.
+    void release(PinnedBuffer* buffer);
+
+    //! Free the buffers that are not in use
+    void trim();
+
+    //! Total bytes of pinned memory held by the pool
+    size_t getBytesAllocated();
+
+    //! Bytes of pinned memory currently handed out
+    size_t getBytesInUse();
+
+    //! Number of buffers currently handed out
+    int getBuffersInUse();
+
+    //! Number of buffers waiting to be reused
+    int getBuffersFree();
+
+    //! Print the occupancy of each size class
+    void printOccupancy();
+
+    //! Round a size up to its size class
+    static size_t roundToClass(size_t bytes);
+
+  private:
+
+    //! Return the size class that holds the given number of bytes
+    static int getSizeClass(size_t bytes);
+
+    //! Buffers available for reuse in each size class
+    std::vector<cl_mem> freeBuffers[PINNED_POOL_NUM_CLASSES];
+
+    //! Number of buffers handed out in each size class
+    int inUse[PINNED_POOL_NUM_CLASSES];
+
+    size_t bytesAllocated;
+
+    size_t bytesInUse;
+};
+
+//! Return the pool selected by the calling thread (by default the pool 
+//! shared by all Surf objects)
+PinnedPool* getPinnedPool();
+
+//! Select the pool the calling thread takes buffers from
+void selectPinnedPool(int index);
+
+//! Free the pools.  Must be called before cl_cleanup.
+void releasePinnedPool();
+
+#endif
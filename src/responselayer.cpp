@@ -52,10 +52,14 @@
 #include "responselayer.h"
 #include "utils.h"
 
-ResponseLayer::ResponseLayer(int width, int height, int step, int filter)
+ResponseLayer::ResponseLayer(int width, int height, int step, int filter,
+                             int images)
 {
     this->width = width;
     this->height = height; 
+    this->capacityWidth = width;
+    this->capacityHeight = height;
+    this->images = images;
     this->step = step;
     this->filter = filter;
 
@@ -64,8 +68,9 @@ ResponseLayer::ResponseLayer(int width, int height, int step, int filter)
         this->d_responses = cl_allocImage(height, width, 'f');
     }
     else {
-        this->d_laplacian = cl_allocBuffer(sizeof(int)*width*height);
-        this->d_responses = cl_allocBuffer(sizeof(float)*width*height);
+        // The layers of a batch of images are stored one after the other
+        this->d_laplacian = cl_allocBuffer(sizeof(int)*width*height*images);
+        this->d_responses = cl_allocBuffer(sizeof(float)*width*height*images);
     }
 }
 
@@ -110,4 +115,23 @@ cl_mem ResponseLayer::getResponses()
 {
 
     return this->d_responses;
+}
+
+void ResponseLayer::setSize(int width, int height) 
+{
+    if(width > this->capacityWidth || height > this->capacityHeight) {
+        printf("Error: Response layer is too small (%dx%d for %dx%d)\n",
+            this->capacityWidth, this->capacityHeight, width, height);
+        exit(-1);
+    }
+
+    this->width = width;
+    this->height = height;
+}
+
+size_t ResponseLayer::getBytes() 
+{
+
+    return (sizeof(float) + sizeof(int)) * this->capacityWidth * 
+        this->capacityHeight * this->images;
 }
\ No newline at end of file
@@ -58,7 +58,10 @@ class ResponseLayer {
 
   public:
     
-    ResponseLayer(int width, int height, int step, int filter);
+    //! Create a layer holding the responses of 'images' images (only a
+    //! single image is supported with OpenCL images)
+    ResponseLayer(int width, int height, int step, int filter, 
+                  int images = 1);
 
     ~ResponseLayer();
 
@@ -74,6 +77,13 @@ class ResponseLayer {
 
     cl_mem getLaplacian();
 
+    //! Shrink (or grow back) the layer to the size used for a smaller 
+    //! image.  The buffers are not reallocated.
+    void setSize(int width, int height);
+
+    //! Return the size of the layer buffers in bytes
+    size_t getBytes();
+
 
   private:
     
@@ -81,6 +91,13 @@ class ResponseLayer {
 
     int height;  
 
+    //! Size the buffers were allocated for
+    int capacityWidth;
+
+    int capacityHeight;
+
+    int images;
+
     int step;
 
     int filter;
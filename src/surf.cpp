@@ -50,6 +50,7 @@
  \****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "cvutils.h"
@@ -57,10 +58,10 @@
 #include "clutils.h"
 #include "utils.h"
 #include "eventlist.h"
+#include "pca.h"
+#include "tuning.h"
 #include "stdio.h"
 
-#define DESC_SIZE 64
-
 // TODO Get rid of these arrays (i and j).  Have the values computed 
 //      dynamically within the kernel
 const int Surf::j[] = {-12, -7, -2, 3,
@@ -88,9 +89,48 @@ const float Surf::gauss25[] = {
 //! Constructor
 Surf::Surf(int initialPoints, int i_height, int i_width, int octaves, 
            int intervals, int sample_step, float threshold,
-           cl_kernel* kernel_list)
+           cl_kernel* kernel_list, bool extended, int descFormat)
            : kernel_list(kernel_list)
 {
+    // The extended descriptor splits each sub-region sum by the sign of
+    // the orthogonal response, doubling the descriptor length
+    this->descSize = extended ? DESC_SIZE_EXTENDED : DESC_SIZE;
+
+    // The descriptors are converted to the output format on the device
+    this->descFormat = descFormat;
+    this->descBytes = getDescriptorBytes(descFormat, this->descSize);
+
+    // Haar responses are computed from the integral image until maps 
+    // are enabled
+    this->haarMapRatio = 0.0f;
+    this->haarMapCapacity = 0;
+    this->d_haarMaps = NULL;
+    this->d_haarMapSlot = cl_allocBuffer(HAAR_MAP_TABLE_SIZE * sizeof(int));
+    this->d_haarHistogram = cl_allocBuffer(HAAR_MAP_TABLE_SIZE * sizeof(int));
+    for(int k = 0; k < HAAR_MAP_TABLE_SIZE; k++) {
+        this->haarMapSlot[k] = -1;
+    }
+    this->uploadHaarMapSlots();
+
+    // Ipoints are processed in detection order unless sorting is enabled
+    this->sortKeypoints = false;
+    this->restoreOrder = false;
+    this->keypointsSorted = false;
+    this->sortCapacity = 0;
+    this->d_sortKeys = NULL;
+    this->d_sortIndices = NULL;
+    this->d_sortedPixPos = NULL;
+    this->d_sortedScale = NULL;
+    this->d_sortedLaplacian = NULL;
+    this->d_sortedOrientation = NULL;
+    this->d_sortedImageIndex = NULL;
+
+    // No PCA projection until one is set
+    this->pcaComponents = 0;
+    this->pcaReplace = false;
+    this->d_pcaMean = NULL;
+    this->d_pcaBasis = NULL;
+    this->d_projected = NULL;
 
     this->fh = new FastHessian(i_height, i_width, octaves, 
         intervals, sample_step, threshold, kernel_list);
@@ -114,6 +154,22 @@ Surf::Surf(int initialPoints, int i_height, int i_width, int octaves,
         this->d_tmpIntImageT2 = cl_allocBuffer(sizeof(float)*i_height*i_width);
     }
 
+    // On devices that share memory with the host the grayscale frame is
+    // written straight into a page-aligned host buffer that the scan 
+    // reads in place, and the results are read by mapping the buffers 
+    // they are written to
+    this->zeroCopy = cl_getDeviceCaps()->unifiedMemory;
+    this->h_frame = NULL;
+    this->d_frame = NULL;
+    if(this->zeroCopy && !isUsingImages()) 
+    {
+        size_t frameBytes = roundUp((unsigned int)(sizeof(float) * 
+            i_width * i_height), ZERO_COPY_ALIGNMENT);
+        this->h_frame = alignedAlloc(frameBytes, ZERO_COPY_ALIGNMENT);
+        this->d_frame = cl_allocBufferHostPtr(frameBytes, this->h_frame,
+            CL_MEM_READ_ONLY);
+    }
+
     // Allocate constant data on device
     this->d_gauss25 = cl_allocBufferConst(sizeof(float)*49,(void*)Surf::gauss25);
     this->d_id = cl_allocBufferConst(sizeof(unsigned int)*13,(void*)Surf::id);
@@ -125,67 +181,139 @@ Surf::Surf(int initialPoints, int i_height, int i_width, int octaves,
     this->d_scale = cl_allocBuffer(initialPoints * sizeof(float));
     this->d_pixPos = cl_allocBuffer(initialPoints * sizeof(float2));
     this->d_laplacian = cl_allocBuffer(initialPoints * sizeof(int));
+    this->d_imageIndex = cl_allocBuffer(initialPoints * sizeof(int));
     
     // These buffers used to wait for the number of actual ipts to be known
     // before being allocated, instead now we'll only allocate them once
     // so that we can take advantage of optimized data transfers and reallocate
     // them if there's not enough space available
     this->d_length = cl_allocBuffer(initialPoints * DESC_SIZE * sizeof(float));
-    this->d_desc = cl_allocBuffer(initialPoints * DESC_SIZE * sizeof(float));
+    this->d_desc = cl_allocBuffer(initialPoints * this->descSize * sizeof(float));
     this->d_res = cl_allocBuffer(initialPoints * 109 * sizeof(float4));
     this->d_orientation = cl_allocBuffer(initialPoints * sizeof(float));
 
-    // Allocate buffers to store the output data (descriptor information)
-    // on the host
+    // Floating point descriptors are normalized in place
+    if(this->descFormat == DESC_FORMAT_FP32) {
+        this->d_descOut = this->d_desc;
+    }
+    else {
+        this->d_descOut = cl_allocBuffer(initialPoints * this->descBytes);
+    }
+
+    // The output data is packed into a single block for the transfer 
+    // to the host.  The buffers are allocated when first needed.
+    this->featureBlock = NULL;
+    this->d_featureBlock = NULL;
+    this->featureBlockBytes = 0;
 #ifdef OPTIMIZED_TRANSFERS
-    this->h_scale = cl_allocBufferPinned(initialPoints * sizeof(float));
-    this->h_pixPos = cl_allocBufferPinned(initialPoints * sizeof(float2));
-    this->h_laplacian = cl_allocBufferPinned(initialPoints * sizeof(int));
-    this->h_desc = cl_allocBufferPinned(initialPoints * DESC_SIZE * sizeof(float));
-    this->h_orientation = cl_allocBufferPinned(initialPoints * sizeof(float));
-#else
-    this->scale = (float*)alloc(initialPoints * sizeof(float));
-    this->pixPos = (float2*)alloc(initialPoints * sizeof(float2));
-    this->laplacian = (int*)alloc(initialPoints * sizeof(int));
-    this->desc = (float*)alloc(initialPoints * DESC_SIZE * sizeof(float));
-    this->orientation = (float*)alloc(initialPoints * sizeof(float));
+    this->featureStaging.mem = NULL;
+    this->featureStaging.bytes = 0;
+    this->featureStaging.sizeClass = 0;
 #endif
     // This is how much space is available for Ipts
     this->maxIpts = initialPoints;
+    this->numIpts = 0;
+
+    this->width = i_width;
+    this->height = i_height;
+    this->capacityWidth = i_width;
+    this->capacityHeight = i_height;
+    this->haveIntegralImage = false;
+    this->haveKeypoints = false;
+    this->featuresMapped = false;
+
+    // Frames are processed one at a time until a batch is run
+    this->batchCapacity = 1;
+    this->numImages = 1;
+    this->batchIpoints = false;
+
+    this->detectionPending = false;
+    this->detectedEvent = NULL;
+    this->readbackOnTransferQueue = false;
+    this->frameStaging.mem = NULL;
+    this->frameStaging.bytes = 0;
+    this->frameStaging.sizeClass = 0;
+    this->frameStagingPtr = NULL;
+    this->frameUploadedEvent = NULL;
+
+    // The launches are recorded and the kernels bound when first used
+    this->planInput = NULL;
+    this->orientationKernel = NULL;
+    this->orientationKernel2 = NULL;
+    this->descriptorKernel = NULL;
+    this->normalizeKernel = NULL;
+    this->projectKernel = NULL;
+    this->packKernel = NULL;
+    this->boundWidth = 0;
+    this->boundHeight = 0;
+    this->boundImageStride = 0;
 }
 
 
 //! Destructor
 Surf::~Surf() {
 
+    this->freeIntegralPlan();
+    this->releaseBoundKernels();
+
     cl_freeMem(this->d_intImage);
     cl_freeMem(this->d_tmpIntImage);
     cl_freeMem(this->d_tmpIntImageT1);
     cl_freeMem(this->d_tmpIntImageT2);
+    if(this->d_frame != NULL) 
+    {
+        cl_freeMem(this->d_frame);
+        alignedFree(this->h_frame);
+    }
+    if(this->detectionPending) 
+    {
+        cl_waitForEvent(this->detectedEvent);
+        clReleaseEvent(this->detectedEvent);
+    }
+    if(this->frameUploadedEvent != NULL) 
+    {
+        cl_waitForEvent(this->frameUploadedEvent);
+        clReleaseEvent(this->frameUploadedEvent);
+    }
+    if(this->frameStaging.mem != NULL) 
+    {
+        cl_unmapBuffer(this->frameStaging.mem, this->frameStagingPtr);
+        getPinnedPool()->release(&(this->frameStaging));
+    }
     cl_freeMem(this->d_desc);
+    if(this->d_descOut != this->d_desc) {
+        cl_freeMem(this->d_descOut);
+    }
     cl_freeMem(this->d_orientation);
     cl_freeMem(this->d_gauss25);
     cl_freeMem(this->d_id);
     cl_freeMem(this->d_i);
     cl_freeMem(this->d_j);
     cl_freeMem(this->d_laplacian);
+    cl_freeMem(this->d_imageIndex);
     cl_freeMem(this->d_pixPos);
     cl_freeMem(this->d_scale);
     cl_freeMem(this->d_res);
     cl_freeMem(this->d_length);
-
+    cl_freeMem(this->d_pcaMean);
+    cl_freeMem(this->d_pcaBasis);
+    this->freeProjectionBuffers();
+    cl_freeMem(this->d_haarMaps);
+    cl_freeMem(this->d_haarMapSlot);
+    cl_freeMem(this->d_haarHistogram);
+    this->freeSortBuffers();
+
+    cl_freeMem(this->d_featureBlock);
 #ifdef OPTIMIZED_TRANSFERS
-    cl_freeMem(this->h_orientation);
-    cl_freeMem(this->h_scale);
-    cl_freeMem(this->h_laplacian);
-    cl_freeMem(this->h_desc);
-    cl_freeMem(this->h_pixPos);
+    // Hand the staging buffers back to the pool for the next Surf object
+    if(this->featuresMapped) 
+    {
+        cl_unmapBuffer(this->featureStaging.mem, this->featureBlock);
+    }
+    this->releaseRetiredStaging();
+    getPinnedPool()->release(&(this->featureStaging));
 #else
-    free(this->orientation);
-    free(this->scale);
-    free(this->laplacian);
-    free(this->desc);
-    free(this->pixPos);
+    free(this->featureBlock);
 #endif
 
     delete this->fh;
@@ -199,74 +327,182 @@ Surf::~Surf() {
 */
 void Surf::computeIntegralImage(IplImage* source)
 {
-    //! convert the image to single channel 32f
+    // set up variables for data access
+    int height = source->height;
+    int width = source->width;
 
-    // TODO This call takes about 4ms (is there any way to speed it up?)
-    IplImage *img = getGray(source);
+    IplImage *img = NULL;
 
-    // set up variables for data access
-    int height = img->height;
-    int width = img->width;
-    float *data = (float*)img->imageData;
+    // The buffer the first scan reads the frame from
+    cl_mem d_input = this->d_intImage;
 
-    cl_kernel scan_kernel;
-    cl_kernel transpose_kernel;
+    if(this->d_frame != NULL) {
+        // Zero-copy: convert straight into the host-resident frame 
+        // buffer, which the device then reads in place
+        void* frame = cl_mapBuffer(this->d_frame, 
+            sizeof(float)*width*height, CL_MAP_WRITE);
 
-    if(isUsingImages()) {
-        // Copy the data to the GPU
-        cl_copyImageToDevice(this->d_intImage, data, height, width);
+        IplImage* header = cvCreateImageHeader(cvGetSize(source), 
+            IPL_DEPTH_32F, 1);
+        cvSetData(header, frame, width*sizeof(float));
+        convertToGray(source, header);
+        cvReleaseImageHeader(&header);
+
+        cl_unmapBuffer(this->d_frame, frame);
 
-        scan_kernel = this->kernel_list[KERNEL_SCANIMAGE];
-        transpose_kernel = this->kernel_list[KERNEL_TRANSPOSEIMAGE];
+        d_input = this->d_frame;
     }
     else {
+        //! convert the image to single channel 32f
+
+        // TODO This call takes about 4ms (is there any way to speed it up?)
+        img = getGray(source);
+    }
+
+    if(isUsingImages()) {
         // Copy the data to the GPU
-        cl_copyBufferToDevice(this->d_intImage, data, sizeof(float)*width*height);
+        cl_copyImageToDevice(this->d_intImage, img->imageData, height, width);
+    }
+    else if(img != NULL) {
+        // Copy the data to the GPU
+        cl_copyBufferToDevice(this->d_intImage, img->imageData, 
+            sizeof(float)*width*height);
+    }
+
+    this->integrateFrame(d_input, width, height, 1);
+
+    // release the gray image
+    if(img != NULL) {
+        cvReleaseImage(&img);
+    }
+}
+
+
+//! Run the scans and transposes that turn frames into integral images
+/*!
+    The frames of a batch are stored one after the other.  The row scans
+    run over the rows of all of them, and the transposes are applied to 
+    each frame separately (the third dimension of their NDRange indexes
+    the frame), so the column scans restart at each frame.
+    \param d_input The grayscale frames (d_intImage or the zero-copy frame
+           buffer).  The integral images are written to d_intImage.
+    \param width The width of the image
+    \param height The height of the image
+    \param images The number of frames in d_input
+*/
+void Surf::integrateFrame(cl_mem d_input, int width, int height, int images)
+{
+    this->numImages = images;
+    this->fh->setNumImages(images);
+
+    int scanKernel;
 
+    if(isUsingImages()) {
+        scanKernel = KERNEL_SCANIMAGE;
+    }
+    else {
         // If it is possible to use the vector scan (scan4) use
-        // it, otherwise, use the regular scan
-        if(cl_deviceIsAMD() && width % 4 == 0 && height % 4 == 0) 
+        // it, otherwise, use the regular scan.  Unless the tuning profile
+        // picked one, scan4 is used on devices that prefer float vectors.
+        int scan4 = getTuningProfile()->scan4;
+        bool vectorDevice = cl_getDeviceCaps()->floatVectorWidth > 1;
+        if((scan4 == 1 || (scan4 < 0 && vectorDevice)) && 
+           width % 4 == 0 && height % 4 == 0) 
         {
             // NOTE Change this to KERNEL_SCAN when running verification code.
             //      The reference code doesn't use a vector type and
             //      scan4 produces a slightly different integral image
-            scan_kernel = this->kernel_list[KERNEL_SCAN4];
+            scanKernel = KERNEL_SCAN4;
         }
         else 
         {
-            scan_kernel = this->kernel_list[KERNEL_SCAN];
+            scanKernel = KERNEL_SCAN;
         }
-        transpose_kernel = this->kernel_list[KERNEL_TRANSPOSE];
     }
-    
+
+    // Record the launches the first time and whenever their arguments
+    // change, then replay them
+    if(this->integralPlan.empty() || d_input != this->planInput ||
+       width != this->planWidth || height != this->planHeight ||
+       images != this->planImages || scanKernel != this->planScanKernel) {
+        this->recordIntegralImage(d_input, width, height, images, 
+            scanKernel);
+    }
+
+    // The plan alternates scans and transposes
+    for(unsigned int i = 0; i < this->integralPlan.size(); i++) {
+        LaunchPlan* launch = &this->integralPlan.at(i);
+        cl_executeKernel(launch->kernel, 3, launch->globalWorkSize, 
+            launch->localWorkSize, (i % 2 == 0) ? "Scan" : "Transpose", 
+            i / 2);
+    }
+}
+
+
+//! Record the scan and transpose launches of integrateFrame
+/*!
+    Each launch gets its own kernel object with all its arguments bound, 
+    so the launches can be replayed without setting any argument.  The
+    scans are recorded as 3D launches with a single plane.
+    \param d_input The grayscale frames
+    \param width The width of the image
+    \param height The height of the image
+    \param images The number of frames in d_input
+    \param scanKernel The scan kernel (KERNEL_SCAN*)
+*/
+void Surf::recordIntegralImage(cl_mem d_input, int width, int height, 
+                               int images, int scanKernel)
+{
+    this->freeIntegralPlan();
+
+    cl_kernel scan_kernel = cl_getKernel(scanKernel);
+    cl_kernel transpose_kernel = cl_getKernel(isUsingImages() ? 
+        KERNEL_TRANSPOSEIMAGE : KERNEL_TRANSPOSE);
+
+    LaunchPlan launch;
+    cl_kernel kernel;
 
     // -----------------------------------------------------------------
     // Step 1: Perform integral summation on the rows
     // -----------------------------------------------------------------
 
-    size_t localWorkSize1[2]={64, 1};
-    size_t globalWorkSize1[2]={64, height};
+    int rows = height*images;
 
-    cl_setKernelArg(scan_kernel, 0, sizeof(cl_mem), (void *)&(this->d_intImage));
-    cl_setKernelArg(scan_kernel, 1, sizeof(cl_mem), (void *)&(this->d_tmpIntImage)); 
-    cl_setKernelArg(scan_kernel, 2, sizeof(int), (void *)&height);
-    cl_setKernelArg(scan_kernel, 3, sizeof(int), (void *)&width);
+    launch.kernel = cl_cloneKernel(scan_kernel);
+    launch.localWorkSize[0] = 64;
+    launch.localWorkSize[1] = 1;
+    launch.localWorkSize[2] = 1;
+    launch.globalWorkSize[0] = 64;
+    launch.globalWorkSize[1] = rows;
+    launch.globalWorkSize[2] = 1;
 
-    cl_executeKernel(scan_kernel, 2, globalWorkSize1, localWorkSize1, "Scan", 0);
+    kernel = launch.kernel;
+    cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void *)&d_input);
+    cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void *)&(this->d_tmpIntImage)); 
+    cl_setKernelArg(kernel, 2, sizeof(int), (void *)&rows);
+    cl_setKernelArg(kernel, 3, sizeof(int), (void *)&width);
+
+    this->integralPlan.push_back(launch);
 
     // -----------------------------------------------------------------
     // Step 2: Transpose
     // -----------------------------------------------------------------
 
-    size_t localWorkSize2[]={16, 16};
-    size_t globalWorkSize2[]={roundUp(width,16), roundUp(height,16)};
+    launch.kernel = cl_cloneKernel(transpose_kernel);
+    launch.localWorkSize[0] = 16;
+    launch.localWorkSize[1] = 16;
+    launch.localWorkSize[2] = 1;
+    launch.globalWorkSize[0] = roundUp(width,16);
+    launch.globalWorkSize[1] = roundUp(height,16);
+    launch.globalWorkSize[2] = images;
 
-    cl_setKernelArg(transpose_kernel, 0, sizeof(cl_mem), (void *)&(this->d_tmpIntImage));  
-    cl_setKernelArg(transpose_kernel, 1, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT1)); 
-    cl_setKernelArg(transpose_kernel, 2, sizeof(int), (void *)&height);
-    cl_setKernelArg(transpose_kernel, 3, sizeof(int), (void *)&width);
+    kernel = launch.kernel;
+    cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void *)&(this->d_tmpIntImage));  
+    cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT1)); 
+    cl_setKernelArg(kernel, 2, sizeof(int), (void *)&height);
+    cl_setKernelArg(kernel, 3, sizeof(int), (void *)&width);
 
-    cl_executeKernel(transpose_kernel, 2, globalWorkSize2, localWorkSize2, "Transpose", 0);
+    this->integralPlan.push_back(launch);
 
     // -----------------------------------------------------------------
     // Step 3: Run integral summation on the rows again (same as columns
@@ -275,33 +511,100 @@ void Surf::computeIntegralImage(IplImage* source)
 
     int heightT = width;
     int widthT = height;
+    int rowsT = heightT*images;
 
-    size_t localWorkSize3[2]={64, 1};
-    size_t globalWorkSize3[2]={64, heightT};
+    launch.kernel = cl_cloneKernel(scan_kernel);
+    launch.localWorkSize[0] = 64;
+    launch.localWorkSize[1] = 1;
+    launch.localWorkSize[2] = 1;
+    launch.globalWorkSize[0] = 64;
+    launch.globalWorkSize[1] = rowsT;
+    launch.globalWorkSize[2] = 1;
 
-    cl_setKernelArg(scan_kernel, 0, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT1));
-    cl_setKernelArg(scan_kernel, 1, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT2)); 
-    cl_setKernelArg(scan_kernel, 2, sizeof(int), (void *)&heightT);
-    cl_setKernelArg(scan_kernel, 3, sizeof(int), (void *)&widthT);
+    kernel = launch.kernel;
+    cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT1));
+    cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT2)); 
+    cl_setKernelArg(kernel, 2, sizeof(int), (void *)&rowsT);
+    cl_setKernelArg(kernel, 3, sizeof(int), (void *)&widthT);
 
-    cl_executeKernel(scan_kernel, 2, globalWorkSize3, localWorkSize3, "Scan", 1);
+    this->integralPlan.push_back(launch);
 
     // -----------------------------------------------------------------
     // Step 4: Transpose back
     // -----------------------------------------------------------------
 
-    size_t localWorkSize4[]={16, 16};
-    size_t globalWorkSize4[]={roundUp(widthT,16), roundUp(heightT,16)};
+    launch.kernel = cl_cloneKernel(transpose_kernel);
+    launch.localWorkSize[0] = 16;
+    launch.localWorkSize[1] = 16;
+    launch.localWorkSize[2] = 1;
+    launch.globalWorkSize[0] = roundUp(widthT,16);
+    launch.globalWorkSize[1] = roundUp(heightT,16);
+    launch.globalWorkSize[2] = images;
+
+    kernel = launch.kernel;
+    cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT2)); 
+    cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void *)&(this->d_intImage));
+    cl_setKernelArg(kernel, 2, sizeof(int), (void *)&heightT);
+    cl_setKernelArg(kernel, 3, sizeof(int), (void *)&widthT);
+
+    this->integralPlan.push_back(launch);
+
+    this->planInput = d_input;
+    this->planWidth = width;
+    this->planHeight = height;
+    this->planImages = images;
+    this->planScanKernel = scanKernel;
+}
 
-    cl_setKernelArg(transpose_kernel, 0, sizeof(cl_mem), (void *)&(this->d_tmpIntImageT2)); 
-    cl_setKernelArg(transpose_kernel, 1, sizeof(cl_mem), (void *)&(this->d_intImage));
-    cl_setKernelArg(transpose_kernel, 2, sizeof(int), (void *)&heightT);
-    cl_setKernelArg(transpose_kernel, 3, sizeof(int), (void *)&widthT);
 
-    cl_executeKernel(transpose_kernel, 2, globalWorkSize4, localWorkSize4, "Transpose", 1);
+//! Release the kernel objects of the recorded integral image launches
+void Surf::freeIntegralPlan()
+{
+    for(unsigned int i = 0; i < this->integralPlan.size(); i++) {
+        cl_freeKernel(this->integralPlan.at(i).kernel);
+    }
+    this->integralPlan.clear();
+}
 
-    // release the gray image
-    cvReleaseImage(&img);
+
+//! Release the kernel objects of the ipoint stages
+/*!
+    Called when a buffer they are bound to is reallocated, so the next
+    launch of each stage creates and binds its kernel again
+*/
+void Surf::releaseBoundKernels()
+{
+    cl_freeKernel(this->orientationKernel);
+    cl_freeKernel(this->orientationKernel2);
+    cl_freeKernel(this->descriptorKernel);
+    cl_freeKernel(this->normalizeKernel);
+    cl_freeKernel(this->projectKernel);
+    cl_freeKernel(this->packKernel);
+    this->orientationKernel = NULL;
+    this->orientationKernel2 = NULL;
+    this->descriptorKernel = NULL;
+    this->normalizeKernel = NULL;
+    this->projectKernel = NULL;
+    this->packKernel = NULL;
+}
+
+
+//! Release the bound kernels if the frame size or image stride changed
+/*!
+    All bound kernels are bound for the same frame size and stride
+    \param i_width The image width
+    \param i_height The image height
+    \param imageStride The distance between the images of a batch
+*/
+void Surf::checkBoundKernels(int i_width, int i_height, int imageStride)
+{
+    if(i_width != this->boundWidth || i_height != this->boundHeight ||
+       imageStride != this->boundImageStride) {
+        this->releaseBoundKernels();
+        this->boundWidth = i_width;
+        this->boundHeight = i_height;
+        this->boundImageStride = imageStride;
+    }
 }
 
 
@@ -319,38 +622,98 @@ void Surf::createDescriptors(int i_width, int i_height)
     const size_t threadsPerWG = 81;
     const size_t wgsPerIpt = 16;
 
-    cl_kernel surf64Descriptor_kernel = this->kernel_list[KERNEL_SURF_DESC];
+    int extended = (this->descSize == DESC_SIZE_EXTENDED);
+
+    // Ipoints of a batch read the integral image of their own image
+    int imageStride = this->batchIpoints ? i_width*i_height : 0;
+
+    // The arguments are bound once, only the NDRange changes per frame
+    this->checkBoundKernels(i_width, i_height, imageStride);
+    if(this->descriptorKernel == NULL) 
+    {
+        this->descriptorKernel = cl_cloneKernel(cl_getKernel(KERNEL_SURF_DESC));
+        cl_kernel kernel = this->descriptorKernel;
+
+        cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void*)&(this->d_intImage));
+        cl_setKernelArg(kernel, 1, sizeof(int),    (void*)&i_width);
+        cl_setKernelArg(kernel, 2, sizeof(int),    (void*)&i_height);
+        cl_setKernelArg(kernel, 3, sizeof(cl_mem), (void*)&(this->d_scale));
+        cl_setKernelArg(kernel, 4, sizeof(cl_mem), (void*)&(this->d_desc));
+        cl_setKernelArg(kernel, 5, sizeof(cl_mem), (void*)&(this->d_pixPos));
+        cl_setKernelArg(kernel, 6, sizeof(cl_mem), (void*)&(this->d_orientation));
+        cl_setKernelArg(kernel, 7, sizeof(cl_mem), (void*)&(this->d_length));
+        cl_setKernelArg(kernel, 8, sizeof(cl_mem), (void*)&(this->d_j));
+        cl_setKernelArg(kernel, 9, sizeof(cl_mem), (void*)&(this->d_i));
+        cl_setKernelArg(kernel, 10, sizeof(int),   (void*)&extended);
+        cl_setKernelArg(kernel, 11, sizeof(cl_mem), (void*)&(this->d_haarMaps));
+        cl_setKernelArg(kernel, 12, sizeof(cl_mem), (void*)&(this->d_haarMapSlot));
+        cl_setKernelArg(kernel, 13, sizeof(cl_mem), (void*)&(this->d_imageIndex));
+        cl_setKernelArg(kernel, 14, sizeof(int),   (void*)&imageStride);
+    }
 
     size_t localWorkSizeSurf64[2] = {threadsPerWG,1};
     size_t globalWorkSizeSurf64[2] = {(wgsPerIpt*threadsPerWG),(size_t)numIpts};
 
-    cl_setKernelArg(surf64Descriptor_kernel, 0, sizeof(cl_mem), (void*)&(this->d_intImage));
-    cl_setKernelArg(surf64Descriptor_kernel, 1, sizeof(int),    (void*)&i_width);
-    cl_setKernelArg(surf64Descriptor_kernel, 2, sizeof(int),    (void*)&i_height);
-    cl_setKernelArg(surf64Descriptor_kernel, 3, sizeof(cl_mem), (void*)&(this->d_scale));
-    cl_setKernelArg(surf64Descriptor_kernel, 4, sizeof(cl_mem), (void*)&(this->d_desc));
-    cl_setKernelArg(surf64Descriptor_kernel, 5, sizeof(cl_mem), (void*)&(this->d_pixPos));
-    cl_setKernelArg(surf64Descriptor_kernel, 6, sizeof(cl_mem), (void*)&(this->d_orientation));
-    cl_setKernelArg(surf64Descriptor_kernel, 7, sizeof(cl_mem), (void*)&(this->d_length));
-    cl_setKernelArg(surf64Descriptor_kernel, 8, sizeof(cl_mem), (void*)&(this->d_j));
-    cl_setKernelArg(surf64Descriptor_kernel, 9, sizeof(cl_mem), (void*)&(this->d_i));
-
-    cl_executeKernel(surf64Descriptor_kernel, 2, globalWorkSizeSurf64,
+    cl_executeKernel(this->descriptorKernel, 2, globalWorkSizeSurf64,
         localWorkSizeSurf64, "CreateDescriptors"); 
 
-    cl_kernel normSurf64_kernel = kernel_list[KERNEL_NORM_DESC];
+    this->normalizeDescriptors();
+} 
+
+
+//! Normalize the descriptors
+/*!
+    Scales each descriptor to unit length, converts it to the output 
+    format and applies the PCA projection (if one is set)
+*/
+void Surf::normalizeDescriptors()
+{
+    if(this->normalizeKernel == NULL) 
+    {
+        this->normalizeKernel = cl_cloneKernel(cl_getKernel(KERNEL_NORM_DESC));
+        cl_kernel kernel = this->normalizeKernel;
+
+        cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void*)&(this->d_desc));
+        cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void*)&(this->d_length));
+        cl_setKernelArg(kernel, 2, sizeof(int),    (void*)&(this->descSize));
+        cl_setKernelArg(kernel, 3, sizeof(cl_mem), (void*)&(this->d_descOut));
+        cl_setKernelArg(kernel, 4, sizeof(int),    (void*)&(this->descFormat));
+    }
 
+    // The normalization kernel always uses 64 work items per descriptor,
+    // each work item scales descSize/64 entries
     size_t localWorkSizeNorm64[] = {DESC_SIZE};
     size_t globallWorkSizeNorm64[] =  {this->numIpts*DESC_SIZE};
 
-    cl_setKernelArg(normSurf64_kernel, 0, sizeof(cl_mem), (void*)&(this->d_desc));
-    cl_setKernelArg(normSurf64_kernel, 1, sizeof(cl_mem), (void*)&(this->d_length));
-
     // Execute the descriptor normalization kernel
-    cl_executeKernel(normSurf64_kernel, 1, globallWorkSizeNorm64, localWorkSizeNorm64,
-        "NormalizeDescriptors"); 
+    cl_executeKernel(this->normalizeKernel, 1, globallWorkSizeNorm64, 
+        localWorkSizeNorm64, "NormalizeDescriptors"); 
 
-} 
+    if(this->pcaComponents > 0) 
+    {
+        if(this->projectKernel == NULL) 
+        {
+            this->projectKernel = cl_cloneKernel(
+                cl_getKernel(KERNEL_PROJECT_DESC));
+            cl_kernel kernel = this->projectKernel;
+
+            cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void*)&(this->d_desc));
+            cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void*)&(this->d_pcaMean));
+            cl_setKernelArg(kernel, 2, sizeof(cl_mem), (void*)&(this->d_pcaBasis));
+            cl_setKernelArg(kernel, 3, sizeof(cl_mem), (void*)&(this->d_projected));
+            cl_setKernelArg(kernel, 4, sizeof(int),    (void*)&(this->descSize));
+            cl_setKernelArg(kernel, 5, sizeof(int),    (void*)&(this->pcaComponents));
+        }
+
+        // One work group per descriptor, one work item per component
+        size_t localWorkSizeProject[] = {MAX_PCA_COMPONENTS};
+        size_t globalWorkSizeProject[] = {(size_t)(this->numIpts*MAX_PCA_COMPONENTS)};
+
+        // Execute the PCA projection kernel
+        cl_executeKernel(this->projectKernel, 1, globalWorkSizeProject, 
+            localWorkSizeProject, "ProjectDescriptors"); 
+    }
+}
 
 
 //! Calculate orientation for all ipoints
@@ -362,9 +725,39 @@ void Surf::createDescriptors(int i_width, int i_height)
 */
 void Surf::getOrientations(int i_width, int i_height)
 {
+    // Ipoints of a batch read the integral image of their own image
+    int imageStride = this->batchIpoints ? i_width*i_height : 0;
+
+    // The arguments are bound once, only the NDRange changes per frame
+    this->checkBoundKernels(i_width, i_height, imageStride);
+    if(this->orientationKernel == NULL) 
+    {
+        this->orientationKernel = cl_cloneKernel(
+            cl_getKernel(KERNEL_GET_ORIENT1));
+        cl_kernel kernel = this->orientationKernel;
+
+        cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void *)&(this->d_intImage));
+        cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void *)&(this->d_scale));
+        cl_setKernelArg(kernel, 2, sizeof(cl_mem), (void *)&(this->d_pixPos));
+        cl_setKernelArg(kernel, 3, sizeof(cl_mem), (void *)&(this->d_gauss25));
+        cl_setKernelArg(kernel, 4, sizeof(cl_mem), (void *)&(this->d_id));
+        cl_setKernelArg(kernel, 5, sizeof(int),    (void *)&i_width);
+        cl_setKernelArg(kernel, 6, sizeof(int),    (void *)&i_height);
+        cl_setKernelArg(kernel, 7, sizeof(cl_mem), (void *)&(this->d_res));
+        cl_setKernelArg(kernel, 8, sizeof(cl_mem), (void *)&(this->d_haarMaps));
+        cl_setKernelArg(kernel, 9, sizeof(cl_mem), (void *)&(this->d_haarMapSlot));
+        cl_setKernelArg(kernel, 10, sizeof(cl_mem), (void *)&(this->d_imageIndex));
+        cl_setKernelArg(kernel, 11, sizeof(int),    (void *)&imageStride);
+    }
+    if(this->orientationKernel2 == NULL) 
+    {
+        this->orientationKernel2 = cl_cloneKernel(
+            cl_getKernel(KERNEL_GET_ORIENT2));
+        cl_kernel kernel = this->orientationKernel2;
 
-    cl_kernel getOrientation = this->kernel_list[KERNEL_GET_ORIENT1];
-    cl_kernel getOrientation2 = this->kernel_list[KERNEL_GET_ORIENT2];  
+        cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void *)&(this->d_orientation));
+        cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void *)&(this->d_res));
+    }
 
     size_t localWorkSize1[] = {169};
     size_t globalWorkSize1[] = {this->numIpts*169};
@@ -373,28 +766,28 @@ void Surf::getOrientations(int i_width, int i_height)
     Assign the supplied Ipoint an orientation
     */
 
-    cl_setKernelArg(getOrientation, 0, sizeof(cl_mem), (void *)&(this->d_intImage));
-    cl_setKernelArg(getOrientation, 1, sizeof(cl_mem), (void *)&(this->d_scale));
-    cl_setKernelArg(getOrientation, 2, sizeof(cl_mem), (void *)&(this->d_pixPos));
-    cl_setKernelArg(getOrientation, 3, sizeof(cl_mem), (void *)&(this->d_gauss25));
-    cl_setKernelArg(getOrientation, 4, sizeof(cl_mem), (void *)&(this->d_id));
-    cl_setKernelArg(getOrientation, 5, sizeof(int),    (void *)&i_width);
-    cl_setKernelArg(getOrientation, 6, sizeof(int),    (void *)&i_height);
-    cl_setKernelArg(getOrientation, 7, sizeof(cl_mem), (void *)&(this->d_res));
-
     // Execute the kernel
-    cl_executeKernel(getOrientation, 1, globalWorkSize1, localWorkSize1, 
-        "GetOrientations");
-
-    cl_setKernelArg(getOrientation2, 0, sizeof(cl_mem), (void *)&(this->d_orientation));
-    cl_setKernelArg(getOrientation2, 1, sizeof(cl_mem), (void *)&(this->d_res));
+    cl_executeKernel(this->orientationKernel, 1, globalWorkSize1, 
+        localWorkSize1, "GetOrientations");
 
     size_t localWorkSize2[] = {42};
     size_t globalWorkSize2[] = {numIpts*42};
 
     // Execute the kernel
-    cl_executeKernel(getOrientation2, 1, globalWorkSize2, localWorkSize2,
-        "GetOrientations2");
+    cl_executeKernel(this->orientationKernel2, 1, globalWorkSize2, 
+        localWorkSize2, "GetOrientations2");
+}
+
+//! Return the length of the descriptors (64 or 128)
+int Surf::getDescriptorSize() 
+{
+    return this->descSize;
+}
+
+//! Return the output format of the descriptors (DESC_FORMAT_*)
+int Surf::getDescriptorFormat() 
+{
+    return this->descFormat;
 }
 
 //! Allocates the memory objects requried for the ipt descriptor information
@@ -404,41 +797,109 @@ void Surf::reallocateIptBuffers() {
     cl_freeMem(d_scale);
     cl_freeMem(d_pixPos);
     cl_freeMem(d_laplacian);
+    cl_freeMem(d_imageIndex);
     cl_freeMem(d_length);
+    if(d_descOut != d_desc) {
+        cl_freeMem(d_descOut);
+    }
     cl_freeMem(d_desc);
     cl_freeMem(d_res);
     cl_freeMem(d_orientation);
 
-    free(this->orientation);
-    free(this->scale);
-    free(this->laplacian);
-    free(this->desc);
-    free(this->pixPos);
-
     int newSize = this->maxIpts;
 
     // Allocate new memory objects based on the new size
     this->d_scale = cl_allocBuffer(newSize * sizeof(float));
     this->d_pixPos = cl_allocBuffer(newSize * sizeof(float2));
     this->d_laplacian = cl_allocBuffer(newSize * sizeof(int));
+    this->d_imageIndex = cl_allocBuffer(newSize * sizeof(int));
     this->d_length = cl_allocBuffer(newSize * DESC_SIZE*sizeof(float));
-    this->d_desc = cl_allocBuffer(newSize * DESC_SIZE * sizeof(float));
+    this->d_desc = cl_allocBuffer(newSize * this->descSize * sizeof(float));
     this->d_res = cl_allocBuffer(newSize * 121 * sizeof(float4));
     this->d_orientation = cl_allocBuffer(newSize * sizeof(float));
+    if(this->descFormat == DESC_FORMAT_FP32) {
+        this->d_descOut = this->d_desc;
+    }
+    else {
+        this->d_descOut = cl_allocBuffer(newSize * this->descBytes);
+    }
 
-#ifdef OPTIMIZED_TRANSFERS
-    this->h_scale = cl_allocBufferPinned(newSize * sizeof(float));
-    this->h_pixPos = cl_allocBufferPinned(newSize * sizeof(float2));
-    this->h_laplacian = cl_allocBufferPinned(newSize * sizeof(int));
-    this->h_desc = cl_allocBufferPinned(newSize * DESC_SIZE * sizeof(float));
-    this->h_orientation = cl_allocBufferPinned(newSize * sizeof(float));
-#else
-    this->scale = (float*)alloc(newSize * sizeof(float));
-    this->pixPos = (float2*)alloc(newSize * sizeof(float2));
-    this->laplacian = (int*)alloc(newSize * sizeof(int));
-    this->desc = (float*)alloc(newSize * DESC_SIZE * sizeof(float));
-    this->orientation = (float*)alloc(newSize * sizeof(float));
-#endif
+    if(this->pcaComponents > 0) {
+        this->freeProjectionBuffers();
+        this->allocateProjectionBuffers(newSize);
+    }
+
+    if(this->sortKeypoints) {
+        this->freeSortBuffers();
+        this->allocateSortBuffers(newSize);
+    }
+
+    // The kernels are bound to the new buffers when next used
+    this->releaseBoundKernels();
+}
+
+
+//! Allocate the buffers holding the projected descriptors
+/*!
+    \param size The number of ipoints to allocate space for
+*/
+void Surf::allocateProjectionBuffers(int size) 
+{
+    size_t bytes = size * this->pcaComponents * sizeof(float);
+
+    this->d_projected = cl_allocBuffer(bytes);
+}
+
+
+//! Release the buffers holding the projected descriptors
+void Surf::freeProjectionBuffers() 
+{
+    cl_freeMem(this->d_projected);
+    this->d_projected = NULL;
+}
+
+
+//! Project the descriptors onto a PCA basis on the device
+/*!
+    The projection is applied to the normalized fp32 descriptors after
+    the normalization kernel has run
+    \param pca The projection (NULL disables it).  Its input length must
+           match the descriptor length.
+    \param replaceDescriptors If true, only the projected descriptors are 
+           copied back to the host and returned in the Ipoints
+*/
+void Surf::setProjection(PcaProjection* pca, bool replaceDescriptors) 
+{
+    // Release any previous projection
+    this->releaseBoundKernels();
+    cl_freeMem(this->d_pcaMean);
+    cl_freeMem(this->d_pcaBasis);
+    this->d_pcaMean = NULL;
+    this->d_pcaBasis = NULL;
+    this->freeProjectionBuffers();
+    this->pcaComponents = 0;
+    this->pcaReplace = false;
+
+    if(pca == NULL) {
+        return;
+    }
+
+    if(pca->inputLength != this->descSize) {
+        printf("Error: PCA projection expects %d-length descriptors, ", 
+            pca->inputLength);
+        printf("but descriptors have length %d\n", this->descSize);
+        exit(-1);
+    }
+
+    this->d_pcaMean = cl_allocBufferConst(pca->inputLength*sizeof(float), 
+        pca->mean);
+    this->d_pcaBasis = cl_allocBufferConst(
+        pca->components*pca->inputLength*sizeof(float), pca->basis);
+
+    this->pcaComponents = pca->components;
+    this->pcaReplace = replaceDescriptors;
+
+    this->allocateProjectionBuffers(this->maxIpts);
 }
 
 
@@ -447,150 +908,1782 @@ void Surf::reallocateIptBuffers() {
 void Surf::reset() 
 {
     this->fh->reset();
+    this->haveKeypoints = false;
+    this->keypointsSorted = false;
 }
 
 
 //! Retreive the descriptors from the GPU
 /*!
     Copy data back from the GPU into an IpVec structure on the host
+    \param compact If not NULL, receives a copy of the descriptors in 
+           the output format (release with freeDescriptorSet)
+    \param projected If not NULL and a PCA projection is set, receives
+           a copy of the projected descriptors
 */
-IpVec* Surf::retrieveDescriptors()
+IpVec* Surf::retrieveDescriptors(DescriptorSet* compact, 
+                                 DescriptorSet* projected)
 {
-    IpVec* ipts = new IpVec();
+    FeatureSet features;
+    this->retrieveFeatures(&features);
 
-    if(this->numIpts == 0) 
+    // Parse the data into Ipoint structures
+    IpVec* ipts = featureSetToIpVec(features);
+
+    // Hand out the descriptors in their compact form as well
+    if(compact != NULL) 
     {
-        return ipts;
+        *compact = features.descriptors;
+        if(features.count > 0) {
+            compact->data = alloc(features.count * compact->stride);
+            memcpy(compact->data, features.descriptors.data, 
+                features.count * compact->stride);
+        }
     }
 
-    // Copy back the output data
+    // Hand out the projected descriptors
+    if(projected != NULL) 
+    {
+        *projected = features.projected;
+        if(features.count > 0 && features.projected.data != NULL) {
+            projected->data = alloc(features.count * projected->stride);
+            memcpy(projected->data, features.projected.data, 
+                features.count * projected->stride);
+        }
+    }
 
-#ifdef OPTIMIZED_TRANSFERS
-    // We're using pinned memory for the transfers.  The data is 
-    // copied back to pinned memory and then must be mapped before
-    // it's usable on the host
+    this->releaseFeatures(&features);
 
-    // Copy back Laplacian data
-    this->laplacian = (int*)cl_copyAndMapBuffer(this->h_laplacian, 
-        this->d_laplacian, this->numIpts * sizeof(int));
+    if(this->restoreOrder && this->keypointsSorted) 
+    {
+        this->restoreDetectionOrder(ipts, compact, projected);
+    }
 
-    // Copy back scale data
-    this->scale = (float*)cl_copyAndMapBuffer(this->h_scale, 
-        this->d_scale, this->numIpts * sizeof(float));
-    
-    // Copy back pixel positions
-    this->pixPos = (float2*)cl_copyAndMapBuffer(this->h_pixPos, 
-        this->d_pixPos, this->numIpts * sizeof(float2));
+    return ipts;
+}
 
-    // Copy back descriptors
-    this->desc = (float*)cl_copyAndMapBuffer(this->h_desc, 
-        this->d_desc, this->numIpts * DESC_SIZE* sizeof(float));
 
-    // Copy back orientation data
-    this->orientation = (float*)cl_copyAndMapBuffer(this->h_orientation, 
-        this->d_orientation, this->numIpts * sizeof(float));
-#else
-    // Copy back Laplacian information
-    cl_copyBufferToHost(this->laplacian, this->d_laplacian, 
-        (this->numIpts) * sizeof(int), CL_FALSE);
+//! Retrieve the ipoints from the GPU as a structure of arrays
+/*!
+    The ipoints are packed into one block on the device and read back with
+    a single transfer.  The arrays of the FeatureSet point directly into 
+    the host buffer the block is copied to (mapped pinned memory when 
+    using optimized transfers), so nothing is copied on the host.  They 
+    are valid until releaseFeatures is called, which must happen before 
+    SURF is run again.  The ipoints are in processing order (see 
+    retrievePermutation if they were sorted).
+    \param features Receives the ipoints
+    \param ready If not NULL, the transfer is non-blocking and this 
+           receives an event that completes when the arrays can be read.
+           The caller must release the event (it is NULL if there are no
+           ipoints).
+*/
+void Surf::retrieveFeatures(FeatureSet* features, cl_event* ready)
+{
+    // The descriptors returned.  When the projection replaces the 
+    // descriptors, only the leading PCA components are transferred.
+    bool projectionOnly = (this->pcaComponents > 0 && this->pcaReplace);
+    bool projectionAlongside = (this->pcaComponents > 0 && !this->pcaReplace);
 
-    // Copy back scale data
-    cl_copyBufferToHost(this->scale, this->d_scale,
-        (this->numIpts)*sizeof(float), CL_FALSE);
+    size_t pcaBytes = this->pcaComponents * sizeof(float);
 
-    // Copy back pixel positions
-    cl_copyBufferToHost(this->pixPos, this->d_pixPos, 
-        (this->numIpts) * sizeof(float2), CL_FALSE);   
+    features->count = this->numIpts;
 
-    // Copy back descriptors
-    cl_copyBufferToHost(this->desc, this->d_desc, 
-        (this->numIpts)*DESC_SIZE*sizeof(float), CL_FALSE);
-    
-    // Copy back orientation data
-    cl_copyBufferToHost(this->orientation, this->d_orientation, 
-        (this->numIpts)*sizeof(float), CL_TRUE);
-#endif  
+    features->descriptors.format = this->descFormat;
+    features->descriptors.length = this->descSize;
+    features->descriptors.count = this->numIpts;
+    features->descriptors.stride = this->descBytes;
+    features->descriptors.data = NULL;
 
-    // Parse the data into Ipoint structures
-    for(int i= 0;i<(this->numIpts);i++)
-    {		
-        Ipoint ipt;		
-        ipt.x = pixPos[i].x;
-        ipt.y = pixPos[i].y;
-        ipt.scale = scale[i];
-        ipt.laplacian = laplacian[i];
-        ipt.orientation = orientation[i];
-        memcpy(ipt.descriptor, &desc[i*64], sizeof(float)*64);
-        ipts->push_back(ipt);
+    if(projectionOnly) 
+    {
+        features->descriptors.format = DESC_FORMAT_PCA;
+        features->descriptors.length = this->pcaComponents;
+        features->descriptors.stride = pcaBytes;
+    }
+
+    features->projected.format = DESC_FORMAT_PCA;
+    features->projected.length = this->pcaComponents;
+    features->projected.count = projectionAlongside ? this->numIpts : 0;
+    features->projected.stride = pcaBytes;
+    features->projected.data = NULL;
+
+    features->pos = NULL;
+    features->scale = NULL;
+    features->orientation = NULL;
+    features->laplacian = NULL;
+
+    if(this->numIpts == 0) 
+    {
+        if(ready != NULL) 
+        {
+            // Nothing to wait for
+            *ready = NULL;
+        }
+        return;
     }
 
+    // Gather everything into one block and copy it back
+    size_t offsets[6];
+    size_t bytes = this->packFeatures(true, offsets);
+
+    char* block = (char*)this->readFeatureBlock(bytes, ready);
+
 #ifdef OPTIMIZED_TRANSFERS
-    // We're done reading from the buffers, so we unmap
-    // them so they can be used again by the device
-    cl_unmapBuffer(this->h_laplacian, this->laplacian);
-    cl_unmapBuffer(this->h_scale, this->scale);
-    cl_unmapBuffer(this->h_pixPos, this->pixPos);
-    cl_unmapBuffer(this->h_desc, this->desc);
-    cl_unmapBuffer(this->h_orientation, this->orientation);
+    this->featuresMapped = true;
 #endif
 
-    return ipts;
+    features->pos = (float2*)(block + offsets[0]);
+    features->scale = (float*)(block + offsets[1]);
+    features->orientation = (float*)(block + offsets[2]);
+    features->laplacian = (int*)(block + offsets[3]);
+    features->descriptors.data = block + offsets[4];
+    if(projectionAlongside) 
+    {
+        features->projected.data = block + offsets[5];
+    }
 }
 
 
-//! Function that builds vector of interest points.  This is the main SURF function
-//! that will be called for any type of input.
+//! Release a FeatureSet returned by retrieveFeatures
 /*!
-    High level driver function for entire OpenSurfOpenCl
-    \param img image to find Ipoints within
-    \param upright Switch for future functionality of upright surf
-    \param fh FastHessian object
+    Unmaps the host buffer so it can be used again by the device
 */
-void Surf::run(IplImage* img, bool upright) 
+void Surf::releaseFeatures(FeatureSet* features)
 {
-
-    if (upright)
+#ifdef OPTIMIZED_TRANSFERS
+    if(this->featuresMapped) 
     {
-        // Extract upright (i.e. not rotation invariant) descriptors
-        printf("Upright surf not supported\n");
-        exit(1);		
+        // We're done reading from the buffer, so we unmap
+        // it so it can be used again by the device
+        cl_unmapBuffer(this->featureStaging.mem, this->featureBlock);
     }
+    this->releaseRetiredStaging();
+#endif
 
-    // Perform the scan sum of the image (populates d_intImage)
-    // GPU kernels: scan (x2), tranpose (x2)
-    this->computeIntegralImage(img);
+    this->featuresMapped = false;
 
-    // Determines the points of interest
-    // GPU kernels: init_det, hessian_det (x12), non_max_suppression (x3)
-    // GPU mem transfer: copies back the number of ipoints 
-    this->numIpts = this->fh->getIpoints(img, this->d_intImage, this->d_laplacian,
-                        this->d_pixPos, this->d_scale, this->maxIpts);
+    memset(features, 0, sizeof(FeatureSet));
+}
 
-    // Verify that there was enough space allocated for the number of
-    // Ipoints found
-    if(this->numIpts >= this->maxIpts) {
-        // If not enough space existed, we need to reallocate space and
-        // run the kernels again
 
-        printf("Not enough space for Ipoints, reallocating and running again\n");
-        this->maxIpts = this->numIpts * 2;
-        this->reallocateIptBuffers();
-        // XXX This was breaking sometimes
-        this->fh->reset();
-        this->numIpts = fh->getIpoints(img, this->d_intImage, 
-            this->d_laplacian, this->d_pixPos, this->d_scale, this->maxIpts);
-    }
+//! Round a feature block section up to the next 32 byte boundary
+static size_t alignFeatureSection(size_t bytes) 
+{
+    return (bytes + 31) & ~(size_t)31;
+}
 
-    printf("There were %d interest points\n", this->numIpts);    
 
-    // Main SURF-64 loop assigns orientations and gets descriptors    
-    if(this->numIpts==0) return;
+//! Gather the ipoint data into the feature block on the device
+/*!
+    The block is a structure of arrays holding the positions, scales, 
+    orientations, laplacians, descriptors and projected descriptors of 
+    the ipoints, each section starting on a 32 byte boundary.  Only the
+    sections that are returned take up space.
+    \param withDescriptors Whether the descriptor sections are packed
+    \param offsets Receives the byte offset of each of the six sections
+    \return The size of the packed data in bytes
+*/
+size_t Surf::packFeatures(bool withDescriptors, size_t* offsets) 
+{
+    bool projectionOnly = (this->pcaComponents > 0 && this->pcaReplace);
+    bool projectionAlongside = (this->pcaComponents > 0 && !this->pcaReplace);
 
-    // GPU kernel: getOrientation1 (1x), getOrientation2 (1x)
-    this->getOrientations(img->width, img->height);
+    size_t pcaBytes = this->pcaComponents * sizeof(float);
 
-    // GPU kernel: surf64descriptor (1x), norm64descriptor (1x)
-    this->createDescriptors(img->width, img->height);
-}
+    cl_mem d_descIn = NULL;
+    cl_mem d_projIn = NULL;
+    size_t descStride = 0;
+    size_t projStride = 0;
+
+    if(withDescriptors) 
+    {
+        if(projectionOnly) 
+        {
+            d_descIn = this->d_projected;
+            descStride = pcaBytes;
+        }
+        else 
+        {
+            d_descIn = this->d_descOut;
+            descStride = this->descBytes;
+        }
+        if(projectionAlongside) 
+        {
+            d_projIn = this->d_projected;
+            projStride = pcaBytes;
+        }
+    }
+
+    // Lay out the sections for the current number of ipoints
+    size_t n = this->numIpts;
+    offsets[0] = 0;
+    offsets[1] = alignFeatureSection(offsets[0] + n * sizeof(float2));
+    offsets[2] = alignFeatureSection(offsets[1] + n * sizeof(float));
+    offsets[3] = alignFeatureSection(offsets[2] + n * sizeof(float));
+    offsets[4] = alignFeatureSection(offsets[3] + n * sizeof(int));
+    offsets[5] = alignFeatureSection(offsets[4] + n * descStride);
+    size_t bytes = offsets[5] + n * projStride;
+
+    // Grow the buffers so they hold the most ipoints there is room for.
+    // Capacities are rounded up to the pool's power-of-two size classes,
+    // so growth is geometric.
+    if(bytes > this->featureBlockBytes) 
+    {
+        size_t capacity = this->maxIpts * (sizeof(float2) + 
+            2 * sizeof(float) + sizeof(int) + descStride + projStride) + 
+            5 * 32;
+        if(capacity < bytes) 
+        {
+            capacity = bytes;
+        }
+        capacity = PinnedPool::roundToClass(capacity);
+
+#ifdef OPTIMIZED_TRANSFERS
+        // With zero-copy the block is packed straight into the staging
+        // buffer, so there is no separate device copy
+        if(!this->zeroCopy) 
+        {
+            cl_freeMem(this->d_featureBlock);
+            this->d_featureBlock = cl_allocBuffer(capacity);
+        }
+#else
+        cl_freeMem(this->d_featureBlock);
+        this->d_featureBlock = cl_allocBuffer(capacity);
+        free(this->featureBlock);
+        this->featureBlock = alloc(capacity);
+#endif
+        this->featureBlockBytes = capacity;
+    }
 
+#ifdef OPTIMIZED_TRANSFERS
+    // A staging buffer still mapped by an unreleased FeatureSet is set 
+    // aside rather than reused, and a fresh one is taken from the pool
+    if(this->featuresMapped) 
+    {
+        this->retiredStaging.push_back(
+            std::make_pair(this->featureStaging, this->featureBlock));
+        this->featureStaging.mem = NULL;
+        this->featureStaging.bytes = 0;
+        this->featuresMapped = false;
+    }
+
+    if(this->featureStaging.bytes < this->featureBlockBytes) 
+    {
+        PinnedPool* pool = getPinnedPool();
+        pool->release(&(this->featureStaging));
+        this->featureStaging = pool->acquire(this->featureBlockBytes);
+    }
+#endif
+
+    cl_mem d_block = this->d_featureBlock;
+#ifdef OPTIMIZED_TRANSFERS
+    if(this->zeroCopy) 
+    {
+        d_block = this->featureStaging.mem;
+    }
+#endif
+
+    // The ipoint buffers are bound once, the sections are set per frame
+    if(this->packKernel == NULL) 
+    {
+        this->packKernel = cl_cloneKernel(cl_getKernel(KERNEL_PACK_FEATURES));
+        cl_kernel kernel = this->packKernel;
+
+        cl_setKernelArg(kernel, 0, sizeof(cl_mem), (void*)&(this->d_pixPos));
+        cl_setKernelArg(kernel, 1, sizeof(cl_mem), (void*)&(this->d_scale));
+        cl_setKernelArg(kernel, 2, sizeof(cl_mem), (void*)&(this->d_orientation));
+        cl_setKernelArg(kernel, 3, sizeof(cl_mem), (void*)&(this->d_laplacian));
+    }
+    cl_kernel pack_kernel = this->packKernel;
+
+    int descWords = (int)(descStride / sizeof(cl_uint));
+    int projWords = (int)(projStride / sizeof(cl_uint));
+    cl_uint scaleOffset = (cl_uint)offsets[1];
+    cl_uint orientationOffset = (cl_uint)offsets[2];
+    cl_uint laplacianOffset = (cl_uint)offsets[3];
+    cl_uint descOffset = (cl_uint)offsets[4];
+    cl_uint projOffset = (cl_uint)offsets[5];
+
+    // One work group per ipoint
+    size_t localWorkSizePack[1] = {(size_t)getTuningProfile()->packLocal};
+    size_t globalWorkSizePack[1] = {this->numIpts * localWorkSizePack[0]};
+
+    cl_setKernelArg(pack_kernel, 4, sizeof(cl_mem), (void*)&d_descIn);
+    cl_setKernelArg(pack_kernel, 5, sizeof(cl_mem), (void*)&d_projIn);
+    cl_setKernelArg(pack_kernel, 6, sizeof(int),    (void*)&(this->numIpts));
+    cl_setKernelArg(pack_kernel, 7, sizeof(int),    (void*)&descWords);
+    cl_setKernelArg(pack_kernel, 8, sizeof(int),    (void*)&projWords);
+    cl_setKernelArg(pack_kernel, 9, sizeof(cl_mem), (void*)&d_block);
+    cl_setKernelArg(pack_kernel, 10, sizeof(cl_uint), (void*)&scaleOffset);
+    cl_setKernelArg(pack_kernel, 11, sizeof(cl_uint), (void*)&orientationOffset);
+    cl_setKernelArg(pack_kernel, 12, sizeof(cl_uint), (void*)&laplacianOffset);
+    cl_setKernelArg(pack_kernel, 13, sizeof(cl_uint), (void*)&descOffset);
+    cl_setKernelArg(pack_kernel, 14, sizeof(cl_uint), (void*)&projOffset);
+
+    cl_executeKernel(pack_kernel, 1, globalWorkSizePack, localWorkSizePack,
+        "PackFeatures");
+
+    return bytes;
+}
+
+
+//! Copy the packed feature block to the host
+/*!
+    \param bytes Number of bytes of the block to copy
+    \param ready If not NULL, the copy is non-blocking and this receives
+           an event that completes when the data has arrived
+    \return Host pointer to the block
+*/
+void* Surf::readFeatureBlock(size_t bytes, cl_event* ready) 
+{
+    // When pipelined, the readback runs on the transfer queue once the 
+    // compute queue has packed the block
+    if(this->readbackOnTransferQueue) 
+    {
+        cl_event packed;
+        cl_enqueueMarker(&packed);
+        cl_flush();
+        cl_selectQueue(CLUTILS_QUEUE_TRANSFER);
+        cl_enqueueWaitForEvent(packed);
+        clReleaseEvent(packed);
+    }
+
+    void* block = this->readFeatureBlockOnQueue(bytes, ready);
+
+    cl_selectQueue(CLUTILS_QUEUE_COMPUTE);
+
+    return block;
+}
+
+
+//! Copy the packed feature block to the host on the active queue
+void* Surf::readFeatureBlockOnQueue(size_t bytes, cl_event* ready) 
+{
+#ifdef OPTIMIZED_TRANSFERS
+    // We're using pinned memory for the transfer.  The data is 
+    // copied back to pinned memory and then must be mapped before
+    // it's usable on the host.  With zero-copy it was packed into the
+    // pinned memory directly, so it only needs mapping.
+    if(this->zeroCopy) 
+    {
+        if(ready != NULL) 
+        {
+            this->featureBlock = cl_mapBufferAsync(this->featureStaging.mem,
+                bytes, CL_MAP_READ, ready);
+        }
+        else 
+        {
+            this->featureBlock = cl_mapBuffer(this->featureStaging.mem, 
+                bytes, CL_MAP_READ);
+        }
+    }
+    else if(ready != NULL) 
+    {
+        this->featureBlock = cl_copyAndMapBufferAsync(
+            this->featureStaging.mem, this->d_featureBlock, bytes, ready);
+    }
+    else 
+    {
+        this->featureBlock = cl_copyAndMapBuffer(this->featureStaging.mem,
+            this->d_featureBlock, bytes);
+    }
+#else
+    if(ready != NULL) 
+    {
+        cl_copyBufferToHostAsync(this->featureBlock, this->d_featureBlock,
+            bytes, ready);
+    }
+    else 
+    {
+        cl_copyBufferToHost(this->featureBlock, this->d_featureBlock, 
+            bytes, CL_TRUE);
+    }
+#endif
+
+    return this->featureBlock;
+}
+
+
+#ifdef OPTIMIZED_TRANSFERS
+//! Unmap the retired staging buffers and return them to the pool
+void Surf::releaseRetiredStaging() 
+{
+    PinnedPool* pool = getPinnedPool();
+
+    for(size_t i = 0; i < this->retiredStaging.size(); i++) 
+    {
+        cl_unmapBuffer(this->retiredStaging[i].first.mem, 
+            this->retiredStaging[i].second);
+        pool->release(&(this->retiredStaging[i].first));
+    }
+    this->retiredStaging.clear();
+}
+#endif
+
+
+//! Function that builds vector of interest points.  This is the main SURF function
+//! that will be called for any type of input.
+/*!
+    High level driver function for entire OpenSurfOpenCl
+    \param img image to find Ipoints within
+    \param upright Switch for future functionality of upright surf
+    \param fh FastHessian object
+*/
+void Surf::run(IplImage* img, bool upright) 
+{
+
+    if (upright)
+    {
+        // Extract upright (i.e. not rotation invariant) descriptors
+        printf("Upright surf not supported\n");
+        exit(1);		
+    }
+
+    this->runStages(img, SURF_STAGE_DETECT, SURF_STAGE_DESCRIBE);
+}
+
+
+//! Run a contiguous range of the SURF pipeline stages
+/*!
+    Stages after SURF_STAGE_DETECT operate on the ipoints already on the
+    device, either detected by a previous call or supplied with 
+    uploadKeypoints.  When the function completes the results are still
+    on the device.
+    \param img The frame to process.  Its integral image is computed first.
+           If NULL, the integral image of the previous frame is reused.
+    \param firstStage The first stage to run (SURF_STAGE_*)
+    \param lastStage The last stage to run (SURF_STAGE_*)
+*/
+void Surf::runStages(IplImage* img, int firstStage, int lastStage) 
+{
+    if(firstStage < SURF_STAGE_DETECT || lastStage > SURF_STAGE_DESCRIBE ||
+       firstStage > lastStage) {
+        printf("Error: Invalid SURF stage range (%d-%d)\n", firstStage, 
+            lastStage);
+        exit(-1);
+    }
+
+    if(img != NULL) 
+    {
+        if(img->width != this->width || img->height != this->height) {
+            printf("Error: Frame size does not match the Surf object\n");
+            exit(-1);
+        }
+
+        // Perform the scan sum of the image (populates d_intImage)
+        // GPU kernels: scan (x2), tranpose (x2)
+        this->computeIntegralImage(img);
+        this->haveIntegralImage = true;
+    }
+    else if(!this->haveIntegralImage) {
+        printf("Error: No frame has been processed yet\n");
+        exit(-1);
+    }
+
+    if(firstStage > SURF_STAGE_DETECT && !this->haveKeypoints) {
+        printf("Error: No ipoints were detected or uploaded for this frame\n");
+        exit(-1);
+    }
+
+    if(firstStage == SURF_STAGE_DETECT) 
+    {
+        // Determines the points of interest
+        // GPU kernels: init_det, hessian_det (x12), non_max_suppression (x3)
+        // GPU mem transfer: copies back the number of ipoints 
+        this->numIpts = this->fh->getIpoints(this->width, this->height, 
+            this->d_intImage, this->d_laplacian, this->d_pixPos, 
+            this->d_scale, this->d_imageIndex, this->maxIpts);
+
+        this->finishDetection();
+    }
+
+    // Main SURF-64/128 loop assigns orientations and gets descriptors    
+    if(this->numIpts==0) return;
+
+    bool orient = (firstStage <= SURF_STAGE_ORIENT && 
+                   lastStage >= SURF_STAGE_ORIENT);
+    bool describe = (lastStage == SURF_STAGE_DESCRIBE);
+
+    // Sort the ipoints so that neighbouring work groups read nearby parts
+    // of the integral image with the same filter sizes.  The image index
+    // of each ipoint of a batch moves with it.
+    if(this->sortKeypoints && !this->keypointsSorted && (orient || describe)) 
+    {
+        this->sortIpoints();
+    }
+
+    // On keypoint-dense frames, precompute the Haar responses shared by
+    // the orientation and descriptor kernels (the maps only cover a 
+    // single image)
+    if(this->haarMapRatio > 0.0f && !this->batchIpoints) 
+    {
+        this->buildHaarMaps(orient, describe);
+    }
+
+    if(orient) 
+    {
+        // GPU kernel: getOrientation1 (1x), getOrientation2 (1x)
+        this->getOrientations(this->width, this->height);
+    }
+
+    if(describe) 
+    {
+        // GPU kernel: surf64descriptor (1x), norm64descriptor (1x)
+        //             (also used to compute the 128-D extended descriptors)
+        this->createDescriptors(this->width, this->height);
+    }
+}
+
+
+//! Detect the ipoints of img without orienting or describing them
+/*!
+    Only the integral image, hessian and non-max suppression kernels are
+    run.  Use retrieveKeypoints to copy the ipoints back to the host.
+*/
+void Surf::detect(IplImage* img) 
+{
+    this->runStages(img, SURF_STAGE_DETECT, SURF_STAGE_DETECT);
+}
+
+
+//! Describe caller supplied keypoints
+/*!
+    Detection is skipped.  The keypoints are uploaded and described in 
+    img, and the descriptors can be retrieved with retrieveDescriptors.
+    \param img The frame in which the keypoints are described
+    \param keypoints The keypoints to describe
+    \param computeOrientation If true, the orientations are recomputed 
+           from img.  Otherwise the orientations of the keypoints are used.
+*/
+void Surf::describe(IplImage* img, IpVec& keypoints, bool computeOrientation) 
+{
+    this->uploadKeypoints(keypoints);
+
+    this->runStages(img, 
+        computeOrientation ? SURF_STAGE_ORIENT : SURF_STAGE_DESCRIBE,
+        SURF_STAGE_DESCRIBE);
+}
+
+
+//! Upload keypoints to the device
+/*!
+    The position, scale, orientation and laplacian of the keypoints 
+    replace the ipoints of the current frame.  The buffers are grown if 
+    there are more keypoints than space allocated.
+    \param keypoints The keypoints to upload
+*/
+void Surf::uploadKeypoints(IpVec& keypoints) 
+{
+    int count = (int)keypoints.size();
+
+    if(count > this->maxIpts) {
+        this->maxIpts = count * 2;
+        this->reallocateIptBuffers();
+    }
+
+    this->numIpts = count;
+    this->haveKeypoints = true;
+    this->keypointsSorted = false;
+    this->batchIpoints = false;
+
+    if(count == 0) {
+        return;
+    }
+
+    float2* pos;
+    float* scales;
+    float* orientations;
+    int* laplacians;
+
+    if(this->zeroCopy) {
+        // Write the keypoints into the buffers in place
+        pos = (float2*)cl_mapBuffer(this->d_pixPos, count * sizeof(float2),
+            CL_MAP_WRITE);
+        scales = (float*)cl_mapBuffer(this->d_scale, count * sizeof(float),
+            CL_MAP_WRITE);
+        orientations = (float*)cl_mapBuffer(this->d_orientation, 
+            count * sizeof(float), CL_MAP_WRITE);
+        laplacians = (int*)cl_mapBuffer(this->d_laplacian, 
+            count * sizeof(int), CL_MAP_WRITE);
+    }
+    else {
+        pos = (float2*)alloc(count * sizeof(float2));
+        scales = (float*)alloc(count * sizeof(float));
+        orientations = (float*)alloc(count * sizeof(float));
+        laplacians = (int*)alloc(count * sizeof(int));
+    }
+
+    for(int i = 0; i < count; i++) {
+        pos[i].x = keypoints[i].x;
+        pos[i].y = keypoints[i].y;
+        scales[i] = keypoints[i].scale;
+        orientations[i] = keypoints[i].orientation;
+        laplacians[i] = keypoints[i].laplacian;
+    }
+
+    if(this->zeroCopy) {
+        cl_unmapBuffer(this->d_pixPos, pos);
+        cl_unmapBuffer(this->d_scale, scales);
+        cl_unmapBuffer(this->d_orientation, orientations);
+        cl_unmapBuffer(this->d_laplacian, laplacians);
+        return;
+    }
+
+    cl_copyBufferToDevice(this->d_pixPos, pos, count * sizeof(float2));
+    cl_copyBufferToDevice(this->d_scale, scales, count * sizeof(float));
+    cl_copyBufferToDevice(this->d_orientation, orientations, 
+        count * sizeof(float));
+    cl_copyBufferToDevice(this->d_laplacian, laplacians, count * sizeof(int));
+
+    free(pos);
+    free(scales);
+    free(orientations);
+    free(laplacians);
+}
+
+
+//! Check the detected ipoints fitted in the buffers
+/*!
+    If they didn't, the buffers are grown and the detection is run again
+    (the integral image is still on the device)
+*/
+void Surf::finishDetection() 
+{
+    // Verify that there was enough space allocated for the number of
+    // Ipoints found
+    if(this->numIpts >= this->maxIpts) {
+        // If not enough space existed, we need to reallocate space and
+        // run the kernels again
+
+        printf("Not enough space for Ipoints, reallocating and running again\n");
+        this->maxIpts = this->numIpts * 2;
+        this->reallocateIptBuffers();
+        // XXX This was breaking sometimes
+        this->fh->reset();
+        this->numIpts = fh->getIpoints(this->width, this->height, 
+            this->d_intImage, this->d_laplacian, this->d_pixPos, 
+            this->d_scale, this->d_imageIndex, this->maxIpts);
+    }
+
+    printf("There were %d interest points\n", this->numIpts);    
+
+    this->haveKeypoints = true;
+    this->keypointsSorted = false;
+    this->batchIpoints = (this->numImages > 1);
+}
+
+
+//! Upload a frame and enqueue its detection without waiting
+/*!
+    The frame is converted on the host and copied on the transfer queue,
+    and the compute queue waits for the copy before integrating it.  The
+    ipoint count is read back without blocking, so this returns as soon
+    as the work is enqueued.  enqueueDescribe completes the frame.
+    \param img The frame (the same size as this object)
+*/
+void Surf::enqueueDetect(IplImage* img) 
+{
+    if(img->width != this->width || img->height != this->height) {
+        printf("Error: Frame size does not match the Surf object\n");
+        exit(-1);
+    }
+
+    if(this->detectionPending) {
+        printf("Error: The previous detection has not been described\n");
+        exit(-1);
+    }
+
+    cl_event uploaded;
+    this->uploadFrameAsync(img, &uploaded);
+
+    // The compute queue picks the frame up once it has arrived
+    cl_enqueueWaitForEvent(uploaded);
+    clReleaseEvent(uploaded);
+
+    cl_mem d_input = (this->d_frame != NULL) ? this->d_frame : 
+        this->d_intImage;
+    this->integrateFrame(d_input, this->width, this->height, 1);
+    this->haveIntegralImage = true;
+
+    // GPU kernels: init_det, hessian_det (x12), non_max_suppression (x3)
+    this->fh->enqueueIpoints(this->width, this->height, this->d_intImage, 
+        this->d_laplacian, this->d_pixPos, this->d_scale, 
+        this->d_imageIndex, this->maxIpts, &(this->detectedEvent));
+    this->detectionPending = true;
+}
+
+
+//! Complete a frame started with enqueueDetect
+/*!
+    Blocks only until the ipoint count of the frame is known (which is 
+    needed to size the remaining stages), then enqueues the orientation
+    and descriptor stages and a non-blocking readback of the features on
+    the transfer queue.
+    \param features Receives the features (see retrieveFeatures)
+    \param ready Receives an event that completes when the features can
+           be read (NULL if there are none).  The caller must release it.
+*/
+void Surf::enqueueDescribe(FeatureSet* features, cl_event* ready) 
+{
+    if(!this->detectionPending) {
+        printf("Error: No detection was enqueued\n");
+        exit(-1);
+    }
+
+    cl_waitForEvent(this->detectedEvent);
+    clReleaseEvent(this->detectedEvent);
+    this->detectionPending = false;
+
+    this->numIpts = this->fh->getIpointCount();
+    this->finishDetection();
+
+    this->runStages(NULL, SURF_STAGE_ORIENT, SURF_STAGE_DESCRIBE);
+
+    this->readbackOnTransferQueue = true;
+    this->retrieveFeatures(features, ready);
+    this->readbackOnTransferQueue = false;
+}
+
+
+//! Convert a frame and copy it to the device on the transfer queue
+/*!
+    The grayscale frame is written into a pinned staging buffer that stays
+    mapped, and copied from there into d_intImage without blocking (with
+    zero-copy it is written straight into the frame buffer instead).  Each
+    Surf object has its own staging buffer, so frames of other objects 
+    can be uploaded while this one computes.
+    \param img The frame
+    \param uploaded Receives an event that completes when the frame is 
+           on the device.  The caller must release it.
+*/
+void Surf::uploadFrameAsync(IplImage* img, cl_event* uploaded) 
+{
+    size_t bytes = sizeof(float) * this->width * this->height;
+
+    cl_selectQueue(CLUTILS_QUEUE_TRANSFER);
+
+    void* frame;
+    if(this->d_frame != NULL) 
+    {
+        frame = cl_mapBuffer(this->d_frame, bytes, CL_MAP_WRITE);
+    }
+    else if(this->frameStaging.mem == NULL) 
+    {
+        // Sized for the largest frame, so it can be kept across changes
+        // of the frame size
+        size_t capacityBytes = sizeof(float) * this->capacityWidth * 
+            this->capacityHeight;
+        this->frameStaging = getPinnedPool()->acquire(capacityBytes);
+        this->frameStagingPtr = cl_mapBuffer(this->frameStaging.mem, 
+            capacityBytes, CL_MAP_WRITE);
+        frame = this->frameStagingPtr;
+    }
+    else 
+    {
+        // The previous upload must be done reading the staging buffer
+        if(this->frameUploadedEvent != NULL) 
+        {
+            cl_waitForEvent(this->frameUploadedEvent);
+            clReleaseEvent(this->frameUploadedEvent);
+            this->frameUploadedEvent = NULL;
+        }
+        frame = this->frameStagingPtr;
+    }
+
+    IplImage* header = cvCreateImageHeader(cvGetSize(img), IPL_DEPTH_32F, 1);
+    cvSetData(header, frame, this->width * sizeof(float));
+    convertToGray(img, header);
+    cvReleaseImageHeader(&header);
+
+    if(this->d_frame != NULL) 
+    {
+        cl_unmapBuffer(this->d_frame, frame);
+    }
+    else if(isUsingImages()) 
+    {
+        cl_copyImageToDevice(this->d_intImage, frame, this->height, 
+            this->width, CL_FALSE);
+    }
+    else 
+    {
+        cl_copyBufferToDevice(this->d_intImage, frame, bytes, CL_FALSE);
+    }
+
+    cl_enqueueMarker(uploaded);
+    cl_flush();
+
+    if(this->d_frame == NULL) 
+    {
+        clRetainEvent(*uploaded);
+        this->frameUploadedEvent = *uploaded;
+    }
+
+    cl_selectQueue(CLUTILS_QUEUE_COMPUTE);
+}
+
+
+//! Copy the keypoints from the GPU to the host
+/*!
+    Only the position, scale, laplacian and orientation are copied.  The
+    orientation is only valid if the orientation stage has run (or the 
+    keypoints were uploaded).
+*/
+IpVec* Surf::retrieveKeypoints() 
+{
+    IpVec* ipts = new IpVec();
+
+    if(this->numIpts == 0) 
+    {
+        return ipts;
+    }
+
+    // Pack the keypoints (without descriptors) and copy them back 
+    // with a single transfer
+    size_t offsets[6];
+    size_t bytes = this->packFeatures(false, offsets);
+
+    char* block = (char*)this->readFeatureBlock(bytes, NULL);
+
+    float2* pixPos = (float2*)(block + offsets[0]);
+    float* scale = (float*)(block + offsets[1]);
+    float* orientation = (float*)(block + offsets[2]);
+    int* laplacian = (int*)(block + offsets[3]);
+
+    for(int i = 0; i < this->numIpts; i++)
+    {
+        Ipoint ipt;
+        ipt.x = pixPos[i].x;
+        ipt.y = pixPos[i].y;
+        ipt.scale = scale[i];
+        ipt.laplacian = laplacian[i];
+        ipt.orientation = orientation[i];
+        ipt.descriptorLength = 0;
+        ipts->push_back(ipt);
+    }
+
+    if(this->restoreOrder && this->keypointsSorted) 
+    {
+        this->restoreDetectionOrder(ipts, NULL, NULL);
+    }
+
+#ifdef OPTIMIZED_TRANSFERS
+    cl_unmapBuffer(this->featureStaging.mem, this->featureBlock);
+#endif
+
+    return ipts;
+}
+
+
+//! Compute descriptors on a regular grid
+/*!
+    Dense extraction replaces detection: a descriptor is computed at every
+    grid point of each scale (with orientation zero).  The Haar responses 
+    are computed once per scale on a lattice with the sample spacing of 
+    that scale, and each descriptor is assembled from shared sub-region 
+    sums, so the cost scales with the image area rather than the number 
+    of grid points.
+    \param img The image to describe
+    \param gridStride The distance between grid points in pixels.  It must
+           be a multiple of each scale, so that the grid points of a scale
+           fall on its lattice.
+    \param scales The scales (sample spacing in pixels) to describe
+    \return The number of descriptors computed
+*/
+int Surf::runDense(IplImage* img, int gridStride, std::vector<int>& scales)
+{
+    // Grid points start far enough from the border that the descriptor
+    // window (12 samples and a Haar filter on each side) fits the image
+    const int firstLattice = 13;
+
+    if(img->width != this->width || img->height != this->height) {
+        printf("Error: Frame size does not match the Surf object\n");
+        exit(-1);
+    }
+
+    // Count the grid points of each scale
+    std::vector<int> gridWidths(scales.size());
+    std::vector<int> gridCounts(scales.size());
+    int total = 0;
+    int maxLattice = 0;
+
+    for(unsigned int k = 0; k < scales.size(); k++) 
+    {
+        int s = scales[k];
+        if(s <= 0 || gridStride <= 0 || gridStride % s != 0) {
+            printf("Error: Dense grid stride (%d) must be a multiple of ", 
+                gridStride);
+            printf("each scale (%d)\n", s);
+            exit(-1);
+        }
+
+        // The last grid point must satisfy (center+12)*s <= size
+        int lastX = this->width/s - 12;
+        int lastY = this->height/s - 12;
+        int gridWidth = 0, gridHeight = 0;
+        if(lastX >= firstLattice && lastY >= firstLattice) {
+            gridWidth = (lastX - firstLattice)/(gridStride/s) + 1;
+            gridHeight = (lastY - firstLattice)/(gridStride/s) + 1;
+        }
+
+        gridWidths[k] = gridWidth;
+        gridCounts[k] = gridWidth*gridHeight;
+        total += gridCounts[k];
+
+        int lattice = ((this->width-1)/s + 1) * ((this->height-1)/s + 1);
+        maxLattice = lattice > maxLattice ? lattice : maxLattice;
+    }
+
+    if(total > this->maxIpts) {
+        this->maxIpts = total;
+        this->reallocateIptBuffers();
+    }
+
+    // Perform the scan sum of the image (populates d_intImage)
+    this->computeIntegralImage(img);
+    this->haveIntegralImage = true;
+    this->haveKeypoints = true;
+    this->keypointsSorted = false;
+    this->batchIpoints = false;
+    this->numIpts = total;
+
+    printf("There were %d grid points\n", this->numIpts);    
+
+    if(total == 0) {
+        return 0;
+    }
+
+    int extended = (this->descSize == DESC_SIZE_EXTENDED);
+
+    // Lattice buffers shared by all of the scales: the responses (which 
+    // are then overwritten by the sub-region sums) and the row sums
+    cl_mem d_responses = cl_allocBuffer(maxLattice * sizeof(float4));
+    cl_mem d_rowSums = cl_allocBuffer(maxLattice * sizeof(float4));
+    cl_mem d_responsesExt = NULL;
+    if(extended) {
+        d_responsesExt = cl_allocBuffer(maxLattice * sizeof(float4));
+    }
+    else {
+        // Unused by the kernels, but an argument must be set
+        d_responsesExt = d_responses;
+    }
+
+    cl_kernel haar_kernel = cl_getKernel(KERNEL_DENSE_HAAR);
+    cl_kernel sums_kernel = cl_getKernel(KERNEL_DENSE_SUMS);
+    cl_kernel assemble_kernel = cl_getKernel(KERNEL_DENSE_DESC);
+
+    int firstDesc = 0;
+
+    for(unsigned int k = 0; k < scales.size(); k++) 
+    {
+        if(gridCounts[k] == 0) continue;
+
+        int s = scales[k];
+        int latticeWidth = (this->width-1)/s + 1;
+        int latticeHeight = (this->height-1)/s + 1;
+
+        size_t localWorkSize[2] = {16, 16};
+        size_t globalWorkSize[2] = {roundUp(latticeWidth, 16), 
+                                    roundUp(latticeHeight, 16)};
+
+        // Haar responses at every lattice point
+        cl_setKernelArg(haar_kernel, 0, sizeof(cl_mem), (void*)&(this->d_intImage));
+        cl_setKernelArg(haar_kernel, 1, sizeof(int),    (void*)&(this->width));
+        cl_setKernelArg(haar_kernel, 2, sizeof(int),    (void*)&(this->height));
+        cl_setKernelArg(haar_kernel, 3, sizeof(int),    (void*)&s);
+        cl_setKernelArg(haar_kernel, 4, sizeof(cl_mem), (void*)&d_responses);
+        cl_setKernelArg(haar_kernel, 5, sizeof(cl_mem), (void*)&d_responsesExt);
+        cl_setKernelArg(haar_kernel, 6, sizeof(int),    (void*)&latticeWidth);
+        cl_setKernelArg(haar_kernel, 7, sizeof(int),    (void*)&latticeHeight);
+        cl_setKernelArg(haar_kernel, 8, sizeof(int),    (void*)&extended);
+
+        cl_executeKernel(haar_kernel, 2, globalWorkSize, localWorkSize,
+            "DenseHaarResponses", k);
+
+        // Gaussian weighted sub-region sums (rows, then columns)
+        int numMaps = extended ? 2 : 1;
+        for(int m = 0; m < numMaps; m++) 
+        {
+            cl_mem d_map = (m == 0) ? d_responses : d_responsesExt;
+
+            for(int vertical = 0; vertical <= 1; vertical++) 
+            {
+                cl_mem d_in = vertical ? d_rowSums : d_map;
+                cl_mem d_out = vertical ? d_map : d_rowSums;
+
+                cl_setKernelArg(sums_kernel, 0, sizeof(cl_mem), (void*)&d_in);
+                cl_setKernelArg(sums_kernel, 1, sizeof(cl_mem), (void*)&d_out);
+                cl_setKernelArg(sums_kernel, 2, sizeof(int),    (void*)&latticeWidth);
+                cl_setKernelArg(sums_kernel, 3, sizeof(int),    (void*)&latticeHeight);
+                cl_setKernelArg(sums_kernel, 4, sizeof(int),    (void*)&s);
+                cl_setKernelArg(sums_kernel, 5, sizeof(int),    (void*)&vertical);
+
+                cl_executeKernel(sums_kernel, 2, globalWorkSize, 
+                    localWorkSize, "DenseWeightedSums", k);
+            }
+        }
+
+        // Assemble the descriptors of this scale from the shared sums
+        int gridStep = gridStride/s;
+
+        size_t localWorkSizeDesc[1] = {16};
+        size_t globalWorkSizeDesc[1] = {(size_t)gridCounts[k]*16};
+
+        cl_setKernelArg(assemble_kernel, 0, sizeof(cl_mem), (void*)&d_responses);
+        cl_setKernelArg(assemble_kernel, 1, sizeof(cl_mem), (void*)&d_responsesExt);
+        cl_setKernelArg(assemble_kernel, 2, sizeof(cl_mem), (void*)&(this->d_desc));
+        cl_setKernelArg(assemble_kernel, 3, sizeof(cl_mem), (void*)&(this->d_length));
+        cl_setKernelArg(assemble_kernel, 4, sizeof(cl_mem), (void*)&(this->d_pixPos));
+        cl_setKernelArg(assemble_kernel, 5, sizeof(cl_mem), (void*)&(this->d_scale));
+        cl_setKernelArg(assemble_kernel, 6, sizeof(cl_mem), (void*)&(this->d_orientation));
+        cl_setKernelArg(assemble_kernel, 7, sizeof(cl_mem), (void*)&(this->d_laplacian));
+        cl_setKernelArg(assemble_kernel, 8, sizeof(cl_mem), (void*)&(this->d_j));
+        cl_setKernelArg(assemble_kernel, 9, sizeof(cl_mem), (void*)&(this->d_i));
+        cl_setKernelArg(assemble_kernel, 10, sizeof(int),   (void*)&latticeWidth);
+        cl_setKernelArg(assemble_kernel, 11, sizeof(int),   (void*)&(gridWidths[k]));
+        cl_setKernelArg(assemble_kernel, 12, sizeof(int),   (void*)&(gridCounts[k]));
+        cl_setKernelArg(assemble_kernel, 13, sizeof(int),   (void*)&firstLattice);
+        cl_setKernelArg(assemble_kernel, 14, sizeof(int),   (void*)&gridStep);
+        cl_setKernelArg(assemble_kernel, 15, sizeof(int),   (void*)&s);
+        cl_setKernelArg(assemble_kernel, 16, sizeof(int),   (void*)&firstDesc);
+        cl_setKernelArg(assemble_kernel, 17, sizeof(int),   (void*)&extended);
+
+        cl_executeKernel(assemble_kernel, 1, globalWorkSizeDesc, 
+            localWorkSizeDesc, "DenseAssembleDescriptors", k);
+
+        firstDesc += gridCounts[k];
+    }
+
+    // The runtime keeps the lattice buffers alive until the kernels 
+    // using them have completed
+    cl_freeMem(d_responses);
+    cl_freeMem(d_rowSums);
+    if(extended) {
+        cl_freeMem(d_responsesExt);
+    }
+
+    // GPU kernel: norm64descriptor (1x)
+    this->normalizeDescriptors();
+
+    return this->numIpts;
+}
+
+
+//! Allocate space for batches of images
+/*!
+    The integral image and hessian response buffers are reallocated to 
+    hold 'images' images one after the other.  Batches need buffers, as 
+    each image would otherwise need its own OpenCL image.
+    \param images The largest number of images in a batch
+*/
+void Surf::setBatchCapacity(int images) 
+{
+    if(images < 1) {
+        printf("Error: Invalid batch capacity (%d)\n", images);
+        exit(-1);
+    }
+
+    if(images == this->batchCapacity) {
+        return;
+    }
+
+    if(isUsingImages()) {
+        printf("Error: Batches of images require buffers\n");
+        exit(-1);
+    }
+
+    if(this->detectionPending) {
+        printf("Error: The previous detection has not been described\n");
+        exit(-1);
+    }
+
+    size_t batchBytes = sizeof(float) * this->capacityWidth * 
+        this->capacityHeight * images;
+
+    this->freeIntegralPlan();
+    this->releaseBoundKernels();
+
+    cl_freeMem(this->d_intImage);
+    cl_freeMem(this->d_tmpIntImage);
+    cl_freeMem(this->d_tmpIntImageT1);
+    cl_freeMem(this->d_tmpIntImageT2);
+
+    this->d_intImage = cl_allocBuffer(batchBytes);
+    this->d_tmpIntImage = cl_allocBuffer(batchBytes);
+    this->d_tmpIntImageT1 = cl_allocBuffer(batchBytes);
+    this->d_tmpIntImageT2 = cl_allocBuffer(batchBytes);
+
+    this->fh->setBatchCapacity(images);
+
+    this->batchCapacity = images;
+    this->numImages = 1;
+    this->haveIntegralImage = false;
+    this->haveKeypoints = false;
+    this->batchIpoints = false;
+}
+
+
+//! Run SURF on a batch of images
+/*!
+    The images are converted into one host buffer and copied to the 
+    device with a single transfer.  Each kernel then covers the whole 
+    batch: the integral image, hessian and non-max suppression kernels 
+    index the images with the third dimension of their NDRange, and the 
+    orientation and descriptor kernels look up the image of each ipoint.
+    Haar response maps are not applied to batches.
+    The results are retrieved with retrieveBatch (or retrieveFeatures 
+    and retrieveImageIndices).
+    \param images The images (all the same size as this object)
+    \param count The number of images.  The batch capacity is grown if
+           it is too small.
+*/
+void Surf::runBatch(IplImage** images, int count) 
+{
+    if(count < 1) {
+        printf("Error: Empty batch\n");
+        exit(-1);
+    }
+
+    // Checked here as well as in setBatchCapacity, which returns early 
+    // when the capacity is large enough
+    if(isUsingImages()) {
+        printf("Error: Batches of images require buffers\n");
+        exit(-1);
+    }
+
+    for(int k = 0; k < count; k++) {
+        if(images[k]->width != this->width || 
+           images[k]->height != this->height) {
+            printf("Error: Frame size does not match the Surf object\n");
+            exit(-1);
+        }
+    }
+
+    if(count > this->batchCapacity) {
+        this->setBatchCapacity(count);
+    }
+
+    // Convert the images to grayscale one after the other
+    int pixels = this->width * this->height;
+    float* batch = (float*)alloc(sizeof(float) * pixels * count);
+
+    for(int k = 0; k < count; k++) {
+        IplImage* header = cvCreateImageHeader(
+            cvSize(this->width, this->height), IPL_DEPTH_32F, 1);
+        cvSetData(header, batch + k*pixels, this->width*sizeof(float));
+        convertToGray(images[k], header);
+        cvReleaseImageHeader(&header);
+    }
+
+    cl_copyBufferToDevice(this->d_intImage, batch, 
+        sizeof(float) * pixels * count);
+    free(batch);
+
+    // GPU kernels: scan (x2), tranpose (x2)
+    this->integrateFrame(this->d_intImage, this->width, this->height, count);
+    this->haveIntegralImage = true;
+
+    this->runStages(NULL, SURF_STAGE_DETECT, SURF_STAGE_DESCRIBE);
+}
+
+
+//! Retrieve the descriptors of the last batch
+/*!
+    \param results Receives a new IpVec per image of the batch, holding
+           the ipoints found in it (release each with delete).  If the 
+           ipoints were not detected in a batch, there is a single IpVec.
+*/
+void Surf::retrieveBatch(std::vector<IpVec*>& results) 
+{
+    IpVec* ipts = this->retrieveDescriptors();
+
+    int images = this->batchIpoints ? this->numImages : 1;
+
+    results.clear();
+    for(int k = 0; k < images; k++) {
+        results.push_back(new IpVec());
+    }
+
+    int* indices = (int*)alloc(ipts->size() * sizeof(int) + sizeof(int));
+    this->retrieveImageIndices(indices);
+
+    for(unsigned int i = 0; i < ipts->size(); i++) {
+        results.at(indices[i])->push_back(ipts->at(i));
+    }
+
+    free(indices);
+    delete ipts;
+}
+
+
+//! Copy the batch image index of each ipoint
+/*!
+    \param indices Receives numIpts indices into the last batch, in the
+           order the ipoints are retrieved in.  They are all 0 if the 
+           ipoints were not detected in a batch.
+*/
+void Surf::retrieveImageIndices(int* indices) 
+{
+    if(!this->batchIpoints) 
+    {
+        for(int i = 0; i < this->numIpts; i++) {
+            indices[i] = 0;
+        }
+        return;
+    }
+
+    if(this->numIpts > 0) 
+    {
+        cl_copyBufferToHost(indices, this->d_imageIndex, 
+            this->numIpts * sizeof(int));
+    }
+
+    // The indices were sorted with the ipoints
+    if(this->restoreOrder && this->keypointsSorted && this->numIpts > 0) 
+    {
+        int* perm = (int*)alloc(this->numIpts * sizeof(int));
+        int* sorted = (int*)alloc(this->numIpts * sizeof(int));
+        this->retrievePermutation(perm);
+        memcpy(sorted, indices, this->numIpts * sizeof(int));
+
+        for(int i = 0; i < this->numIpts; i++) {
+            indices[perm[i]] = sorted[i];
+        }
+
+        free(sorted);
+        free(perm);
+    }
+}
+
+
+//! Change the size of the frames processed
+/*!
+    The buffers are kept: the integral image and response layers of the
+    smaller frame are laid out at the start of them, with the frame width
+    as their row length.  This lets a pool of objects serve images of 
+    many sizes without reallocating (see SurfPool).
+    \param i_width The frame width (at most the capacity width)
+    \param i_height The frame height (at most the capacity height)
+*/
+void Surf::setFrameSize(int i_width, int i_height) 
+{
+    if(i_width == this->width && i_height == this->height) {
+        return;
+    }
+
+    if(i_width < 1 || i_height < 1 || i_width > this->capacityWidth ||
+       i_height > this->capacityHeight) {
+        printf("Error: Frame size %dx%d does not fit the Surf object "
+            "(%dx%d)\n", i_width, i_height, this->capacityWidth, 
+            this->capacityHeight);
+        exit(-1);
+    }
+
+    if(this->detectionPending) {
+        printf("Error: The previous detection has not been described\n");
+        exit(-1);
+    }
+
+    this->width = i_width;
+    this->height = i_height;
+    this->fh->setImageSize(i_width, i_height);
+
+    this->haveIntegralImage = false;
+    this->haveKeypoints = false;
+    this->numIpts = 0;
+}
+
+
+//! Detect with kernels specialised for the frame size
+/*!
+    The hessian determinant is computed with a program built for each 
+    response layer of the frame size, with the sizes as constants.  The
+    first frame of each size pays for the builds (unless the binaries are
+    in the program cache).
+    \param enable Use the specialised kernels
+*/
+void Surf::setSpecialisedKernels(bool enable) 
+{
+    this->fh->setSpecialisedKernels(enable);
+}
+
+
+//! Return the width of the frames processed
+int Surf::getWidth() 
+{
+    return this->width;
+}
+
+
+//! Return the height of the frames processed
+int Surf::getHeight() 
+{
+    return this->height;
+}
+
+
+//! Return the largest frame width the buffers have space for
+int Surf::getCapacityWidth() 
+{
+    return this->capacityWidth;
+}
+
+
+//! Return the largest frame height the buffers have space for
+int Surf::getCapacityHeight() 
+{
+    return this->capacityHeight;
+}
+
+
+//! Return the approximate size of the device buffers in bytes
+/*!
+    Counts the integral image, response layer, ipoint, Haar map and 
+    feature block buffers (the constant tables are ignored)
+*/
+size_t Surf::getDeviceBytes() 
+{
+    size_t pixels = (size_t)this->capacityWidth * this->capacityHeight;
+
+    // Integral image and the intermediate scans
+    size_t bytes = 4 * sizeof(float) * pixels * this->batchCapacity;
+
+    bytes += this->fh->getDeviceBytes();
+
+    // Per-ipoint buffers
+    size_t iptBytes = sizeof(float2) + 2 * sizeof(float) + 2 * sizeof(int) +
+        DESC_SIZE * sizeof(float) + this->descSize * sizeof(float) + 
+        121 * sizeof(float4);
+    if(this->descFormat != DESC_FORMAT_FP32) {
+        iptBytes += this->descBytes;
+    }
+    if(this->pcaComponents > 0) {
+        iptBytes += this->pcaComponents * sizeof(float);
+    }
+    bytes += iptBytes * this->maxIpts;
+
+    bytes += (size_t)this->haarMapCapacity * pixels * sizeof(float2);
+    bytes += this->featureBlockBytes;
+
+    return bytes;
+}
+
+
+//! Enable precomputed Haar response maps
+/*!
+    The orientation and descriptor kernels sample Haar wavelets at 
+    integer positions with filters of 4 and 2 times the rounded ipoint 
+    scale, so on keypoint-dense frames the same responses are computed 
+    many times.  A map of the responses at every pixel costs one 
+    evaluation per pixel, so it is built for a filter size when the 
+    number of samples at that size exceeds ratio times the number of 
+    pixels.  At most MAX_HAAR_MAPS maps are kept.
+    \param ratio The samples per pixel above which a map is built.  Values
+           around 1 trade memory for fewer integral image reads, and 0 
+           disables the maps.
+*/
+void Surf::setHaarMapRatio(float ratio) 
+{
+    this->haarMapRatio = ratio;
+
+    if(ratio <= 0.0f) 
+    {
+        // Fall back to the integral image for every filter size
+        for(int k = 0; k < HAAR_MAP_TABLE_SIZE; k++) {
+            this->haarMapSlot[k] = -1;
+        }
+        this->uploadHaarMapSlots();
+
+        cl_freeMem(this->d_haarMaps);
+        this->d_haarMaps = NULL;
+        this->haarMapCapacity = 0;
+        this->releaseBoundKernels();
+    }
+}
+
+
+//! Build the Haar response maps for the busiest filter sizes
+/*!
+    \param orient Whether the orientation stage will run
+    \param describe Whether the descriptor stage will run
+*/
+void Surf::buildHaarMaps(bool orient, bool describe) 
+{
+    // Samples per ipoint taken by each kernel
+    const int orientSamples = 109;
+    const int describeSamples = 16*81;
+
+    // Count the ipoints at each rounded scale
+    int histogram[HAAR_MAP_TABLE_SIZE];
+    memset(histogram, 0, sizeof(histogram));
+    cl_copyBufferToDevice(this->d_haarHistogram, histogram, sizeof(histogram));
+
+    cl_kernel histogram_kernel = cl_getKernel(KERNEL_HAAR_HISTOGRAM);
+
+    size_t localWorkSize[1] = {64};
+    size_t globalWorkSize[1] = {roundUp(this->numIpts, 64)};
+
+    cl_setKernelArg(histogram_kernel, 0, sizeof(cl_mem), (void*)&(this->d_scale));
+    cl_setKernelArg(histogram_kernel, 1, sizeof(int),    (void*)&(this->numIpts));
+    cl_setKernelArg(histogram_kernel, 2, sizeof(cl_mem), (void*)&(this->d_haarHistogram));
+
+    cl_executeKernel(histogram_kernel, 1, globalWorkSize, localWorkSize,
+        "HaarScaleHistogram");
+
+    cl_copyBufferToHost(histogram, this->d_haarHistogram, sizeof(histogram));
+
+    // Number of samples at each filter size (indexed by half the size)
+    double samples[HAAR_MAP_TABLE_SIZE];
+    for(int k = 0; k < HAAR_MAP_TABLE_SIZE; k++) {
+        samples[k] = 0.0;
+    }
+    for(int s = 1; s < HAAR_MAP_TABLE_SIZE; s++) {
+        if(describe) {
+            samples[s] += (double)histogram[s] * describeSamples;
+        }
+        if(orient && 2*s < HAAR_MAP_TABLE_SIZE) {
+            samples[2*s] += (double)histogram[s] * orientSamples;
+        }
+    }
+
+    // Assign slots to the busiest filter sizes that are worth a map
+    double minSamples = (double)this->haarMapRatio * this->width * 
+        this->height;
+    int numMaps = 0;
+
+    for(int k = 0; k < HAAR_MAP_TABLE_SIZE; k++) {
+        this->haarMapSlot[k] = -1;
+    }
+    while(numMaps < MAX_HAAR_MAPS) 
+    {
+        int busiest = 0;
+        for(int k = 1; k < HAAR_MAP_TABLE_SIZE; k++) {
+            if(samples[k] > samples[busiest]) busiest = k;
+        }
+        if(samples[busiest] <= minSamples) break;
+
+        this->haarMapSlot[busiest] = numMaps++;
+        samples[busiest] = 0.0;
+    }
+
+    // Grow the maps if needed (they are kept between frames)
+    if(numMaps > this->haarMapCapacity) 
+    {
+        cl_freeMem(this->d_haarMaps);
+        this->d_haarMaps = cl_allocBuffer((size_t)numMaps * 
+            this->capacityWidth * this->capacityHeight * sizeof(float2));
+        this->haarMapCapacity = numMaps;
+        this->releaseBoundKernels();
+    }
+
+    // Compute the maps
+    cl_kernel map_kernel = cl_getKernel(KERNEL_HAAR_MAP);
+
+    size_t localWorkSizeMap[2] = {16, 16};
+    size_t globalWorkSizeMap[2] = {roundUp(this->width, 16), 
+                                   roundUp(this->height, 16)};
+
+    for(int k = 0; k < HAAR_MAP_TABLE_SIZE; k++) 
+    {
+        if(this->haarMapSlot[k] < 0) continue;
+
+        int filterSize = 2*k;
+
+        cl_setKernelArg(map_kernel, 0, sizeof(cl_mem), (void*)&(this->d_intImage));
+        cl_setKernelArg(map_kernel, 1, sizeof(int),    (void*)&(this->width));
+        cl_setKernelArg(map_kernel, 2, sizeof(int),    (void*)&(this->height));
+        cl_setKernelArg(map_kernel, 3, sizeof(int),    (void*)&filterSize);
+        cl_setKernelArg(map_kernel, 4, sizeof(cl_mem), (void*)&(this->d_haarMaps));
+        cl_setKernelArg(map_kernel, 5, sizeof(int),    (void*)&(this->haarMapSlot[k]));
+
+        cl_executeKernel(map_kernel, 2, globalWorkSizeMap, localWorkSizeMap,
+            "ComputeHaarMap", filterSize);
+    }
+
+    this->uploadHaarMapSlots();
+}
+
+
+//! Upload the table mapping filter sizes to Haar map slots
+void Surf::uploadHaarMapSlots() 
+{
+    cl_copyBufferToDevice(this->d_haarMapSlot, this->haarMapSlot, 
+        HAAR_MAP_TABLE_SIZE * sizeof(int));
+}
+
+
+//! Enable sorting of the ipoints before orientation and description
+/*!
+    The non-max suppression kernel appends ipoints in effectively random 
+    order.  When sorting is enabled, the ipoints are sorted on the device 
+    by rounded scale and then by the Morton code of their position, so 
+    consecutive work groups of the orientation and descriptor kernels 
+    read nearby parts of the integral image with the same filter sizes.
+    \param enable Whether to sort the ipoints
+    \param detectionOrder If true, the retrieved ipoints are permuted back
+           into the order they were detected (or uploaded) in
+*/
+void Surf::setKeypointSorting(bool enable, bool detectionOrder) 
+{
+    this->sortKeypoints = enable;
+    this->restoreOrder = enable && detectionOrder;
+
+    this->freeSortBuffers();
+    if(enable) {
+        this->allocateSortBuffers(this->maxIpts);
+    }
+}
+
+
+//! Copy the permutation applied by the last sort
+/*!
+    \param perm Receives numIpts indices: perm[i] is the detection index 
+           of the i-th sorted ipoint.  If the ipoints were not sorted, 
+           this is the identity.
+*/
+void Surf::retrievePermutation(int* perm) 
+{
+    if(!this->keypointsSorted) 
+    {
+        for(int i = 0; i < this->numIpts; i++) {
+            perm[i] = i;
+        }
+        return;
+    }
+
+    cl_copyBufferToHost(perm, this->d_sortIndices, 
+        this->numIpts * sizeof(int));
+}
+
+
+//! Allocate the buffers used to sort the ipoints
+/*!
+    \param size The number of ipoints to allocate space for
+*/
+void Surf::allocateSortBuffers(int size) 
+{
+    // The bitonic sort requires a power of two number of keys
+    this->sortCapacity = 1;
+    while(this->sortCapacity < size) {
+        this->sortCapacity <<= 1;
+    }
+
+    this->d_sortKeys = cl_allocBuffer(this->sortCapacity * sizeof(cl_uint));
+    this->d_sortIndices = cl_allocBuffer(this->sortCapacity * sizeof(int));
+
+    this->d_sortedPixPos = cl_allocBuffer(size * sizeof(float2));
+    this->d_sortedScale = cl_allocBuffer(size * sizeof(float));
+    this->d_sortedLaplacian = cl_allocBuffer(size * sizeof(int));
+    this->d_sortedOrientation = cl_allocBuffer(size * sizeof(float));
+    this->d_sortedImageIndex = cl_allocBuffer(size * sizeof(int));
+}
+
+
+//! Release the buffers used to sort the ipoints
+void Surf::freeSortBuffers() 
+{
+    cl_freeMem(this->d_sortKeys);
+    cl_freeMem(this->d_sortIndices);
+    cl_freeMem(this->d_sortedPixPos);
+    cl_freeMem(this->d_sortedScale);
+    cl_freeMem(this->d_sortedLaplacian);
+    cl_freeMem(this->d_sortedOrientation);
+    cl_freeMem(this->d_sortedImageIndex);
+
+    this->d_sortKeys = NULL;
+    this->d_sortIndices = NULL;
+    this->d_sortedPixPos = NULL;
+    this->d_sortedScale = NULL;
+    this->d_sortedLaplacian = NULL;
+    this->d_sortedOrientation = NULL;
+    this->d_sortedImageIndex = NULL;
+    this->sortCapacity = 0;
+}
+
+
+//! Sort the ipoints on the device by scale and position
+/*!
+    Computes a key per ipoint, sorts the (key, index) pairs with a bitonic
+    sort and gathers the ipoint data into sorted order.  The permutation 
+    is kept in d_sortIndices.  Each stage of the sort runs its steps with
+    pairs in different work groups as separate launches, and the rest in
+    local memory in a single launch.
+*/
+void Surf::sortIpoints() 
+{
+    if(this->numIpts < 2) 
+    {
+        return;
+    }
+
+    // Only the next power of two above numIpts is sorted
+    int count = 1;
+    while(count < this->numIpts) {
+        count <<= 1;
+    }
+
+    size_t localWorkSize[1] = {count < 64 ? (size_t)count : 64};
+    size_t globalWorkSize[1] = {(size_t)count};
+
+    // Compute the keys
+    cl_kernel keys_kernel = cl_getKernel(KERNEL_SORT_KEYS);
+
+    cl_setKernelArg(keys_kernel, 0, sizeof(cl_mem), (void*)&(this->d_pixPos));
+    cl_setKernelArg(keys_kernel, 1, sizeof(cl_mem), (void*)&(this->d_scale));
+    cl_setKernelArg(keys_kernel, 2, sizeof(int),    (void*)&(this->numIpts));
+    cl_setKernelArg(keys_kernel, 3, sizeof(cl_mem), (void*)&(this->d_sortKeys));
+    cl_setKernelArg(keys_kernel, 4, sizeof(cl_mem), (void*)&(this->d_sortIndices));
+
+    cl_executeKernel(keys_kernel, 1, globalWorkSize, localWorkSize,
+        "ComputeSortKeys");
+
+    // Bitonic sort of the (key, index) pairs
+    cl_kernel sort_kernel = cl_getKernel(KERNEL_BITONIC_SORT);
+    cl_kernel sortLocal_kernel = cl_getKernel(KERNEL_BITONIC_SORT_LOCAL);
+
+    // The local steps use the largest power of two work group (up to 
+    // SORT_LOCAL_SIZE) the device supports
+    size_t sortLocal = SORT_LOCAL_SIZE;
+    while(sortLocal > cl_getDeviceCaps()->maxWorkGroupSize) {
+        sortLocal >>= 1;
+    }
+    if(sortLocal > (size_t)count) {
+        sortLocal = count;
+    }
+    size_t localWorkSizeSort[1] = {sortLocal};
+
+    cl_setKernelArg(sort_kernel, 0, sizeof(cl_mem), (void*)&(this->d_sortKeys));
+    cl_setKernelArg(sort_kernel, 1, sizeof(cl_mem), (void*)&(this->d_sortIndices));
+
+    cl_setKernelArg(sortLocal_kernel, 0, sizeof(cl_mem), (void*)&(this->d_sortKeys));
+    cl_setKernelArg(sortLocal_kernel, 1, sizeof(cl_mem), (void*)&(this->d_sortIndices));
+    cl_setKernelArg(sortLocal_kernel, 4, sortLocal*sizeof(cl_uint), NULL);
+    cl_setKernelArg(sortLocal_kernel, 5, sortLocal*sizeof(int), NULL);
+
+    for(int k = 2; k <= count; k <<= 1) 
+    {
+        int j = k >> 1;
+
+        // Steps whose pairs span work groups
+        for(; j >= (int)sortLocal; j >>= 1) 
+        {
+            cl_setKernelArg(sort_kernel, 2, sizeof(int), (void*)&j);
+            cl_setKernelArg(sort_kernel, 3, sizeof(int), (void*)&k);
+
+            cl_executeKernel(sort_kernel, 1, globalWorkSize, localWorkSize,
+                "BitonicSortStep");
+        }
+
+        // The remaining steps of the stage in local memory
+        cl_setKernelArg(sortLocal_kernel, 2, sizeof(int), (void*)&j);
+        cl_setKernelArg(sortLocal_kernel, 3, sizeof(int), (void*)&k);
+
+        cl_executeKernel(sortLocal_kernel, 1, globalWorkSize, 
+            localWorkSizeSort, "BitonicSortLocal", k);
+    }
+
+    // Gather the ipoints into sorted order
+    cl_kernel permute_kernel = cl_getKernel(KERNEL_PERMUTE_IPTS);
+
+    size_t globalWorkSizePermute[1] = {roundUp(this->numIpts, 64)};
+    size_t localWorkSizePermute[1] = {64};
+
+    cl_setKernelArg(permute_kernel, 0, sizeof(cl_mem), (void*)&(this->d_sortIndices));
+    cl_setKernelArg(permute_kernel, 1, sizeof(int),    (void*)&(this->numIpts));
+    cl_setKernelArg(permute_kernel, 2, sizeof(cl_mem), (void*)&(this->d_pixPos));
+    cl_setKernelArg(permute_kernel, 3, sizeof(cl_mem), (void*)&(this->d_scale));
+    cl_setKernelArg(permute_kernel, 4, sizeof(cl_mem), (void*)&(this->d_laplacian));
+    cl_setKernelArg(permute_kernel, 5, sizeof(cl_mem), (void*)&(this->d_orientation));
+    cl_setKernelArg(permute_kernel, 6, sizeof(cl_mem), (void*)&(this->d_imageIndex));
+    cl_setKernelArg(permute_kernel, 7, sizeof(cl_mem), (void*)&(this->d_sortedPixPos));
+    cl_setKernelArg(permute_kernel, 8, sizeof(cl_mem), (void*)&(this->d_sortedScale));
+    cl_setKernelArg(permute_kernel, 9, sizeof(cl_mem), (void*)&(this->d_sortedLaplacian));
+    cl_setKernelArg(permute_kernel, 10, sizeof(cl_mem), (void*)&(this->d_sortedOrientation));
+    cl_setKernelArg(permute_kernel, 11, sizeof(cl_mem), (void*)&(this->d_sortedImageIndex));
+
+    cl_executeKernel(permute_kernel, 1, globalWorkSizePermute, 
+        localWorkSizePermute, "PermuteIpoints");
+
+    // Copy the sorted ipoints back rather than swapping the buffers, so 
+    // the recorded detection launches keep writing to the same buffers
+    cl_copyBufferToBuffer(this->d_pixPos, this->d_sortedPixPos, 
+        this->numIpts * sizeof(float2));
+    cl_copyBufferToBuffer(this->d_scale, this->d_sortedScale, 
+        this->numIpts * sizeof(float));
+    cl_copyBufferToBuffer(this->d_laplacian, this->d_sortedLaplacian, 
+        this->numIpts * sizeof(int));
+    cl_copyBufferToBuffer(this->d_orientation, this->d_sortedOrientation, 
+        this->numIpts * sizeof(float));
+    cl_copyBufferToBuffer(this->d_imageIndex, this->d_sortedImageIndex, 
+        this->numIpts * sizeof(int));
+
+    this->keypointsSorted = true;
+}
+
+
+//! Put retrieved ipoints back in detection order
+/*!
+    \param ipts The ipoints (in sorted order)
+    \param compact If not NULL, descriptors in sorted order
+    \param projected If not NULL, projected descriptors in sorted order
+*/
+void Surf::restoreDetectionOrder(IpVec* ipts, DescriptorSet* compact, 
+                                 DescriptorSet* projected) 
+{
+    int* perm = (int*)alloc(this->numIpts * sizeof(int));
+    this->retrievePermutation(perm);
+
+    IpVec sorted(*ipts);
+    for(int i = 0; i < this->numIpts; i++) {
+        ipts->at(perm[i]) = sorted[i];
+    }
+
+    // Descriptor sets are permuted a row at a time
+    DescriptorSet* sets[2] = {compact, projected};
+    for(int k = 0; k < 2; k++) 
+    {
+        if(sets[k] == NULL || sets[k]->data == NULL) continue;
+
+        size_t stride = sets[k]->stride;
+        char* src = (char*)sets[k]->data;
+        char* dst = (char*)alloc(this->numIpts * stride);
+        for(int i = 0; i < this->numIpts; i++) {
+            memcpy(dst + perm[i]*stride, src + i*stride, stride);
+        }
+        free(src);
+        sets[k]->data = dst;
+    }
+
+    free(perm);
+}
+
+
+//! Convert a FeatureSet to Ipoints
+/*!
+    The descriptors are decoded to floats.  This copies all of the data, 
+    so it should only be used by callers that need an IpVec.
+    \param features The features to convert
+    \return A new IpVec (release with delete)
+*/
+IpVec* featureSetToIpVec(FeatureSet& features)
+{
+    IpVec* ipts = new IpVec(features.count);
+
+    DescriptorSet& descs = features.descriptors;
+
+    for(int i = 0; i < features.count; i++)
+    {		
+        Ipoint& ipt = ipts->at(i);
+        ipt.x = features.pos[i].x;
+        ipt.y = features.pos[i].y;
+        ipt.scale = features.scale[i];
+        ipt.laplacian = features.laplacian[i];
+        ipt.orientation = features.orientation[i];
+        ipt.descriptorLength = descs.length;
+        decodeDescriptor((char*)descs.data + i*descs.stride, descs.format,
+            descs.length, ipt.descriptor);
+    }
+
+    return ipts;
+}
 
@@ -60,13 +60,39 @@
 
 #include "fasthessian.h"
 #include "eventlist.h"
+#include "pinnedpool.h"
 
 // Uncomment the following define to use optimized data transfers
 // when possible.  Note that AMD's use of memory mapping is 
 // different than NVIDIA, so it will crash on NVIDIA's devices
 #define OPTIMIZED_TRANSFERS
 
+// Alignment of host memory wrapped by zero-copy buffers (a page)
+#define ZERO_COPY_ALIGNMENT 4096
+
+// Length of the standard (SURF-64) and extended (SURF-128) descriptors
 #define DESC_SIZE 64
+#define DESC_SIZE_EXTENDED 128
+
+// Output formats for the descriptors.  The conversion is applied by the 
+// normalization kernel, so only the compact form is copied back to the host
+#define DESC_FORMAT_FP32 0
+#define DESC_FORMAT_FP16 1
+#define DESC_FORMAT_INT8 2
+#define DESC_FORMAT_BINARY 3        // Sign bit per component
+// The magnitude bits are set when a component of the L2-normalized 
+// descriptor exceeds 1/sqrt(length), its RMS value.  Bits are packed 
+// into 32-bit words, sign bits first.
+#define DESC_FORMAT_BINARY_MAG 4    // Sign and magnitude bit per component
+#define DESC_FORMAT_PCA 5           // Leading PCA components (fp32)
+
+// Fixed scale applied to the L2-normalized descriptors before they are 
+// rounded to int8.  Components of normalized SURF descriptors rarely
+// exceed 0.5 in magnitude, larger values saturate.
+#define DESC_INT8_SCALE 256.0f
+
+// Largest number of video frames in one batch (-y)
+#define MAX_BATCH_IMAGES 16
 
 //! Ipoint structure holds a interest point descriptor
 typedef struct{
@@ -76,18 +102,62 @@ typedef struct{
         float orientation;
         int laplacian;
         int clusterIndex;
-        float descriptor[64];
+        int descriptorLength;   // Number of valid entries in descriptor
+        float descriptor[DESC_SIZE_EXTENDED];
 } Ipoint;
 
 typedef std::vector<Ipoint> IpVec;
 
+// Defined in pca.h
+struct PcaProjection;
+
+// Stages of the SURF pipeline, in the order they run.  Surf::runStages
+// executes any contiguous range of them.
+#define SURF_STAGE_DETECT 0     // Hessian determinants and non-max suppression
+#define SURF_STAGE_ORIENT 1     // Orientation assignment
+#define SURF_STAGE_DESCRIBE 2   // Descriptor creation and normalization
+
+// Precomputed Haar response maps are looked up by half the filter size
+// (filters are 2 or 4 times the rounded ipoint scale).  At most 
+// MAX_HAAR_MAPS maps of a float2 per pixel are kept.
+#define HAAR_MAP_TABLE_SIZE 64
+#define MAX_HAAR_MAPS 8
+
+// Work group size of the bitonic sort steps that run in local memory 
+// (reduced to what the device supports)
+#define SORT_LOCAL_SIZE 256
+
+//! DescriptorSet holds descriptors in their compact output format
+typedef struct{
+        int format;         // One of DESC_FORMAT_*
+        int length;         // Number of components per descriptor
+        int count;          // Number of descriptors
+        size_t stride;      // Size in bytes of each descriptor
+        void* data;         // count*stride bytes of descriptor data
+} DescriptorSet;
+
+//! FeatureSet is a structure of arrays view of the retrieved ipoints.  The
+//! arrays point directly into the host buffers the data was copied to, 
+//! and are only valid until Surf::releaseFeatures is called.
+typedef struct{
+        int count;                  // Number of ipoints
+        float2* pos;                // (x, y) position of each ipoint
+        float* scale;
+        float* orientation;
+        int* laplacian;
+        DescriptorSet descriptors;  // Descriptors in the output format
+        DescriptorSet projected;    // PCA projection (if computed in 
+                                    // addition to the descriptors)
+} FeatureSet;
+
 class Surf {
 
   public:
     
     Surf(int initialPoints, int i_height, int i_width,  int octaves, 
            int intervals, int sample_step, float threshold, 
-           cl_kernel* kernel_list);
+           cl_kernel* kernel_list, bool extended = false,
+           int descFormat = DESC_FORMAT_FP32);
 
     ~Surf();
     
@@ -100,26 +170,197 @@ class Surf {
     //! Calculate Orientation for each Ipoint
     void  getOrientations(int i_width, int i_height);
 
+    //! Return the length of the descriptors (64 or 128)
+    int getDescriptorSize();
+
+    //! Return the output format of the descriptors (DESC_FORMAT_*)
+    int getDescriptorFormat();
+
     //! Rellocate OpenCL buffers if the number of ipoints is too high
     void reallocateIptBuffers();
 
     //! Resets the object state so that SURF can be run on a new frame
     void reset();
 
-    //! Copy the descriptors from the GPU to the host
-    IpVec* retrieveDescriptors();
+    //! Copy the descriptors from the GPU to the host.  If compact is 
+    //! supplied, it also receives the descriptors in the output format,
+    //! and projected receives the PCA-projected descriptors
+    IpVec* retrieveDescriptors(DescriptorSet* compact = NULL, 
+                               DescriptorSet* projected = NULL);
+
+    //! Project the descriptors onto a PCA basis on the device.  If 
+    //! replaceDescriptors is set, only the projection is copied back
+    void setProjection(PcaProjection* pca, bool replaceDescriptors = false);
 
     //! Run the main SURF loop
     void run(IplImage* img, bool upright);
 
+    //! Run a contiguous range of the pipeline stages (SURF_STAGE_*).  If
+    //! img is NULL, the integral image of the previous frame is reused
+    void runStages(IplImage* img, int firstStage, int lastStage);
+
+    //! Detect the ipoints of img without orienting or describing them
+    void detect(IplImage* img);
+
+    //! Describe caller supplied keypoints in img.  If computeOrientation
+    //! is false, the orientations of the keypoints are used as they are
+    void describe(IplImage* img, IpVec& keypoints, bool computeOrientation);
+
+    //! Upload keypoints (x, y, scale, orientation and laplacian) to the
+    //! device, replacing any detected ipoints
+    void uploadKeypoints(IpVec& keypoints);
+
+    //! Copy the keypoints (without descriptors) from the GPU to the host
+    IpVec* retrieveKeypoints();
+
+    //! Copy the ipoints from the GPU and return them as a structure of
+    //! arrays backed by the host transfer buffer (no host copy).  If 
+    //! ready is given the transfer is non-blocking and the data may only
+    //! be read once the returned event completes.
+    void retrieveFeatures(FeatureSet* features, cl_event* ready = NULL);
+
+    //! Release a FeatureSet returned by retrieveFeatures
+    void releaseFeatures(FeatureSet* features);
+
+    //! Precompute Haar response maps for the filter sizes whose Haar 
+    //! samples exceed ratio times the number of pixels (0 disables)
+    void setHaarMapRatio(float ratio);
+
+    //! Sort the ipoints by scale and position on the device before the
+    //! orientation and descriptor stages.  If detectionOrder is set, the
+    //! results are returned in the order the ipoints were detected (or
+    //! uploaded) instead of in sorted order.
+    void setKeypointSorting(bool enable, bool detectionOrder = false);
+
+    //! Copy the permutation applied by the last sort: perm[i] is the 
+    //! detection index of the i-th sorted ipoint
+    void retrievePermutation(int* perm);
+
+    //! Upload img on the transfer queue and enqueue its detection 
+    //! without waiting for the device (used by SurfPipeline)
+    void enqueueDetect(IplImage* img);
+
+    //! Wait for the detection started by enqueueDetect, enqueue the 
+    //! orientation and descriptor stages and start a non-blocking 
+    //! readback of the features on the transfer queue.  The features may
+    //! be read once ready completes (see retrieveFeatures).
+    void enqueueDescribe(FeatureSet* features, cl_event* ready);
+
+    //! Compute upright descriptors on a regular grid of img at each of 
+    //! the given (integer) scales instead of detecting ipoints.  Returns
+    //! the number of descriptors, which are retrieved as usual.
+    int runDense(IplImage* img, int gridStride, std::vector<int>& scales);
+
+    //! Allocate space for batches of up to 'images' images (buffers only)
+    void setBatchCapacity(int images);
+
+    //! Run SURF on a batch of images the size of this object in one set
+    //! of kernel launches.  The ipoints of all the images are kept on the
+    //! device together, each tagged with the index of its image.
+    void runBatch(IplImage** images, int count);
+
+    //! Copy the descriptors of the last batch back, split per image
+    void retrieveBatch(std::vector<IpVec*>& results);
+
+    //! Copy the batch image index of each ipoint (0 if the ipoints were 
+    //! not detected in a batch)
+    void retrieveImageIndices(int* indices);
+
+    //! Process frames of a different size, up to the size the object was
+    //! created for, in the existing buffers
+    void setFrameSize(int i_width, int i_height);
+
+    //! Detect with kernels built for the frame size, which is passed to
+    //! the compiler as constants
+    void setSpecialisedKernels(bool enable);
+
+    //! Return the size of the frames processed
+    int getWidth();
+    int getHeight();
+
+    //! Return the largest frame size the buffers have space for
+    int getCapacityWidth();
+    int getCapacityHeight();
+
+    //! Return the approximate size of the device buffers in bytes
+    size_t getDeviceBytes();
+
   private:
 
     // The actual number of ipoints for this image
     int numIpts; 
 
+    //! Size of the images processed by this object
+    int width;
+    int height;
+
+    //! Size of the images the buffers are allocated for (frames may be
+    //! smaller, see setFrameSize)
+    int capacityWidth;
+    int capacityHeight;
+
+    //! Whether the integral image holds a frame
+    bool haveIntegralImage;
+
+    //! Number of images the integral image has space for, and the number
+    //! it holds.  The images of a batch are stored one after the other.
+    int batchCapacity;
+    int numImages;
+
+    //! Whether the ipoints were detected in a batch (and d_imageIndex 
+    //! holds the image of each)
+    bool batchIpoints;
+
+    //! Whether ipoints have been detected or uploaded for this frame
+    bool haveKeypoints;
+
+    //! Whether the ipoints are sorted before orientation and description
+    bool sortKeypoints;
+
+    //! Whether results are returned in detection order when sorting
+    bool restoreOrder;
+
+    //! Whether the ipoints of this frame have been sorted
+    bool keypointsSorted;
+
+    //! Whether the host buffers are mapped by a FeatureSet
+    bool featuresMapped;
+
+    //! Whether a detection started by enqueueDetect hasn't been waited on
+    bool detectionPending;
+
+    //! Completes when the ipoint count of the pending detection arrives
+    cl_event detectedEvent;
+
+    //! Whether the feature block is read back on the transfer queue
+    bool readbackOnTransferQueue;
+
+    //! Pinned buffer frames are staged in for asynchronous uploads.  It
+    //! stays mapped, and the host pointer is the source of the uploads.
+    PinnedBuffer frameStaging;
+    void* frameStagingPtr;
+
+    //! Completes when the last upload from the staging buffer is done
+    cl_event frameUploadedEvent;
+
     //! The amount of ipoints we have allocated space for
     int maxIpts;
 
+    //! Length of each descriptor (DESC_SIZE or DESC_SIZE_EXTENDED)
+    int descSize;
+
+    //! Output format of the descriptors (DESC_FORMAT_*)
+    int descFormat;
+
+    //! Size in bytes of a descriptor in the output format
+    size_t descBytes;
+
+    //! Number of PCA components computed on the device (0 if disabled)
+    int pcaComponents;
+
+    //! Whether the projection replaces the full descriptors
+    bool pcaReplace;
+
     //! A fast hessian object that will be used for detecting ipoints
     FastHessian* fh;
 
@@ -129,6 +370,14 @@ class Surf {
     cl_mem d_tmpIntImageT1; // transposed
     cl_mem d_tmpIntImageT2; // transposed
 
+    //! Whether the device works on host memory directly (zero-copy)
+    bool zeroCopy;
+
+    //! Page-aligned host memory holding the grayscale frame when using
+    //! zero-copy buffers, and the buffer wrapping it
+    void* h_frame;
+    cl_mem d_frame;
+
     //! Number of surf descriptors
     cl_mem d_length;
 
@@ -138,6 +387,48 @@ class Surf {
     //! Array of Descriptors for each Ipoint
     cl_mem d_desc;
 
+    //! Descriptors in the output format (aliases d_desc for fp32)
+    cl_mem d_descOut;
+
+    //! Mean descriptor and basis of the PCA projection
+    cl_mem d_pcaMean;
+    cl_mem d_pcaBasis;
+
+    //! PCA-projected descriptors
+    cl_mem d_projected;
+
+    //! Haar samples per pixel above which a response map is built
+    float haarMapRatio;
+
+    //! Number of Haar response maps d_haarMaps has space for
+    int haarMapCapacity;
+
+    //! Haar map slot of each filter size (indexed by half the size), -1
+    //! if the responses are computed from the integral image
+    int haarMapSlot[HAAR_MAP_TABLE_SIZE];
+
+    //! Precomputed Haar x and y responses (one map of width*height per 
+    //! slot), the slot table, and the scale histogram used to fill it
+    cl_mem d_haarMaps;
+    cl_mem d_haarMapSlot;
+    cl_mem d_haarHistogram;
+
+    //! Number of keys the sort buffers have space for (a power of two)
+    int sortCapacity;
+
+    //! Sort keys and the permutation (sorted position to detection index)
+    cl_mem d_sortKeys;
+    cl_mem d_sortIndices;
+
+    //! Buffers the ipoints are gathered into when sorted.  They are 
+    //! copied back to d_pixPos, d_scale, d_laplacian, d_orientation and 
+    //! d_imageIndex.
+    cl_mem d_sortedPixPos;
+    cl_mem d_sortedScale;
+    cl_mem d_sortedLaplacian;
+    cl_mem d_sortedOrientation;
+    cl_mem d_sortedImageIndex;
+
     //! Orientation of each Ipoint an array of float
     cl_mem d_orientation;
     
@@ -149,20 +440,14 @@ class Surf {
 
     cl_mem d_j;
 
-    //! Position data on the host
-    float2* pixPos;
-
-    //! Scale data on the host
-    float* scale;
+    //! Packed ipoint data on the host (see packFeatures)
+    void* featureBlock;
 
-    //! Laplacian data on the host
-    int* laplacian;
+    //! Packed ipoint data on the device
+    cl_mem d_featureBlock;
 
-    //! Descriptor data on the host
-    float* desc;
-
-    //! Orientation data on the host
-    float* orientation;
+    //! Size of the feature block buffers in bytes
+    size_t featureBlockBytes;
 
     //! Position buffer on the device
     cl_mem d_pixPos;
@@ -173,28 +458,113 @@ class Surf {
     //! Laplacian buffer on the device
     cl_mem d_laplacian;
 
+    //! Batch image index of each ipoint on the device
+    cl_mem d_imageIndex;
+
     //! Res buffer on the device
     cl_mem d_res;
 
+    //! Recorded scan and transpose launches of integrateFrame, and the 
+    //! arguments they were recorded with (they are recorded again if 
+    //! these change)
+    std::vector<LaunchPlan> integralPlan;
+    cl_mem planInput;
+    int planWidth;
+    int planHeight;
+    int planImages;
+    int planScanKernel;
+
+    //! Kernel objects of the ipoint stages owned by this object, with 
+    //! their buffer arguments bound.  They are created when first used 
+    //! and released when the buffers or the frame size change.
+    cl_kernel orientationKernel;
+    cl_kernel orientationKernel2;
+    cl_kernel descriptorKernel;
+    cl_kernel normalizeKernel;
+    cl_kernel projectKernel;
+    cl_kernel packKernel;
+
+    //! Frame size and batch image stride the kernels were bound for
+    int boundWidth;
+    int boundHeight;
+    int boundImageStride;
+
 #ifdef OPTIMIZED_TRANSFERS
-    // If we are using pinned memory, we need additional
-    // buffers on the host
+    // If we are using pinned memory, we need an additional
+    // buffer on the host.  It comes from the shared pinned pool.
 
-    //! Position buffer on the host
-    cl_mem h_pixPos;
+    //! Feature block buffer on the host
+    PinnedBuffer featureStaging;
 
-    //! Scale buffer on the host
-    cl_mem h_scale;
+    //! Staging buffers replaced while still mapped by a FeatureSet, with
+    //! their mapped pointers.  They go back to the pool on release.
+    std::vector<std::pair<PinnedBuffer, void*> > retiredStaging;
 
-    //! Laplacian buffer on the host
-    cl_mem h_laplacian;
+    //! Unmap the retired staging buffers and return them to the pool
+    void releaseRetiredStaging();
+#endif
 
-    //! Descriptor buffer on the host
-    cl_mem h_desc;
+    //! Gather the ipoints (and optionally their descriptors) into the 
+    //! feature block.  Returns the size of the packed data in bytes.
+    size_t packFeatures(bool withDescriptors, size_t* offsets);
 
-    //! Orientation buffer on the host
-    cl_mem h_orientation;
-#endif
+    //! Copy the packed feature block to the host
+    void* readFeatureBlock(size_t bytes, cl_event* ready);
+    void* readFeatureBlockOnQueue(size_t bytes, cl_event* ready);
+
+    //! Normalize the descriptors and convert them to the output format
+    void normalizeDescriptors();
+
+    //! Compute the integral image of the frames in d_input
+    void integrateFrame(cl_mem d_input, int width, int height, int images);
+
+    //! Record the launches of integrateFrame
+    void recordIntegralImage(cl_mem d_input, int width, int height, 
+        int images, int scanKernel);
+
+    //! Release the recorded launches of integrateFrame
+    void freeIntegralPlan();
+
+    //! Release the kernel objects with bound arguments (the buffers they
+    //! were bound to changed)
+    void releaseBoundKernels();
+
+    //! Release the bound kernel objects if they were bound for another 
+    //! frame size or image stride
+    void checkBoundKernels(int i_width, int i_height, int imageStride);
+
+    //! Convert img to grayscale and copy it to the device on the transfer
+    //! queue.  'uploaded' completes when the copy has finished.
+    void uploadFrameAsync(IplImage* img, cl_event* uploaded);
+
+    //! Check the number of detected ipoints fitted in the buffers (and
+    //! detect again with larger buffers if not)
+    void finishDetection();
+
+    //! Build the Haar response maps used by the next stages
+    void buildHaarMaps(bool orient, bool describe);
+
+    //! Upload the table mapping filter sizes to Haar map slots
+    void uploadHaarMapSlots();
+
+    //! Sort the ipoints on the device by scale and position
+    void sortIpoints();
+
+    //! Allocate the buffers used to sort the ipoints
+    void allocateSortBuffers(int size);
+
+    //! Release the buffers used to sort the ipoints
+    void freeSortBuffers();
+
+    //! Put retrieved ipoints (and descriptors) back in detection order
+    void restoreDetectionOrder(IpVec* ipts, DescriptorSet* compact,
+                               DescriptorSet* projected);
+
+    //! Allocate the buffers holding the projected descriptors
+    void allocateProjectionBuffers(int size);
+
+    //! Release the buffers holding the projected descriptors
+    void freeProjectionBuffers();
 
     const static int j[16];
     
@@ -204,4 +574,7 @@ class Surf {
 
     const static float gauss25[49];
 };
+//! Convert a FeatureSet to Ipoints (for callers using IpVec)
+IpVec* featureSetToIpVec(FeatureSet& features);
+
 #endif
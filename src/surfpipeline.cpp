@@ -0,0 +1,245 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clutils.h"
+#include "surfpipeline.h"
+
+//! Constructor
+/*!
+    \param surfs The Surf objects, configured and all for the same frame
+           size.  They are deleted with the pipeline.
+*/
+SurfPipeline::SurfPipeline(std::vector<Surf*>& surfs) 
+{
+    if(surfs.empty() || surfs.size() > MAX_PIPELINE_DEPTH) 
+    {
+        printf("Error: A pipeline needs 1 to %d Surf objects\n", 
+            MAX_PIPELINE_DEPTH);
+        exit(-1);
+    }
+
+    for(size_t i = 0; i < surfs.size(); i++) 
+    {
+        PipelineSlot slot;
+        slot.surf = surfs[i];
+        slot.state = SLOT_IDLE;
+        slot.tag = NULL;
+        memset(&slot.features, 0, sizeof(FeatureSet));
+        slot.ready = NULL;
+        this->slots.push_back(slot);
+    }
+
+    this->head = 0;
+    this->tail = 0;
+    this->pending = 0;
+}
+
+
+//! Destructor
+/*!
+    Frames still in flight are completed and dropped
+*/
+SurfPipeline::~SurfPipeline() 
+{
+    FeatureSet features;
+
+    while(this->pending > 0) 
+    {
+        if(this->slots[this->tail].state != SLOT_COLLECTED) 
+        {
+            this->collect(&features);
+        }
+        else 
+        {
+            features = this->slots[this->tail].features;
+        }
+        this->release(&features);
+    }
+
+    for(size_t i = 0; i < this->slots.size(); i++) 
+    {
+        delete this->slots[i].surf;
+    }
+}
+
+
+//! Start processing a frame
+/*!
+    The frame is converted and uploaded, and its detection enqueued, 
+    without waiting for the device.  The previous frame is then completed
+    (its description and readback enqueued), which waits only for the 
+    previous frame's ipoint count.
+    \param frame The frame.  It may be reused as soon as this returns.
+    \param tag Caller data returned with the features
+    \return false if the pipeline is full
+*/
+bool SurfPipeline::submit(IplImage* frame, void* tag) 
+{
+    int depth = (int)this->slots.size();
+
+    if(this->pending == depth) 
+    {
+        return false;
+    }
+
+    PipelineSlot* slot = &(this->slots[this->head]);
+
+    slot->surf->enqueueDetect(frame);
+    slot->state = SLOT_DETECTING;
+    slot->tag = tag;
+
+    // Complete the frame submitted before this one
+    PipelineSlot* prev = &(this->slots[(this->head + depth - 1) % depth]);
+    if(prev != slot && prev->state == SLOT_DETECTING) 
+    {
+        this->describeSlot(prev);
+    }
+
+    this->head = (this->head + 1) % depth;
+    this->pending++;
+
+    return true;
+}
+
+
+//! Enqueue the description and readback of a detected slot
+void SurfPipeline::describeSlot(PipelineSlot* slot) 
+{
+    slot->surf->enqueueDescribe(&(slot->features), &(slot->ready));
+    slot->state = SLOT_DESCRIBED;
+}
+
+
+//! Wait for the oldest frame and return its features
+/*!
+    \param features Receives the features, valid until release
+    \param tag If not NULL, receives the tag the frame was submitted with
+    \return false if no frames are in flight
+*/
+bool SurfPipeline::collect(FeatureSet* features, void** tag) 
+{
+    if(this->pending == 0) 
+    {
+        return false;
+    }
+
+    PipelineSlot* slot = &(this->slots[this->tail]);
+
+    if(slot->state == SLOT_COLLECTED) 
+    {
+        printf("Error: The collected features must be released first\n");
+        exit(-1);
+    }
+
+    // The last frame submitted is completed here
+    if(slot->state == SLOT_DETECTING) 
+    {
+        this->describeSlot(slot);
+    }
+
+    if(slot->ready != NULL) 
+    {
+        cl_waitForEvent(slot->ready);
+        clReleaseEvent(slot->ready);
+        slot->ready = NULL;
+    }
+
+    slot->state = SLOT_COLLECTED;
+
+    *features = slot->features;
+    if(tag != NULL) 
+    {
+        *tag = slot->tag;
+    }
+
+    return true;
+}
+
+
+//! Release the features returned by collect
+void SurfPipeline::release(FeatureSet* features) 
+{
+    PipelineSlot* slot = &(this->slots[this->tail]);
+
+    if(this->pending == 0 || slot->state != SLOT_COLLECTED) 
+    {
+        printf("Error: No collected features to release\n");
+        exit(-1);
+    }
+
+    slot->surf->releaseFeatures(&(slot->features));
+    slot->surf->reset();
+    slot->state = SLOT_IDLE;
+    slot->tag = NULL;
+
+    memset(features, 0, sizeof(FeatureSet));
+
+    this->tail = (this->tail + 1) % (int)this->slots.size();
+    this->pending--;
+}
+
+
+//! Number of frames submitted and not yet released
+int SurfPipeline::getPending() 
+{
+    return this->pending;
+}
+
+
+//! Number of slots
+int SurfPipeline::getDepth() 
+{
+    return (int)this->slots.size();
+}
@@ -0,0 +1,133 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#ifndef _SURFPIPELINE_H_
+#define _SURFPIPELINE_H_
+
+#include <vector>
+#include <CL/cl.h>
+
+#include "surf.h"
+
+// Most frames a pipeline can have in flight
+#define MAX_PIPELINE_DEPTH 3
+
+// States of a pipeline slot
+#define SLOT_IDLE 0         // Free for the next frame
+#define SLOT_DETECTING 1    // Uploaded and detection enqueued
+#define SLOT_DESCRIBED 2    // Description and readback enqueued
+#define SLOT_COLLECTED 3    // Features handed to the caller
+
+//! One frame in flight: the Surf object that owns its buffers
+typedef struct PipelineSlot{
+        Surf* surf;
+        int state;              // One of SLOT_*
+        void* tag;              // Caller data passed with the frame
+        FeatureSet features;
+        cl_event ready;         // Completes when the features are readable
+} PipelineSlot;
+
+//! Asynchronous frame pipeline
+/*!
+    Each slot owns a Surf object, and so a full set of per-frame buffers.
+    Frames are uploaded on the transfer queue, computed on the compute 
+    queue and read back on the transfer queue, with events linking the 
+    two, so the upload of one frame, the computation of another and the
+    readback of a third overlap (as does the host work between calls).
+    Submitting a frame enqueues its detection and then completes the 
+    previous frame, so the compute queue always has the next frame's 
+    detection queued behind the current description.  Features are 
+    collected in submission order.
+*/
+class SurfPipeline {
+
+  public:
+
+    //! Create a pipeline with one slot per Surf object (at most 
+    //! MAX_PIPELINE_DEPTH).  The pipeline takes ownership of them.
+    SurfPipeline(std::vector<Surf*>& surfs);
+
+    ~SurfPipeline();
+
+    //! Start processing a frame.  Returns false if every slot is busy 
+    //! (collect and release the oldest frame first).
+    bool submit(IplImage* frame, void* tag = NULL);
+
+    //! Wait for the oldest frame and return its features (and tag).
+    //! Returns false if no frames are in flight.
+    bool collect(FeatureSet* features, void** tag = NULL);
+
+    //! Release the features returned by collect, freeing the slot
+    void release(FeatureSet* features);
+
+    //! Number of frames submitted and not yet released
+    int getPending();
+
+    //! Number of slots
+    int getDepth();
+
+  private:
+
+    //! Enqueue the description and readback of a detected slot
+    void describeSlot(PipelineSlot* slot);
+
+    std::vector<PipelineSlot> slots;
+
+    //! Next slot to submit to
+    int head;
+
+    //! Oldest slot in flight
+    int tail;
+
+    int pending;
+};
+
+#endif
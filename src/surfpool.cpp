@@ -0,0 +1,312 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "surfpool.h"
+#include "utils.h"
+
+//! Constructor
+/*!
+    \param granularity Frame sizes are rounded up to a multiple of this 
+           many pixels to give the size of new objects
+    \param budgetMB Device memory in MB the idle objects may hold
+*/
+SurfPool::SurfPool(int initialPoints, int octaves, int intervals, 
+                   int sample_step, float threshold, cl_kernel* kernel_list,
+                   bool extended, int descFormat, int granularity, 
+                   size_t budgetMB) 
+{
+    this->initialPoints = initialPoints;
+    this->octaves = octaves;
+    this->intervals = intervals;
+    this->sample_step = sample_step;
+    this->threshold = threshold;
+    this->kernel_list = kernel_list;
+    this->extended = extended;
+    this->descFormat = descFormat;
+
+    this->granularity = (granularity > 0 ? granularity : 
+        SURF_POOL_DEFAULT_GRANULARITY);
+    this->budget = budgetMB << 20;
+
+    this->clock = 0;
+}
+
+
+//! Destructor
+/*!
+    All objects must have been returned to the pool
+*/
+SurfPool::~SurfPool() 
+{
+    if(this->getInstancesInUse() > 0) 
+    {
+        printf("Warning: %d Surf objects still in use\n", 
+            this->getInstancesInUse());
+    }
+
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        delete this->entries[i].surf;
+    }
+}
+
+
+//! Get a Surf object for frames of the given size
+/*!
+    An idle object of the frame's size bucket is used if there is one, 
+    then the smallest idle object whose buffers fit the frame (unless it
+    is more than SURF_POOL_MAX_OVERSIZE times the bucket).  Otherwise a 
+    new object is created with the size of the bucket.
+    \param width The frame width
+    \param height The frame height
+    \param created If not NULL, set when the object was just created
+    \return The object, set up for the frame size.  Give it back with 
+            release.
+*/
+Surf* SurfPool::acquire(int width, int height, bool* created) 
+{
+    int bucketWidth = (int)roundUp(width, this->granularity);
+    int bucketHeight = (int)roundUp(height, this->granularity);
+    size_t bucketArea = (size_t)bucketWidth * bucketHeight;
+
+    int best = -1;
+    size_t bestArea = 0;
+
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        SurfPoolEntry& entry = this->entries[i];
+        if(entry.inUse) continue;
+
+        int capacityWidth = entry.surf->getCapacityWidth();
+        int capacityHeight = entry.surf->getCapacityHeight();
+        if(capacityWidth < width || capacityHeight < height) continue;
+
+        size_t area = (size_t)capacityWidth * capacityHeight;
+        if(area > bucketArea * SURF_POOL_MAX_OVERSIZE) continue;
+
+        if(best < 0 || area < bestArea) 
+        {
+            best = (int)i;
+            bestArea = area;
+        }
+    }
+
+    if(created != NULL) 
+    {
+        *created = (best < 0);
+    }
+
+    if(best < 0) 
+    {
+        SurfPoolEntry entry;
+        entry.surf = new Surf(this->initialPoints, bucketHeight, 
+            bucketWidth, this->octaves, this->intervals, this->sample_step,
+            this->threshold, this->kernel_list, this->extended, 
+            this->descFormat);
+        entry.inUse = false;
+        entry.lastUse = 0;
+        entry.bytes = entry.surf->getDeviceBytes();
+        this->entries.push_back(entry);
+        best = (int)this->entries.size() - 1;
+    }
+
+    Surf* surf = this->entries[best].surf;
+    this->entries[best].inUse = true;
+    surf->setFrameSize(width, height);
+
+    return surf;
+}
+
+
+//! Return an object to the pool
+/*!
+    The object is reset for its next frame.  The other idle objects are 
+    deleted if they are over budget; the object itself is kept, even if 
+    it alone exceeds the budget, so the next frame of its size reuses it
+    instead of creating it again.
+    \param surf An object returned by acquire
+*/
+void SurfPool::release(Surf* surf) 
+{
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        SurfPoolEntry& entry = this->entries[i];
+        if(entry.surf != surf) continue;
+
+        if(!entry.inUse) 
+        {
+            printf("Error: Surf object released twice\n");
+            exit(-1);
+        }
+
+        surf->reset();
+
+        // The ipoint buffers may have grown while it was in use
+        entry.bytes = surf->getDeviceBytes();
+        entry.inUse = false;
+        entry.lastUse = ++this->clock;
+
+        this->evict(this->budget, true);
+        return;
+    }
+
+    printf("Error: Surf object does not belong to the pool\n");
+    exit(-1);
+}
+
+
+//! Delete idle objects, least recently used first, until under budget
+/*!
+    Only the idle objects count towards the budget, so objects in use 
+    (however large) never force the others out.
+    \param budget The bytes the idle objects may hold
+    \param keepLatest Keep the most recently released object (it neither
+           counts towards the budget nor is deleted)
+*/
+void SurfPool::evict(size_t budget, bool keepLatest) 
+{
+    while(true) 
+    {
+        size_t bytes = 0;
+        int oldest = -1;
+        for(size_t i = 0; i < this->entries.size(); i++) 
+        {
+            SurfPoolEntry& entry = this->entries[i];
+            if(entry.inUse) continue;
+            if(keepLatest && entry.lastUse == this->clock) continue;
+
+            bytes += entry.bytes;
+            if(oldest < 0 || entry.lastUse < this->entries[oldest].lastUse) 
+            {
+                oldest = (int)i;
+            }
+        }
+
+        if(bytes <= budget) break;
+
+        delete this->entries[oldest].surf;
+        this->entries.erase(this->entries.begin() + oldest);
+    }
+}
+
+
+//! Delete the objects that are not in use
+void SurfPool::trim() 
+{
+    this->evict(0, false);
+}
+
+
+//! Device memory held by the objects in the pool
+size_t SurfPool::getBytesAllocated() 
+{
+    size_t bytes = 0;
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        bytes += this->entries[i].bytes;
+    }
+    return bytes;
+}
+
+
+//! Device memory held by the objects that are not in use
+size_t SurfPool::getIdleBytes() 
+{
+    size_t bytes = 0;
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        if(this->entries[i].inUse) continue;
+        bytes += this->entries[i].bytes;
+    }
+    return bytes;
+}
+
+
+//! Number of objects in the pool
+int SurfPool::getInstances() 
+{
+    return (int)this->entries.size();
+}
+
+
+//! Number of objects handed out
+int SurfPool::getInstancesInUse() 
+{
+    int count = 0;
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        if(this->entries[i].inUse) count++;
+    }
+    return count;
+}
+
+
+//! Print the objects held by the pool
+void SurfPool::printOccupancy() 
+{
+    printf("Surf pool: %d objects, %lu KB allocated, %lu KB idle "
+        "(budget %lu KB)\n", this->getInstances(), 
+        (unsigned long)(this->getBytesAllocated() >> 10),
+        (unsigned long)(this->getIdleBytes() >> 10),
+        (unsigned long)(this->budget >> 10));
+
+    for(size_t i = 0; i < this->entries.size(); i++) 
+    {
+        Surf* surf = this->entries[i].surf;
+        printf("\t%5dx%-5d %8lu KB %s\n", surf->getCapacityWidth(), 
+            surf->getCapacityHeight(), 
+            (unsigned long)(this->entries[i].bytes >> 10),
+            this->entries[i].inUse ? "in use" : "idle");
+    }
+}
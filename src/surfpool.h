@@ -0,0 +1,159 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#ifndef _SURFPOOL_H_
+#define _SURFPOOL_H_
+
+#include <vector>
+#include <CL/cl.h>
+
+#include "surf.h"
+
+// Frame sizes are rounded up to a multiple of this many pixels to pick
+// the size bucket of the Surf object that processes them
+#define SURF_POOL_DEFAULT_GRANULARITY 64
+
+// Device memory (in MB) that idle Surf objects may hold before the least
+// recently used ones are deleted
+#define SURF_POOL_DEFAULT_BUDGET 256
+
+// A larger idle object is only used for a frame if its buffers are at 
+// most this many times the size of the frame's bucket
+#define SURF_POOL_MAX_OVERSIZE 4
+
+//! A Surf object held by a SurfPool
+typedef struct SurfPoolEntry{
+        Surf* surf;
+        bool inUse;
+        unsigned long lastUse;  // Pool clock when the object was released
+        size_t bytes;           // Device memory held by the object
+} SurfPoolEntry;
+
+//! Pool of Surf objects for frames of varying sizes
+/*!
+    Creating a Surf object allocates its integral image, response layers
+    and staging buffers for one frame size.  The pool keeps the objects 
+    it creates, keyed by their size rounded up to the granularity, and 
+    hands them out again for frames of the same bucket, or for smaller 
+    frames that fit in their buffers (which are processed at their own 
+    logical size, see Surf::setFrameSize).  When the idle objects hold 
+    more device memory than the budget, the least recently used ones are
+    deleted.  Objects in use, and the object released last, are never 
+    deleted.
+*/
+class SurfPool {
+
+  public:
+
+    //! Create an empty pool.  The parameters are those of the Surf 
+    //! objects it creates.
+    SurfPool(int initialPoints, int octaves, int intervals, 
+             int sample_step, float threshold, cl_kernel* kernel_list,
+             bool extended = false, int descFormat = DESC_FORMAT_FP32,
+             int granularity = SURF_POOL_DEFAULT_GRANULARITY,
+             size_t budgetMB = SURF_POOL_DEFAULT_BUDGET);
+
+    ~SurfPool();
+
+    //! Get a Surf object set up for frames of the given size.  If created
+    //! is given, it is set when the object is new (and so needs to be 
+    //! configured by the caller).
+    Surf* acquire(int width, int height, bool* created = NULL);
+
+    //! Return an object to the pool
+    void release(Surf* surf);
+
+    //! Delete the objects that are not in use
+    void trim();
+
+    //! Device memory held by the objects in the pool
+    size_t getBytesAllocated();
+
+    //! Number of objects in the pool
+    int getInstances();
+
+    //! Number of objects handed out
+    int getInstancesInUse();
+
+    //! Print the objects held by the pool
+    void printOccupancy();
+
+  private:
+
+    //! Delete idle objects, least recently used first, until the idle 
+    //! objects hold at most budget bytes.  With keepLatest, the object 
+    //! released last is left out.
+    void evict(size_t budget, bool keepLatest);
+
+    //! Device memory held by the objects that are not in use
+    size_t getIdleBytes();
+
+    std::vector<SurfPoolEntry> entries;
+
+    //! Parameters of the Surf objects
+    int initialPoints;
+    int octaves;
+    int intervals;
+    int sample_step;
+    float threshold;
+    cl_kernel* kernel_list;
+    bool extended;
+    int descFormat;
+
+    int granularity;
+
+    size_t budget;
+
+    //! Incremented on each release (orders the idle objects)
+    unsigned long clock;
+};
+
+#endif
@@ -0,0 +1,517 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+
+#include "cv.h"
+#include "clutils.h"
+#include "nearestNeighbor.h"
+#include "surf.h"
+#include "tuning.h"
+#include "utils.h"
+
+// SURF parameters used while tuning (the same as the other procedures)
+#define TUNING_OCTAVES 5
+#define TUNING_INTERVALS 4
+#define TUNING_SAMPLE_STEP 2
+#define TUNING_THRESHOLD 0.00005f
+#define TUNING_IPTS 1000
+
+// Number of timed runs per candidate (the fastest is kept)
+#define TUNING_RUNS 5
+
+// Candidate work-group sizes
+static const int localSizes2D[][2] = {
+    {16, 16}, {32, 8}, {8, 32}, {64, 4}, {32, 4}, {8, 8}, 
+    {64, 1}, {128, 1}, {256, 1}
+};
+#define NUM_LOCAL_SIZES_2D (int)(sizeof(localSizes2D)/sizeof(localSizes2D[0]))
+
+static const int localSizes1D[] = {16, 32, 64, 128, 256};
+#define NUM_LOCAL_SIZES_1D (int)(sizeof(localSizes1D)/sizeof(localSizes1D[0]))
+
+//! The profile the kernels are launched with
+static TuningProfile tuningProfile;
+static bool tuningProfileInit = false;
+
+
+//! Return the profile the kernels are launched with
+TuningProfile* getTuningProfile() 
+{
+    if(!tuningProfileInit) {
+        initTuningProfile(&tuningProfile);
+        tuningProfileInit = true;
+    }
+
+    return &tuningProfile;
+}
+
+
+//! Reset a profile to the built-in sizes
+/*!
+    These are the sizes SURF was written for (GPUs of 2011)
+*/
+void initTuningProfile(TuningProfile* profile) 
+{
+    profile->device[0] = '\0';
+    profile->hessianLocal[0] = 16;
+    profile->hessianLocal[1] = 16;
+    profile->nmsLocal[0] = 16;
+    profile->nmsLocal[1] = 16;
+    profile->packLocal = 32;
+    profile->nnLocal = 64;
+    profile->scan4 = -1;
+    profile->images = 1;
+}
+
+
+//! Load a profile written by writeTuningProfile
+/*!
+    \param filename The profile
+    \param profile Receives the profile
+    \return false if the file doesn't exist or is for another device
+*/
+bool loadTuningProfile(char* filename, TuningProfile* profile) 
+{
+    std::ifstream infile(filename);
+    if(!infile) {
+        return false;
+    }
+
+    TuningProfile loaded;
+    initTuningProfile(&loaded);
+
+    std::string key;
+    while(infile >> key) {
+        if(key[0] == '#') {
+            std::getline(infile, key);
+        }
+        else if(key == "device") {
+            std::string name;
+            std::getline(infile, name);
+            size_t start = name.find_first_not_of(" \t");
+            name = (start == std::string::npos ? "" : name.substr(start));
+            strncpy(loaded.device, name.c_str(), sizeof(loaded.device) - 1);
+            loaded.device[sizeof(loaded.device) - 1] = '\0';
+        }
+        else if(key == "hessian_local") {
+            infile >> loaded.hessianLocal[0] >> loaded.hessianLocal[1];
+        }
+        else if(key == "nms_local") {
+            infile >> loaded.nmsLocal[0] >> loaded.nmsLocal[1];
+        }
+        else if(key == "pack_local") {
+            infile >> loaded.packLocal;
+        }
+        else if(key == "nn_local") {
+            infile >> loaded.nnLocal;
+        }
+        else if(key == "scan4") {
+            infile >> loaded.scan4;
+        }
+        else if(key == "images") {
+            infile >> loaded.images;
+        }
+        else {
+            // Ignore settings of newer versions
+            std::getline(infile, key);
+        }
+    }
+
+    if(loaded.hessianLocal[0] <= 0 || loaded.hessianLocal[1] <= 0 ||
+       loaded.nmsLocal[0] <= 0 || loaded.nmsLocal[1] <= 0 ||
+       loaded.packLocal <= 0 || loaded.nnLocal <= 0 ||
+       (loaded.nnLocal & (loaded.nnLocal - 1)) != 0) {
+        printf("Error: %s is not a valid tuning profile\n", filename);
+        exit(-1);
+    }
+
+    char* deviceName = cl_getDeviceName();
+    bool sameDevice = (strcmp(loaded.device, deviceName) == 0);
+    free(deviceName);
+
+    if(!sameDevice) {
+        printf("Tuning profile %s is for %s, using the default sizes\n\n",
+            filename, loaded.device);
+        return false;
+    }
+
+    *profile = loaded;
+
+    printf("Using the tuning profile %s\n\n", filename);
+
+    return true;
+}
+
+
+//! Shrink the work-group sizes of a profile to fit the devices
+/*!
+    The larger dimension of the two-dimensional sizes is halved until 
+    they fit, so the sizes stay multiples of the ones tuned.
+    \param profile The profile
+    \param maxSize The largest work group of the devices
+*/
+void fitTuningProfile(TuningProfile* profile, size_t maxSize) 
+{
+    int* sizes2D[2] = {profile->hessianLocal, profile->nmsLocal};
+    for(int k = 0; k < 2; k++) {
+        int* size = sizes2D[k];
+        while((size_t)(size[0] * size[1]) > maxSize) {
+            if(size[0] >= size[1]) {
+                size[0] = (size[0] + 1) / 2;
+            }
+            else {
+                size[1] = (size[1] + 1) / 2;
+            }
+        }
+    }
+
+    while((size_t)profile->packLocal > maxSize) {
+        profile->packLocal = (profile->packLocal + 1) / 2;
+    }
+
+    // The nearest neighbor size stays a power of 2
+    while((size_t)profile->nnLocal > maxSize) {
+        profile->nnLocal >>= 1;
+    }
+}
+
+
+//! Write a profile to filename
+void writeTuningProfile(char* filename, TuningProfile* profile) 
+{
+    std::ofstream outfile(filename);
+
+    outfile << "# SURF tuning profile (written by procedure 8)\n";
+    outfile << "device " << profile->device << "\n";
+    outfile << "hessian_local " << profile->hessianLocal[0] << " " 
+            << profile->hessianLocal[1] << "\n";
+    outfile << "nms_local " << profile->nmsLocal[0] << " " 
+            << profile->nmsLocal[1] << "\n";
+    outfile << "pack_local " << profile->packLocal << "\n";
+    outfile << "nn_local " << profile->nnLocal << "\n";
+    outfile << "scan4 " << profile->scan4 << "\n";
+    outfile << "images " << profile->images << "\n";
+
+    outfile.close();
+
+    printf("Tuning profile written to %s\n", filename);
+}
+
+
+//! Create a synthetic image to tune on
+/*!
+    Blobs of random sizes and contrast on a gradient give the detector a
+    realistic number of ipoints at all scales.  The image is the same on
+    every run.
+*/
+IplImage* createTuningImage(int width, int height) 
+{
+    IplImage* img = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
+
+    for(int y = 0; y < height; y++) {
+        unsigned char* row = (unsigned char*)(img->imageData + 
+            y*img->widthStep);
+        for(int x = 0; x < width*3; x++) {
+            row[x] = (unsigned char)(64 + (x/3 + y) * 128 / (width + height));
+        }
+    }
+
+    srand(1);
+    int blobs = width*height/2000;
+    for(int i = 0; i < blobs; i++) {
+        CvPoint center = cvPoint(rand() % width, rand() % height);
+        int radius = 2 + rand() % 24;
+        int shade = rand() % 256;
+        cvCircle(img, center, radius, cvScalarAll(shade), CV_FILLED);
+    }
+
+    return img;
+}
+
+
+//! Build the SURF programs for images or buffers
+static cl_kernel* buildTuningKernels() 
+{
+    if(isUsingImages()) {
+        return cl_precompileKernels("-DIMAGES_SUPPORTED");
+    }
+    return cl_precompileKernels(NULL);
+}
+
+
+//! Time SURF on img with the current profile
+/*!
+    A warm-up run (which also builds the programs) is followed by 
+    TUNING_RUNS timed runs that include the readback of the features
+    \return The fastest run in milliseconds
+*/
+static double timeSurf(IplImage* img, cl_kernel* kernel_list) 
+{
+    Surf* surf = new Surf(TUNING_IPTS, img->height, img->width, 
+        TUNING_OCTAVES, TUNING_INTERVALS, TUNING_SAMPLE_STEP, 
+        TUNING_THRESHOLD, kernel_list);
+
+    double best = -1.0;
+    for(int i = 0; i <= TUNING_RUNS; i++) {
+        cl_time start, end;
+        FeatureSet features;
+
+        cl_getTime(&start);
+        surf->run(img, false);
+        surf->retrieveFeatures(&features);
+        cl_getTime(&end);
+
+        surf->releaseFeatures(&features);
+        surf->reset();
+
+        double time = cl_computeTime(start, end);
+        if(i > 0 && (best < 0 || time < best)) {
+            best = time;
+        }
+    }
+
+    delete surf;
+
+    return best;
+}
+
+
+//! Time matching the descriptors of img against themselves
+/*!
+    \return The fastest of TUNING_RUNS runs in milliseconds
+*/
+static double timeMatching(IplImage* img, cl_kernel* kernel_list) 
+{
+    Surf* surf = new Surf(TUNING_IPTS, img->height, img->width, 
+        TUNING_OCTAVES, TUNING_INTERVALS, TUNING_SAMPLE_STEP, 
+        TUNING_THRESHOLD, kernel_list);
+
+    DescriptorSet descs;
+    surf->run(img, false);
+    IpVec* ipts = surf->retrieveDescriptors(&descs);
+
+    double best = -1.0;
+    for(int i = 0; i <= TUNING_RUNS; i++) {
+        cl_time start, end;
+
+        cl_getTime(&start);
+        std::vector<distPoint>* matches = findNearestNeighbors(*ipts, descs,
+            *ipts, descs, kernel_list);
+        cl_getTime(&end);
+
+        delete matches;
+
+        double time = cl_computeTime(start, end);
+        if(i > 0 && (best < 0 || time < best)) {
+            best = time;
+        }
+    }
+
+    freeDescriptorSet(&descs);
+    delete ipts;
+    delete surf;
+
+    return best;
+}
+
+
+//! Pick the fastest two-dimensional work-group size for a kernel
+/*!
+    \param name The name printed for the kernel
+    \param size The size in the profile (set to the fastest)
+    \param kernel The kernel (KERNEL_*), which limits the size
+*/
+static void tuneLocalSize2D(const char* name, int* size, int kernel, 
+    IplImage* img, cl_kernel* kernel_list) 
+{
+    size_t maxSize = cl_getKernelWorkGroupSize(cl_getKernel(kernel));
+
+    int best[2] = {size[0], size[1]};
+    double bestTime = -1.0;
+
+    printf("Tuning %s\n", name);
+    for(int i = 0; i < NUM_LOCAL_SIZES_2D; i++) {
+        if((size_t)(localSizes2D[i][0] * localSizes2D[i][1]) > maxSize) {
+            continue;
+        }
+        size[0] = localSizes2D[i][0];
+        size[1] = localSizes2D[i][1];
+
+        double time = timeSurf(img, kernel_list);
+        printf("\t%3d x %-3d: %.3f ms\n", size[0], size[1], time);
+
+        if(bestTime < 0 || time < bestTime) {
+            bestTime = time;
+            best[0] = size[0];
+            best[1] = size[1];
+        }
+    }
+
+    size[0] = best[0];
+    size[1] = best[1];
+}
+
+
+//! Pick the fastest one-dimensional work-group size for a kernel
+/*!
+    \param name The name printed for the kernel
+    \param size The size in the profile (set to the fastest)
+    \param kernel The kernel (KERNEL_*), which limits the size
+    \param timer Times the stage that runs the kernel
+*/
+static void tuneLocalSize1D(const char* name, int* size, int kernel, 
+    double (*timer)(IplImage*, cl_kernel*), IplImage* img, 
+    cl_kernel* kernel_list) 
+{
+    size_t maxSize = cl_getKernelWorkGroupSize(cl_getKernel(kernel));
+
+    int best = *size;
+    double bestTime = -1.0;
+
+    printf("Tuning %s\n", name);
+    for(int i = 0; i < NUM_LOCAL_SIZES_1D; i++) {
+        if((size_t)localSizes1D[i] > maxSize) {
+            continue;
+        }
+        *size = localSizes1D[i];
+
+        double time = timer(img, kernel_list);
+        printf("\t%3d: %.3f ms\n", *size, time);
+
+        if(bestTime < 0 || time < bestTime) {
+            bestTime = time;
+            best = *size;
+        }
+    }
+
+    *size = best;
+}
+
+
+//! Benchmark the candidate sizes and variants on img
+/*!
+    Each setting is tuned in turn with the others at their best value so
+    far.  Images are only tried if the device supports them (and -n wasn't
+    given).
+*/
+void tuneDevice(IplImage* img) 
+{
+    TuningProfile* profile = getTuningProfile();
+    initTuningProfile(profile);
+
+    // The sizes are kept if no candidate fits, so they must fit already
+    fitTuningProfile(profile, cl_getContextCaps()->maxWorkGroupSize);
+
+    char* deviceName = cl_getDeviceName();
+    strncpy(profile->device, deviceName, sizeof(profile->device) - 1);
+    profile->device[sizeof(profile->device) - 1] = '\0';
+    free(deviceName);
+
+    printf("Tuning for %s on a %dx%d image\n\n", profile->device, 
+        img->width, img->height);
+
+    // The tuning runs aren't logged
+    cl_disableEvents();
+
+    // Images or buffers (the programs are built again for each)
+    cl_kernel* kernel_list = NULL;
+    if(isUsingImages()) {
+        kernel_list = buildTuningKernels();
+        double imageTime = timeSurf(img, kernel_list);
+
+        setUsingImages(false);
+        kernel_list = buildTuningKernels();
+        double bufferTime = timeSurf(img, kernel_list);
+
+        printf("Tuning images\n");
+        printf("\timages : %.3f ms\n", imageTime);
+        printf("\tbuffers: %.3f ms\n", bufferTime);
+
+        if(imageTime < bufferTime) {
+            setUsingImages(true);
+            kernel_list = buildTuningKernels();
+        }
+    }
+    else {
+        kernel_list = buildTuningKernels();
+    }
+    profile->images = isUsingImages() ? 1 : 0;
+
+    // Vector or scalar scan (buffers only)
+    if(!isUsingImages()) {
+        profile->scan4 = 0;
+        double scanTime = timeSurf(img, kernel_list);
+        profile->scan4 = 1;
+        double scan4Time = timeSurf(img, kernel_list);
+
+        printf("Tuning scan\n");
+        printf("\tscan : %.3f ms\n", scanTime);
+        printf("\tscan4: %.3f ms\n", scan4Time);
+
+        profile->scan4 = (scan4Time < scanTime ? 1 : 0);
+    }
+
+    tuneLocalSize2D("hessian_det", profile->hessianLocal, KERNEL_BUILD_DET,
+        img, kernel_list);
+    tuneLocalSize2D("non_max_supression", profile->nmsLocal, 
+        KERNEL_NON_MAX_SUP, img, kernel_list);
+    tuneLocalSize1D("packFeatures", &profile->packLocal, 
+        KERNEL_PACK_FEATURES, timeSurf, img, kernel_list);
+    tuneLocalSize1D("NearestNeighbor", &profile->nnLocal, KERNEL_NN,
+        timeMatching, img, kernel_list);
+
+    printf("\n");
+}
@@ -0,0 +1,101 @@
+ /****************************************************************************\
+ * Copyright (c) 2011, Advanced Micro Devices, Inc.                           *
+ * All rights reserved.                                                       *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions         *
+ * are met:                                                                   *
+ *                                                                            *
+ * Redistributions of source code must retain the above copyright notice,     *
+ * this list of conditions and the following disclaimer.                      *
+ *                                                                            *
+ * Redistributions in binary form must reproduce the above copyright notice,  *
+ * this list of conditions and the following disclaimer in the documentation  *
+ * and/or other materials provided with the distribution.                     *
+ *                                                                            *
+ * Neither the name of the copyright holder nor the names of its contributors *
+ * may be used to endorse or promote products derived from this software      *
+ * without specific prior written permission.                                 *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS        *
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  *
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ * If you use the software (in whole or in part), you shall adhere to all     *
+ * applicable U.S., European, and other export laws, including but not        *
+ * limited to the U.S. Export Administration Regulations (EAR), (15 C.F.R.  *
+ * Sections 730 through 774), and E.U. Council Regulation (EC) No 1334/2000   *
+ * of 22 June 2000.  Further, pursuant to Section 740.6 of the EAR, you       *
+ * hereby certify that, except pursuant to a license granted by the United    *
+ * States Department of Commerce Bureau of Industry and Security or as        *
+ * otherwise permitted pursuant to a License Exception under the U.S. Export  *
+ * Administration Regulations ("EAR"), you will not (1) export, re-export or  *
+ * release to a national of a country in Country Groups D:1, E:1 or E:2 any   *
+ * restricted technology, software, or source code you receive hereunder,     *
+ * or (2) export to Country Groups D:1, E:1 or E:2 the direct product of such *
+ * technology or software, if such foreign produced direct product is subject *
+ * to national security controls as identified on the Commerce Control List   *
+ *(currently found in Supplement 1 to Part 774 of EAR).  For the most current *
+ * Country Group listings, or for additional information about the EAR or     *
+ * your obligations under those regulations, please refer to the U.S. Bureau  *
+ * of Industry and Securitys website at http://www.bis.doc.gov/.             *
+ \****************************************************************************/
+
+#ifndef _TUNING_H_
+#define _TUNING_H_
+
+#include "cv.h"
+
+// Default name of the tuning profile
+#define TUNING_PROFILE_NAME "SurfTuning.txt"
+
+//! TuningProfile holds the work-group sizes and kernel variants that run
+//! fastest on a device.  The sizes of the other kernels are fixed by the
+//! way they map work items to samples.
+typedef struct TuningProfile{
+        char device[256];       // Device the profile was tuned on
+        int hessianLocal[2];    // Hessian determinant work-group size
+        int nmsLocal[2];        // Non-maximum suppression work-group size
+        int packLocal;          // Readback packing work-group size
+        int nnLocal;            // Nearest neighbor work-group size (a 
+                                // power of 2)
+        int scan4;              // Vector scan (1), scalar scan (0) or
+                                // vector scan on devices that prefer 
+                                // float vectors (-1)
+        int images;             // Use OpenCL images (1) or buffers (0)
+} TuningProfile;
+
+//! Return the profile the kernels are launched with
+TuningProfile* getTuningProfile();
+
+//! Reset a profile to the built-in sizes
+void initTuningProfile(TuningProfile* profile);
+
+//! Load a profile written by writeTuningProfile.  Returns false (and
+//! leaves the profile unchanged) if the file doesn't exist or was tuned 
+//! on another device.
+bool loadTuningProfile(char* filename, TuningProfile* profile);
+
+//! Shrink the work-group sizes of a profile that exceed maxSize work 
+//! items (the largest work group of the devices)
+void fitTuningProfile(TuningProfile* profile, size_t maxSize);
+
+//! Write a profile to filename
+void writeTuningProfile(char* filename, TuningProfile* profile);
+
+//! Create a synthetic image with blobs of many sizes to tune on
+IplImage* createTuningImage(int width, int height);
+
+//! Benchmark the candidate sizes and variants on img and keep the 
+//! fastest in the current profile
+void tuneDevice(IplImage* img);
+
+#endif
@@ -53,11 +53,55 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #include "utils.h"
+#include "surfpipeline.h"
+#include "surfpool.h"
+#include "tuning.h"
+#include "framescheduler.h"
 
 static bool usingImages = true;
 
+static bool usingExtendedDescriptors = false;
+
+static int descriptorFormat = DESC_FORMAT_FP32;
+
+static char* pcaProjectionPath = NULL;
+
+static int pcaTrainingComponents = 24;
+
+static int denseGridStride = 0;
+
+static float haarMapRatio = 0.0f;
+
+static bool sortingKeypoints = false;
+
+static int pipelineDepth = 1;
+
+static int surfPoolGranularity = SURF_POOL_DEFAULT_GRANULARITY;
+
+static int surfPoolBudget = SURF_POOL_DEFAULT_BUDGET;
+
+static char* programCacheDir = (char*)"ProgramCache";
+
+static int compileThreads = 4;
+
+static bool specialisingKernels = false;
+
+static char* tuningProfilePath = (char*)TUNING_PROFILE_NAME;
+
+static int schedulerWorkers = 1;
+
+static bool numaAware = false;
+
+static int videoBatchSize = 1;
+
+static bool usingSubgroups = true;
+
 //! A wrapper for malloc that checks the return value
 void* alloc(size_t size) {
 
@@ -71,6 +115,39 @@ void* alloc(size_t size) {
     return ptr;
 }
 
+//! Allocate memory aligned to a boundary (e.g. a page)
+/*!
+    \param size Number of bytes
+    \param alignment Alignment in bytes (a power of two)
+    \return The memory, which must be freed with alignedFree
+*/
+void* alignedAlloc(size_t size, size_t alignment) {
+
+    void* ptr = NULL;
+#ifdef _WIN32
+    ptr = _aligned_malloc(size, alignment);
+#else
+    if(posix_memalign(&ptr, alignment, size) != 0) {
+        ptr = NULL;
+    }
+#endif
+    if(ptr == NULL) {
+        perror("alignedAlloc");
+        exit(-1);
+    }
+
+    return ptr;
+}
+
+//! Free memory allocated with alignedAlloc
+void alignedFree(void* ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 // This function checks to make sure a file exists before we open it
 void checkFile(char* filename) 
 {
@@ -171,7 +248,16 @@ bool compareIpts(IpVec* refIpts, IpVec* oclIpts)
                 refIpts->at(i).laplacian, oclIpts->at(i).laplacian);
             return false;
         }
-        for(int j = 0; j < 64; j++) {
+        if(refIpts->at(i).descriptorLength != 
+            oclIpts->at(i).descriptorLength) {
+
+            printf("failed\n");
+            printf("Ipt %d: Descriptor length mismatch (%d vs. %d)\n", i,
+                refIpts->at(i).descriptorLength, 
+                oclIpts->at(i).descriptorLength);
+            return false;
+        }
+        for(int j = 0; j < refIpts->at(i).descriptorLength; j++) {
             if(fabs(refIpts->at(i).descriptor[j] - 
                 oclIpts->at(i).descriptor[j]) > 0.1) {
                
@@ -194,6 +280,48 @@ void parseArguments(int argc, char** argv, char** input, char** events,
 {
     
     for(int i = 2; i < argc; i++) {
+        if(strcmp(argv[i], "-a") == 0) {   // Asynchronous video pipeline
+            if(i == argc-1) {
+                printf("Usage: -a Needs a number of frames in flight\n");
+                exit(-1);
+            }
+            setPipelineDepth(atoi(argv[i+1]));
+            if(getPipelineDepth() < 1 || 
+               getPipelineDepth() > MAX_PIPELINE_DEPTH) {
+                printf("Usage: -a The number of frames must be 1 to %d\n",
+                    MAX_PIPELINE_DEPTH);
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-b") == 0) {   // Surf pool size buckets
+            if(i == argc-1) {
+                printf("Usage: -b Needs a number of pixels\n");
+                exit(-1);
+            }
+            setSurfPoolGranularity(atoi(argv[i+1]));
+            if(getSurfPoolGranularity() < 1) {
+                printf("Usage: -b The granularity must be positive\n");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-c") == 0) {   // Program binary cache
+            if(i == argc-1) {
+                printf("Usage: -c Needs directory path (or none)\n");
+                exit(-1);
+            }
+            if(strcmp(argv[i+1], "none") == 0) {
+                setProgramCacheDir(NULL);
+            }
+            else {
+                setProgramCacheDir(argv[i+1]);
+            }
+            i++;
+            continue;
+        }
         if(strcmp(argv[i], "-d") == 0) {   // Event dump found
             if(i == argc-1) {
                 printf("Usage: -e Needs directory path\n");
@@ -212,6 +340,23 @@ void parseArguments(int argc, char** argv, char** input, char** events,
             i++;
             continue;
         }
+        if(strcmp(argv[i], "-f") == 0) {   // Size specialised kernels
+            setSpecialisingKernels(true);
+            continue;
+        }
+        if(strcmp(argv[i], "-g") == 0) {   // Dense grid stride
+            if(i == argc-1) {
+                printf("Usage: -g Needs a grid stride\n");
+                exit(-1);
+            }
+            setDenseGridStride(atoi(argv[i+1]));
+            if(getDenseGridStride() <= 0 || getDenseGridStride() % 4 != 0) {
+                printf("Usage: -g The grid stride must be a multiple of 4\n");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
         if(strcmp(argv[i], "-i") == 0) {   // Input found
             if(i == argc-1) {
                 printf("Usage: -i Needs directory path\n");
@@ -221,6 +366,28 @@ void parseArguments(int argc, char** argv, char** input, char** events,
             i++;
             continue;
         }
+        if(strcmp(argv[i], "-j") == 0) {   // Program build threads
+            if(i == argc-1) {
+                printf("Usage: -j Needs a number of threads\n");
+                exit(-1);
+            }
+            setCompileThreads(atoi(argv[i+1]));
+            if(getCompileThreads() < 0) {
+                printf("Usage: -j The number of threads can't be negative\n");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-k") == 0) {   // PCA components to train
+            if(i == argc-1) {
+                printf("Usage: -k Needs a number of components\n");
+                exit(-1);
+            }
+            setPcaTrainingComponents(atoi(argv[i+1]));
+            i++;
+            continue;
+        }
         if(strcmp(argv[i], "-l") == 0) {   // Ipts dump found
             if(i == argc-1) {
                 printf("Usage: -l Needs directory path\n");
@@ -230,14 +397,114 @@ void parseArguments(int argc, char** argv, char** input, char** events,
             i++;
             continue;
         }
+        if(strcmp(argv[i], "-m") == 0) {   // Surf pool memory budget
+            if(i == argc-1) {
+                printf("Usage: -m Needs a size in MB\n");
+                exit(-1);
+            }
+            setSurfPoolBudget(atoi(argv[i+1]));
+            if(getSurfPoolBudget() < 0) {
+                printf("Usage: -m The budget can't be negative\n");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
         if(strcmp(argv[i], "-n") == 0) {   // Don't use OpenCL images
             setUsingImages(false);
             continue;
         }
+        if(strcmp(argv[i], "-r") == 0) {   // Haar response maps
+            if(i == argc-1) {
+                printf("Usage: -r Needs a ratio of samples per pixel\n");
+                exit(-1);
+            }
+            setHaarMapRatio((float)atof(argv[i+1]));
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-s") == 0) {   // Sort ipoints
+            setSortingKeypoints(true);
+            continue;
+        }
+        if(strcmp(argv[i], "-t") == 0) {   // Tuning profile
+            if(i == argc-1) {
+                printf("Usage: -t Needs a file path (or none)\n");
+                exit(-1);
+            }
+            if(strcmp(argv[i+1], "none") == 0) {
+                setTuningProfilePath(NULL);
+            }
+            else {
+                setTuningProfilePath(argv[i+1]);
+            }
+            i++;
+            continue;
+        }
         if(strcmp(argv[i], "-v") == 0) {   // Verify results
             *verifyResults = true;
             continue;
         }
+        if(strcmp(argv[i], "-u") == 0) {   // NUMA-aware placement
+            setNumaAware(true);
+            continue;
+        }
+        if(strcmp(argv[i], "-y") == 0) {   // Batches of video frames
+            if(i == argc-1) {
+                printf("Usage: -y Needs a number of frames\n");
+                exit(-1);
+            }
+            setVideoBatchSize(atoi(argv[i+1]));
+            if(getVideoBatchSize() < 1 || 
+               getVideoBatchSize() > MAX_BATCH_IMAGES) {
+                printf("Usage: -y The number of frames must be 1 to %d\n",
+                    MAX_BATCH_IMAGES);
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-z") == 0) {   // Barrier-based reductions
+            setUsingSubgroups(false);
+            continue;
+        }
+        if(strcmp(argv[i], "-w") == 0) {   // Frame scheduler workers
+            if(i == argc-1) {
+                printf("Usage: -w Needs a number of workers\n");
+                exit(-1);
+            }
+            setSchedulerWorkers(atoi(argv[i+1]));
+            if(getSchedulerWorkers() < 1 || 
+               getSchedulerWorkers() > MAX_SCHEDULER_WORKERS) {
+                printf("Usage: -w The number of workers must be 1 to %d\n",
+                    MAX_SCHEDULER_WORKERS);
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-p") == 0) {   // PCA projection
+            if(i == argc-1) {
+                printf("Usage: -p Needs a projection file\n");
+                exit(-1);
+            }
+            setPcaProjectionPath(argv[i+1]);
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-q") == 0) {   // Descriptor output format
+            if(i == argc-1) {
+                printf("Usage: -q Needs a format (fp32, fp16, int8, bin or binmag)\n");
+                exit(-1);
+            }
+            setDescriptorFormat(parseDescriptorFormat(argv[i+1]));
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "-x") == 0) {   // Extended (128-D) descriptors
+            setUsingExtendedDescriptors(true);
+            continue;
+        }
     }
 }
 
@@ -249,7 +516,7 @@ void printIptInfo(Ipoint ipt)
     printf("ipt.orientation = %f\n", ipt.orientation);
     printf("ipt.laplacian = %d\n", ipt.laplacian);
     printf("ipt.desc = \n");
-    for(int i = 0; i < 8; i++) {
+    for(int i = 0; i < ipt.descriptorLength/8; i++) {
         printf("   ");
         for(int j = 0; j < 8; j++) {
             printf("[%d] = %.3f  ", i*8+j, ipt.descriptor[i*8+j]); 
@@ -270,30 +537,82 @@ void printUsage()
    3 - Video stabilization \n\
    4 - (Not used) \n\
    5 - Geo referencing (disabled) \n\
-   6 - Run SURF in Benchmark Mode \n\n\
+   6 - Run SURF in Benchmark Mode \n\
+   7 - Train a PCA projection from an Ipoint log \n\
+   8 - Tune the work-group sizes for the device \n\n\
  Optional Parameters:\n\
+   -a <num>  - Keep up to <num> (2 or 3) video frames in flight, \n\
+               overlapping upload, computation and readback\n\
+               (procedure 2)\n\
+   -b <num>  - Round frame sizes up to multiples of <num> pixels to\n\
+               pick the Surf object that processes them (default 64,\n\
+               procedure 2)\n\
+   -c <dir>  - Directory of the OpenCL program binary cache (default\n\
+               ProgramCache, none disables the cache)\n\
    -d <type> - Device to execute with (g=gpu, c=cpu)\n\
    -e <dir>  - Directory to dump event log\n\
                Event logs have format: Events_<timestamp>.surflog\n\
+   -f        - Build the hessian kernel for each frame size and\n\
+               response layer, with the sizes as constants\n\
+   -g <num>  - Compute upright descriptors every <num> pixels (a\n\
+               multiple of 4) at scales 2 and 4 instead of detecting\n\
+               ipoints (procedures 1 and 6)\n\
    -i <file> - Input file (video or image depending on function)\n\
+   -j <num>  - Build the OpenCL programs on <num> threads in the\n\
+               background (default 4).  With 0 each program is built\n\
+               the first time one of its kernels is used\n\
+   -k <num>  - Number of components kept when training PCA (default 24)\n\
    -l <dir>  - Directory to dump Ipoints information\n\
                Ipoint logs have the format: SurfIpts.log\n\
+   -m <num>  - Device memory in MB kept by idle Surf objects for other\n\
+               frame sizes (default 256, procedure 2)\n\
    -n        - Disables use of OpenCL images\n\
+   -p <file> - Project the descriptors onto the PCA basis in <file>\n\
+               (SurfPca.txt, see procedure 7).  Only the projected\n\
+               descriptors are copied back and matched\n\
+   -q <fmt>  - Descriptor output format (fp32, fp16, int8, bin or binmag).\n\
+               bin stores one sign bit per component, binmag adds a\n\
+               magnitude bit.  Compact formats are also logged to\n\
+               SurfIpts.bin when -l is used\n\
+   -r <num>  - Precompute Haar response maps for the filter sizes that\n\
+               take more than <num> samples per pixel (e.g. 1.0)\n\
+   -s        - Sort the ipoints by scale and position on the device\n\
+               before orientation and description\n\
+   -t <file> - Tuning profile with the work-group sizes for the device\n\
+               (default SurfTuning.txt, none uses the built-in sizes).\n\
+               Procedure 8 writes it\n\
    -v        - Verify the output with the reference implementation (only\n\
                supported with option 1)\n\
+   -u        - Run a worker per NUMA node of the device, with its host\n\
+               threads and buffers on that node (procedure 2)\n\
+   -w <num>  - Process video frames on <num> workers, one per device,\n\
+               or per sub-device when the platform has one device\n\
+               (procedure 2)\n\
+   -x        - Compute extended (128-D) descriptors instead of 64-D\n\
+   -y <num>  - Run SURF on batches of <num> video frames with one set\n\
+               of kernel launches (procedure 2, disables OpenCL images)\n\
+   -z        - Disables the subgroup reductions (used when the device\n\
+               supports cl_khr_subgroups or cl_intel_subgroups)\n\
  Required parameters based on procedure:\n\
    OpenSURF.exe 1 <-i input_image> \n\
    OpenSURF.exe 2 <-i input_video> (logging not supported)\n\
    OpenSURF.exe 2                  (no input video implies use of webcam)\n\
    OpenSURF.exe 3 <-i input_video> \n\
    OpenSURF.exe 3                  (no input video implies use of webcam)\n\
-   OpenSURF.exe 6 <-i input_image> \n\n\
+   OpenSURF.exe 6 <-i input_image> \n\
+   OpenSURF.exe 7 <-i SurfIpts.log> <-l output_dir> \n\
+   OpenSURF.exe 8                  (tunes on a synthetic image unless\n\
+                                    -i is given)\n\n\
  Examples:\n\
    OpenSURF.exe 1 -v -d g -i ../Images/norm.jpg -e EventDumps -l .\n\
    OpenSURF.exe 2\n\
    OpenSURF.exe 2 -i ../Videos/Woz.avi\n\
+   OpenSURF.exe 2 -d c -w 2 -i ../Videos/Woz.avi\n\
    OpenSURF.exe 3\n\
-   OpenSURF.exe 6 -i ../Images/norm.jpg -e EventDumps -l .\n\n");
+   OpenSURF.exe 6 -i ../Images/norm.jpg -e EventDumps -l .\n\
+   OpenSURF.exe 7 -i SurfIpts.log -k 24 -l .\n\
+   OpenSURF.exe 3 -p SurfPca.txt\n\
+   OpenSURF.exe 8 -d c -t SurfTuning.txt\n\n");
 }
 
 // This function that takes a positive integer 'value' and returns
@@ -338,3 +657,383 @@ bool isUsingImages()
 {
     return usingImages;
 }
+
+
+// Set whether the extended (SURF-128) descriptors should be computed
+void setUsingExtendedDescriptors(bool val) 
+{
+    usingExtendedDescriptors = val;
+}
+
+
+// Return whether or not extended descriptors are being computed
+bool isUsingExtendedDescriptors() 
+{
+    return usingExtendedDescriptors;
+}
+
+
+// Set the output format of the descriptors (DESC_FORMAT_*)
+void setDescriptorFormat(int format) 
+{
+    descriptorFormat = format;
+}
+
+
+// Return the output format of the descriptors
+int getDescriptorFormat() 
+{
+    return descriptorFormat;
+}
+
+
+// Set the file holding the PCA projection applied to the descriptors
+void setPcaProjectionPath(char* path) 
+{
+    pcaProjectionPath = path;
+}
+
+
+// Return the PCA projection file (NULL if descriptors aren't projected)
+char* getPcaProjectionPath() 
+{
+    return pcaProjectionPath;
+}
+
+
+// Set the number of components kept when training a PCA projection
+void setPcaTrainingComponents(int components) 
+{
+    pcaTrainingComponents = components;
+}
+
+
+// Return the number of components kept when training a PCA projection
+int getPcaTrainingComponents() 
+{
+    return pcaTrainingComponents;
+}
+
+
+// Set the stride of the dense descriptor grid (0 to detect ipoints)
+void setDenseGridStride(int stride) 
+{
+    denseGridStride = stride;
+}
+
+
+// Return the stride of the dense descriptor grid (0 if not dense)
+int getDenseGridStride() 
+{
+    return denseGridStride;
+}
+
+
+// Set the Haar samples per pixel above which response maps are built
+void setHaarMapRatio(float ratio) 
+{
+    haarMapRatio = ratio;
+}
+
+
+// Return the Haar samples per pixel above which response maps are built
+float getHaarMapRatio() 
+{
+    return haarMapRatio;
+}
+
+
+// Set whether the ipoints are sorted before orientation and description
+void setSortingKeypoints(bool val) 
+{
+    sortingKeypoints = val;
+}
+
+
+// Return whether the ipoints are sorted before orientation and description
+bool isSortingKeypoints() 
+{
+    return sortingKeypoints;
+}
+
+
+// Set the number of video frames in flight (1 runs frames in sequence)
+void setPipelineDepth(int depth) 
+{
+    pipelineDepth = depth;
+}
+
+
+// Return the number of video frames in flight
+int getPipelineDepth() 
+{
+    return pipelineDepth;
+}
+
+
+// Set the granularity in pixels of the Surf pool size buckets
+void setSurfPoolGranularity(int pixels) 
+{
+    surfPoolGranularity = pixels;
+}
+
+
+// Return the granularity in pixels of the Surf pool size buckets
+int getSurfPoolGranularity() 
+{
+    return surfPoolGranularity;
+}
+
+
+// Set the device memory in MB idle Surf objects may hold
+void setSurfPoolBudget(int megabytes) 
+{
+    surfPoolBudget = megabytes;
+}
+
+
+// Return the device memory in MB idle Surf objects may hold
+int getSurfPoolBudget() 
+{
+    return surfPoolBudget;
+}
+
+
+// Set the directory program binaries are cached in (NULL disables)
+void setProgramCacheDir(char* dir) 
+{
+    programCacheDir = dir;
+}
+
+
+// Return the directory program binaries are cached in (NULL if disabled)
+char* getProgramCacheDir() 
+{
+    return programCacheDir;
+}
+
+
+// Set the number of threads that build programs in the background
+void setCompileThreads(int threads) 
+{
+    compileThreads = threads;
+}
+
+
+// Return the number of threads that build programs in the background
+int getCompileThreads() 
+{
+    return compileThreads;
+}
+
+
+// Set whether kernels are built for each frame size
+void setSpecialisingKernels(bool val) 
+{
+    specialisingKernels = val;
+}
+
+
+// Return whether kernels are built for each frame size
+bool isSpecialisingKernels() 
+{
+    return specialisingKernels;
+}
+
+
+// Set the path of the tuning profile (NULL uses the built-in sizes)
+void setTuningProfilePath(char* path) 
+{
+    tuningProfilePath = path;
+}
+
+
+// Return the path of the tuning profile (NULL if not used)
+char* getTuningProfilePath() 
+{
+    return tuningProfilePath;
+}
+
+
+// Set the number of workers video frames are scheduled on
+void setSchedulerWorkers(int workers) 
+{
+    schedulerWorkers = workers;
+}
+
+
+// Return the number of workers video frames are scheduled on
+int getSchedulerWorkers() 
+{
+    return schedulerWorkers;
+}
+
+
+// Set whether workers are placed on the NUMA nodes of the device
+void setNumaAware(bool val) 
+{
+    numaAware = val;
+}
+
+
+// Return whether workers are placed on the NUMA nodes of the device
+bool isNumaAware() 
+{
+    return numaAware;
+}
+
+
+// Set the number of video frames run as one batch (1 runs them one at a
+// time)
+void setVideoBatchSize(int frames) 
+{
+    videoBatchSize = frames;
+}
+
+
+// Return the number of video frames run as one batch
+int getVideoBatchSize() 
+{
+    return videoBatchSize;
+}
+
+
+// Set whether the reductions use subgroups on devices that support them
+void setUsingSubgroups(bool val) 
+{
+    usingSubgroups = val;
+}
+
+
+// Return whether the reductions use subgroups on devices that support them
+bool isUsingSubgroups() 
+{
+    return usingSubgroups;
+}
+
+
+// Convert a format name (fp32, fp16, int8, bin or binmag) to a 
+// DESC_FORMAT_* value
+int parseDescriptorFormat(char* name) 
+{
+    if(strcmp(name, "fp32") == 0) {
+        return DESC_FORMAT_FP32;
+    }
+    if(strcmp(name, "fp16") == 0) {
+        return DESC_FORMAT_FP16;
+    }
+    if(strcmp(name, "int8") == 0) {
+        return DESC_FORMAT_INT8;
+    }
+    if(strcmp(name, "bin") == 0) {
+        return DESC_FORMAT_BINARY;
+    }
+    if(strcmp(name, "binmag") == 0) {
+        return DESC_FORMAT_BINARY_MAG;
+    }
+
+    printf("Unknown descriptor format: %s\n", name);
+    exit(-1);
+}
+
+
+// Return the size in bytes of a descriptor with length components 
+// stored in the given format
+size_t getDescriptorBytes(int format, int length) 
+{
+    switch(format) {
+    case DESC_FORMAT_FP32:
+    case DESC_FORMAT_PCA:
+        return length*sizeof(float);
+    case DESC_FORMAT_FP16:
+        return length*sizeof(unsigned short);
+    case DESC_FORMAT_INT8:
+        return length*sizeof(signed char);
+    case DESC_FORMAT_BINARY:
+        // One sign bit per component
+        return length/8;
+    case DESC_FORMAT_BINARY_MAG:
+        // One sign bit and one magnitude bit per component
+        return 2*length/8;
+    default:
+        printf("Error: Invalid descriptor format %d\n", format);
+        exit(-1);
+    }
+}
+
+
+// Convert a 16-bit IEEE half precision value to a float
+float halfToFloat(unsigned short h) 
+{
+    int exponent = (h >> 10) & 0x1f;
+    int mantissa = h & 0x3ff;
+    float value;
+
+    if(exponent == 0) {
+        // Zero or subnormal
+        value = ldexpf((float)mantissa, -24);
+    }
+    else if(exponent == 31) {
+        // Inf or NaN (normalized descriptors never contain either)
+        value = (float)HUGE_VAL;
+    }
+    else {
+        value = ldexpf((float)(mantissa | 0x400), exponent - 25);
+    }
+
+    return (h & 0x8000) ? -value : value;
+}
+
+
+// Decode a descriptor stored in a compact format into floats
+void decodeDescriptor(const void* src, int format, int length, float* dst) 
+{
+    switch(format) {
+    case DESC_FORMAT_FP32:
+    case DESC_FORMAT_PCA:
+        memcpy(dst, src, length*sizeof(float));
+        break;
+    case DESC_FORMAT_FP16:
+        for(int i = 0; i < length; i++) {
+            dst[i] = halfToFloat(((const unsigned short*)src)[i]);
+        }
+        break;
+    case DESC_FORMAT_INT8:
+        for(int i = 0; i < length; i++) {
+            dst[i] = ((const signed char*)src)[i] / DESC_INT8_SCALE;
+        }
+        break;
+    case DESC_FORMAT_BINARY:
+    case DESC_FORMAT_BINARY_MAG:
+        {
+            // Only an approximation can be recovered: the sign of each 
+            // component, and (with magnitude bits) whether its magnitude 
+            // was above or below the threshold
+            const unsigned int* words = (const unsigned int*)src;
+            float threshold = 1.0f/sqrtf((float)length);
+            for(int i = 0; i < length; i++) {
+                float magnitude = threshold;
+                if(format == DESC_FORMAT_BINARY_MAG) {
+                    int bit = length + i;
+                    magnitude = ((words[bit/32] >> (bit%32)) & 1) ? 
+                        1.5f*threshold : 0.5f*threshold;
+                }
+                dst[i] = ((words[i/32] >> (i%32)) & 1) ? 
+                    magnitude : -magnitude;
+            }
+        }
+        break;
+    default:
+        printf("Error: Invalid descriptor format %d\n", format);
+        exit(-1);
+    }
+}
+
+
+// Release the data held by a descriptor set
+void freeDescriptorSet(DescriptorSet* descs) 
+{
+    free(descs->data);
+    descs->data = NULL;
+    descs->count = 0;
+}
@@ -57,6 +57,12 @@
 // Wrapper for malloc
 void* alloc(size_t size);
 
+// Allocates memory aligned to the given (power of two) boundary
+void* alignedAlloc(size_t size, size_t alignment);
+
+// Frees memory from alignedAlloc
+void alignedFree(void* ptr);
+
 // Checks for existence of directory
 void checkDir(char* dirpath);
 
@@ -87,4 +93,132 @@ void setUsingImages(bool val);
 // Return whether or not images are being used
 bool isUsingImages(); 
 
+// Set the value of usingExtendedDescriptors
+void setUsingExtendedDescriptors(bool val);
+
+// Return whether or not extended (128-D) descriptors are being computed
+bool isUsingExtendedDescriptors();
+
+// Set the output format of the descriptors
+void setDescriptorFormat(int format);
+
+// Return the output format of the descriptors
+int getDescriptorFormat();
+
+// Set the file holding the PCA projection applied to the descriptors
+void setPcaProjectionPath(char* path);
+
+// Return the PCA projection file (NULL if descriptors aren't projected)
+char* getPcaProjectionPath();
+
+// Set the number of components kept when training a PCA projection
+void setPcaTrainingComponents(int components);
+
+// Return the number of components kept when training a PCA projection
+int getPcaTrainingComponents();
+
+// Set the stride of the dense descriptor grid (0 to detect ipoints)
+void setDenseGridStride(int stride);
+
+// Return the stride of the dense descriptor grid (0 if not dense)
+int getDenseGridStride();
+
+// Set the Haar samples per pixel above which response maps are built
+void setHaarMapRatio(float ratio);
+
+// Return the Haar samples per pixel above which response maps are built
+float getHaarMapRatio();
+
+// Set whether the ipoints are sorted before orientation and description
+void setSortingKeypoints(bool val);
+
+// Return whether the ipoints are sorted before orientation and description
+bool isSortingKeypoints();
+
+// Set the number of video frames in flight (1 runs frames in sequence)
+void setPipelineDepth(int depth);
+
+// Return the number of video frames in flight
+int getPipelineDepth();
+
+// Set the granularity in pixels of the Surf pool size buckets
+void setSurfPoolGranularity(int pixels);
+
+// Return the granularity in pixels of the Surf pool size buckets
+int getSurfPoolGranularity();
+
+// Set the device memory in MB idle Surf objects may hold
+void setSurfPoolBudget(int megabytes);
+
+// Return the device memory in MB idle Surf objects may hold
+int getSurfPoolBudget();
+
+// Set the directory program binaries are cached in (NULL disables)
+void setProgramCacheDir(char* dir);
+
+// Return the directory program binaries are cached in (NULL if disabled)
+char* getProgramCacheDir();
+
+// Set the number of threads that build programs in the background (0 
+// builds each program the first time it is used)
+void setCompileThreads(int threads);
+
+// Return the number of threads that build programs in the background
+int getCompileThreads();
+
+// Set whether kernels are built for each frame size
+void setSpecialisingKernels(bool val);
+
+// Return whether kernels are built for each frame size
+bool isSpecialisingKernels();
+
+// Set the path of the tuning profile (NULL uses the built-in sizes)
+void setTuningProfilePath(char* path);
+
+// Return the path of the tuning profile (NULL if not used)
+char* getTuningProfilePath();
+
+// Set the number of workers video frames are scheduled on (1 runs them 
+// on the device chosen by cl_init)
+void setSchedulerWorkers(int workers);
+
+// Return the number of workers video frames are scheduled on
+int getSchedulerWorkers();
+
+// Set whether workers are placed on the NUMA nodes of the device (one 
+// sub-device, host thread and set of host buffers per node)
+void setNumaAware(bool val);
+
+// Return whether workers are placed on the NUMA nodes of the device
+bool isNumaAware();
+
+// Set the number of video frames run as one batch (1 runs them one at a
+// time)
+void setVideoBatchSize(int frames);
+
+// Return the number of video frames run as one batch
+int getVideoBatchSize();
+
+// Set whether the reductions use subgroups on devices that support them 
+// (chosen when the kernels are built)
+void setUsingSubgroups(bool val);
+
+// Return whether the reductions use subgroups on devices that support them
+bool isUsingSubgroups();
+
+// Convert a descriptor format name (fp32, fp16, int8) to DESC_FORMAT_*
+int parseDescriptorFormat(char* name);
+
+// Return the size in bytes of a descriptor of length components
+size_t getDescriptorBytes(int format, int length);
+
+// Convert a half precision value to a float
+float halfToFloat(unsigned short h);
+
+// Decode a descriptor stored in a compact format into floats
+void decodeDescriptor(const void* src, int format, int length, float* dst);
+
+// Release the data held by a descriptor set
+void freeDescriptorSet(DescriptorSet* descs);
+
 #endif